@@ -0,0 +1,228 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16 // same as malloc() on x86_64
+
+struct arena_block {
+	struct arena_block *prev;
+	size_t size; // of data[]
+	size_t used; // data[0 .. used) has been allocated (always a multiple of ARENA_ALIGN)
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+__thread struct arena_stats arena_stats;
+
+static __thread struct arena *free_list = NULL;
+static __thread unsigned free_count = 0;
+
+static size_t align_size(size_t size)
+{
+	return (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+}
+
+static struct arena_block *new_block(size_t size)
+{
+	struct arena_block *b = malloc(sizeof(struct arena_block) + size);
+	if(!b)
+		return NULL;
+
+	arena_stats.mallocs ++;
+	b->prev = NULL;
+	b->size = size;
+	b->used = 0;
+	return b;
+}
+
+static void free_blocks(struct arena *arena)
+{
+	struct arena_block *b, *prev;
+	for(b = arena->block; b; b = prev)
+	{
+		prev = b->prev;
+		free(b);
+	}
+
+	arena->block = NULL;
+	arena->total = 0;
+}
+
+struct arena *arena_get(void)
+{
+	struct arena *arena = free_list;
+	if(arena)
+	{
+		free_list = arena->next_free;
+		free_count --;
+	}
+	else
+	{
+		arena = calloc(1, sizeof(struct arena));
+		if(!arena)
+			return NULL;
+
+		arena_stats.mallocs ++;
+	}
+
+	arena->next_free = NULL;
+	arena_stats.taken ++;
+	return arena;
+}
+
+void arena_put(struct arena *arena)
+{
+	if(free_count >= ARENA_MAX_FREE)
+	{
+		free_blocks(arena);
+		free(arena);
+		return;
+	}
+
+	arena_reset(arena);
+	arena->next_free = free_list;
+	free_list = arena;
+	free_count ++;
+}
+
+void arena_free_unused(void)
+{
+	struct arena *arena;
+	while((arena = free_list))
+	{
+		free_list = arena->next_free;
+		free_blocks(arena);
+		free(arena);
+	}
+	free_count = 0;
+}
+
+void arena_reset(struct arena *arena)
+{
+	if(!arena->block)
+		return;
+
+	if(arena->total > ARENA_MAX_KEEP)
+	{
+		free_blocks(arena);
+		return;
+	}
+
+	if(!arena->block->prev)
+	{
+		arena->block->used = 0;
+		return;
+	}
+
+	/* Several blocks: replace them with one (large enough for all that was needed this time) */
+	size_t total = arena->total;
+	free_blocks(arena);
+
+	arena->block = new_block(total);
+	if(arena->block)
+		arena->total = total;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	size = align_size(size ? size : 1);
+
+	struct arena_block *b = arena->block;
+	if(!b || b->size - b->used < size)
+	{
+		/* New block: at least twice as large as all the previous ones together */
+		size_t block_size = arena->total > ARENA_MIN_BLOCK_SIZE ? arena->total : ARENA_MIN_BLOCK_SIZE;
+		if(block_size < size)
+			block_size = size;
+
+		b = new_block(block_size);
+		if(!b)
+			return NULL;
+
+		b->prev = arena->block;
+		arena->block = b;
+		arena->total += block_size;
+	}
+
+	void *ptr = b->data + b->used;
+	b->used += size;
+	return ptr;
+}
+
+void *arena_realloc(struct arena *arena, void *ptr, size_t old_size, size_t new_size)
+{
+	struct arena_block *b = arena->block;
+
+	/* The last allocation in the current block can grow in place */
+	if(ptr && b && (char *) ptr >= b->data && (char *) ptr + align_size(old_size) == b->data + b->used)
+	{
+		size_t offset = (char *) ptr - b->data;
+		if(b->size - offset >= align_size(new_size))
+		{
+			b->used = offset + align_size(new_size);
+			return ptr;
+		}
+	}
+
+	void *new_ptr = arena_alloc(arena, new_size);
+	if(new_ptr && ptr)
+		memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+	return new_ptr;
+}
+
+char *arena_strdup(struct arena *arena, const char *s)
+{
+	size_t size = strlen(s) + 1;
+	char *copy = arena_alloc(arena, size);
+	if(copy)
+		memcpy(copy, s, size);
+	return copy;
+}
+
+char *arena_vprintf(struct arena *arena, const char *format, va_list ap)
+{
+	/* Try to print right into the free space of the current block */
+	struct arena_block *b = arena->block;
+	size_t room = b ? b->size - b->used : 0;
+
+	va_list copy;
+	va_copy(copy, ap);
+	int length = vsnprintf(room ? b->data + b->used : NULL, room, format, copy);
+	va_end(copy);
+
+	if(length < 0)
+		return NULL;
+
+	if((size_t) length < room)
+		return arena_alloc(arena, length + 1); // Already there
+
+	char *s = arena_alloc(arena, length + 1);
+	if(s)
+		vsnprintf(s, length + 1, format, ap);
+	return s;
+}
+
+char *arena_printf(struct arena *arena, const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	char *s = arena_vprintf(arena, format, ap);
+	va_end(ap);
+	return s;
+}
@@ -0,0 +1,81 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_ARENA_H
+#define HTTP_CLIENT_ARENA_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+/*
+	Arena (bump allocator) for the small allocations of one request:
+	URL of each hop, the outgoing request, the buffer and the array of
+	response headers, redirect targets, etc. Memory is taken from the end
+	of the current block, and nothing is freed separately: everything
+	is forgotten at once by arena_reset().
+
+	After the reset the arena keeps one block which is large enough for
+	everything that was allocated before, so the next request of the same
+	size doesn't call malloc() at all.
+
+	Arenas are reused by the next requests (on any connection): arena_get() takes
+	one from the free list of this thread, arena_put() resets it and returns it there.
+*/
+
+#define ARENA_MIN_BLOCK_SIZE 4096
+#define ARENA_MAX_KEEP (64 * 1024) // larger arenas don't keep their block after the reset
+#define ARENA_MAX_FREE 256 // arenas on the free list of a thread (more are freed)
+
+struct arena_block;
+
+struct arena {
+	struct arena_block *block; // current block (older ones are in block->prev)
+	size_t total; // sum of the sizes of all blocks
+	struct arena *next_free; // in the free list (see arena_get)
+};
+
+struct arena_stats {
+	unsigned long taken; // arena_get() calls
+	unsigned long mallocs; // malloc() calls for new arenas and blocks
+};
+extern __thread struct arena_stats arena_stats;
+
+/* Returns an empty arena (NULL if out of memory) */
+struct arena *arena_get(void);
+
+/* Resets the arena and returns it to the free list */
+void arena_put(struct arena *arena);
+
+/* Frees all arenas on the free list of this thread (e.g. before the thread exits) */
+void arena_free_unused(void);
+
+/* Forgets all allocations, keeps (or allocates) one block which fits all of them
+	(unless it's larger than ARENA_MAX_KEEP: e.g. very long headers are rare) */
+void arena_reset(struct arena *arena);
+
+/* Returns "size" bytes (aligned for any type), NULL if out of memory */
+void *arena_alloc(struct arena *arena, size_t size);
+
+/* Same as realloc(), but the old memory stays in the arena (it's extended in place
+	if it was the last allocation). "ptr" can be NULL (then "old_size" is 0). */
+void *arena_realloc(struct arena *arena, void *ptr, size_t old_size, size_t new_size);
+
+char *arena_strdup(struct arena *arena, const char *s);
+
+/* Same as asprintf(), but the string is in the arena. Returns NULL if out of memory. */
+char *arena_printf(struct arena *arena, const char *format, ...) __attribute__((format(printf, 2, 3)));
+char *arena_vprintf(struct arena *arena, const char *format, va_list ap);
+
+#endif
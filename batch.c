@@ -0,0 +1,2135 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+/*
+	Batch mode: many requests are performed at the same time in one thread.
+	Each request is a state machine (resolve -> connect -> send -> headers
+	-> body), and all sockets are non-blocking and multiplexed via epoll.
+
+	With HTTP/2 (-2), requests to the same host:port are streams of one
+	connection (see h2.c), whose socket is registered in epoll by itself:
+	its events are handled by h2_process(), which calls the job callbacks.
+
+	With several threads (-w), each thread runs its own event loop with its own
+	jobs, timers, connection pool, DNS cache and statistics (they are __thread),
+	so nothing is shared while the responses are received. Only the queues
+	of URLs are shared (see take_url).
+*/
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "content_encoding.h"
+#include "pool.h"
+#include "connect.h"
+#include "dns.h"
+#include "chunked.h"
+#include "transfer.h"
+#include "batch.h"
+#include "cache.h"
+#include "timing.h"
+#include "deadline.h"
+#include "redirect.h"
+#include "h2.h"
+#include "output.h"
+#include "log.h"
+
+#define BATCH_MAX_EVENTS 64 // how many events to fetch with one epoll_wait()
+
+enum job_state {
+	JOB_RESOLVE, // about to resolve the hostname and to start connect()
+	JOB_RESOLVING, // waiting for the non-blocking DNS lookup (see dns.c)
+	JOB_CONNECT, // waiting for non-blocking connect() to complete
+	JOB_QUEUED, // request was pipelined, waiting for the responses to the previous requests
+	JOB_SEND, // sending the request
+	JOB_HEADERS, // receiving response headers
+	JOB_BODY, // receiving response body
+	JOB_H2, // request is a stream of HTTP/2 connection (advanced by its callbacks, see h2_callbacks)
+	JOB_FINISHED // done (either successfully or not)
+};
+
+/* What epoll_event.data.ptr points to (NULL is the DNS eventfd) */
+enum event_source {
+	SOURCE_JOB, // struct batch_job
+	SOURCE_H2 // struct batch_h2
+};
+
+/*
+	The job itself and all its strings and buffers (URLs, requests, response headers,
+	data left by the previous response in the pipeline, etc.) are in its arena (see arena.h),
+	which is returned to the free list by job_free(). Nothing is freed separately.
+*/
+struct batch_job {
+	enum event_source source; // SOURCE_JOB (must be the first field, see batch_loop)
+	struct arena *arena;
+	struct batch_job *prev, *next; // list of active jobs
+
+	unsigned nr; // 1 for the first URL in the batch, etc.
+	char *url; // URL from the batch file (for messages)
+	char *hop_url; // URL of the current redirect hop (modified by parse_url())
+	struct http_url u;
+	unsigned redirect_nr;
+	char *location; // where to go after the body of redirect is read
+
+	enum job_state state;
+	struct deadlines deadlines; // connect, first byte, idle, total (see deadline.h)
+	struct timer timer; // fires at the earliest deadline or at "wakeup" (see job_schedule)
+
+	int sock;
+	int reused; // 1 if "sock" was taken from the pool
+
+	struct addrinfo *ai; // resolved addresses (while connecting)
+	struct happy_eyeballs he;
+	long long wakeup; // when to call job_step() again (in ms, see now_ms()), 0 if not needed
+
+	char *request;
+	int request_length;
+	int request_sent; // number of bytes already sent
+
+	/* Pipelining: requests of "pipe_next" (and of the jobs after it)
+		are sent via the same connection right after our request */
+	struct batch_job *pipe_next;
+	char *pipeline_request; // our request + requests of all jobs after us (sent instead of "request")
+	int pipeline_request_length;
+
+	/* Data which was received from the socket before this job got it
+		(the end of the previous response in the pipeline was in the middle of it).
+		It is read before the socket, see job_recv(). */
+	char *pending;
+	size_t pending_offset, pending_length;
+
+	char *buffer; // response headers are read here (grows if they are long)
+	size_t buffer_size;
+	size_t buffer_length; // number of bytes in buffer[]
+	struct http_response response; // parsed from buffer[]
+
+	unsigned short code;
+	int keep_alive;
+	struct body_framing framing;
+	unsigned long remaining; // bytes of body not yet received (if the length is known)
+
+	struct chunked_decoder chunked;
+	struct content_decoder decoder; // Content-Encoding (gzip, etc.)
+	struct digest digest; // of the saved body (if it's verified, see batch_verify)
+	struct digest_value expected_digest; // from Repr-Digest or Digest header (size is 0 if none)
+
+	int fout; // -1 if the body must be discarded (e.g. body of redirect)
+	char *filename;
+	unsigned long long body_bytes;
+
+	char *cache_key; // normalized URL of the current hop (NULL if the cache is disabled)
+	struct cache_entry cache_entry; // stale entry which is being revalidated ("url" is NULL if none)
+
+	struct request_timing timing;
+	char *error; // why the job has failed (reported by job_free)
+
+	struct batch_h2 *h2; // HTTP/2 connection which has our stream (NULL if none)
+	struct h2_stream stream;
+};
+
+/* HTTP/2 connection to one host:port (one per thread, while it's usable) */
+struct batch_h2 {
+	enum event_source source; // SOURCE_H2 (must be the first field)
+	struct batch_h2 *prev, *next; // list of connections
+	char *host, *port;
+
+	struct h2_connection conn;
+	struct batch_job *connector; // job which is connecting (its stream is the first one), NULL once connected
+	int failed; // connection has failed: its waiting streams must not be retried
+};
+
+/* State of the event loop (one per thread) */
+static __thread int epfd = -1;
+static __thread struct batch_job *active_jobs = NULL;
+static __thread unsigned active_count = 0;
+static __thread unsigned succeeded = 0, failed = 0;
+
+static __thread unsigned pipelined = 0, pipeline_retried = 0;
+
+static __thread struct batch_h2 *h2_connections = NULL;
+static int batch_http2 = 0; // see batch_run()
+static enum digest_algorithm batch_verify = DIGEST_NONE; // see batch_run()
+
+/* Bodies checked against Repr-Digest/Digest: matched, didn't match, had no such header */
+static __thread unsigned digests_matched = 0, digests_mismatched = 0, digests_missing = 0;
+
+/* Timers of all active jobs: epoll_wait() sleeps until the earliest one */
+static __thread struct timer_heap timers;
+
+/* Body is read here (not into job->buffer): all requests of the thread share one large buffer,
+	because every part of body is processed right after it was read */
+static __thread char body_buffer[CHUNKED_BUFFER_SIZE];
+
+/* Monotonic time in milliseconds */
+static long long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+	Schedules job->timer at the earliest of its deadlines and "wakeup".
+	Deadlines move forward all the time (idle one after each read), so the timer
+	is only moved when it must fire earlier: if it fires too early,
+	batch_expire_timers() finds that nothing has expired and schedules it again.
+*/
+static void job_schedule(struct batch_job *job)
+{
+	long long next = DEADLINE_NONE;
+	if(job->state != JOB_QUEUED && job->state != JOB_FINISHED)
+		next = deadline_next(&job->deadlines, NULL);
+
+	if(job->wakeup && (next == DEADLINE_NONE || job->wakeup < next))
+		next = job->wakeup;
+
+	if(next == DEADLINE_NONE)
+	{
+		timer_cancel(&timers, &job->timer);
+		return;
+	}
+
+	if(job->timer.index != TIMER_INACTIVE && job->timer.expires <= next)
+		return; // Will fire early (see above)
+
+	timer_set(&timers, &job->timer, next); // Can't fail: room has been reserved by job_new()
+}
+
+/* Cancels the connection attempts in progress */
+static void job_cancel_connect(struct batch_job *job)
+{
+	if(!job->ai)
+		return;
+
+	he_free(&job->he);
+	dns_freeaddrinfo(job->ai);
+	job->ai = NULL;
+	job->wakeup = 0;
+}
+
+static void job_close_connection(struct batch_job *job, int reusable)
+{
+	if(job->sock < 0)
+		return;
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, job->sock, NULL);
+
+	if(reusable)
+		pool_release(&job->u, job->sock);
+	else
+		close(job->sock);
+
+	job->sock = -1;
+}
+
+/* Returns 0 on success, -1 if the rest of the body couldn't be written (see output_close) */
+static int job_close_file(struct batch_job *job)
+{
+	int ret = 0;
+	if(job->fout >= 0)
+	{
+		ret = output_close(job->fout);
+		job->fout = -1;
+	}
+	return ret;
+}
+
+/* Requests which follow ours in the pipeline won't get their responses
+	via this connection: they are retried, each with its own connection */
+static void job_break_pipeline(struct batch_job *job)
+{
+	struct batch_job *next = job->pipe_next, *follower;
+	job->pipe_next = NULL;
+	job->pipeline_request = NULL;
+
+	for(; (follower = next); )
+	{
+		next = follower->pipe_next;
+		follower->pipe_next = NULL;
+
+		fprintf(stderr, "[debug] [%u] Pipeline was interrupted, retrying via a separate connection.\n", follower->nr);
+
+		follower->state = JOB_RESOLVE;
+		deadlines_start(&follower->deadlines, &deadline_limits);
+		timing_retry(&follower->timing);
+		follower->wakeup = now_ms(); // Will be started by the main loop
+		job_schedule(follower);
+		pipeline_retried ++;
+	}
+}
+
+/* Closes HTTP/2 connection: its remaining streams are closed with "error" (see job_h2_close) */
+static void batch_h2_close(struct batch_h2 *h, const char *error)
+{
+	if(h->prev)
+		h->prev->next = h->next;
+	else
+		h2_connections = h->next;
+
+	if(h->next)
+		h->next->prev = h->prev;
+
+	h2_free(&h->conn, error); // The socket is removed from epoll when it's closed
+	free(h->host);
+	free(h);
+}
+
+/* Takes the stream of the job out of its HTTP/2 connection */
+static void job_h2_detach(struct batch_job *job)
+{
+	struct batch_h2 *h = job->h2;
+	job->h2 = NULL;
+	h2_cancel(&job->stream);
+
+	/* The connection we were establishing has failed: so do the requests which wait for it */
+	if(h->connector == job)
+	{
+		h->connector = NULL;
+		h->failed = 1;
+		batch_h2_close(h, job->error ? job->error : "connection has failed");
+	}
+}
+
+static void job_fail(struct batch_job *job, const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+
+	job->error = arena_vprintf(job->arena, format, ap);
+	va_end(ap);
+
+	fprintf(stderr, "[error] [%u] %s: %s\n", job->nr, job->url, job->error ? job->error : "memory allocation failed");
+
+	if(job->state == JOB_RESOLVING)
+		dns_cancel(job);
+
+	if(job->h2)
+		job_h2_detach(job);
+
+	job_cancel_connect(job);
+	job_close_connection(job, 0);
+	job_close_file(job);
+	job_break_pipeline(job);
+
+	job->state = JOB_FINISHED;
+	failed ++;
+}
+
+static void job_succeed(struct batch_job *job)
+{
+	if(job->filename)
+		fprintf(stderr, "[notice] [%u] %s: saved to %s (%llu bytes)\n", job->nr, job->url, job->filename, job->body_bytes);
+	else
+		fprintf(stderr, "[notice] [%u] %s: no content\n", job->nr, job->url);
+
+	job->state = JOB_FINISHED;
+	succeeded ++;
+}
+
+/* Saves the body from the cache (job->cache_key) into the output file */
+static void job_save_cached(struct batch_job *job)
+{
+	job->filename = arena_printf(job->arena, "%s.%u", output_name, job->nr);
+	if(!job->filename)
+	{
+		job_fail(job, "memory allocation failed");
+		return;
+	}
+
+	if(cache_copy_body(job->cache_key, job->filename) < 0)
+	{
+		job_fail(job, "failed to copy the cached response into \"%s\": %s", job->filename, strerror(errno));
+		return;
+	}
+
+	job->body_bytes = job->cache_entry.length;
+	job_succeed(job);
+}
+
+/* Starts the request to "url" (either the URL from the batch file or the target of redirect) */
+static void job_start_hop(struct batch_job *job, const char *url)
+{
+	job->request = NULL;
+
+	timing_hop(&job->timing);
+
+	job->hop_url = arena_strdup(job->arena, url);
+	if(!job->hop_url)
+	{
+		job_fail(job, "memory allocation failed");
+		return;
+	}
+
+	if(parse_url(job->hop_url, &job->u) != 0)
+	{
+		job_fail(job, "unsupported URL");
+		return;
+	}
+
+	/* TLS is only supported by the blocking single-request engine (see httpclient.c) */
+	if(job->u.tls)
+	{
+		job_fail(job, "HTTPS is not supported in batch mode");
+		return;
+	}
+
+	/* On-disk cache (see cache.c): fresh entry is used without requests, stale one is revalidated */
+	job->cache_key = NULL;
+	cache_entry_free(&job->cache_entry);
+
+	if(cache_enabled())
+	{
+		job->cache_key = cache_key(job->arena, &job->u);
+		if(!job->cache_key)
+		{
+			job_fail(job, "memory allocation failed");
+			return;
+		}
+
+		if(cache_lookup(job->cache_key, &job->cache_entry) == 0)
+		{
+			if(cache_is_fresh(&job->cache_entry))
+			{
+				fprintf(stderr, "[info] [%u] %s: using the fresh copy from the cache\n", job->nr, job->hop_url);
+				cache_stats.hits ++;
+				job_save_cached(job);
+				return;
+			}
+
+			if(!cache_can_revalidate(&job->cache_entry))
+				cache_entry_free(&job->cache_entry);
+		}
+
+		if(!job->cache_entry.url)
+			cache_stats.misses ++;
+	}
+
+	if(job->cache_entry.url)
+		job->request_length = format_conditional_request(job->arena, &job->request, &job->u,
+			job->cache_entry.etag, job->cache_entry.last_modified);
+	else
+		job->request_length = format_request(job->arena, &job->request, &job->u);
+
+	if(job->request_length < 0)
+	{
+		job_fail(job, "memory allocation failed");
+		return;
+	}
+
+	job->state = JOB_RESOLVE;
+}
+
+/* Starts the request to the URL from the batch file (or straight to its target, if it's a known permanent redirect) */
+static void job_start(struct batch_job *job)
+{
+	char *target = redirect_lookup(job->arena, job->url, &job->redirect_nr);
+	if(target)
+	{
+		fprintf(stderr, "[info] [%u] %s: known permanent redirect to %s\n", job->nr, job->url, target);
+		redirect_stats.used ++;
+		job_start_hop(job, target);
+	}
+	else job_start_hop(job, job->url);
+}
+
+/* Resets the state of the response parser before (re)sending the request */
+static void job_reset_response(struct batch_job *job)
+{
+	job->request_sent = 0;
+	job->buffer_length = 0;
+
+	http_response_init(&job->response, job->arena);
+
+	content_decoder_free(&job->decoder);
+	content_decoder_init(&job->decoder, "");
+
+	deadline_disarm(&job->deadlines, DEADLINE_FIRST_BYTE);
+	deadline_disarm(&job->deadlines, DEADLINE_IDLE);
+}
+
+/* Called for every new socket (including the sockets of connection attempts) */
+static void job_register_socket(void *opaque, int sock)
+{
+	struct batch_job *job = opaque;
+
+	/* Edge-triggered: we always read/write until EAGAIN,
+		so there is no need to change the event mask later */
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = job;
+
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0)
+		fprintf(stderr, "[warn] [%u] epoll_ctl() failed: %s\n", job->nr, strerror(errno));
+}
+
+/* Starts the connection attempts to the addresses in job->ai
+	("error" is the result of DNS lookup) */
+static void job_start_connect(struct batch_job *job, int error)
+{
+	if(error != 0)
+	{
+		job->ai = NULL;
+		job_fail(job, "bad hostname or address: \"%s\": %s", job->u.host, gai_strerror(error));
+		return;
+	}
+
+	timing_mark(&job->timing, TIMING_DNS);
+
+	/* Connection attempts to all addresses (see connect.c) */
+	if(he_init(&job->he, job->ai) < 0)
+	{
+		dns_freeaddrinfo(job->ai);
+		job->ai = NULL;
+		job_fail(job, "memory allocation failed");
+		return;
+	}
+	job->he.on_socket = job_register_socket;
+	job->he.opaque = job;
+
+	job->state = JOB_CONNECT;
+}
+
+static void job_step(struct batch_job *job);
+static void job_free(struct batch_job *job);
+static int job_h2_submit(struct batch_job *job);
+
+/* Called from dns_process() when the non-blocking DNS lookup is completed */
+static void job_resolved(void *opaque, int error, struct addrinfo *res)
+{
+	struct batch_job *job = opaque;
+
+	job->ai = res;
+	job_start_connect(job, error);
+	job_step(job);
+
+	if(job->state == JOB_FINISHED)
+		job_free(job);
+}
+
+static void job_connect(struct batch_job *job)
+{
+	job_reset_response(job);
+
+	/* HTTP/2: the request becomes a stream of the connection to this host:port */
+	if(batch_http2 && job_h2_submit(job) != 0)
+		return;
+
+	/* Reuse the keep-alive connection to the same host:port (if we have one) */
+	job->sock = pool_acquire(&job->u);
+	if(job->sock >= 0)
+	{
+		job->reused = 1;
+		job->state = JOB_SEND;
+		timing_set_reused(&job->timing, 1);
+
+		job_register_socket(job, job->sock);
+		return;
+	}
+
+	job->reused = 0;
+	deadline_arm(&job->deadlines, DEADLINE_CONNECT);
+
+	int ret = dns_resolve_async(job->u.host, job->u.port, job_resolved, job, &job->ai);
+	if(ret == DNS_PENDING)
+	{
+		job->state = JOB_RESOLVING;
+		return;
+	}
+
+	job_start_connect(job, ret);
+}
+
+/* Keep-alive connection from the pool was closed by server before
+	it has responded. Not an error: just try again with a new connection. */
+static void job_reconnect(struct batch_job *job)
+{
+	job_close_connection(job, 0);
+	job_break_pipeline(job);
+
+	job->pending = NULL;
+	job->pending_offset = job->pending_length = 0;
+
+	job->state = JOB_RESOLVE;
+	timing_retry(&job->timing);
+}
+
+/* Reads from the socket (or the data left by the previous response in the pipeline) */
+static ssize_t job_recv(struct batch_job *job, char *buf, size_t size)
+{
+	if(job->pending)
+	{
+		size_t length = job->pending_length - job->pending_offset;
+		if(length > size)
+			length = size;
+
+		memcpy(buf, job->pending + job->pending_offset, length);
+		job->pending_offset += length;
+
+		if(job->pending_offset == job->pending_length)
+		{
+			job->pending = NULL;
+			job->pending_offset = job->pending_length = 0;
+		}
+		return length;
+	}
+
+	transfer_stats.read_calls ++;
+	return read(job->sock, buf, size);
+}
+
+/*
+	Called when "length" bytes after the end of the response have been received.
+	This is the beginning of the response to the next pipelined request:
+	it will be read by the next job (before the unread part of "pending").
+	Returns 0 on success, -1 on error.
+*/
+static int job_keep_excess(struct batch_job *job, const char *data, size_t length)
+{
+	if(!job->pipe_next)
+	{
+		job->keep_alive = 0; // Unexpected data after the end of response
+		return 0;
+	}
+
+	size_t unread = job->pending_length - job->pending_offset;
+	char *excess = arena_alloc(job->arena, length + unread);
+	if(!excess)
+	{
+		job_fail(job, "memory allocation failed");
+		return -1;
+	}
+
+	memcpy(excess, data, length);
+	if(unread)
+		memcpy(excess + length, job->pending + job->pending_offset, unread);
+
+	job->pending = excess;
+	job->pending_offset = 0;
+	job->pending_length = length + unread;
+	return 0;
+}
+
+/* Response has been received: the connection (together with the data
+	which was read from it, but not used yet) goes to the next job in the pipeline */
+static void job_pass_connection(struct batch_job *job)
+{
+	struct batch_job *next = job->pipe_next;
+
+	if(job->sock < 0 || !job->keep_alive || job->framing.no_length)
+	{
+		job_close_connection(job, 0);
+		job_break_pipeline(job);
+		return;
+	}
+
+	/* Unread data is copied: the arena of this job is about to be reset */
+	size_t unread = job->pending_length - job->pending_offset;
+	if(unread)
+	{
+		next->pending = arena_alloc(next->arena, unread);
+		if(!next->pending)
+		{
+			job_close_connection(job, 0);
+			job_break_pipeline(job);
+			return;
+		}
+
+		memcpy(next->pending, job->pending + job->pending_offset, unread);
+		next->pending_offset = 0;
+		next->pending_length = unread;
+	}
+	job->pending = NULL;
+	job->pending_offset = job->pending_length = 0;
+
+	job->pipe_next = NULL;
+	job->pipeline_request = NULL;
+
+	next->sock = job->sock;
+	next->reused = 1;
+	job->sock = -1;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = next;
+	if(epoll_ctl(epfd, EPOLL_CTL_MOD, next->sock, &ev) < 0)
+		fprintf(stderr, "[warn] [%u] epoll_ctl() failed: %s\n", next->nr, strerror(errno));
+
+	job_reset_response(next);
+	next->state = JOB_HEADERS;
+	deadlines_start(&next->deadlines, &deadline_limits);
+	deadline_arm(&next->deadlines, DEADLINE_FIRST_BYTE);
+	next->wakeup = now_ms(); // Its response may already be in "pending"
+	job_schedule(next);
+	pool_stats.reused ++;
+	timing_set_reused(&next->timing, 1);
+}
+
+/* Writes a part of response body into the output file */
+static int job_write_body(struct batch_job *job, const char *data, size_t length)
+{
+	if(job->fout < 0)
+		return 0; // Discarded
+
+	if(decode_body(&job->decoder, job->fout, data, length) < 0)
+	{
+		job_fail(job, "failed to save the response body into \"%s\": %s", job->filename, decode_strerror(&job->decoder));
+		return -1;
+	}
+
+	job->body_bytes += length;
+	return 0;
+}
+
+/* Decodes the next part of chunked body.
+	Returns 1 if the last chunk (and the trailer) has been received,
+	0 if more data is needed, -1 on error. */
+static int job_consume_chunked(struct batch_job *job, const char *data, size_t length)
+{
+	struct iovec iov[CHUNKED_MAX_IOV];
+
+	while(length > 0)
+	{
+		int iovcnt;
+		ssize_t used = chunked_decode_iov(&job->chunked, data, length, iov, CHUNKED_MAX_IOV, &iovcnt);
+		if(used < 0)
+		{
+			job_fail(job, "malformed chunked body: %s", job->chunked.error);
+			return -1;
+		}
+
+		if(job->fout >= 0)
+		{
+			int i;
+			for(i = 0; i < iovcnt; i ++)
+				job->body_bytes += iov[i].iov_len;
+
+			if(decode_body_iov(&job->decoder, job->fout, iov, iovcnt) < 0)
+			{
+				job_fail(job, "failed to save the response body into \"%s\": %s", job->filename, decode_strerror(&job->decoder));
+				return -1;
+			}
+		}
+
+		data += used;
+		length -= used;
+
+		if(chunked_is_done(&job->chunked))
+		{
+			if(length > 0 && job_keep_excess(job, data, length) < 0)
+				return -1;
+
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+	Handles the next part of response body.
+	Returns 1 if the body has been received completely,
+	0 if more data is needed, -1 on error.
+*/
+static int job_consume_body(struct batch_job *job, const char *data, size_t length)
+{
+	if(job->framing.is_chunked)
+		return job_consume_chunked(job, data, length);
+
+	size_t todo = length;
+	if(!job->framing.no_length && todo > job->remaining)
+		todo = job->remaining;
+
+	if(job_write_body(job, data, todo) < 0)
+		return -1;
+
+	if(todo < length && job_keep_excess(job, data + todo, length - todo) < 0)
+		return -1;
+
+	if(job->framing.no_length)
+		return 0; // Until the server closes the connection
+
+	job->remaining -= todo;
+	return job->remaining == 0;
+}
+
+/* Returns the number of the following bytes of body which can be moved
+	from the socket directly into the file (i.e. without parsing them),
+	or 0 if they must be read into buffer[] first */
+static size_t job_raw_body_length(struct batch_job *job)
+{
+	if(job->fout < 0 || job->pending)
+		return 0;
+
+	if(job->framing.is_chunked)
+	{
+		unsigned long long remaining = chunked_data_remaining(&job->chunked);
+		return remaining >= CHUNKED_SPLICE_MIN ? remaining : 0;
+	}
+
+	return job->remaining;
+}
+
+/* Accounts for "bytes" of body which were moved via transfer_from_socket().
+	Returns 1 if the body has been received completely, 0 otherwise. */
+static int job_raw_body_received(struct batch_job *job, size_t bytes)
+{
+	job->body_bytes += bytes;
+
+	if(job->framing.is_chunked)
+	{
+		chunked_data_consumed(&job->chunked, bytes);
+		return 0;
+	}
+
+	if(job->framing.no_length)
+		return 0; // Until the server closes the connection
+
+	job->remaining -= bytes;
+	return job->remaining == 0;
+}
+
+/*
+	Compares the digest of the received body with the one from the headers.
+	Returns 0 if it matches or there is nothing to compare with, -1 if the job has failed.
+*/
+static int job_check_digest(struct batch_job *job)
+{
+	struct digest_value actual;
+	char hex[DIGEST_HEX_SIZE], expected_hex[DIGEST_HEX_SIZE];
+
+	digest_final(&job->digest, &actual);
+	if(!job->expected_digest.size)
+	{
+		fprintf(stderr, "[debug] [%u] %s: no %s in Repr-Digest or Digest, not verified.\n", job->nr, job->url, digest_name(batch_verify));
+		digests_missing ++;
+		return 0;
+	}
+
+	if(!digest_equal(&actual, &job->expected_digest))
+	{
+		digests_mismatched ++;
+		job_fail(job, "%s of the body is %s, but the server has sent %s", digest_name(batch_verify),
+			digest_format(&actual, hex), digest_format(&job->expected_digest, expected_hex));
+		return -1;
+	}
+
+	digests_matched ++;
+	return 0;
+}
+
+/* Response has been received completely */
+static void job_body_complete(struct batch_job *job)
+{
+	if(!content_decoder_is_done(&job->decoder))
+	{
+		job_fail(job, "compressed response body has ended prematurely");
+		return;
+	}
+
+	timing_mark(&job->timing, TIMING_BODY);
+	if(job_close_file(job) < 0)
+	{
+		job_fail(job, "failed to save the response body into \"%s\": %s", job->filename, strerror(errno));
+		return;
+	}
+
+	if(job->pipe_next)
+		job_pass_connection(job);
+	else
+		job_close_connection(job, job->keep_alive && !job->framing.no_length);
+
+	if(job->decoder.digest && job_check_digest(job) < 0)
+		return;
+
+	if(job->location)
+	{
+		char *location = job->location;
+		job->location = NULL;
+
+		job_start_hop(job, location);
+		return;
+	}
+
+	if(job->code == 304)
+	{
+		/* Cached copy is still valid */
+		if(cache_refresh(&job->cache_entry, &job->response) < 0)
+			fprintf(stderr, "[warn] [%u] %s: failed to update the cache: %s\n", job->nr, job->url, strerror(errno));
+
+		job_save_cached(job);
+		return;
+	}
+
+	if(job->cache_key && cache_store(job->cache_key, &job->response, job->filename) < 0)
+		fprintf(stderr, "[warn] [%u] %s: failed to save the response into the cache: %s\n", job->nr, job->url, strerror(errno));
+
+	job_succeed(job);
+}
+
+/*
+	Handles the headers parsed into job->response
+	and prepares to receive the body.
+	Returns 0 on success, -1 on error.
+*/
+static int job_handle_headers(struct batch_job *job)
+{
+	struct http_response *r = &job->response;
+	job->code = r->code;
+	timing_set_code(&job->timing, job->code);
+
+	/* Catch the "wrong" status codes */
+	if(job->code >= 400 || job->code < 200)
+	{
+		job_fail(job, "server returned HTTP code %i: %s", job->code, http_status_text(r));
+		return -1;
+	}
+
+	if(get_body_framing(r, &job->framing) < 0)
+	{
+		job_fail(job, "unsupported response body");
+		return -1;
+	}
+	job->keep_alive = is_keep_alive(r);
+
+	job->remaining = job->framing.len;
+	chunked_init(&job->chunked);
+	job->fout = -1;
+
+	if(job->code == 304) // Not Modified (no body)
+	{
+		if(!job->cache_entry.url)
+		{
+			job_fail(job, "server returned 304 Not Modified, but the request was not conditional");
+			return -1;
+		}
+
+		fprintf(stderr, "[info] [%u] %s: not modified, using the copy from the cache\n", job->nr, job->hop_url);
+		return 0;
+	}
+
+	if(job->cache_entry.url)
+		cache_stats.misses ++; // Stale entry has changed on the server
+
+	if(job->code >= 300) /* codes >= 400 have already been filtered before */
+	{
+		const char *location = http_known_header(r, HDR_LOCATION);
+		if(!location)
+		{
+			job_fail(job, "server returned redirect (%i) without Location", job->code);
+			return -1;
+		}
+
+		if(++ job->redirect_nr > max_redirects)
+		{
+			job_fail(job, "redirects depth limit reached: maximum %u are allowed", max_redirects);
+			return -1;
+		}
+
+		job->location = resolve_location(job->arena, &job->u, location);
+		if(!job->location)
+		{
+			job_fail(job, "resolve_location: memory allocation failed");
+			return -1;
+		}
+		redirect_store(job->arena, &job->u, job->location, r);
+
+		/* Body of the redirect is not needed, but it must be read
+			(if it's not too long), otherwise we can't send the next
+			request via the same connection */
+		if(job->framing.no_length || (!job->framing.is_chunked && job->framing.len > MAX_DRAIN_LENGTH))
+			job->keep_alive = 0;
+
+		return 0;
+	}
+
+	/* Compressed response (we have sent Accept-Encoding) */
+	const char *content_encoding = http_known_header(r, HDR_CONTENT_ENCODING);
+	if(content_encoding && content_decoder_init(&job->decoder, content_encoding) < 0)
+	{
+		job_fail(job, "server has returned Content-Encoding: %s, but %s", content_encoding, job->decoder.error);
+		return -1;
+	}
+
+	if(job->code == 204)
+		return 0;
+
+	job->filename = arena_printf(job->arena, "%s.%u", output_name, job->nr);
+	if(!job->filename)
+	{
+		job_fail(job, "memory allocation failed");
+		return -1;
+	}
+
+	/* Space for the body is allocated if its length is known (and it's not compressed) */
+	long long length = -1;
+	if(!job->framing.is_chunked && !job->framing.no_length && job->decoder.coding == CODING_IDENTITY)
+		length = job->framing.len;
+
+	job->fout = output_open(job->filename, 0, length);
+	if(job->fout < 0)
+	{
+		job_fail(job, "open(\"%s\") failed: %s", job->filename, strerror(errno));
+		return -1;
+	}
+
+	/* The body is hashed as it's written. Digests in the headers are of the representation,
+		i.e. of the compressed data if there is Content-Encoding: only uncompressed bodies are checked. */
+	if(batch_verify != DIGEST_NONE && job->decoder.coding == CODING_IDENTITY)
+	{
+		memset(&job->expected_digest, 0, sizeof(job->expected_digest));
+
+		const char *header = find_header(r, "Repr-Digest");
+		if(!header || digest_parse_header(header, batch_verify, &job->expected_digest) < 0)
+		{
+			header = find_header(r, "Digest");
+			if(header)
+				digest_parse_header(header, batch_verify, &job->expected_digest);
+		}
+
+		digest_init(&job->digest, batch_verify);
+		job->decoder.digest = &job->digest;
+	}
+	return 0;
+}
+
+/* End of HTTP/2 callback: the job may have finished, or it must be advanced by the main loop */
+static void job_h2_done(struct batch_job *job)
+{
+	if(job->state == JOB_FINISHED)
+	{
+		job_free(job);
+		return;
+	}
+
+	if(job->state != JOB_H2)
+		job->wakeup = now_ms(); // Redirect or retry: not from inside h2_process()
+	job_schedule(job);
+}
+
+static void job_h2_on_sent(void *opaque)
+{
+	struct batch_job *job = opaque;
+
+	timing_mark(&job->timing, TIMING_REQUEST);
+	deadline_arm(&job->deadlines, DEADLINE_FIRST_BYTE);
+	job_schedule(job);
+}
+
+static int job_h2_on_headers(void *opaque, const char *head, size_t length)
+{
+	struct batch_job *job = opaque;
+	int ret = -1;
+
+	timing_mark(&job->timing, TIMING_FIRST_BYTE);
+	deadline_disarm(&job->deadlines, DEADLINE_FIRST_BYTE);
+	deadline_arm(&job->deadlines, DEADLINE_IDLE);
+
+	/* Parsed response keeps pointers into the buffer: it must live as long as the job */
+	job->buffer = arena_alloc(job->arena, length);
+	if(!job->buffer)
+	{
+		job_fail(job, "memory allocation failed");
+		goto done;
+	}
+	memcpy(job->buffer, head, length);
+	job->buffer_length = job->buffer_size = length;
+
+	if(http_parse_response(&job->response, job->buffer, job->buffer_length) <= 0)
+	{
+		job_fail(job, "malformed HTTP headers");
+		goto done;
+	}
+
+	timing_mark(&job->timing, TIMING_HEADERS);
+	if(job_handle_headers(job) < 0)
+		goto done;
+
+	/* The end of body is END_STREAM (Content-Length, if any, is checked by job_h2_on_close) */
+	job->framing.is_chunked = 0;
+	job->keep_alive = 1;
+
+	if(job->location)
+	{
+		/* The body of redirect is not needed: the stream is reset, the connection stays */
+		job_h2_detach(job);
+		job_body_complete(job);
+		goto done;
+	}
+	ret = 0;
+
+done:
+	job_h2_done(job);
+	return ret;
+}
+
+static int job_h2_on_data(void *opaque, const char *data, size_t length)
+{
+	struct batch_job *job = opaque;
+
+	deadline_arm(&job->deadlines, DEADLINE_IDLE);
+	int ret = job_consume_body(job, data, length) < 0 ? -1 : 0;
+
+	job_h2_done(job);
+	return ret;
+}
+
+static void job_h2_on_close(void *opaque, const char *error, int retry)
+{
+	struct batch_job *job = opaque;
+	struct batch_h2 *h = job->h2;
+	job->h2 = NULL;
+
+	if(!error)
+	{
+		if(!job->framing.no_length && job->remaining)
+			job_fail(job, "response has ended prematurely");
+		else
+			job_body_complete(job);
+	}
+	else if(retry && !h->failed)
+	{
+		/* Server hasn't processed the request: try again (via another connection, if this one is going away) */
+		fprintf(stderr, "[debug] [%u] %s, retrying.\n", job->nr, error);
+
+		job->state = JOB_RESOLVE;
+		deadlines_start(&job->deadlines, &deadline_limits);
+		timing_retry(&job->timing);
+	}
+	else
+		job_fail(job, "%s", error);
+
+	job_h2_done(job);
+}
+
+static const struct h2_callbacks job_h2_callbacks = {
+	job_h2_on_sent,
+	job_h2_on_headers,
+	job_h2_on_data,
+	job_h2_on_close
+};
+
+/*
+	Adds the request as a stream of HTTP/2 connection to its host:port.
+	Returns 0 if there is no such connection yet: the job must establish it (as usual),
+	its stream will be the first one. Otherwise, returns 1 (the job is waiting for the response or has failed).
+*/
+static int job_h2_submit(struct batch_job *job)
+{
+	struct batch_h2 *h;
+	for(h = h2_connections; h; h = h->next)
+	{
+		if(h2_usable(&h->conn) && !strcmp(h->host, job->u.host) && !strcmp(h->port, job->u.port))
+			break;
+	}
+
+	int created = 0;
+	if(!h)
+	{
+		h = calloc(1, sizeof(struct batch_h2));
+		if(!h || h2_init(&h->conn, &job_h2_callbacks) < 0)
+		{
+			free(h);
+			job_fail(job, "memory allocation failed");
+			return 1;
+		}
+
+		h->source = SOURCE_H2;
+		if(!(h->host = malloc(strlen(job->u.host) + strlen(job->u.port) + 2)))
+		{
+			h2_free(&h->conn, NULL);
+			free(h);
+			job_fail(job, "memory allocation failed");
+			return 1;
+		}
+		h->port = stpcpy(h->host, job->u.host) + 1;
+		strcpy(h->port, job->u.port);
+
+		h->next = h2_connections;
+		if(h2_connections)
+			h2_connections->prev = h;
+		h2_connections = h;
+		created = 1;
+	}
+
+	h2_submit(&h->conn, &job->stream, job->request, job->request_length, job); // Can't fail: it's usable
+	job->h2 = h;
+
+	if(created)
+	{
+		h->connector = job;
+		return 0;
+	}
+
+	if(!h->connector)
+	{
+		pool_stats.reused ++;
+		timing_set_reused(&job->timing, 1);
+	}
+
+	job->state = JOB_H2;
+	return 1;
+}
+
+/* The job has established the connection for HTTP/2 (see job_h2_submit) */
+static void job_h2_connected(struct batch_job *job)
+{
+	struct batch_h2 *h = job->h2;
+	int sock = job->sock;
+	job->sock = -1;
+	h->connector = NULL;
+
+	if(h2_start(&h->conn, sock) < 0)
+	{
+		job_h2_detach(job);
+		h->failed = 1;
+		batch_h2_close(h, "memory allocation failed");
+		job_fail(job, "memory allocation failed");
+		return;
+	}
+
+	/* The socket was registered by job_register_socket(): now its events go to the connection */
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = h;
+	if(epoll_ctl(epfd, EPOLL_CTL_MOD, sock, &ev) < 0)
+		fprintf(stderr, "[warn] [%u] epoll_ctl() failed: %s\n", job->nr, strerror(errno));
+
+	job->state = JOB_H2; // Stream is started by h2_flush() (see batch_loop)
+}
+
+/* Advances the state machine of the job as far as possible without blocking */
+static void job_advance(struct batch_job *job)
+{
+	ssize_t bytes;
+	int ret;
+
+	while(1)
+	{
+		switch(job->state)
+		{
+			case JOB_RESOLVE:
+				job_connect(job);
+				break;
+
+			case JOB_RESOLVING:
+			case JOB_QUEUED:
+			case JOB_H2:
+				return;
+
+			case JOB_CONNECT:
+			{
+				int wait_ms;
+				int sock = he_step(&job->he, &wait_ms);
+
+				if(sock == HE_IN_PROGRESS)
+				{
+					job->wakeup = wait_ms >= 0 ? now_ms() + wait_ms : 0;
+					return;
+				}
+
+				if(sock == HE_FAILED)
+				{
+					job_fail(job, "connect(%s:%s) failed: %s", job->u.host, job->u.port, strerror(job->he.last_error));
+					return;
+				}
+
+				fprintf(stderr, "[debug] [%u] Connected to %s:%s (address %s, %.1f ms)\n",
+					job->nr, job->u.host, job->u.port, job->he.winner_address, job->he.elapsed_ms);
+
+				job->sock = sock;
+				job_cancel_connect(job);
+				pool_stats.created ++;
+				timing_mark(&job->timing, TIMING_CONNECT);
+				deadline_disarm(&job->deadlines, DEADLINE_CONNECT);
+
+				if(job->h2)
+				{
+					job_h2_connected(job);
+					break;
+				}
+
+				job->state = JOB_SEND;
+				break;
+			}
+
+			case JOB_SEND:
+			{
+				/* Requests of the whole pipeline are sent at once */
+				const char *request = job->pipeline_request ? job->pipeline_request : job->request;
+				int request_length = job->pipeline_request ? job->pipeline_request_length : job->request_length;
+
+				bytes = send(job->sock, request + job->request_sent, request_length - job->request_sent, MSG_NOSIGNAL);
+				if(bytes < 0)
+				{
+					if(errno == EAGAIN)
+						return;
+
+					if(job->reused)
+					{
+						job_reconnect(job);
+						break;
+					}
+
+					job_fail(job, "send() failed: %s", strerror(errno));
+					return;
+				}
+
+				job->request_sent += bytes;
+				if(job->request_sent == request_length)
+				{
+					job->state = JOB_HEADERS;
+					deadline_arm(&job->deadlines, DEADLINE_FIRST_BYTE);
+
+					struct batch_job *follower;
+					for(follower = job; follower; follower = follower->pipe_next)
+						timing_mark(&follower->timing, TIMING_REQUEST);
+				}
+				break;
+			}
+
+			case JOB_HEADERS:
+			{
+				if(job->buffer_length == job->buffer_size)
+				{
+					/* Long headers: make the buffer larger
+						(http_parse_response() has a sanity limit for their length) */
+					size_t size = job->buffer_size ? job->buffer_size * 2 : HTTP_HEADERS_BUFFER_SIZE;
+					char *buffer = arena_realloc(job->arena, job->buffer, job->buffer_size, size);
+					if(!buffer)
+					{
+						job_fail(job, "memory allocation failed");
+						return;
+					}
+
+					job->buffer = buffer;
+					job->buffer_size = size;
+				}
+
+				bytes = job_recv(job, job->buffer + job->buffer_length, job->buffer_size - job->buffer_length);
+				if(bytes <= 0)
+				{
+					if(bytes < 0 && errno == EAGAIN)
+						return;
+
+					if(job->reused && job->buffer_length == 0 && (bytes == 0 || errno == ECONNRESET))
+					{
+						job_reconnect(job);
+						break;
+					}
+
+					if(bytes == 0)
+						job_fail(job, "connection closed by server before all HTTP response headers were received");
+					else
+						job_fail(job, "read(sock) failed: %s", strerror(errno));
+					return;
+				}
+
+				if(job->buffer_length == 0)
+				{
+					timing_mark(&job->timing, TIMING_FIRST_BYTE);
+					deadline_disarm(&job->deadlines, DEADLINE_FIRST_BYTE);
+				}
+				deadline_arm(&job->deadlines, DEADLINE_IDLE);
+				job->buffer_length += bytes;
+
+				/* Only the new data is parsed (the parser remembers where it has stopped) */
+				ssize_t body_offset = http_parse_response(&job->response, job->buffer, job->buffer_length);
+				if(body_offset < 0)
+				{
+					job_fail(job, "malformed HTTP headers");
+					return;
+				}
+
+				if(body_offset == 0)
+					break; // Not all headers have been received yet
+
+				size_t end_of_headers = body_offset;
+
+				timing_mark(&job->timing, TIMING_HEADERS);
+				if(job_handle_headers(job) < 0)
+					return;
+
+				job->state = JOB_BODY;
+
+				/* Part of the body could have been read together with headers */
+				if(!job->framing.is_chunked && job->remaining == 0)
+				{
+					ret = 1;
+					if(job->buffer_length > end_of_headers &&
+						job_keep_excess(job, job->buffer + end_of_headers, job->buffer_length - end_of_headers) < 0)
+					{
+						return;
+					}
+				}
+				else if(job->buffer_length > end_of_headers)
+					ret = job_consume_body(job, job->buffer + end_of_headers, job->buffer_length - end_of_headers);
+				else
+					ret = 0;
+
+				if(ret < 0)
+					return;
+
+				if(ret == 0 && job->location && !job->keep_alive)
+				{
+					/* The body of redirect is not worth reading */
+					job_close_connection(job, 0);
+					ret = 1;
+				}
+
+				if(ret == 1)
+					job_body_complete(job);
+				break;
+			}
+
+			case JOB_BODY:
+			{
+				/* The data which doesn't need to be parsed goes from
+					the socket directly into the file (via splice) */
+				size_t raw_length = job_raw_body_length(job);
+				if(raw_length)
+					bytes = decode_from_socket(&job->decoder, job->fout, job->sock, raw_length);
+				else
+					bytes = job_recv(job, body_buffer, CHUNKED_BUFFER_SIZE);
+
+				if(bytes < 0)
+				{
+					if(errno == EAGAIN)
+						return;
+
+					job_fail(job, "failed to receive the response body: %s", decode_strerror(&job->decoder));
+					return;
+				}
+
+				if(bytes == 0)
+				{
+					if(!job->framing.no_length)
+					{
+						job_fail(job, "response has ended prematurely");
+						return;
+					}
+
+					job_body_complete(job);
+					break;
+				}
+				deadline_arm(&job->deadlines, DEADLINE_IDLE);
+
+				if(raw_length)
+					ret = job_raw_body_received(job, bytes);
+				else
+					ret = job_consume_body(job, body_buffer, bytes);
+
+				if(ret < 0)
+					return;
+
+				if(ret == 1)
+					job_body_complete(job);
+				break;
+			}
+
+			case JOB_FINISHED:
+				return;
+		}
+	}
+}
+
+static void job_step(struct batch_job *job)
+{
+	struct transfer_stats before = transfer_stats;
+	job_advance(job);
+	timing_add_transfer(&job->timing, &before);
+
+	job_schedule(job);
+}
+
+/* "url" is copied */
+static struct batch_job *job_new(unsigned nr, const char *url)
+{
+	struct arena *arena = arena_get();
+	struct batch_job *job = arena ? arena_alloc(arena, sizeof(struct batch_job)) : NULL;
+	if(job)
+	{
+		memset(job, 0, sizeof(struct batch_job));
+		job->url = arena_strdup(arena, url);
+	}
+	if(!job || !job->url || timer_heap_reserve(&timers, active_count + 1) < 0)
+	{
+		fprintf(stderr, "[error] Memory allocation failed\n");
+		exit(1);
+	}
+
+	job->arena = arena;
+	job->nr = nr;
+	job->sock = -1;
+	job->fout = -1;
+	http_response_init(&job->response, arena);
+	content_decoder_init(&job->decoder, "");
+	timing_start(&job->timing);
+	deadlines_start(&job->deadlines, &deadline_limits);
+	timer_init(&job->timer, job);
+
+	/* Add to the list of active jobs */
+	job->next = active_jobs;
+	if(active_jobs)
+		active_jobs->prev = job;
+	active_jobs = job;
+	active_count ++;
+
+	return job;
+}
+
+static void job_free(struct batch_job *job)
+{
+	if(job->prev)
+		job->prev->next = job->next;
+	else
+		active_jobs = job->next;
+
+	if(job->next)
+		job->next->prev = job->prev;
+
+	active_count --;
+	timer_cancel(&timers, &job->timer);
+
+	timing_report(&job->timing, job->url, job->error);
+
+	content_decoder_free(&job->decoder);
+	cache_entry_free(&job->cache_entry);
+	arena_put(job->arena); // Everything else
+}
+
+/* Fails the jobs whose deadlines have expired, wakes up the ones which wait for "wakeup" */
+static void batch_expire_timers(void)
+{
+	long long now = now_ms();
+	struct timer *timer;
+
+	while((timer = timer_pop_expired(&timers, now)))
+	{
+		struct batch_job *job = timer->data;
+
+		enum deadline_kind kind;
+		long long deadline = deadline_next(&job->deadlines, &kind);
+		if(deadline != DEADLINE_NONE && deadline <= now && job->state != JOB_QUEUED)
+		{
+			job_fail(job, "timeout: %s deadline (%u ms) has expired", deadline_name(kind), deadline_limits.ms[kind]);
+			job_free(job);
+			continue;
+		}
+
+		/* Time to start the next connection attempt, etc. */
+		if(job->wakeup && now >= job->wakeup)
+		{
+			job->wakeup = 0;
+			job_step(job);
+
+			if(job->state == JOB_FINISHED)
+				job_free(job);
+			continue;
+		}
+
+		job_schedule(job); // Fired too early (see job_schedule)
+	}
+}
+
+static __thread char *line = NULL; // see read_url()
+static __thread size_t line_size = 0;
+
+/* Returns the next URL from the batch file (valid until the next call), or NULL at EOF */
+static char *read_url(FILE *urls)
+{
+	while(getline(&line, &line_size, urls) >= 0)
+	{
+		char *begin = line;
+		while(isspace(*begin))
+			begin ++;
+
+		char *end = begin + strlen(begin);
+		while(end > begin && isspace(end[-1]))
+			end --;
+		*end = '\0';
+
+		if(*begin == '\0' || *begin == '#')
+			continue; // Skip empty lines and comments
+
+		memmove(line, begin, end - begin + 1);
+		return line;
+	}
+
+	free(line);
+	line = NULL;
+	line_size = 0;
+	return NULL;
+}
+
+/*
+	Several threads (-w): all URLs are read before the start and split into
+	contiguous ranges (so that URLs on the same host stay together for pipelining),
+	one range per thread. The thread takes URLs from the front of its range.
+	When its range is empty, it steals the back half of the largest remaining
+	range of another thread. Each range has its own lock, which is taken
+	once per URL (rarely contended: only by a thread which has nothing to do).
+*/
+struct url_queue {
+	pthread_mutex_t lock;
+	unsigned begin, end; // all_urls[begin .. end) are not taken yet
+};
+
+struct batch_thread {
+	pthread_t thread;
+	unsigned concurrency; // this thread's share of requests performed at the same time
+	struct url_queue queue;
+
+	/* Statistics of the thread, see batch_merge_stats() */
+	unsigned succeeded, failed, pipelined, pipeline_retried;
+	unsigned digests_matched, digests_mismatched, digests_missing;
+	struct pool_stats pool_stats;
+	struct dns_stats dns_stats;
+	struct transfer_stats transfer_stats;
+	struct cache_stats cache_stats;
+	struct redirect_stats redirect_stats;
+	struct arena_stats arena_stats;
+	struct h2_stats h2_stats;
+	struct output_stats output_stats;
+
+	struct log_target log; // logger of the thread which has started the batch (see log.h)
+};
+
+static char **all_urls = NULL;
+static unsigned all_url_count = 0;
+
+static struct batch_thread *threads = NULL;
+static unsigned thread_count = 0;
+static unsigned ranges_stolen = 0; // atomic
+
+static __thread struct batch_thread *current_thread = NULL; // NULL if there is only one thread
+
+static FILE *url_file; // read by the only thread (if there are several, see all_urls)
+static unsigned url_count = 0;
+static unsigned batch_pipeline_depth;
+
+static __thread char *lookahead_url = NULL; // URL which was taken, but not used yet
+static __thread unsigned lookahead_nr;
+static __thread int eof = 0;
+
+/* Moves the back half of the largest range of other threads into the range of this thread.
+	Returns 0 on success, -1 if all ranges are empty. */
+static int steal_urls(void)
+{
+	struct url_queue *own = &current_thread->queue;
+
+	while(1)
+	{
+		struct url_queue *victim = NULL;
+		unsigned largest = 0, i;
+
+		for(i = 0; i < thread_count; i ++)
+		{
+			struct url_queue *q = &threads[i].queue;
+			if(q == own)
+				continue;
+
+			pthread_mutex_lock(&q->lock);
+			unsigned left = q->end - q->begin;
+			pthread_mutex_unlock(&q->lock);
+
+			if(left > largest)
+			{
+				largest = left;
+				victim = q;
+			}
+		}
+
+		if(!victim)
+			return -1;
+
+		pthread_mutex_lock(&victim->lock);
+		unsigned left = victim->end - victim->begin;
+		unsigned begin = victim->end - (left + 1) / 2, end = victim->end;
+		victim->end = begin;
+		pthread_mutex_unlock(&victim->lock);
+
+		if(left == 0)
+			continue; // Another thread was faster
+
+		pthread_mutex_lock(&own->lock);
+		own->begin = begin;
+		own->end = end;
+		pthread_mutex_unlock(&own->lock);
+
+		__atomic_add_fetch(&ranges_stolen, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+}
+
+/* Takes the next URL of this thread (see above), NULL if all URLs have been taken */
+static char *take_url(unsigned *nr)
+{
+	struct url_queue *q = &current_thread->queue;
+
+	do {
+		pthread_mutex_lock(&q->lock);
+		unsigned i = q->begin < q->end ? q->begin ++ : UINT_MAX;
+		pthread_mutex_unlock(&q->lock);
+
+		if(i != UINT_MAX)
+		{
+			*nr = i + 1;
+			return all_urls[i];
+		}
+	} while(steal_urls() == 0);
+
+	return NULL;
+}
+
+/* Returns the next URL (valid until the next call) and its number in the batch file ("*nr"), or NULL at EOF */
+static char *read_next_url(unsigned *nr)
+{
+	char *url = lookahead_url;
+	*nr = lookahead_nr;
+	lookahead_url = NULL;
+
+	if(!url && !eof)
+	{
+		if(current_thread)
+			url = take_url(nr);
+		else if((url = read_url(url_file)))
+			*nr = ++ url_count;
+
+		if(!url)
+			eof = 1;
+	}
+	return url;
+}
+
+/* Returns 1 if "url" (or its target, if it's a known permanent redirect)
+	is on the same scheme://host:port as the current hop of "job" */
+static int is_same_origin(struct batch_job *job, const char *url)
+{
+	unsigned hops = 0;
+	char *copy = redirect_lookup(job->arena, url, &hops);
+	if(!copy && !(copy = arena_strdup(job->arena, url)))
+		return 0;
+
+	struct http_url u;
+	return parse_url(copy, &u) == 0 && u.tls == job->u.tls && !strcmp(u.host, job->u.host) && !strcmp(u.port, job->u.port);
+}
+
+/*
+	Pipelining: the following URLs from the batch file which are on the same
+	host:port as "head" are fetched via its connection (up to "depth" requests
+	in total). All requests are sent at once, responses are received in order.
+*/
+static void batch_add_pipeline(struct batch_job *head, unsigned depth, unsigned concurrency)
+{
+	struct batch_job *tail = head;
+	unsigned count = 1;
+
+	while(count < depth && active_count < concurrency)
+	{
+		unsigned nr;
+		char *url = read_next_url(&nr);
+		if(!url)
+			break;
+
+		if(!is_same_origin(head, url))
+		{
+			lookahead_url = url;
+			lookahead_nr = nr;
+			break;
+		}
+
+		struct batch_job *job = job_new(nr, url);
+		job_start(job);
+		if(job->state == JOB_FINISHED)
+		{
+			job_free(job);
+			continue;
+		}
+
+		int length = head->pipeline_request ? head->pipeline_request_length : head->request_length;
+		char *request = arena_realloc(head->arena, head->pipeline_request, head->pipeline_request ? length : 0, length + job->request_length);
+		if(!request)
+		{
+			/* Not fatal: this request will be sent via another connection */
+			job_step(job);
+			if(job->state == JOB_FINISHED)
+				job_free(job);
+			break;
+		}
+
+		if(!head->pipeline_request)
+		{
+			memcpy(request, head->request, head->request_length);
+			head->pipeline_request_length = head->request_length;
+		}
+		memcpy(request + head->pipeline_request_length, job->request, job->request_length);
+		head->pipeline_request = request;
+		head->pipeline_request_length += job->request_length;
+
+		job->state = JOB_QUEUED;
+		tail->pipe_next = job;
+		tail = job;
+		count ++;
+		pipelined ++;
+	}
+}
+
+/* Event loop of one thread: performs the requests until there are no more URLs */
+static void batch_loop(unsigned concurrency, unsigned pipeline_depth)
+{
+	struct epoll_event events[BATCH_MAX_EVENTS];
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(epfd < 0)
+	{
+		fprintf(stderr, "[error] epoll_create1() failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	pool_set_capacity(concurrency);
+
+	/* Completion of DNS lookups is reported via this descriptor (data.ptr is NULL) */
+	struct epoll_event dns_ev;
+	dns_ev.events = EPOLLIN;
+	dns_ev.data.ptr = NULL;
+	if(dns_fd() < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, dns_fd(), &dns_ev) < 0)
+	{
+		fprintf(stderr, "[error] Failed to create eventfd for DNS lookups: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	while(1)
+	{
+		/* Start new requests (if there are free slots) */
+		while(active_count < concurrency)
+		{
+			unsigned nr;
+			char *url = read_next_url(&nr);
+			if(!url)
+				break;
+
+			struct batch_job *job = job_new(nr, url);
+			job_start(job);
+
+			if(pipeline_depth > 1 && job->state != JOB_FINISHED)
+				batch_add_pipeline(job, pipeline_depth, concurrency);
+
+			job_step(job);
+
+			if(job->state == JOB_FINISHED)
+				job_free(job);
+		}
+
+		/* HTTP/2: start the new streams and send what the callbacks have queued */
+		struct batch_h2 *h, *next;
+		for(h = h2_connections; h; h = next)
+		{
+			next = h->next;
+			if(h->conn.sock >= 0 && h2_flush(&h->conn) < 0)
+				batch_h2_close(h, h->conn.error);
+		}
+
+		if(!active_count)
+			break;
+
+		int n = epoll_wait(epfd, events, BATCH_MAX_EVENTS, timer_next_ms(&timers));
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			fprintf(stderr, "[error] epoll_wait() failed: %s\n", strerror(errno));
+			exit(1);
+		}
+
+		int i;
+		for(i = 0; i < n; i ++)
+		{
+			void *ptr = events[i].data.ptr;
+			if(!ptr)
+			{
+				dns_process();
+				continue;
+			}
+
+			if(*(enum event_source *) ptr == SOURCE_H2)
+			{
+				h = ptr;
+				if(h2_process(&h->conn) < 0)
+					batch_h2_close(h, h->conn.error);
+				continue;
+			}
+
+			struct batch_job *job = ptr;
+			job_step(job);
+
+			if(job->state == JOB_FINISHED)
+				job_free(job);
+		}
+
+		batch_expire_timers();
+	}
+
+	while(h2_connections)
+		batch_h2_close(h2_connections, "batch has finished");
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, dns_fd(), NULL);
+	close(epfd);
+	epfd = -1;
+	timer_heap_free(&timers);
+}
+
+static void *batch_thread_main(void *arg)
+{
+	struct batch_thread *t = arg;
+	current_thread = t;
+	log_target = t->log;
+
+	batch_loop(t->concurrency, batch_pipeline_depth);
+	pool_close_all();
+	if(t != threads)
+	{
+		dns_clear(); // The first thread is the main one: its cache is saved by -D
+		arena_free_unused();
+		transfer_thread_exit();
+	}
+
+	t->succeeded = succeeded;
+	t->failed = failed;
+	t->pipelined = pipelined;
+	t->pipeline_retried = pipeline_retried;
+	t->digests_matched = digests_matched;
+	t->digests_mismatched = digests_mismatched;
+	t->digests_missing = digests_missing;
+	t->pool_stats = pool_stats;
+	t->dns_stats = dns_stats;
+	t->transfer_stats = transfer_stats;
+	t->cache_stats = cache_stats;
+	t->redirect_stats = redirect_stats;
+	t->arena_stats = arena_stats;
+	t->h2_stats = h2_stats;
+	t->output_stats = output_stats;
+	return NULL;
+}
+
+/* Adds the statistics of another thread to the ones of this thread */
+static void batch_merge_stats(const struct batch_thread *t)
+{
+	succeeded += t->succeeded;
+	failed += t->failed;
+	pipelined += t->pipelined;
+	pipeline_retried += t->pipeline_retried;
+	digests_matched += t->digests_matched;
+	digests_mismatched += t->digests_mismatched;
+	digests_missing += t->digests_missing;
+
+	pool_stats.created += t->pool_stats.created;
+	pool_stats.reused += t->pool_stats.reused;
+
+	dns_stats.lookups += t->dns_stats.lookups;
+	dns_stats.hits += t->dns_stats.hits;
+	dns_stats.joined += t->dns_stats.joined;
+
+	transfer_stats.bytes += t->transfer_stats.bytes;
+	transfer_stats.compressed_bytes += t->transfer_stats.compressed_bytes;
+	transfer_stats.decoded_bytes += t->transfer_stats.decoded_bytes;
+	transfer_stats.splice_calls += t->transfer_stats.splice_calls;
+	transfer_stats.read_calls += t->transfer_stats.read_calls;
+	transfer_stats.write_calls += t->transfer_stats.write_calls;
+	transfer_stats.uring_calls += t->transfer_stats.uring_calls;
+
+	cache_stats.hits += t->cache_stats.hits;
+	cache_stats.revalidated += t->cache_stats.revalidated;
+	cache_stats.misses += t->cache_stats.misses;
+	cache_stats.stored += t->cache_stats.stored;
+
+	redirect_stats.used += t->redirect_stats.used;
+	redirect_stats.stored += t->redirect_stats.stored;
+
+	arena_stats.taken += t->arena_stats.taken;
+	arena_stats.mallocs += t->arena_stats.mallocs;
+
+	h2_stats.connections += t->h2_stats.connections;
+	h2_stats.streams += t->h2_stats.streams;
+	h2_stats.frames += t->h2_stats.frames;
+	h2_stats.header_bytes += t->h2_stats.header_bytes;
+	h2_stats.plain_header_bytes += t->h2_stats.plain_header_bytes;
+	if(t->h2_stats.max_concurrent > h2_stats.max_concurrent)
+		h2_stats.max_concurrent = t->h2_stats.max_concurrent;
+
+	output_stats.preallocated += t->output_stats.preallocated;
+	output_stats.direct_writes += t->output_stats.direct_writes;
+	output_stats.writebehind += t->output_stats.writebehind;
+}
+
+/* Several threads: reads all URLs, runs the event loop in each thread (this one is the first) */
+static void batch_run_threads(FILE *urls, unsigned concurrency)
+{
+	unsigned size = 0;
+	char *url;
+	while((url = read_url(urls)))
+	{
+		if(!(url = strdup(url)))
+		{
+			fprintf(stderr, "[error] strdup: memory allocation failed\n");
+			exit(1);
+		}
+
+		if(all_url_count == size)
+		{
+			size = size ? size * 2 : 1024;
+			char **new_urls = realloc(all_urls, size * sizeof(char *));
+			if(!new_urls)
+			{
+				fprintf(stderr, "[error] realloc: memory allocation failed\n");
+				exit(1);
+			}
+			all_urls = new_urls;
+		}
+		all_urls[all_url_count ++] = url;
+	}
+	url_count = all_url_count;
+
+	threads = calloc(thread_count, sizeof(struct batch_thread));
+	if(!threads)
+	{
+		fprintf(stderr, "[error] calloc: memory allocation failed\n");
+		exit(1);
+	}
+
+	unsigned i;
+	for(i = 0; i < thread_count; i ++)
+	{
+		struct batch_thread *t = &threads[i];
+		t->concurrency = concurrency / thread_count + (i < concurrency % thread_count);
+		t->queue.begin = (unsigned long long) all_url_count * i / thread_count;
+		t->queue.end = (unsigned long long) all_url_count * (i + 1) / thread_count;
+		pthread_mutex_init(&t->queue.lock, NULL);
+		t->log = log_target;
+	}
+
+	for(i = 1; i < thread_count; i ++)
+	{
+		int ret = pthread_create(&threads[i].thread, NULL, batch_thread_main, &threads[i]);
+		if(ret != 0)
+		{
+			fprintf(stderr, "[error] pthread_create() failed: %s\n", strerror(ret));
+			exit(1);
+		}
+	}
+
+	/* This thread is the first one. Its statistics are already here, others are added. */
+	batch_thread_main(&threads[0]);
+
+	for(i = 1; i < thread_count; i ++)
+	{
+		pthread_join(threads[i].thread, NULL);
+		batch_merge_stats(&threads[i]);
+	}
+
+	for(i = 0; i < thread_count; i ++)
+		pthread_mutex_destroy(&threads[i].queue.lock);
+
+	free(threads);
+	threads = NULL;
+
+	for(i = 0; i < all_url_count; i ++)
+		free(all_urls[i]);
+	free(all_urls);
+	all_urls = NULL;
+}
+
+unsigned batch_run(FILE *urls, unsigned concurrency, unsigned pipeline_depth, unsigned thread_number, int http2,
+	enum digest_algorithm verify)
+{
+	batch_pipeline_depth = http2 ? 1 : pipeline_depth; // Streams don't need pipelining
+	batch_http2 = http2;
+	batch_verify = verify;
+
+	if(thread_number == 0)
+	{
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		thread_number = cpus > 0 ? cpus : 1;
+	}
+	thread_count = thread_number < concurrency ? thread_number : concurrency;
+
+	struct timeval start;
+	gettimeofday(&start, NULL);
+
+	if(thread_count > 1)
+		batch_run_threads(urls, concurrency);
+	else
+	{
+		url_file = urls;
+		batch_loop(concurrency, batch_pipeline_depth);
+	}
+
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	double spent = now.tv_sec - start.tv_sec + 0.000001 * (now.tv_usec - start.tv_usec);
+
+	fprintf(stderr, "[notice] Batch finished: %u requests (%u succeeded, %u failed) in %.4f seconds, %.1f requests/s.\n",
+		url_count, succeeded, failed, spent, spent > 0 ? url_count / spent : 0);
+	if(thread_count > 1)
+		fprintf(stderr, "[info] Threads: %u event loops, %u ranges of URLs were taken over by idle threads.\n",
+			thread_count, ranges_stolen);
+	fprintf(stderr, "[info] Connections: %lu opened, %lu reused.\n", pool_stats.created, pool_stats.reused);
+	if(batch_pipeline_depth > 1)
+		fprintf(stderr, "[info] Pipelining: %u requests were sent after another request on the same connection, %u of them had to be retried.\n",
+			pipelined, pipeline_retried);
+	if(http2)
+		fprintf(stderr, "[info] HTTP/2: %lu connections, %lu streams (up to %u at once on one connection), %lu frames received, "
+			"request headers took %llu bytes (%llu bytes in HTTP/1.1).\n",
+			h2_stats.connections, h2_stats.streams, h2_stats.max_concurrent, h2_stats.frames,
+			h2_stats.header_bytes, h2_stats.plain_header_bytes);
+	if(verify != DIGEST_NONE)
+		fprintf(stderr, "[info] Integrity (%s): %u bodies matched Repr-Digest/Digest, %u didn't match, %u had no digest to compare with.\n",
+			digest_name(verify), digests_matched, digests_mismatched, digests_missing);
+	fprintf(stderr, "[info] DNS: %lu lookups, %lu answered from cache, %lu merged with a lookup in progress.\n",
+		dns_stats.lookups, dns_stats.hits, dns_stats.joined);
+	fprintf(stderr, "[info] Body transfer: %llu bytes via %lu splice(), %lu read() and %lu write() calls.\n",
+		transfer_stats.bytes, transfer_stats.splice_calls, transfer_stats.read_calls, transfer_stats.write_calls);
+	if(output_stats.preallocated || output_stats.direct_writes)
+		fprintf(stderr, "[info] Output files: %llu bytes allocated in advance, %lu O_DIRECT writes, %lu windows of %u Mb written back early.\n",
+			output_stats.preallocated, output_stats.direct_writes, output_stats.writebehind, OUTPUT_WRITEBEHIND / (1024 * 1024));
+	if(transfer_stats.compressed_bytes)
+		fprintf(stderr, "[info] Content-Encoding: %llu compressed bytes received, %llu bytes after decompression.\n",
+			transfer_stats.compressed_bytes, transfer_stats.decoded_bytes);
+	if(cache_enabled())
+		fprintf(stderr, "[info] Cache: %lu hits, %lu revalidated (304), %lu misses, %lu responses stored.\n",
+			cache_stats.hits, cache_stats.revalidated, cache_stats.misses, cache_stats.stored);
+	fprintf(stderr, "[info] Memory: %lu arenas taken by requests, %lu malloc() calls for them.\n",
+		arena_stats.taken, arena_stats.mallocs);
+	if(redirect_stats.used || redirect_stats.stored)
+		fprintf(stderr, "[info] Permanent redirects: %lu requests went straight to the known target, %lu redirects remembered.\n",
+			redirect_stats.used, redirect_stats.stored);
+
+	return failed;
+}
@@ -0,0 +1,52 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_BATCH_H
+#define HTTP_CLIENT_BATCH_H
+
+#include <stdio.h>
+
+#include "digest.h"
+
+/*
+	Batch mode: fetches all URLs from "urls" (one per line),
+	performing up to "concurrency" requests at the same time.
+	Response to N-th URL is saved into "http.out.N".
+
+	If "pipeline_depth" is more than 1, then consecutive URLs on the same
+	host:port are requested via one connection without waiting for responses
+	(HTTP/1.1 pipelining), up to "pipeline_depth" requests at a time.
+
+	If "threads" is more than 1 (0 means one per CPU), then the requests are
+	performed by several threads, each with its own event loop and its share
+	of "concurrency". URLs are split between the threads in contiguous ranges,
+	and a thread which has finished its range takes half of the largest
+	remaining one.
+
+	If "http2" is 1, then requests are sent via HTTP/2 without TLS ("h2c" with prior
+	knowledge, the server must support it): requests to the same host:port are
+	streams of one connection, and their responses arrive at the same time.
+	Pipelining is not used then.
+
+	If "verify" is not DIGEST_NONE, then each body is hashed while it's saved and
+	compared with the value from Repr-Digest (or Digest) header of the response,
+	if there is one: the request fails if they are different.
+
+	Returns the number of failed requests.
+*/
+unsigned batch_run(FILE *urls, unsigned concurrency, unsigned pipeline_depth, unsigned threads, int http2,
+	enum digest_algorithm verify);
+
+#endif
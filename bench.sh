@@ -0,0 +1,87 @@
+#!/bin/bash
+
+# Benchmark of http_client against the local test_server.
+# Prints MB/s and requests/s for single large downloads and for batches of requests.
+#
+# Environment variables:
+#	BENCH_PORT - port of test_server (default: 18090)
+#	BENCH_SIZE_MB - size of the large download (default: 256)
+#	BENCH_REQUESTS - number of requests in batch tests (default: 2000)
+
+PORT=${BENCH_PORT:-18090}
+SIZE_MB=${BENCH_SIZE_MB:-256}
+REQUESTS=${BENCH_REQUESTS:-2000}
+HOST="127.0.0.1:$PORT"
+
+BIN=$(cd "$(dirname "$0")" && pwd)
+WORKDIR=$(mktemp -d)
+
+function main {
+	SIZE=$(( SIZE_MB * 1024 * 1024 ))
+
+	bench "single, Content-Length ($SIZE_MB Mb)" 1 $SIZE \
+		"$BIN/http_client" http://$HOST/bytes/$SIZE
+	bench "single, Content-Length, -U ($SIZE_MB Mb)" 1 $SIZE \
+		"$BIN/http_client" -U http://$HOST/bytes/$SIZE # io_uring (if built with IO_URING=1)
+	bench "single, chunked by 64Kb ($SIZE_MB Mb)" 1 $SIZE \
+		"$BIN/http_client" http://$HOST/chunked/$SIZE/65536
+	bench "single, chunked by 1Kb ($SIZE_MB Mb)" 1 $SIZE \
+		"$BIN/http_client" http://$HOST/chunked/$SIZE/1024
+
+	make_url_list /bytes/1024 $REQUESTS > "$WORKDIR/small.txt"
+	bench "batch, $REQUESTS x 1Kb, -j 8" $REQUESTS $(( REQUESTS * 1024 )) \
+		"$BIN/http_client" -i "$WORKDIR/small.txt" -j 8
+	bench "batch, $REQUESTS x 1Kb, -j 8 -p 8" $REQUESTS $(( REQUESTS * 1024 )) \
+		"$BIN/http_client" -i "$WORKDIR/small.txt" -j 8 -p 8
+	bench "batch, $REQUESTS x 1Kb, -j 32 -w 0" $REQUESTS $(( REQUESTS * 1024 )) \
+		"$BIN/http_client" -i "$WORKDIR/small.txt" -j 32 -w 0
+
+	COUNT=$(( REQUESTS / 10 ))
+	make_url_list /bytes/1048576 $COUNT > "$WORKDIR/large.txt"
+	bench "batch, $COUNT x 1Mb, -j 8" $COUNT $(( COUNT * 1048576 )) \
+		"$BIN/http_client" -i "$WORKDIR/large.txt" -j 8
+}
+
+function make_url_list {
+	for (( i = 0; i < $2; i ++ )); do
+		echo http://$HOST$1
+	done
+}
+
+# Usage: bench NAME REQUESTS BYTES COMMAND...
+function bench {
+	name=$1
+	requests=$2
+	bytes=$3
+	shift 3
+
+	rm -rf "$WORKDIR/out"
+	mkdir "$WORKDIR/out"
+
+	start=$(date +%s.%N)
+	( cd "$WORKDIR/out" && "$@" 2>/dev/null )
+	retval=$?
+	end=$(date +%s.%N)
+
+	if [ $retval -ne 0 ]; then
+		echo "bench: $name: FAILED (exit code $retval)" >&2
+		return
+	fi
+
+	awk -v name="$name" -v requests=$requests -v bytes=$bytes -v start=$start -v end=$end 'BEGIN {
+		seconds = end - start
+		printf("bench: %-40s %8.3f s %10.1f MB/s %10.1f requests/s\n", name ":", seconds, bytes / 1048576 / seconds, requests / seconds)
+	}' >&2
+}
+
+if [ ! -x "$BIN/http_client" -o ! -x "$BIN/test_server" ]; then
+	echo "bench: build http_client and test_server first (make)." >&2
+	exit 1
+fi
+
+"$BIN/test_server" -p $PORT 2>/dev/null &
+SERVER_PID=$!
+trap 'kill $SERVER_PID; rm -rf "$WORKDIR"' EXIT
+sleep 0.5
+
+main
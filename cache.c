@@ -0,0 +1,445 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "cache.h"
+
+/*
+	Format of "<hash>.meta" (one field per line, like http.out.resume):
+		url http://example.com/page
+		etag "abc"
+		last-modified Mon, 01 Jan 2018 00:00:00 GMT
+		stored 1514764800
+		fresh-until 1514768400
+		length 1234
+*/
+
+__thread struct cache_stats cache_stats;
+
+static char *cache_dir = NULL;
+
+int cache_open(const char *dir)
+{
+	if(mkdir(dir, 0700) < 0 && errno != EEXIST)
+		return -1;
+
+	free(cache_dir);
+	cache_dir = strdup(dir);
+	return cache_dir ? 0 : -1;
+}
+
+int cache_enabled(void)
+{
+	return cache_dir != NULL;
+}
+
+char *cache_key(struct arena *arena, const struct http_url *u)
+{
+	return url_normalize(arena, u);
+}
+
+/* Name of the file of the entry: "<dir>/<hash of key><suffix>" */
+static char *entry_filename(const char *key, const char *suffix)
+{
+	/* FNV-1a (64 bit). Collisions are detected: the key is saved in .meta */
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	const unsigned char *p;
+	for(p = (const unsigned char *) key; *p; p ++)
+	{
+		hash ^= *p;
+		hash *= 0x100000001b3ULL;
+	}
+
+	char *name;
+	if(asprintf(&name, "%s/%016llx%s", cache_dir, hash, suffix) < 0)
+		return NULL;
+	return name;
+}
+
+void cache_entry_free(struct cache_entry *entry)
+{
+	free(entry->url);
+	free(entry->etag);
+	free(entry->last_modified);
+	memset(entry, 0, sizeof(struct cache_entry));
+}
+
+int cache_lookup(const char *key, struct cache_entry *entry)
+{
+	memset(entry, 0, sizeof(struct cache_entry));
+	if(!cache_dir)
+		return -1;
+
+	char *name = entry_filename(key, ".meta");
+	if(!name)
+		return -1;
+
+	FILE *f = fopen(name, "r");
+	free(name);
+	if(!f)
+		return -1;
+
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t length;
+
+	while((length = getline(&line, &line_size, f)) > 0)
+	{
+		if(line[length - 1] == '\n')
+			line[-- length] = '\0';
+
+		char *value = strchr(line, ' ');
+		if(!value)
+			continue;
+		*value ++ = '\0';
+
+		if(!strcmp(line, "url"))
+		{
+			free(entry->url);
+			entry->url = strdup(value);
+		}
+		else if(!strcmp(line, "etag"))
+		{
+			free(entry->etag);
+			entry->etag = strdup(value);
+		}
+		else if(!strcmp(line, "last-modified"))
+		{
+			free(entry->last_modified);
+			entry->last_modified = strdup(value);
+		}
+		else if(!strcmp(line, "stored"))
+			entry->stored = strtoll(value, NULL, 10);
+		else if(!strcmp(line, "fresh-until"))
+			entry->fresh_until = strtoll(value, NULL, 10);
+		else if(!strcmp(line, "length"))
+			entry->length = strtoull(value, NULL, 10);
+	}
+
+	free(line);
+	fclose(f);
+
+	/* Another URL with the same hash, or the body doesn't match (e.g. it was replaced
+		but .meta was not yet written when we were interrupted) */
+	struct stat st;
+	name = entry_filename(key, ".body");
+	if(!entry->url || strcmp(entry->url, key) || !name || stat(name, &st) < 0 ||
+		(unsigned long long) st.st_size != entry->length)
+	{
+		free(name);
+		cache_entry_free(entry);
+		return -1;
+	}
+
+	free(name);
+	return 0;
+}
+
+int cache_is_fresh(const struct cache_entry *entry)
+{
+	return time(NULL) < entry->fresh_until;
+}
+
+int cache_can_revalidate(const struct cache_entry *entry)
+{
+	return entry->etag || entry->last_modified;
+}
+
+/*
+	Creates a temporary file "<dir>/<hash of key><suffix>.XXXXXX" for the new version of the entry.
+	Its name is unique, so several threads (or processes) can store the same entry at once.
+	Returns the file descriptor (and the name in "*tmpname"), or -1 on error.
+*/
+static int create_temp(const char *key, const char *suffix, char **tmpname)
+{
+	char *name;
+	if(asprintf(&name, "%s.XXXXXX", suffix) < 0)
+		return -1;
+
+	*tmpname = entry_filename(key, name);
+	free(name);
+	if(!*tmpname)
+		return -1;
+
+	int fd = mkostemp(*tmpname, O_CLOEXEC);
+	if(fd < 0)
+	{
+		free(*tmpname);
+		*tmpname = NULL;
+	}
+	return fd;
+}
+
+/*
+	Copies file "from" into (empty) file "out_fd".
+	On filesystems which support it (btrfs, xfs) the data is shared (FICLONE),
+	otherwise it's copied inside the kernel (copy_file_range) when possible.
+*/
+static int copy_file(const char *from, int out_fd)
+{
+	static __thread char buffer[65536];
+	int ret = -1;
+
+	int in_fd = open(from, O_RDONLY | O_CLOEXEC);
+	if(in_fd < 0)
+		return -1;
+
+	if(ioctl(out_fd, FICLONE, in_fd) == 0)
+	{
+		ret = 0;
+		goto done;
+	}
+
+	ssize_t bytes;
+	int copied = 0;
+	while((bytes = copy_file_range(in_fd, NULL, out_fd, NULL, 1 << 30, 0)) > 0)
+		copied = 1;
+
+	if(bytes < 0)
+	{
+		/* Not supported between these files: copy them in userspace */
+		if(copied || (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP))
+			goto done;
+
+		while((bytes = read(in_fd, buffer, sizeof(buffer))) > 0)
+		{
+			char *p = buffer;
+			while(bytes > 0)
+			{
+				ssize_t written = write(out_fd, p, bytes);
+				if(written < 0)
+				{
+					if(errno == EINTR)
+						continue;
+					goto done;
+				}
+				p += written;
+				bytes -= written;
+			}
+		}
+		if(bytes < 0)
+			goto done;
+	}
+	ret = 0;
+
+done:
+	{
+		int saved_errno = errno;
+		close(in_fd);
+		errno = saved_errno;
+	}
+	return ret;
+}
+
+int cache_copy_body(const char *key, const char *filename)
+{
+	char *name = entry_filename(key, ".body");
+	if(!name)
+		return -1;
+
+	int ret = -1;
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if(fd >= 0)
+	{
+		ret = copy_file(name, fd);
+		if(close(fd) < 0)
+			ret = -1;
+	}
+
+	free(name);
+	return ret;
+}
+
+/* Values are written one per line, so they must not contain line breaks */
+static char *copy_value(const char *value)
+{
+	if(!value || strpbrk(value, "\r\n"))
+		return NULL;
+
+	return strdup(value);
+}
+
+/* Writes "<hash>.meta" of the entry */
+static int save_meta(const struct cache_entry *entry)
+{
+	char *name = entry_filename(entry->url, ".meta");
+	char *tmpname = NULL;
+	int ret = -1;
+
+	if(!name)
+		goto done;
+
+	int fd = create_temp(entry->url, ".meta", &tmpname);
+	if(fd < 0)
+		goto done;
+
+	FILE *f = fdopen(fd, "w");
+	if(!f)
+	{
+		close(fd);
+		unlink(tmpname);
+		goto done;
+	}
+
+	fprintf(f, "url %s\n", entry->url);
+	if(entry->etag)
+		fprintf(f, "etag %s\n", entry->etag);
+	if(entry->last_modified)
+		fprintf(f, "last-modified %s\n", entry->last_modified);
+	fprintf(f, "stored %lld\n", (long long) entry->stored);
+	fprintf(f, "fresh-until %lld\n", (long long) entry->fresh_until);
+	fprintf(f, "length %llu\n", entry->length);
+
+	if(fclose(f) != 0 || rename(tmpname, name) < 0)
+	{
+		unlink(tmpname);
+		goto done;
+	}
+	ret = 0;
+
+done:
+	free(name);
+	free(tmpname);
+	return ret;
+}
+
+/* Deletes the entry (e.g. the server doesn't allow to cache it anymore) */
+static void remove_entry(const char *key)
+{
+	char *name = entry_filename(key, ".meta");
+	if(name)
+	{
+		unlink(name);
+		free(name);
+	}
+
+	name = entry_filename(key, ".body");
+	if(name)
+	{
+		unlink(name);
+		free(name);
+	}
+}
+
+int cache_store(const char *key, const struct http_response *r, const char *filename)
+{
+	if(!cache_dir || r->code != 200)
+		return 0;
+
+	long long lifetime = http_freshness_lifetime(r);
+	const char *etag = http_known_header(r, HDR_ETAG);
+	const char *last_modified = http_known_header(r, HDR_LAST_MODIFIED);
+
+	/* Without validators the stale entry is useless */
+	if(lifetime == HTTP_LIFETIME_NO_STORE || (lifetime <= 0 && !etag && !last_modified))
+	{
+		remove_entry(key);
+		return 0;
+	}
+
+	struct cache_entry entry;
+	memset(&entry, 0, sizeof(entry));
+
+	struct stat st;
+	if(stat(filename, &st) < 0)
+		return -1;
+
+	entry.url = strdup(key);
+	entry.etag = copy_value(etag);
+	entry.last_modified = copy_value(last_modified);
+	entry.stored = time(NULL);
+	entry.fresh_until = entry.stored + (lifetime > 0 ? lifetime : 0);
+	entry.length = st.st_size;
+
+	int ret = -1;
+	char *name = entry_filename(key, ".body");
+	char *tmpname = NULL;
+
+	if(!entry.url || !name)
+	{
+		errno = ENOMEM;
+		goto done;
+	}
+
+	int fd = create_temp(key, ".body", &tmpname);
+	if(fd < 0)
+		goto done;
+
+	/* New body replaces the old one only when it has been copied completely */
+	int copied = copy_file(filename, fd);
+	if(close(fd) < 0)
+		copied = -1;
+
+	if(copied < 0 || rename(tmpname, name) < 0)
+	{
+		int saved_errno = errno;
+		unlink(tmpname);
+		errno = saved_errno;
+		goto done;
+	}
+
+	if(save_meta(&entry) < 0)
+		goto done;
+
+	cache_stats.stored ++;
+	ret = 0;
+
+done:
+	free(name);
+	free(tmpname);
+	cache_entry_free(&entry);
+	return ret;
+}
+
+int cache_refresh(struct cache_entry *entry, const struct http_response *r)
+{
+	long long lifetime = http_freshness_lifetime(r);
+	if(lifetime == HTTP_LIFETIME_UNKNOWN) // Same as before
+		lifetime = entry->fresh_until > entry->stored ? entry->fresh_until - entry->stored : 0;
+	else if(lifetime < 0)
+		lifetime = 0;
+
+	/* 304 can have new validators */
+	const char *etag = http_known_header(r, HDR_ETAG);
+	if(etag)
+	{
+		free(entry->etag);
+		entry->etag = copy_value(etag);
+	}
+
+	const char *last_modified = http_known_header(r, HDR_LAST_MODIFIED);
+	if(last_modified)
+	{
+		free(entry->last_modified);
+		entry->last_modified = copy_value(last_modified);
+	}
+
+	entry->stored = time(NULL);
+	entry->fresh_until = entry->stored + lifetime;
+
+	cache_stats.revalidated ++;
+	return save_meta(entry);
+}
@@ -0,0 +1,85 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_CACHE_H
+#define HTTP_CLIENT_CACHE_H
+
+#include <time.h>
+
+#include "http.h"
+
+/*
+	On-disk cache of responses (conditional GET).
+
+	Each entry is a pair of files in the cache directory, named after
+	the hash of the normalized URL: "<hash>.body" (the response body)
+	and "<hash>.meta" (URL, validators and how long the entry is fresh).
+
+	Fresh entries are used without any requests. Stale ones are revalidated:
+	the request has If-None-Match/If-Modified-Since, and if the server
+	answers "304 Not Modified", the body is taken from the cache.
+*/
+
+struct cache_entry {
+	char *url; // normalized URL (see cache_key())
+	char *etag; // NULL if none
+	char *last_modified; // NULL if none
+	time_t stored; // when the response was received (or last revalidated)
+	time_t fresh_until; // after this time the entry must be revalidated
+	unsigned long long length; // of the body
+};
+
+struct cache_stats {
+	unsigned long hits; // fresh entries used without requests
+	unsigned long revalidated; // stale entries confirmed by 304
+	unsigned long misses; // no usable entry (request was sent)
+	unsigned long stored; // new (or changed) responses saved into the cache
+};
+extern __thread struct cache_stats cache_stats;
+
+/* Enables the cache in "dir" (creates it if needed).
+	Returns 0 on success, -1 on error (errno is set). */
+int cache_open(const char *dir);
+
+/* Returns 1 if the cache has been enabled by cache_open(), 0 otherwise */
+int cache_enabled(void);
+
+/* Returns the normalized URL (in "arena", NULL if out of memory), see url_normalize() */
+char *cache_key(struct arena *arena, const struct http_url *u);
+
+/* Finds the entry for "key". Returns 0 if found, -1 otherwise. */
+int cache_lookup(const char *key, struct cache_entry *entry);
+
+/* Returns 1 if the entry can be used without revalidation, 0 otherwise */
+int cache_is_fresh(const struct cache_entry *entry);
+
+/* Returns 1 if the entry has validators (can be revalidated with a conditional request), 0 otherwise */
+int cache_can_revalidate(const struct cache_entry *entry);
+
+/* Copies the body of the entry into "filename".
+	Returns 0 on success, -1 on error (errno is set). */
+int cache_copy_body(const char *key, const char *filename);
+
+/* Saves 200 response with body "filename" under "key" (if the response can be cached).
+	Returns 0 on success (or if it's not cacheable), -1 on error (errno is set). */
+int cache_store(const char *key, const struct http_response *r, const char *filename);
+
+/* Updates the entry after "304 Not Modified" response "r" (new validators and freshness).
+	Returns 0 on success, -1 on error (errno is set). */
+int cache_refresh(struct cache_entry *entry, const struct http_response *r);
+
+void cache_entry_free(struct cache_entry *entry);
+
+#endif
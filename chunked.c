@@ -0,0 +1,247 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include <string.h>
+
+#include "chunked.h"
+
+void chunked_init(struct chunked_decoder *d)
+{
+	memset(d, 0, sizeof(*d));
+	d->state = CHUNKED_SIZE;
+}
+
+static int hex_digit(char c)
+{
+	if(c >= '0' && c <= '9')
+		return c - '0';
+
+	c |= 0x20; // lowercase
+	if(c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+
+	return -1;
+}
+
+static ssize_t chunked_fail(struct chunked_decoder *d, const char *error)
+{
+	d->state = CHUNKED_ERROR;
+	d->error = error;
+	return -1;
+}
+
+/* End of the line with chunk length: either the data or the trailer follows */
+static void chunked_size_done(struct chunked_decoder *d)
+{
+	if(d->remaining)
+	{
+		d->chunks ++;
+		d->state = CHUNKED_DATA;
+	}
+	else d->state = CHUNKED_TRAILER; // Last chunk
+}
+
+ssize_t chunked_decode(struct chunked_decoder *d, const char *input, size_t length,
+	const char **span, size_t *span_length)
+{
+	size_t i;
+	int digit;
+
+	*span_length = 0;
+
+	for(i = 0; i < length; i ++)
+	{
+		char c = input[i];
+
+		switch(d->state)
+		{
+			case CHUNKED_SIZE:
+				digit = hex_digit(c);
+				if(digit >= 0)
+				{
+					if(d->remaining >> 60)
+						return chunked_fail(d, "chunk length is too large");
+
+					d->remaining = (d->remaining << 4) | digit;
+					d->size_digits ++;
+					break;
+				}
+
+				if(!d->size_digits)
+					return chunked_fail(d, "chunk length is not a number");
+
+				if(c == ' ' || c == '\t')
+					d->state = CHUNKED_SIZE_END;
+				else if(c == ';')
+					d->state = CHUNKED_EXTENSION;
+				else if(c == '\r')
+					d->state = CHUNKED_SIZE_LF;
+				else if(c == '\n')
+					chunked_size_done(d);
+				else
+					return chunked_fail(d, "unexpected character after chunk length");
+				break;
+
+			case CHUNKED_SIZE_END:
+				if(c == ';')
+					d->state = CHUNKED_EXTENSION;
+				else if(c == '\r')
+					d->state = CHUNKED_SIZE_LF;
+				else if(c == '\n')
+					chunked_size_done(d);
+				else if(c != ' ' && c != '\t')
+					return chunked_fail(d, "unexpected character after chunk length");
+				break;
+
+			case CHUNKED_EXTENSION:
+				if(c == '"')
+					d->state = CHUNKED_EXTENSION_QUOTED;
+				else if(c == '\r')
+					d->state = CHUNKED_SIZE_LF;
+				else if(c == '\n')
+					chunked_size_done(d);
+				break;
+
+			case CHUNKED_EXTENSION_QUOTED:
+				if(c == '\\')
+					d->state = CHUNKED_EXTENSION_ESCAPE;
+				else if(c == '"')
+					d->state = CHUNKED_EXTENSION;
+				else if(c == '\r' || c == '\n')
+					return chunked_fail(d, "unterminated quoted string in chunk extension");
+				break;
+
+			case CHUNKED_EXTENSION_ESCAPE:
+				d->state = CHUNKED_EXTENSION_QUOTED;
+				break;
+
+			case CHUNKED_SIZE_LF:
+				if(c != '\n')
+					return chunked_fail(d, "no LF after CR in chunk header");
+
+				chunked_size_done(d);
+				break;
+
+			case CHUNKED_DATA:
+			{
+				/* Return as much of the chunk as we have, without copying */
+				size_t todo = length - i;
+				if(todo > d->remaining)
+					todo = d->remaining;
+
+				*span = input + i;
+				*span_length = todo;
+
+				chunked_data_consumed(d, todo);
+				return i + todo;
+			}
+
+			case CHUNKED_DATA_CR:
+				if(c == '\r')
+				{
+					d->state = CHUNKED_DATA_LF;
+					break;
+				}
+
+				/* Bare LF (without CR) is tolerated */
+				// fall through
+
+			case CHUNKED_DATA_LF:
+				if(c != '\n')
+					return chunked_fail(d, "no CRLF after chunk data");
+
+				d->state = CHUNKED_SIZE;
+				d->remaining = 0;
+				d->size_digits = 0;
+				break;
+
+			case CHUNKED_TRAILER:
+				if(c == '\r')
+					d->state = CHUNKED_END_LF;
+				else if(c == '\n')
+				{
+					d->state = CHUNKED_DONE;
+					return i + 1;
+				}
+				else
+				{
+					d->trailers ++;
+					d->state = CHUNKED_TRAILER_FIELD;
+				}
+				break;
+
+			case CHUNKED_TRAILER_FIELD:
+			{
+				/* Skip to the end of line */
+				const char *lf = memchr(input + i, '\n', length - i);
+				if(!lf)
+					return length;
+
+				i = lf - input;
+				d->state = CHUNKED_TRAILER;
+				break;
+			}
+
+			case CHUNKED_END_LF:
+				if(c != '\n')
+					return chunked_fail(d, "no LF after CR at the end of chunked body");
+
+				d->state = CHUNKED_DONE;
+				return i + 1;
+
+			case CHUNKED_DONE:
+				return i;
+
+			case CHUNKED_ERROR:
+				return -1;
+		}
+	}
+
+	return length;
+}
+
+ssize_t chunked_decode_iov(struct chunked_decoder *d, const char *input, size_t length,
+	struct iovec *iov, int max_iov, int *iovcnt)
+{
+	size_t offset = 0;
+	*iovcnt = 0;
+
+	while(offset < length && *iovcnt < max_iov && !chunked_is_done(d))
+	{
+		const char *span;
+		size_t span_length;
+
+		ssize_t used = chunked_decode(d, input + offset, length - offset, &span, &span_length);
+		if(used < 0)
+			return -1;
+
+		if(span_length)
+		{
+			iov[*iovcnt].iov_base = (void *) span;
+			iov[*iovcnt].iov_len = span_length;
+			(*iovcnt) ++;
+		}
+
+		offset += used;
+	}
+	return offset;
+}
+
+void chunked_data_consumed(struct chunked_decoder *d, unsigned long long count)
+{
+	d->remaining -= count;
+	if(!d->remaining)
+		d->state = CHUNKED_DATA_CR;
+}
@@ -0,0 +1,97 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_CHUNKED_H
+#define HTTP_CLIENT_CHUNKED_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+	Incremental decoder of "Transfer-Encoding: chunked".
+	Input can be split at any byte. Chunk data is not copied:
+	the decoder returns pointers into the input buffer.
+*/
+
+#define CHUNKED_BUFFER_SIZE (256 * 1024) // recommended size of the receive buffer
+#define CHUNKED_SPLICE_MIN 65536 // chunk remainders this long are worth moving via splice()
+#define CHUNKED_MAX_IOV 1024 // maximum number of spans returned by chunked_decode_iov() (IOV_MAX)
+
+enum chunked_state {
+	CHUNKED_SIZE, // hexadecimal length of the chunk
+	CHUNKED_SIZE_END, // whitespace after the length
+	CHUNKED_EXTENSION, // ";name=value" after the length (ignored)
+	CHUNKED_EXTENSION_QUOTED, // quoted string within the extension
+	CHUNKED_EXTENSION_ESCAPE, // backslash within the quoted string
+	CHUNKED_SIZE_LF, // CR after the length has been received
+	CHUNKED_DATA,
+	CHUNKED_DATA_CR, // expecting CRLF after the chunk data
+	CHUNKED_DATA_LF,
+	CHUNKED_TRAILER, // beginning of the line within trailer
+	CHUNKED_TRAILER_FIELD, // trailer field (ignored)
+	CHUNKED_END_LF, // CR of the final empty line has been received
+	CHUNKED_DONE,
+	CHUNKED_ERROR
+};
+
+struct chunked_decoder {
+	enum chunked_state state;
+	unsigned long long remaining; // bytes of the current chunk not yet returned
+	int size_digits; // number of hex digits in the length of the current chunk
+
+	unsigned long chunks; // number of chunks received
+	unsigned trailers; // number of trailer fields received
+	const char *error; // description of the error (if state is CHUNKED_ERROR)
+};
+
+void chunked_init(struct chunked_decoder *d);
+
+/*
+	Decodes "input" until either the end of "input", or the end of the body,
+	or until some chunk data is found (then "*span" points to it within
+	"input", and "*span_length" is its length, otherwise "*span_length" is 0).
+
+	Returns the number of bytes of "input" consumed (including "*span"),
+	or -1 if the input is malformed (see d->error).
+*/
+ssize_t chunked_decode(struct chunked_decoder *d, const char *input, size_t length,
+	const char **span, size_t *span_length);
+
+/*
+	Same as chunked_decode(), but collects all chunk data within "input"
+	into iov[] (up to "max_iov" elements), e.g. for writev().
+	Returns the number of bytes of "input" consumed, or -1 on error.
+*/
+ssize_t chunked_decode_iov(struct chunked_decoder *d, const char *input, size_t length,
+	struct iovec *iov, int max_iov, int *iovcnt);
+
+/* Returns 1 if the last chunk and the trailer have been received */
+static inline int chunked_is_done(const struct chunked_decoder *d)
+{
+	return d->state == CHUNKED_DONE;
+}
+
+/* Returns the number of bytes of chunk data which follow in the input
+	(they can be read without parsing, e.g. via splice), 0 if none */
+static inline unsigned long long chunked_data_remaining(const struct chunked_decoder *d)
+{
+	return d->state == CHUNKED_DATA ? d->remaining : 0;
+}
+
+/* Tells the decoder that "count" bytes of chunk data were read bypassing it.
+	"count" must not exceed chunked_data_remaining(). */
+void chunked_data_consumed(struct chunked_decoder *d, unsigned long long count);
+
+#endif
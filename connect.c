@@ -0,0 +1,299 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "connect.h"
+
+static double ms_between(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000.0 + (to->tv_nsec - from->tv_nsec) / 1000000.0;
+}
+
+int he_init(struct happy_eyeballs *he, struct addrinfo *ai)
+{
+	struct addrinfo *p;
+	int count = 0;
+
+	memset(he, 0, sizeof(*he));
+
+	for(p = ai; p; p = p->ai_next)
+		count ++;
+
+	he->attempts = calloc(count ? count : 1, sizeof(he->attempts[0]));
+	if(!he->attempts)
+		return -1;
+
+	/* Interleave address families (RFC 8305, section 4): the first address
+		(as sorted by getaddrinfo) goes first, then an address of the other
+		family, then the next address of the first family, etc. */
+	int first_family = ai ? ai->ai_family : AF_UNSPEC;
+	struct addrinfo *same = ai, *other = ai;
+	int take_same = 1;
+
+	while(he->count < count)
+	{
+		struct addrinfo **cursor = take_same ? &same : &other;
+
+		while(*cursor && ((*cursor)->ai_family == first_family) != take_same)
+			*cursor = (*cursor)->ai_next;
+
+		if(*cursor)
+		{
+			he->attempts[he->count].sock = -1;
+			he->attempts[he->count].ai = *cursor;
+			he->count ++;
+
+			*cursor = (*cursor)->ai_next;
+		}
+
+		take_same = !take_same;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &he->start_time);
+	he->next_attempt_time = he->start_time;
+	he->last_error = ENOENT;
+
+	return 0;
+}
+
+static void format_address(struct happy_eyeballs *he, struct addrinfo *ai)
+{
+	char host[NI_MAXHOST], port[NI_MAXSERV];
+
+	if(getnameinfo(ai->ai_addr, ai->ai_addrlen, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+	{
+		strcpy(he->winner_address, "?");
+		return;
+	}
+
+	snprintf(he->winner_address, sizeof(he->winner_address),
+		ai->ai_family == AF_INET6 ? "[%s]:%s" : "%s:%s", host, port);
+}
+
+/* Starts the next attempt. Returns the connected socket (if connect() succeeded
+	immediately), HE_IN_PROGRESS otherwise (even if the attempt failed). */
+static int he_start_attempt(struct happy_eyeballs *he)
+{
+	struct connect_attempt *attempt = &he->attempts[he->started ++];
+	struct addrinfo *ai = attempt->ai;
+
+	int sock = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+	if(sock < 0)
+	{
+		he->last_error = errno;
+		return HE_IN_PROGRESS;
+	}
+
+	if(he->on_socket)
+		he->on_socket(he->opaque, sock);
+
+	if(connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+		return sock;
+
+	if(errno != EINPROGRESS)
+	{
+		he->last_error = errno;
+		close(sock);
+		return HE_IN_PROGRESS;
+	}
+
+	attempt->sock = sock;
+	return HE_IN_PROGRESS;
+}
+
+/* Closes all attempts except "winner" and remembers how the connection was made */
+static int he_finish(struct happy_eyeballs *he, int winner, struct addrinfo *ai)
+{
+	int i;
+	for(i = 0; i < he->started; i ++)
+	{
+		if(he->attempts[i].sock >= 0 && he->attempts[i].sock != winner)
+			close(he->attempts[i].sock);
+
+		he->attempts[i].sock = -1;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	he->elapsed_ms = ms_between(&he->start_time, &now);
+	format_address(he, ai);
+
+	return winner;
+}
+
+int he_step(struct happy_eyeballs *he, int *wait_ms)
+{
+	int i, in_progress = 0;
+
+	/* Which of the attempts have completed? */
+	for(i = 0; i < he->started; i ++)
+	{
+		struct connect_attempt *attempt = &he->attempts[i];
+		if(attempt->sock < 0)
+			continue;
+
+		struct pollfd fds;
+		fds.fd = attempt->sock;
+		fds.events = POLLOUT;
+
+		if(poll(&fds, 1, 0) <= 0)
+		{
+			in_progress ++;
+			continue;
+		}
+
+		int error = 0;
+		socklen_t error_len = sizeof(error);
+		if(getsockopt(attempt->sock, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0)
+			error = errno;
+
+		if(!error)
+			return he_finish(he, attempt->sock, attempt->ai);
+
+		he->last_error = error;
+		close(attempt->sock);
+		attempt->sock = -1;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* Start the next attempt if it's time, or if all previous attempts have failed */
+	while(he->started < he->count && (!in_progress || ms_between(&he->next_attempt_time, &now) >= 0))
+	{
+		int sock = he_start_attempt(he);
+		if(sock >= 0)
+			return he_finish(he, sock, he->attempts[he->started - 1].ai);
+
+		if(he->attempts[he->started - 1].sock >= 0)
+		{
+			in_progress ++;
+
+			he->next_attempt_time = now;
+			he->next_attempt_time.tv_nsec += CONNECT_ATTEMPT_DELAY_MS * 1000000L;
+			if(he->next_attempt_time.tv_nsec >= 1000000000L)
+			{
+				he->next_attempt_time.tv_sec ++;
+				he->next_attempt_time.tv_nsec -= 1000000000L;
+			}
+		}
+	}
+
+	if(!in_progress)
+		return HE_FAILED;
+
+	if(he->started < he->count)
+	{
+		double ms = ms_between(&now, &he->next_attempt_time);
+		*wait_ms = ms > 0 ? (int) ms + 1 : 0;
+	}
+	else *wait_ms = -1; // Nothing else to start: just wait for the attempts in progress
+
+	return HE_IN_PROGRESS;
+}
+
+void he_free(struct happy_eyeballs *he)
+{
+	int i;
+	for(i = 0; i < he->started; i ++)
+	{
+		if(he->attempts[i].sock >= 0)
+			close(he->attempts[i].sock);
+	}
+
+	free(he->attempts);
+	he->attempts = NULL;
+	he->count = he->started = 0;
+}
+
+int connect_happy_eyeballs(struct addrinfo *ai, struct happy_eyeballs *he, int timeout_ms)
+{
+	if(he_init(he, ai) < 0)
+		return -1;
+
+	while(1)
+	{
+		int wait_ms;
+		int sock = he_step(he, &wait_ms);
+
+		if(sock >= 0)
+		{
+			he_free(he);
+
+			/* Put the socket back into the blocking mode */
+			if(fcntl(sock, F_SETFL, 0) < 0)
+			{
+				close(sock);
+				return -1;
+			}
+			return sock;
+		}
+
+		if(sock == HE_FAILED)
+		{
+			he_free(he);
+			errno = he->last_error;
+			return -1;
+		}
+
+		if(timeout_ms >= 0)
+		{
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+
+			int left_ms = timeout_ms - (int) ms_between(&he->start_time, &now);
+			if(left_ms <= 0)
+			{
+				he_free(he);
+				errno = ETIMEDOUT;
+				return -1;
+			}
+
+			if(wait_ms < 0 || wait_ms > left_ms)
+				wait_ms = left_ms;
+		}
+
+		/* Wait until one of the attempts completes (or until it's time to start the next one) */
+		struct pollfd fds[he->started];
+		int i, nfds = 0;
+
+		for(i = 0; i < he->started; i ++)
+		{
+			if(he->attempts[i].sock < 0)
+				continue;
+
+			fds[nfds].fd = he->attempts[i].sock;
+			fds[nfds].events = POLLOUT;
+			nfds ++;
+		}
+
+		if(poll(fds, nfds, wait_ms) < 0 && errno != EINTR)
+		{
+			he_free(he);
+			return -1;
+		}
+	}
+}
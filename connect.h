@@ -0,0 +1,82 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_CONNECT_H
+#define HTTP_CLIENT_CONNECT_H
+
+#include <netdb.h>
+#include <time.h>
+
+/*
+	"Happy Eyeballs" (RFC 8305): connection attempts to all resolved
+	addresses (alternating IPv6 and IPv4) are started one after another
+	with a small delay, without waiting for the previous attempt to fail.
+	The first connection to succeed wins, the others are cancelled.
+*/
+
+#define CONNECT_ATTEMPT_DELAY_MS 250 // RFC 8305 "Connection Attempt Delay"
+
+#define HE_IN_PROGRESS -1
+#define HE_FAILED -2
+
+struct connect_attempt {
+	int sock; // -1 if not started yet or already failed
+	struct addrinfo *ai;
+};
+
+struct happy_eyeballs {
+	struct connect_attempt *attempts; // in the order of trying
+	int count;
+	int started; // number of attempts which have been started
+
+	struct timespec start_time;
+	struct timespec next_attempt_time; // when to start the next attempt
+
+	int last_error; // errno of the last failed attempt
+
+	/* Optional: called for each new socket (e.g. to add it into epoll) */
+	void (*on_socket)(void *opaque, int sock);
+	void *opaque;
+
+	/* Filled after the connection is established */
+	char winner_address[64]; // e.g. "[2001:db8::1]:80" or "192.0.2.1:80"
+	double elapsed_ms; // how long did it take to connect
+};
+
+/* Prepares to connect to addresses from "ai" (which must not be freed
+	until he_free()). Returns 0 on success, -1 if out of memory. */
+int he_init(struct happy_eyeballs *he, struct addrinfo *ai);
+
+/*
+	Checks the attempts in progress and starts new ones (when it's time).
+	Doesn't block. Returns the connected socket (non-blocking),
+	or HE_IN_PROGRESS (then "*wait_ms" is set to the time after which
+	he_step() must be called again, unless some socket becomes writable
+	earlier), or HE_FAILED (all attempts failed, see "last_error").
+*/
+int he_step(struct happy_eyeballs *he, int *wait_ms);
+
+/* Closes the sockets of all attempts (except the one returned by he_step) */
+void he_free(struct happy_eyeballs *he);
+
+/*
+	Blocking wrapper: connects to one of the addresses from "ai"
+	within "timeout_ms" (-1: no timeout, except the one of the kernel).
+	Returns the connected socket (in blocking mode), or -1 (errno is set,
+	ETIMEDOUT if the timeout has expired).
+*/
+int connect_happy_eyeballs(struct addrinfo *ai, struct happy_eyeballs *he, int timeout_ms);
+
+#endif
@@ -0,0 +1,234 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "content_encoding.h"
+#include "transfer.h"
+
+int content_decoder_init(struct content_decoder *d, const char *content_encoding)
+{
+	memset(d, 0, sizeof(struct content_decoder));
+	d->coding = CODING_IDENTITY;
+
+	/* The value is a list of codings (in the order they were applied).
+		We support only one of them (plus "identity", which means nothing). */
+	const char *p = content_encoding;
+	while(*p)
+	{
+		p += strspn(p, " \t,");
+		size_t length = strcspn(p, " \t,");
+		if(length == 0)
+			break;
+
+		enum content_coding coding;
+		if((length == 4 && !strncasecmp(p, "gzip", 4)) || (length == 6 && !strncasecmp(p, "x-gzip", 6)))
+			coding = CODING_GZIP;
+		else if(length == 7 && !strncasecmp(p, "deflate", 7))
+			coding = CODING_DEFLATE;
+		else if(length == 8 && !strncasecmp(p, "identity", 8))
+			coding = CODING_IDENTITY;
+		else
+		{
+			d->error = "only gzip and deflate are supported";
+			return -1;
+		}
+
+		if(coding != CODING_IDENTITY)
+		{
+			if(d->coding != CODING_IDENTITY)
+			{
+				d->error = "more than one encoding is not supported";
+				return -1;
+			}
+			d->coding = coding;
+		}
+
+		p += length;
+	}
+
+	if(d->coding == CODING_IDENTITY)
+		d->finished = 1; // Nothing to decode
+	return 0;
+}
+
+void content_decoder_free(struct content_decoder *d)
+{
+	if(d->initialized)
+	{
+		inflateEnd(&d->zs);
+		d->initialized = 0;
+	}
+}
+
+/* zlib is initialized when the first bytes of the body are known:
+	"deflate" is supposed to have a zlib header, but some servers send raw deflate data */
+static int decoder_start(struct content_decoder *d, const unsigned char *data, size_t length)
+{
+	int window_bits = 15;
+
+	if(d->coding == CODING_GZIP)
+		window_bits += 16;
+	else if(length >= 2 && ((data[0] & 0x0f) != Z_DEFLATED || ((data[0] << 8) | data[1]) % 31 != 0))
+	{
+		d->raw_deflate = 1;
+		window_bits = -15;
+	}
+
+	if(inflateInit2(&d->zs, window_bits) != Z_OK)
+	{
+		d->error = "inflateInit2() failed";
+		errno = ENOMEM;
+		return -1;
+	}
+
+	d->initialized = 1;
+	return 0;
+}
+
+int decode_body_to(struct content_decoder *d, const char *data, size_t length, content_writer writer, void *opaque)
+{
+	static __thread unsigned char out[CONTENT_DECODER_BUFFER_SIZE];
+
+	if(!d || d->coding == CODING_IDENTITY)
+	{
+		transfer_stats.bytes += length;
+		if(d && d->digest)
+			digest_update(d->digest, data, length);
+		return length ? writer(opaque, data, length) : 0;
+	}
+
+	if(length == 0)
+		return 0;
+
+	if(!d->initialized && decoder_start(d, (const unsigned char *) data, length) < 0)
+		return -1;
+
+	transfer_stats.bytes += length;
+	transfer_stats.compressed_bytes += length;
+
+	d->zs.next_in = (unsigned char *) data;
+	d->zs.avail_in = length;
+
+	do {
+		if(d->finished)
+		{
+			/* gzip body can consist of several "members" (one after another).
+				Anything else after the end of compressed data is ignored. */
+			if(d->coding != CODING_GZIP || inflateReset(&d->zs) != Z_OK)
+				break;
+
+			d->finished = 0;
+		}
+
+		d->zs.next_out = out;
+		d->zs.avail_out = sizeof(out);
+
+		int ret = inflate(&d->zs, Z_NO_FLUSH);
+		if(ret == Z_STREAM_END)
+			d->finished = 1;
+		else if(ret != Z_OK && ret != Z_BUF_ERROR)
+		{
+			d->error = d->zs.msg ? d->zs.msg : "malformed compressed data";
+			errno = EBADMSG;
+			return -1;
+		}
+
+		size_t produced = sizeof(out) - d->zs.avail_out;
+		if(produced > 0)
+		{
+			if(d->digest)
+				digest_update(d->digest, out, produced);
+			if(writer(opaque, (const char *) out, produced) < 0)
+				return -1;
+
+			transfer_stats.decoded_bytes += produced;
+		}
+		else if(ret == Z_BUF_ERROR)
+			break; // No progress is possible without more input
+	} while(d->zs.avail_in > 0 || d->zs.avail_out == 0);
+
+	return 0;
+}
+
+static int write_to_fd(void *opaque, const char *data, size_t length)
+{
+	return write_all(*(int *) opaque, data, length);
+}
+
+int decode_body(struct content_decoder *d, int out_fd, const char *data, size_t length)
+{
+	if(!d || d->coding == CODING_IDENTITY)
+	{
+		if(d && d->digest)
+			digest_update(d->digest, data, length);
+		return write_body(out_fd, data, length);
+	}
+
+	return decode_body_to(d, data, length, write_to_fd, &out_fd);
+}
+
+int decode_body_iov(struct content_decoder *d, int out_fd, struct iovec *iov, int iovcnt)
+{
+	int i;
+	if(!d || d->coding == CODING_IDENTITY)
+	{
+		if(d && d->digest)
+		{
+			for(i = 0; i < iovcnt; i ++)
+				digest_update(d->digest, iov[i].iov_base, iov[i].iov_len);
+		}
+		return write_body_iov(out_fd, iov, iovcnt);
+	}
+
+	for(i = 0; i < iovcnt; i ++)
+	{
+		if(decode_body(d, out_fd, iov[i].iov_base, iov[i].iov_len) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+ssize_t decode_from_socket(struct content_decoder *d, int out_fd, int in_fd, size_t count)
+{
+	static __thread char buffer[TRANSFER_BUFFER_SIZE];
+
+	if(!d || (d->coding == CODING_IDENTITY && !d->digest))
+		return transfer_from_socket(out_fd, in_fd, count);
+
+	if(count > sizeof(buffer))
+		count = sizeof(buffer);
+
+	ssize_t bytes = read(in_fd, buffer, count);
+	transfer_stats.read_calls ++;
+
+	if(bytes <= 0)
+		return bytes;
+
+	if(decode_body(d, out_fd, buffer, bytes) < 0)
+		return -1;
+
+	return bytes;
+}
+
+const char *decode_strerror(const struct content_decoder *d)
+{
+	return d && d->error ? d->error : strerror(errno);
+}
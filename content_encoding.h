@@ -0,0 +1,96 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_CONTENT_ENCODING_H
+#define HTTP_CLIENT_CONTENT_ENCODING_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+#include "digest.h"
+
+/*
+	Streaming decoder of "Content-Encoding: gzip" and "deflate".
+	The body is decompressed as it arrives (after the chunked decoder, if any),
+	through a fixed-size output buffer, and written into the output file.
+
+	All functions below accept decoder=NULL, which means "no Content-Encoding":
+	then the data is written as is (and moved via splice(), when possible).
+
+	If d->digest is set, the decoded data is also hashed on its way into the file
+	(then splice() is not used, because the data must pass through our memory).
+*/
+
+#define ACCEPT_ENCODING "gzip, deflate" // value of Accept-Encoding header in our requests
+#define CONTENT_DECODER_BUFFER_SIZE 65536 // decompressed data is written in parts of this size
+
+enum content_coding {
+	CODING_IDENTITY,
+	CODING_GZIP,
+	CODING_DEFLATE
+};
+
+struct content_decoder {
+	enum content_coding coding;
+	z_stream zs;
+	int initialized; // zs must be freed with inflateEnd()
+	int raw_deflate; // "deflate" without zlib header (sent by some servers)
+	int finished; // end of compressed stream has been reached
+	const char *error; // description of the error (malformed data, etc.)
+	struct digest *digest; // if not NULL, all decoded data is added to it (set after content_decoder_init)
+};
+
+/*
+	Prepares the decoder for the value of Content-Encoding header.
+	Returns 0 on success, -1 if the encoding is not supported (see d->error).
+*/
+int content_decoder_init(struct content_decoder *d, const char *content_encoding);
+
+/* Returns 1 if the compressed stream has ended (i.e. the body wasn't truncated) */
+static inline int content_decoder_is_done(const struct content_decoder *d)
+{
+	return d->finished;
+}
+
+void content_decoder_free(struct content_decoder *d);
+
+/* Decodes a part of the body and writes it into "out_fd".
+	Returns 0 on success, -1 on error (see decode_strerror()). */
+int decode_body(struct content_decoder *d, int out_fd, const char *data, size_t length);
+
+/* Receives the decoded data. Returns 0 on success, -1 on error (errno must be set). */
+typedef int (*content_writer)(void *opaque, const char *data, size_t length);
+
+/* Same as decode_body(), but the decoded data is passed to "writer" (instead of being written into a file).
+	With decoder=NULL the data is passed as is. */
+int decode_body_to(struct content_decoder *d, const char *data, size_t length, content_writer writer, void *opaque);
+
+/* Same as decode_body(), but for several parts of the body (e.g. from chunked_decode_iov()).
+	Modifies iov[]. */
+int decode_body_iov(struct content_decoder *d, int out_fd, struct iovec *iov, int iovcnt);
+
+/*
+	Same as transfer_from_socket(): reads up to "count" bytes of the body
+	from socket "in_fd", decodes them and writes into "out_fd".
+	Returns the number of bytes read from socket, 0 on EOF, -1 on error
+	(errno is EAGAIN if "in_fd" is non-blocking and has no data yet).
+*/
+ssize_t decode_from_socket(struct content_decoder *d, int out_fd, int in_fd, size_t count);
+
+/* Describes the error returned by the functions above */
+const char *decode_strerror(const struct content_decoder *d);
+
+#endif
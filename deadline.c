@@ -0,0 +1,295 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "deadline.h"
+
+struct deadline_limits deadline_limits = { {
+	[DEADLINE_CONNECT] = 10000,
+	[DEADLINE_FIRST_BYTE] = 30000,
+	[DEADLINE_IDLE] = 30000,
+	[DEADLINE_TOTAL] = 60000
+} };
+
+static const char *deadline_names[DEADLINE_KINDS] = {
+	[DEADLINE_CONNECT] = "connect",
+	[DEADLINE_FIRST_BYTE] = "first byte",
+	[DEADLINE_IDLE] = "idle",
+	[DEADLINE_TOTAL] = "total"
+};
+
+/* Same, as they are written in -t */
+static const char *deadline_options[DEADLINE_KINDS] = {
+	[DEADLINE_CONNECT] = "connect",
+	[DEADLINE_FIRST_BYTE] = "first-byte",
+	[DEADLINE_IDLE] = "idle",
+	[DEADLINE_TOTAL] = "total"
+};
+
+long long deadline_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void deadlines_start(struct deadlines *d, const struct deadline_limits *limits)
+{
+	memset(d, 0, sizeof(struct deadlines));
+	d->limits = limits;
+	deadline_arm(d, DEADLINE_TOTAL);
+}
+
+void deadline_arm(struct deadlines *d, enum deadline_kind kind)
+{
+	unsigned limit = d->limits->ms[kind];
+	d->at[kind] = limit ? deadline_now_ms() + limit : DEADLINE_NONE;
+}
+
+void deadline_disarm(struct deadlines *d, enum deadline_kind kind)
+{
+	d->at[kind] = DEADLINE_NONE;
+}
+
+long long deadline_next(const struct deadlines *d, enum deadline_kind *kind)
+{
+	long long next = DEADLINE_NONE;
+	int i;
+
+	for(i = 0; i < DEADLINE_KINDS; i ++)
+	{
+		if(d->at[i] != DEADLINE_NONE && (next == DEADLINE_NONE || d->at[i] < next))
+		{
+			next = d->at[i];
+			if(kind)
+				*kind = i;
+		}
+	}
+	return next;
+}
+
+int deadline_wait_ms(const struct deadlines *d, enum deadline_kind *kind)
+{
+	long long next = deadline_next(d, kind);
+	if(next == DEADLINE_NONE)
+		return -1;
+
+	long long wait = next - deadline_now_ms();
+	return wait > 0 ? (int) wait : 0;
+}
+
+const char *deadline_name(enum deadline_kind kind)
+{
+	return deadline_names[kind];
+}
+
+int deadline_parse_limits(const char *spec, struct deadline_limits *limits)
+{
+	char *copy = strdup(spec);
+	if(!copy)
+		return -1;
+
+	int ret = 0;
+	char *saveptr, *item;
+
+	for(item = strtok_r(copy, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr))
+	{
+		char *value = strchr(item, '=');
+		if(!value)
+		{
+			ret = -1;
+			break;
+		}
+		*value ++ = '\0';
+
+		int i;
+		for(i = 0; i < DEADLINE_KINDS; i ++)
+		{
+			if(!strcmp(item, deadline_options[i]))
+				break;
+		}
+
+		char *end;
+		double seconds = strtod(value, &end);
+		if(i == DEADLINE_KINDS || end == value || *end != '\0' || !(seconds >= 0 && seconds <= UINT_MAX / 1000))
+		{
+			ret = -1;
+			break;
+		}
+		limits->ms[i] = seconds * 1000;
+		if(seconds > 0 && limits->ms[i] == 0)
+			limits->ms[i] = 1; // Not "no limit"
+
+	}
+
+	free(copy);
+	return ret;
+}
+
+/* Binary min-heap: timers[0] expires first, timers[i] expires no later than its children */
+
+void timer_init(struct timer *timer, void *data)
+{
+	timer->expires = 0;
+	timer->index = TIMER_INACTIVE;
+	timer->data = data;
+}
+
+void timer_heap_init(struct timer_heap *heap)
+{
+	memset(heap, 0, sizeof(struct timer_heap));
+}
+
+void timer_heap_free(struct timer_heap *heap)
+{
+	unsigned i;
+	for(i = 0; i < heap->count; i ++)
+		heap->timers[i]->index = TIMER_INACTIVE;
+
+	free(heap->timers);
+	memset(heap, 0, sizeof(struct timer_heap));
+}
+
+int timer_heap_reserve(struct timer_heap *heap, unsigned count)
+{
+	if(count <= heap->size)
+		return 0;
+
+	unsigned size = heap->size ? heap->size : 64;
+	while(size < count)
+		size *= 2;
+
+	struct timer **timers = realloc(heap->timers, size * sizeof(struct timer *));
+	if(!timers)
+		return -1;
+
+	heap->timers = timers;
+	heap->size = size;
+	return 0;
+}
+
+static void heap_place(struct timer_heap *heap, unsigned index, struct timer *timer)
+{
+	heap->timers[index] = timer;
+	timer->index = index;
+}
+
+/* Moves the timer at "index" towards the root while it expires earlier than its parent */
+static void heap_up(struct timer_heap *heap, unsigned index)
+{
+	struct timer *timer = heap->timers[index];
+
+	while(index > 0)
+	{
+		unsigned parent = (index - 1) / 2;
+		if(heap->timers[parent]->expires <= timer->expires)
+			break;
+
+		heap_place(heap, index, heap->timers[parent]);
+		index = parent;
+	}
+	heap_place(heap, index, timer);
+}
+
+/* Moves the timer at "index" towards the leaves while any of its children expires earlier */
+static void heap_down(struct timer_heap *heap, unsigned index)
+{
+	struct timer *timer = heap->timers[index];
+
+	while(1)
+	{
+		unsigned child = index * 2 + 1;
+		if(child >= heap->count)
+			break;
+
+		if(child + 1 < heap->count && heap->timers[child + 1]->expires < heap->timers[child]->expires)
+			child ++;
+
+		if(timer->expires <= heap->timers[child]->expires)
+			break;
+
+		heap_place(heap, index, heap->timers[child]);
+		index = child;
+	}
+	heap_place(heap, index, timer);
+}
+
+int timer_set(struct timer_heap *heap, struct timer *timer, long long expires)
+{
+	if(timer->index != TIMER_INACTIVE)
+	{
+		long long old_expires = timer->expires;
+		timer->expires = expires;
+
+		if(expires < old_expires)
+			heap_up(heap, timer->index);
+		else
+			heap_down(heap, timer->index);
+		return 0;
+	}
+
+	if(timer_heap_reserve(heap, heap->count + 1) < 0)
+		return -1;
+
+	timer->expires = expires;
+	heap->timers[heap->count] = timer;
+	heap_up(heap, heap->count ++);
+	return 0;
+}
+
+void timer_cancel(struct timer_heap *heap, struct timer *timer)
+{
+	unsigned index = timer->index;
+	if(index == TIMER_INACTIVE)
+		return;
+
+	timer->index = TIMER_INACTIVE;
+
+	struct timer *last = heap->timers[-- heap->count];
+	if(last == timer)
+		return;
+
+	/* The last timer takes the place of the removed one (and moves up or down from there) */
+	heap_place(heap, index, last);
+	if(index > 0 && heap->timers[(index - 1) / 2]->expires > last->expires)
+		heap_up(heap, index);
+	else
+		heap_down(heap, index);
+}
+
+int timer_next_ms(const struct timer_heap *heap)
+{
+	if(heap->count == 0)
+		return -1;
+
+	long long wait = heap->timers[0]->expires - deadline_now_ms();
+	return wait > 0 ? (int) wait : 0;
+}
+
+struct timer *timer_pop_expired(struct timer_heap *heap, long long now)
+{
+	if(heap->count == 0 || heap->timers[0]->expires > now)
+		return NULL;
+
+	struct timer *timer = heap->timers[0];
+	timer_cancel(heap, timer);
+	return timer;
+}
@@ -0,0 +1,116 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_DEADLINE_H
+#define HTTP_CLIENT_DEADLINE_H
+
+/*
+	Timeouts of a request. Each request has several deadlines, so that
+	a slow connect() can be told from a server which doesn't respond,
+	and from a body which has stalled:
+		connect - DNS lookup and connect() must complete within this time,
+		first byte - the response must start within this time after the request was sent,
+		idle - nothing received for this long (while reading the response),
+		total - the whole request (including redirects).
+
+	Many requests at once (batch mode) keep their timers in a binary heap:
+	the event loop sleeps until the earliest one (see timer_next_ms).
+	All times are in milliseconds of CLOCK_MONOTONIC (see deadline_now_ms).
+*/
+
+enum deadline_kind {
+	DEADLINE_CONNECT,
+	DEADLINE_FIRST_BYTE,
+	DEADLINE_IDLE,
+	DEADLINE_TOTAL,
+	DEADLINE_KINDS
+};
+
+#define DEADLINE_NONE 0 // not armed (or no limit)
+
+/* Limits for each kind of deadline, in milliseconds (0: no limit) */
+struct deadline_limits {
+	unsigned ms[DEADLINE_KINDS];
+};
+extern struct deadline_limits deadline_limits; // defaults (see -t)
+
+/* Deadlines of one request */
+struct deadlines {
+	const struct deadline_limits *limits;
+	long long at[DEADLINE_KINDS]; // when each deadline expires, DEADLINE_NONE if it's not armed
+};
+
+long long deadline_now_ms(void);
+
+/* Starts the deadlines of a new request: only the total one is armed */
+void deadlines_start(struct deadlines *d, const struct deadline_limits *limits);
+
+/* Arms the deadline "kind" (it expires after its limit from now).
+	For DEADLINE_IDLE it's also called after each read: the deadline moves forward. */
+void deadline_arm(struct deadlines *d, enum deadline_kind kind);
+
+void deadline_disarm(struct deadlines *d, enum deadline_kind kind);
+
+/* Returns the earliest armed deadline (DEADLINE_NONE if none), its kind is stored into "*kind" (if not NULL) */
+long long deadline_next(const struct deadlines *d, enum deadline_kind *kind);
+
+/* Returns milliseconds left until the earliest deadline (for poll(), etc.):
+	0 if it has expired (its kind is in "*kind"), -1 if there are no deadlines */
+int deadline_wait_ms(const struct deadlines *d, enum deadline_kind *kind);
+
+/* e.g. "first byte" */
+const char *deadline_name(enum deadline_kind kind);
+
+/* Parses "connect=S,first-byte=S,idle=S,total=S" (seconds, any subset of them) into "limits".
+	Less than 1 ms (but not 0) means 1 ms. Returns 0 on success, -1 on error
+	(including values which don't fit "unsigned" in milliseconds). */
+int deadline_parse_limits(const char *spec, struct deadline_limits *limits);
+
+/* Binary min-heap of timers (for many requests at once) */
+
+#define TIMER_INACTIVE ((unsigned) -1)
+
+struct timer {
+	long long expires;
+	unsigned index; // position in the heap, TIMER_INACTIVE if not there
+	void *data;
+};
+
+struct timer_heap {
+	struct timer **timers;
+	unsigned count, size;
+};
+
+void timer_init(struct timer *timer, void *data);
+
+void timer_heap_init(struct timer_heap *heap);
+void timer_heap_free(struct timer_heap *heap);
+
+/* Makes room for "count" timers (then timer_set() can't fail while there are no more of them).
+	Returns 0 on success, -1 if out of memory. */
+int timer_heap_reserve(struct timer_heap *heap, unsigned count);
+
+/* Schedules (or reschedules) "timer" at "expires". Returns 0 on success, -1 if out of memory. */
+int timer_set(struct timer_heap *heap, struct timer *timer, long long expires);
+
+void timer_cancel(struct timer_heap *heap, struct timer *timer);
+
+/* Returns milliseconds until the earliest timer (0 if it has already expired), -1 if there are no timers */
+int timer_next_ms(const struct timer_heap *heap);
+
+/* Removes and returns the earliest timer, if it has expired by "now". Otherwise returns NULL. */
+struct timer *timer_pop_expired(struct timer_heap *heap, long long now);
+
+#endif
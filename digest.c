@@ -0,0 +1,494 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DIGEST_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "digest.h"
+#include "transfer.h"
+
+#define CRC32C_POLY 0x82f63b78 // reflected Castagnoli polynomial
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_initial[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+/* Implementations are chosen once (by what the CPU supports) */
+static uint32_t crc32c_table[256];
+static uint32_t (*crc32c_update)(uint32_t crc, const unsigned char *data, size_t length);
+static void (*sha256_blocks)(uint32_t state[8], const unsigned char *data, size_t blocks);
+static pthread_once_t digest_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_portable(uint32_t crc, const unsigned char *data, size_t length)
+{
+	while(length --)
+		crc = crc32c_table[(crc ^ *data ++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks_portable(uint32_t state[8], const unsigned char *data, size_t blocks)
+{
+	uint32_t w[64];
+
+	for(; blocks; blocks --, data += 64)
+	{
+		int i;
+		for(i = 0; i < 16; i ++)
+			w[i] = ((uint32_t) data[4 * i] << 24) | (data[4 * i + 1] << 16) | (data[4 * i + 2] << 8) | data[4 * i + 3];
+
+		for(i = 16; i < 64; i ++)
+		{
+			uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+		for(i = 0; i < 64; i ++)
+		{
+			uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+			uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+	}
+}
+
+#ifdef DIGEST_X86
+/* crc32 instruction (SSE 4.2): 8 bytes per instruction */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t length)
+{
+#ifdef __x86_64__
+	uint64_t crc64 = crc;
+	for(; length >= 8; length -= 8, data += 8)
+	{
+		uint64_t word;
+		memcpy(&word, data, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = crc64;
+#endif
+
+	while(length --)
+		crc = _mm_crc32_u8(crc, *data ++);
+	return crc;
+}
+
+/*
+	SHA extensions: sha256rnds2 performs two rounds, sha256msg1/sha256msg2
+	compute the message schedule, four words at a time.
+	The state is kept as ABEF and CDGH (the order these instructions need).
+*/
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_blocks_shani(uint32_t state[8], const unsigned char *data, size_t blocks)
+{
+	const __m128i shuffle = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL); // big-endian words
+
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[0]), 0xb1); // CDAB
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[4]), 0x1b); // EFGH
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0); // CDGH
+
+	for(; blocks; blocks --, data += 64)
+	{
+		__m128i abef = state0, cdgh = state1;
+		__m128i w[4]; // the last 16 words of the schedule
+		int i;
+
+#pragma GCC unroll 16
+		for(i = 0; i < 16; i ++)
+		{
+			if(i < 4)
+				w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16 * i)), shuffle);
+			else
+			{
+				/* W[t] = W[t-16] + s0(W[t-15]) + W[t-7] + s1(W[t-2]) */
+				__m128i t = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+				t = _mm_add_epi32(t, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+				w[i & 3] = _mm_sha256msg2_epu32(t, w[(i + 3) & 3]);
+			}
+
+			__m128i msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *) &sha256_k[4 * i]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+		}
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b); // FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xb1); // DCHG
+	_mm_storeu_si128((__m128i *) &state[0], _mm_blend_epi16(tmp, state1, 0xf0)); // DCBA
+	_mm_storeu_si128((__m128i *) &state[4], _mm_alignr_epi8(state1, tmp, 8)); // HGFE
+}
+#endif
+
+static void digest_setup(void)
+{
+	unsigned i, j;
+	for(i = 0; i < 256; i ++)
+	{
+		uint32_t crc = i;
+		for(j = 0; j < 8; j ++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		crc32c_table[i] = crc;
+	}
+
+	crc32c_update = crc32c_portable;
+	sha256_blocks = sha256_blocks_portable;
+
+#ifdef DIGEST_X86
+	unsigned eax, ebx, ecx, edx;
+	if(__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2))
+	{
+		crc32c_update = crc32c_sse42;
+
+		/* SHA-NI: CPUID.(EAX=7,ECX=0):EBX bit 29 (and SSE 4.1/SSSE3 for the shuffles) */
+		if((ecx & bit_SSE4_1) && (ecx & bit_SSSE3) &&
+			__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA))
+		{
+			sha256_blocks = sha256_blocks_shani;
+		}
+	}
+#endif
+}
+
+void digest_init(struct digest *d, enum digest_algorithm algorithm)
+{
+	pthread_once(&digest_once, digest_setup);
+
+	memset(d, 0, sizeof(struct digest));
+	d->algorithm = algorithm;
+	d->crc = 0xffffffff;
+	memcpy(d->state, sha256_initial, sizeof(sha256_initial));
+}
+
+void digest_update(struct digest *d, const void *data, size_t length)
+{
+	const unsigned char *p = data;
+	d->length += length;
+
+	if(d->algorithm == DIGEST_CRC32C)
+	{
+		d->crc = crc32c_update(d->crc, p, length);
+		return;
+	}
+
+	if(d->algorithm != DIGEST_SHA256)
+		return;
+
+	if(d->block_length)
+	{
+		size_t part = 64 - d->block_length;
+		if(part > length)
+			part = length;
+
+		memcpy(d->block + d->block_length, p, part);
+		d->block_length += part;
+		p += part;
+		length -= part;
+
+		if(d->block_length < 64)
+			return;
+
+		sha256_blocks(d->state, d->block, 1);
+		d->block_length = 0;
+	}
+
+	/* Whole blocks are hashed right from the data */
+	if(length >= 64)
+	{
+		sha256_blocks(d->state, p, length / 64);
+		p += length & ~(size_t) 63;
+		length &= 63;
+	}
+
+	memcpy(d->block, p, length);
+	d->block_length = length;
+}
+
+void digest_final(struct digest *d, struct digest_value *result)
+{
+	memset(result, 0, sizeof(struct digest_value));
+	result->algorithm = d->algorithm;
+
+	if(d->algorithm == DIGEST_CRC32C)
+	{
+		uint32_t crc = ~d->crc;
+		result->value[0] = crc >> 24;
+		result->value[1] = crc >> 16;
+		result->value[2] = crc >> 8;
+		result->value[3] = crc;
+		result->size = 4;
+		return;
+	}
+
+	if(d->algorithm != DIGEST_SHA256)
+		return;
+
+	/* Padding: 0x80, zeroes, length in bits (64-bit big-endian) */
+	unsigned long long bits = d->length * 8;
+	unsigned char padding[72];
+	size_t padding_length = (d->block_length < 56 ? 56 : 120) - d->block_length;
+
+	memset(padding, 0, sizeof(padding));
+	padding[0] = 0x80;
+
+	int i;
+	for(i = 0; i < 8; i ++)
+		padding[padding_length + i] = bits >> (56 - 8 * i);
+
+	digest_update(d, padding, padding_length + 8);
+
+	for(i = 0; i < 8; i ++)
+	{
+		result->value[4 * i] = d->state[i] >> 24;
+		result->value[4 * i + 1] = d->state[i] >> 16;
+		result->value[4 * i + 2] = d->state[i] >> 8;
+		result->value[4 * i + 3] = d->state[i];
+	}
+	result->size = 32;
+}
+
+int digest_file(struct digest *d, const char *filename, unsigned long long length)
+{
+	static char buffer[TRANSFER_BUFFER_SIZE];
+
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		return -1;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	while(length)
+	{
+		ssize_t bytes = read(fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer));
+		if(bytes < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			int saved_errno = errno;
+			close(fd);
+			errno = saved_errno;
+			return -1;
+		}
+		if(bytes == 0)
+			break;
+
+		digest_update(d, buffer, bytes);
+		length -= bytes;
+	}
+
+	close(fd);
+	return 0;
+}
+
+const char *digest_name(enum digest_algorithm algorithm)
+{
+	switch(algorithm)
+	{
+		case DIGEST_CRC32C:
+			return "CRC32C";
+		case DIGEST_SHA256:
+			return "SHA-256";
+		default:
+			return "none";
+	}
+}
+
+char *digest_format(const struct digest_value *v, char *hex)
+{
+	static const char digits[] = "0123456789abcdef";
+	size_t i;
+
+	for(i = 0; i < v->size; i ++)
+	{
+		hex[2 * i] = digits[v->value[i] >> 4];
+		hex[2 * i + 1] = digits[v->value[i] & 15];
+	}
+	hex[2 * i] = '\0';
+	return hex;
+}
+
+int digest_equal(const struct digest_value *a, const struct digest_value *b)
+{
+	return a->algorithm == b->algorithm && a->size && a->size == b->size && !memcmp(a->value, b->value, a->size);
+}
+
+static size_t digest_size(enum digest_algorithm algorithm)
+{
+	return algorithm == DIGEST_SHA256 ? 32 : algorithm == DIGEST_CRC32C ? 4 : 0;
+}
+
+/* Algorithm by its name: "sha256" and "crc32c" (-V), "sha-256" (Repr-Digest and Digest headers) */
+static enum digest_algorithm find_algorithm(const char *name, size_t length)
+{
+#define IS(s) (length == sizeof(s) - 1 && !strncasecmp(name, s, length))
+	if(IS("sha-256") || IS("sha256"))
+		return DIGEST_SHA256;
+	if(IS("crc32c"))
+		return DIGEST_CRC32C;
+	return DIGEST_NONE;
+#undef IS
+}
+
+static int hex_value(int c)
+{
+	if(c >= '0' && c <= '9')
+		return c - '0';
+	c = tolower(c);
+	return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+int digest_parse_option(const char *spec, struct digest_value *expected)
+{
+	memset(expected, 0, sizeof(struct digest_value));
+
+	const char *colon = strchr(spec, ':');
+	size_t name_length = colon ? (size_t) (colon - spec) : strlen(spec);
+
+	expected->algorithm = find_algorithm(spec, name_length);
+	if(expected->algorithm == DIGEST_NONE)
+		return -1;
+
+	if(!colon)
+		return 0; // Only the algorithm: the value comes from the headers
+
+	const char *hex = colon + 1;
+	size_t size = digest_size(expected->algorithm), i;
+	if(strlen(hex) != 2 * size)
+		return -1;
+
+	for(i = 0; i < size; i ++)
+	{
+		int high = hex_value(hex[2 * i]), low = hex_value(hex[2 * i + 1]);
+		if(high < 0 || low < 0)
+			return -1;
+		expected->value[i] = (high << 4) | low;
+	}
+	expected->size = size;
+	return 0;
+}
+
+/* Decodes base64 (with or without padding) into "out". Returns the number of bytes, -1 if it's malformed or too long. */
+static ssize_t base64_decode(const char *in, size_t length, unsigned char *out, size_t size)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	uint32_t bits = 0;
+	unsigned count = 0;
+	size_t produced = 0, i;
+
+	while(length > 0 && in[length - 1] == '=')
+		length --;
+
+	for(i = 0; i < length; i ++)
+	{
+		const char *p = in[i] ? strchr(alphabet, in[i]) : NULL;
+		if(!p)
+			return -1;
+
+		bits = (bits << 6) | (p - alphabet);
+		count += 6;
+		if(count >= 8)
+		{
+			count -= 8;
+			if(produced == size)
+				return -1;
+			out[produced ++] = bits >> count;
+		}
+	}
+	return produced;
+}
+
+int digest_parse_header(const char *header, enum digest_algorithm algorithm, struct digest_value *value)
+{
+	memset(value, 0, sizeof(struct digest_value));
+	value->algorithm = algorithm;
+
+	/* Comma-separated "name=value", the value is either ":BASE64:" (Repr-Digest) or "BASE64" (Digest) */
+	const char *p = header;
+	while(*p)
+	{
+		p += strspn(p, " \t,");
+		size_t length = strcspn(p, ",");
+		const char *eq = memchr(p, '=', length);
+
+		if(eq && find_algorithm(p, strcspn(p, " \t=")) == algorithm)
+		{
+			const char *v = eq + 1;
+			v += strspn(v, " \t");
+
+			size_t v_length = strcspn(v, ", \t;");
+			if(v_length >= 2 && v[0] == ':' && v[v_length - 1] == ':')
+			{
+				v ++;
+				v_length -= 2;
+			}
+
+			ssize_t size = base64_decode(v, v_length, value->value, sizeof(value->value));
+			if(size == (ssize_t) digest_size(algorithm))
+			{
+				value->size = size;
+				return 0;
+			}
+		}
+		p += length;
+	}
+	return -1;
+}
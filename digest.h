@@ -0,0 +1,86 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_DIGEST_H
+#define HTTP_CLIENT_DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+	Streaming digests of the response body: it's hashed while it's being written
+	into the file (see content_decoder.digest), so checking its integrity doesn't
+	need another pass over the file after the download.
+
+	CRC32C uses the crc32 instruction of SSE 4.2, SHA-256 uses the SHA extensions
+	(SHA-NI), if the CPU has them (checked once at runtime), portable code otherwise.
+*/
+
+#define DIGEST_MAX_SIZE 32 // SHA-256
+#define DIGEST_HEX_SIZE (2 * DIGEST_MAX_SIZE + 1)
+
+enum digest_algorithm {
+	DIGEST_NONE,
+	DIGEST_CRC32C,
+	DIGEST_SHA256
+};
+
+struct digest {
+	enum digest_algorithm algorithm;
+	unsigned long long length; // bytes hashed so far
+
+	uint32_t crc; // CRC32C
+	uint32_t state[8]; // SHA-256
+	unsigned char block[64]; // incomplete block of SHA-256
+	size_t block_length;
+};
+
+/* Result of a digest (CRC32C is stored as 4 bytes, big-endian) */
+struct digest_value {
+	enum digest_algorithm algorithm;
+	unsigned char value[DIGEST_MAX_SIZE];
+	size_t size; // 0 if unknown
+};
+
+void digest_init(struct digest *d, enum digest_algorithm algorithm);
+void digest_update(struct digest *d, const void *data, size_t length);
+void digest_final(struct digest *d, struct digest_value *result);
+
+/* Hashes the first "length" bytes of the file (all of it if it's shorter).
+	Returns 0 on success, -1 on error (see errno). */
+int digest_file(struct digest *d, const char *filename, unsigned long long length);
+
+/* "SHA-256" or "CRC32C" */
+const char *digest_name(enum digest_algorithm algorithm);
+
+/* Returns "hex" (DIGEST_HEX_SIZE bytes) with the value in hex */
+char *digest_format(const struct digest_value *v, char *hex);
+
+/* Returns 1 if both values are known and the same, 0 otherwise */
+int digest_equal(const struct digest_value *a, const struct digest_value *b);
+
+/*
+	Parses "ALGORITHM[:HEX]" (e.g. "sha256:e3b0c442...", see -V) into "expected"
+	(its size is 0 if there is no value). Returns 0 on success, -1 if it's malformed.
+*/
+int digest_parse_option(const char *spec, struct digest_value *expected);
+
+/*
+	Finds the value for "algorithm" in the value of Repr-Digest (RFC 9530: "sha-256=:BASE64:, ...")
+	or Digest (RFC 3230: "SHA-256=BASE64, ...") header. Returns 0 on success, -1 if there is none.
+*/
+int digest_parse_header(const char *header, enum digest_algorithm algorithm, struct digest_value *value);
+
+#endif
@@ -0,0 +1,550 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "dns.h"
+#include "log.h"
+
+__thread struct dns_stats dns_stats;
+
+struct dns_waiter {
+	struct dns_waiter *next;
+	dns_callback callback;
+	void *opaque;
+};
+
+struct dns_entry {
+	struct dns_entry *next;
+	char *host;
+	char *port;
+
+	time_t expires;
+	int error; // 0 or EAI_* (negative answer)
+	struct addrinfo *ai; // our own copy (see copy_addrinfo)
+
+	/* Non-blocking lookup in progress (getaddrinfo_a) */
+	int pending;
+	struct gaicb request;
+	struct addrinfo hints;
+	struct dns_waiter *waiters;
+};
+
+static __thread struct dns_entry *CACHE = NULL;
+static __thread int event_fd = -1;
+
+/* Makes a copy of "src" which can be freed with dns_freeaddrinfo().
+	Each element is allocated together with its sockaddr. */
+static struct addrinfo *copy_addrinfo(const struct addrinfo *src)
+{
+	struct addrinfo *first = NULL, **tail = &first;
+
+	for(; src; src = src->ai_next)
+	{
+		struct addrinfo *copy = malloc(sizeof(struct addrinfo) + src->ai_addrlen);
+		if(!copy)
+		{
+			dns_freeaddrinfo(first);
+			return NULL;
+		}
+
+		*copy = *src;
+		copy->ai_addr = (struct sockaddr *) (copy + 1);
+		memcpy(copy->ai_addr, src->ai_addr, src->ai_addrlen);
+		copy->ai_canonname = NULL;
+		copy->ai_next = NULL;
+
+		*tail = copy;
+		tail = &copy->ai_next;
+	}
+
+	return first;
+}
+
+void dns_freeaddrinfo(struct addrinfo *res)
+{
+	while(res)
+	{
+		struct addrinfo *next = res->ai_next;
+		free(res);
+		res = next;
+	}
+}
+
+static void free_entry(struct dns_entry *e)
+{
+	dns_freeaddrinfo(e->ai);
+	free(e->host);
+	free(e->port);
+	free(e);
+}
+
+/* Finds the entry for host:port. Expired entries are removed along the way. */
+static struct dns_entry *find_entry(const char *host, const char *port)
+{
+	time_t now = time(NULL);
+	struct dns_entry **pe = &CACHE, *e;
+
+	while((e = *pe))
+	{
+		if(!e->pending && e->expires <= now)
+		{
+			*pe = e->next;
+			free_entry(e);
+			continue;
+		}
+
+		if(!strcmp(e->host, host) && !strcmp(e->port, port))
+			return e;
+
+		pe = &e->next;
+	}
+
+	return NULL;
+}
+
+static struct dns_entry *new_entry(const char *host, const char *port)
+{
+	struct dns_entry *e = calloc(1, sizeof(struct dns_entry));
+	if(!e)
+		return NULL;
+
+	e->host = strdup(host);
+	e->port = strdup(port);
+	if(!e->host || !e->port)
+	{
+		free_entry(e);
+		return NULL;
+	}
+
+	e->next = CACHE;
+	CACHE = e;
+	return e;
+}
+
+static void remove_entry(struct dns_entry *e)
+{
+	struct dns_entry **pe = &CACHE;
+	while(*pe != e)
+		pe = &(*pe)->next;
+
+	*pe = e->next;
+	free_entry(e);
+}
+
+/* Remembers the result of getaddrinfo() */
+static void store_result(struct dns_entry *e, int error, const struct addrinfo *ai)
+{
+	e->error = error;
+	e->ai = NULL;
+
+	if(!error)
+	{
+		e->ai = copy_addrinfo(ai);
+		if(!e->ai)
+			e->error = EAI_MEMORY;
+	}
+
+	switch(e->error)
+	{
+		case 0:
+			e->expires = time(NULL) + DNS_TTL;
+			break;
+		case EAI_AGAIN:
+		case EAI_MEMORY:
+		case EAI_SYSTEM:
+			e->expires = 0; // Temporary failure: not cached
+			break;
+		default:
+			e->expires = time(NULL) + DNS_NEGATIVE_TTL;
+	}
+}
+
+/* Returns the cached answer (the copy of addresses goes into "*res") */
+static int get_answer(const struct dns_entry *e, struct addrinfo **res)
+{
+	if(e->error)
+		return e->error;
+
+	*res = copy_addrinfo(e->ai);
+	return *res ? 0 : EAI_MEMORY;
+}
+
+static void init_hints(struct addrinfo *hints)
+{
+	memset(hints, 0, sizeof(struct addrinfo));
+	hints->ai_family = AF_UNSPEC; /* Both IPv4 and IPv6 are acceptable */
+	hints->ai_socktype = SOCK_STREAM;
+}
+
+int dns_resolve(const char *host, const char *port, struct addrinfo **res)
+{
+	struct dns_entry *e = find_entry(host, port);
+	if(e && !e->pending)
+	{
+		dns_stats.hits ++;
+		return get_answer(e, res);
+	}
+
+	struct addrinfo hints, *ai;
+	init_hints(&hints);
+
+	dns_stats.lookups ++;
+	int ret = getaddrinfo(host, port, &hints, &ai);
+
+	if(!e)
+		e = new_entry(host, port);
+
+	if(!e || e->pending)
+	{
+		/* Can't cache (out of memory, or the same name is being resolved
+			by dns_resolve_async() right now): return the result as is */
+		if(ret != 0)
+			return ret;
+
+		*res = copy_addrinfo(ai);
+		freeaddrinfo(ai);
+		return *res ? 0 : EAI_MEMORY;
+	}
+
+	store_result(e, ret, ai);
+	if(ret == 0)
+		freeaddrinfo(ai);
+
+	return get_answer(e, res);
+}
+
+/* Called by glibc (in a separate thread) when getaddrinfo_a() is completed.
+	"sv" is the eventfd of the thread which has started the lookup. */
+static void dns_notify(union sigval sv)
+{
+	uint64_t one = 1;
+	if(write(sv.sival_int, &one, sizeof(one)) < 0)
+	{
+		// Nothing we can do here: eventfd counter can't overflow in practice
+	}
+}
+
+int dns_fd(void)
+{
+	if(event_fd < 0)
+		event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	return event_fd;
+}
+
+int dns_resolve_async(const char *host, const char *port, dns_callback callback, void *opaque, struct addrinfo **res)
+{
+	struct dns_entry *e = find_entry(host, port);
+	if(e && !e->pending)
+	{
+		dns_stats.hits ++;
+		return get_answer(e, res);
+	}
+
+	struct dns_waiter *w = malloc(sizeof(struct dns_waiter));
+	if(!w)
+		return EAI_MEMORY;
+
+	w->callback = callback;
+	w->opaque = opaque;
+
+	if(e)
+	{
+		/* The same host:port is already being resolved */
+		dns_stats.joined ++;
+
+		w->next = e->waiters;
+		e->waiters = w;
+		return DNS_PENDING;
+	}
+
+	if(dns_fd() < 0 || !(e = new_entry(host, port)))
+	{
+		free(w);
+		return EAI_MEMORY;
+	}
+
+	init_hints(&e->hints);
+	e->request.ar_name = e->host;
+	e->request.ar_service = e->port;
+	e->request.ar_request = &e->hints;
+
+	struct sigevent sev;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD;
+	sev.sigev_notify_function = dns_notify;
+	sev.sigev_value.sival_int = event_fd;
+
+	struct gaicb *list[1] = { &e->request };
+
+	dns_stats.lookups ++;
+	int ret = getaddrinfo_a(GAI_NOWAIT, list, 1, &sev);
+	if(ret != 0)
+	{
+		remove_entry(e);
+		free(w);
+		return ret;
+	}
+
+	e->pending = 1;
+	w->next = NULL;
+	e->waiters = w;
+	return DNS_PENDING;
+}
+
+void dns_cancel(void *opaque)
+{
+	struct dns_entry *e;
+	for(e = CACHE; e; e = e->next)
+	{
+		struct dns_waiter **pw = &e->waiters, *w;
+		while((w = *pw))
+		{
+			if(w->opaque == opaque)
+			{
+				*pw = w->next;
+				free(w);
+				continue;
+			}
+			pw = &w->next;
+		}
+	}
+}
+
+void dns_process(void)
+{
+	uint64_t counter;
+	if(read(event_fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN)
+		log_warn("read(eventfd) failed: %s", strerror(errno));
+
+	struct dns_entry *e = CACHE;
+	while(e)
+	{
+		if(!e->pending)
+		{
+			e = e->next;
+			continue;
+		}
+
+		int ret = gai_error(&e->request);
+		if(ret == EAI_INPROGRESS)
+		{
+			e = e->next;
+			continue;
+		}
+
+		e->pending = 0;
+		store_result(e, ret, e->request.ar_result);
+		if(e->request.ar_result)
+		{
+			freeaddrinfo(e->request.ar_result);
+			e->request.ar_result = NULL;
+		}
+
+		struct dns_waiter *w = e->waiters, *next;
+		e->waiters = NULL;
+
+		for(; w; w = next)
+		{
+			next = w->next;
+
+			struct addrinfo *res = NULL;
+			int error = get_answer(e, &res);
+			w->callback(w->opaque, error, res);
+			free(w);
+		}
+
+		/* Callbacks could have added or removed entries: start over */
+		e = CACHE;
+	}
+}
+
+void dns_clear(void)
+{
+	struct dns_entry **pe = &CACHE, *e;
+	while((e = *pe))
+	{
+		if(e->pending)
+		{
+			pe = &e->next;
+			continue;
+		}
+
+		*pe = e->next;
+		free_entry(e);
+	}
+
+	if(!CACHE && event_fd >= 0)
+	{
+		close(event_fd);
+		event_fd = -1;
+	}
+}
+
+int dns_save(const char *filename)
+{
+	char *tmpname;
+	if(asprintf(&tmpname, "%s.tmp", filename) < 0)
+		return -1;
+
+	FILE *f = fopen(tmpname, "w");
+	if(!f)
+	{
+		free(tmpname);
+		return -1;
+	}
+
+	fprintf(f, "# host port expires address\n");
+
+	time_t now = time(NULL);
+	struct dns_entry *e;
+	for(e = CACHE; e; e = e->next)
+	{
+		if(e->pending || e->error || e->expires <= now)
+			continue;
+
+		struct addrinfo *ai;
+		for(ai = e->ai; ai; ai = ai->ai_next)
+		{
+			char address[INET6_ADDRSTRLEN];
+			const void *src = ai->ai_family == AF_INET6 ?
+				(const void *) &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr :
+				(const void *) &((struct sockaddr_in *) ai->ai_addr)->sin_addr;
+
+			if(!inet_ntop(ai->ai_family, src, address, sizeof(address)))
+				continue;
+
+			fprintf(f, "%s %s %lld %s\n", e->host, e->port, (long long) e->expires, address);
+		}
+	}
+
+	if(fclose(f) != 0 || rename(tmpname, filename) < 0)
+	{
+		int saved_errno = errno;
+		unlink(tmpname);
+		free(tmpname);
+		errno = saved_errno;
+		return -1;
+	}
+
+	free(tmpname);
+	return 0;
+}
+
+/* Makes an addrinfo (for dns_load) from the address in text form */
+static struct addrinfo *parse_address(const char *address, unsigned short port)
+{
+	struct addrinfo *ai = calloc(1, sizeof(struct addrinfo) + sizeof(struct sockaddr_in6));
+	if(!ai)
+		return NULL;
+
+	ai->ai_socktype = SOCK_STREAM;
+	ai->ai_protocol = IPPROTO_TCP;
+	ai->ai_addr = (struct sockaddr *) (ai + 1);
+
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ai->ai_addr;
+	struct sockaddr_in *sin = (struct sockaddr_in *) ai->ai_addr;
+
+	if(inet_pton(AF_INET6, address, &sin6->sin6_addr) == 1)
+	{
+		ai->ai_family = sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		ai->ai_addrlen = sizeof(struct sockaddr_in6);
+	}
+	else if(inet_pton(AF_INET, address, &sin->sin_addr) == 1)
+	{
+		ai->ai_family = sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		ai->ai_addrlen = sizeof(struct sockaddr_in);
+	}
+	else
+	{
+		free(ai);
+		return NULL;
+	}
+
+	return ai;
+}
+
+int dns_load(const char *filename)
+{
+	FILE *f = fopen(filename, "r");
+	if(!f)
+		return -1;
+
+	time_t now = time(NULL);
+	char line[512], host[256], port[32], address[INET6_ADDRSTRLEN];
+	long long expires;
+
+	while(fgets(line, sizeof(line), f))
+	{
+		if(line[0] == '#')
+			continue;
+
+		if(sscanf(line, "%255s %31s %lld %45s", host, port, &expires, address) != 4)
+			continue;
+
+		if(expires <= now)
+			continue;
+
+		char *endptr;
+		unsigned long port_number = strtoul(port, &endptr, 10);
+		if(*endptr != '\0' || port_number < 1 || port_number > 65535)
+			continue;
+
+		struct addrinfo *ai = parse_address(address, port_number);
+		if(!ai)
+			continue;
+
+		struct dns_entry *e = find_entry(host, port);
+		if(!e && !(e = new_entry(host, port)))
+		{
+			free(ai);
+			continue;
+		}
+
+		if(e->pending)
+		{
+			free(ai);
+			continue;
+		}
+
+		/* Append (the order of addresses is preserved) */
+		struct addrinfo **tail = &e->ai;
+		while(*tail)
+			tail = &(*tail)->ai_next;
+		*tail = ai;
+
+		e->error = 0;
+		e->expires = expires;
+	}
+
+	fclose(f);
+	return 0;
+}
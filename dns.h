@@ -0,0 +1,86 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_DNS_H
+#define HTTP_CLIENT_DNS_H
+
+#include <netdb.h>
+
+/*
+	Resolver with a cache of results, keyed by "host:port".
+	Successful lookups are cached for DNS_TTL seconds, failed ones
+	(e.g. "Name or service not known") for DNS_NEGATIVE_TTL seconds.
+
+	getaddrinfo() doesn't tell us the TTL of DNS records,
+	so the same (short) lifetime is used for all of them.
+
+	Each thread has its own cache (and its own dns_fd()), see batch.c.
+*/
+
+#define DNS_TTL 60
+#define DNS_NEGATIVE_TTL 5
+
+#define DNS_PENDING 1 // returned by dns_resolve_async(): the callback will be called later
+
+struct dns_stats {
+	unsigned long lookups; // calls to getaddrinfo() or getaddrinfo_a()
+	unsigned long hits; // answered from cache (including negative answers)
+	unsigned long joined; // waited for a lookup which was already in progress
+};
+extern __thread struct dns_stats dns_stats;
+
+/*
+	Addresses returned by the functions below are our own copies
+	and must be freed with dns_freeaddrinfo() (NOT with freeaddrinfo).
+*/
+
+/* Blocking lookup. Returns 0 (and sets "*res") or EAI_* error code. */
+int dns_resolve(const char *host, const char *port, struct addrinfo **res);
+
+typedef void (*dns_callback)(void *opaque, int error, struct addrinfo *res);
+
+/*
+	Non-blocking lookup. If the answer is in cache, returns 0 (and sets "*res")
+	or EAI_* error code. Otherwise returns DNS_PENDING, and "callback" will be
+	called from dns_process() when the lookup is completed.
+	Several lookups of the same host:port are merged into one.
+*/
+int dns_resolve_async(const char *host, const char *port, dns_callback callback, void *opaque, struct addrinfo **res);
+
+/* Forget about the pending callback(s) with this "opaque" (e.g. request timed out) */
+void dns_cancel(void *opaque);
+
+/* Returns the file descriptor (eventfd) which becomes readable when
+	some non-blocking lookup is completed, or -1 on error */
+int dns_fd(void);
+
+/* Calls the callbacks of completed lookups. Must be called when dns_fd() is readable. */
+void dns_process(void);
+
+void dns_freeaddrinfo(struct addrinfo *res);
+
+/* Forgets the cache of this thread (e.g. before the thread exits).
+	Lookups still in progress are kept (glibc will write into them). */
+void dns_clear(void);
+
+/*
+	On-disk cache (for short-lived invocations): positive answers
+	which are not yet expired are loaded/saved from/to "filename".
+	Returns 0 on success, -1 on error (errno is set).
+*/
+int dns_load(const char *filename);
+int dns_save(const char *filename);
+
+#endif
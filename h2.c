@@ -0,0 +1,1073 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "h2.h"
+#include "transfer.h"
+
+/* Frame types */
+#define FRAME_DATA 0x0
+#define FRAME_HEADERS 0x1
+#define FRAME_PRIORITY 0x2
+#define FRAME_RST_STREAM 0x3
+#define FRAME_SETTINGS 0x4
+#define FRAME_PUSH_PROMISE 0x5
+#define FRAME_PING 0x6
+#define FRAME_GOAWAY 0x7
+#define FRAME_WINDOW_UPDATE 0x8
+#define FRAME_CONTINUATION 0x9
+
+/* Flags */
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+/* Settings */
+#define SETTINGS_HEADER_TABLE_SIZE 0x1
+#define SETTINGS_ENABLE_PUSH 0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+
+#define DEFAULT_WINDOW 65535 // initial flow control window (before SETTINGS and WINDOW_UPDATE)
+#define MAX_STREAM_ID 0x7fffffff
+#define MAX_HEADER_BLOCK (1024 * 1024) // sanity limit, same as HTTP_MAX_HEADERS_SIZE
+
+#define PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+__thread struct h2_stats h2_stats;
+
+static void put32(uint8_t *p, uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static void set_error(struct h2_connection *c, const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	vsnprintf(c->error, sizeof(c->error), format, ap);
+	va_end(ap);
+
+	c->dead = 1;
+}
+
+/* Returns the place for "length" more bytes in the output buffer (NULL if out of memory) */
+static uint8_t *out_reserve(struct h2_connection *c, size_t length)
+{
+	if(c->out_offset > 0 && c->out_offset == c->out_length)
+		c->out_offset = c->out_length = 0;
+
+	if(c->out_length + length > c->out_size)
+	{
+		if(c->out_offset > 0)
+		{
+			memmove(c->out, c->out + c->out_offset, c->out_length - c->out_offset);
+			c->out_length -= c->out_offset;
+			c->out_offset = 0;
+		}
+
+		size_t size = c->out_size ? c->out_size : 4096;
+		while(c->out_length + length > size)
+			size *= 2;
+
+		if(size != c->out_size)
+		{
+			uint8_t *out = realloc(c->out, size);
+			if(!out)
+			{
+				set_error(c, "memory allocation failed");
+				return NULL;
+			}
+			c->out = out;
+			c->out_size = size;
+		}
+	}
+
+	return c->out + c->out_length;
+}
+
+static void queue_frame(struct h2_connection *c, uint8_t type, uint8_t flags, uint32_t stream_id, const void *payload, size_t length)
+{
+	uint8_t *p = out_reserve(c, H2_FRAME_HEADER_SIZE + length);
+	if(!p)
+		return;
+
+	p[0] = length >> 16;
+	p[1] = length >> 8;
+	p[2] = length;
+	p[3] = type;
+	p[4] = flags;
+	put32(p + 5, stream_id);
+	if(length)
+		memcpy(p + H2_FRAME_HEADER_SIZE, payload, length);
+
+	c->out_length += H2_FRAME_HEADER_SIZE + length;
+}
+
+static void queue_u32_frame(struct h2_connection *c, uint8_t type, uint32_t stream_id, uint32_t value)
+{
+	uint8_t payload[4];
+	put32(payload, value);
+	queue_frame(c, type, 0, stream_id, payload, 4);
+}
+
+static void queue_goaway(struct h2_connection *c, uint32_t code)
+{
+	uint8_t payload[8];
+	put32(payload, 0); // Last stream initiated by the server that we have processed: none
+	put32(payload + 4, code);
+	queue_frame(c, FRAME_GOAWAY, 0, 0, payload, 8);
+}
+
+/* Connection error: the connection can't be used any more. Always returns -1. */
+static int connection_error(struct h2_connection *c, uint32_t code, const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	vsnprintf(c->error, sizeof(c->error), format, ap);
+	va_end(ap);
+
+	/* Dead before the flush: it must not start the waiting streams (they are retried via another connection) */
+	c->dead = 1;
+	queue_goaway(c, code);
+	h2_flush(c); // Best effort
+	return -1;
+}
+
+static unsigned bucket_of(uint32_t id)
+{
+	return (id >> 1) % H2_STREAM_BUCKETS;
+}
+
+static struct h2_stream *find_stream(const struct h2_connection *c, uint32_t id)
+{
+	struct h2_stream *s;
+	for(s = c->streams[bucket_of(id)]; s; s = s->next)
+	{
+		if(s->id == id)
+			return s;
+	}
+	return NULL;
+}
+
+/* Removes the stream from the open ones (or from the queue of waiting ones) */
+static void detach_stream(struct h2_connection *c, struct h2_stream *s)
+{
+	if(s->id)
+	{
+		struct h2_stream **ps = &c->streams[bucket_of(s->id)];
+		while(*ps != s)
+			ps = &(*ps)->next;
+		*ps = s->next;
+		c->open_streams --;
+	}
+	else
+	{
+		if(s->prev)
+			s->prev->next = s->next;
+		else
+			c->waiting = s->next;
+
+		if(s->next)
+			s->next->prev = s->prev;
+		else
+			c->waiting_tail = s->prev;
+	}
+
+	s->next = s->prev = NULL;
+	s->conn = NULL;
+}
+
+static void start_waiting(struct h2_connection *c);
+
+/* Closes the stream and tells the caller (the stream must not be used after this) */
+static void close_stream(struct h2_connection *c, struct h2_stream *s, const char *error, int retry)
+{
+	detach_stream(c, s);
+	c->cb->on_close(s->opaque, error, retry);
+	start_waiting(c);
+}
+
+/* Stream error: RST_STREAM is sent, the request has failed */
+static void reset_stream(struct h2_connection *c, struct h2_stream *s, uint32_t code, const char *error)
+{
+	queue_u32_frame(c, FRAME_RST_STREAM, s->id, code);
+	close_stream(c, s, error, 0);
+}
+
+/* Closes all streams (both open and waiting ones) */
+static void close_all_streams(struct h2_connection *c, const char *error)
+{
+	struct h2_stream *list = NULL, *s;
+	unsigned i;
+
+	/* Detached first: callbacks may submit new streams (which will fail) */
+	for(i = 0; i < H2_STREAM_BUCKETS; i ++)
+	{
+		while((s = c->streams[i]))
+		{
+			detach_stream(c, s);
+			s->next = list;
+			list = s;
+		}
+	}
+
+	while((s = list))
+	{
+		list = s->next;
+		s->next = NULL;
+		c->cb->on_close(s->opaque, error, 0);
+	}
+
+	/* Waiting streams haven't been sent at all */
+	while((s = c->waiting))
+	{
+		detach_stream(c, s);
+		c->cb->on_close(s->opaque, error, 1);
+	}
+}
+
+/* What the encoder should do with request header "name" */
+static enum hpack_indexing header_indexing(const char *name, size_t length)
+{
+#define IS(s) (length == sizeof(s) - 1 && !memcmp(name, s, length))
+	if(IS("authorization") || IS("proxy-authorization") || IS("cookie"))
+		return HPACK_NEVER_INDEX;
+
+	/* Different in every request: would only push the useful entries out of the table */
+	if(IS(":path") || IS("if-none-match") || IS("if-modified-since") || IS("if-range") || IS("range") || IS("content-length"))
+		return HPACK_NO_INDEX;
+
+	return HPACK_INDEX;
+#undef IS
+}
+
+/* Returns 1 for the HTTP/1.1 headers which are not allowed in HTTP/2 (RFC 9113 8.2.2) */
+static int is_connection_header(const char *name, size_t length)
+{
+#define IS(s) (length == sizeof(s) - 1 && !strncasecmp(name, s, length))
+	return IS("connection") || IS("keep-alive") || IS("proxy-connection") || IS("transfer-encoding") || IS("upgrade") || IS("te");
+#undef IS
+}
+
+static size_t encode(struct h2_connection *c, uint8_t *out, const char *name, size_t name_length, const char *value, size_t value_length)
+{
+	return hpack_encode_header(&c->encoder, out, name, name_length, value, value_length, header_indexing(name, name_length));
+}
+
+/*
+	Converts the HTTP/1.1 request of "s" into a header block (in c->arena).
+	Returns its length, -1 if the request is malformed or out of memory.
+*/
+static ssize_t encode_request(struct h2_connection *c, struct h2_stream *s, uint8_t **block)
+{
+	const char *request = s->request, *end = s->request + s->request_length;
+
+	/* Every header needs at most HPACK_ENCODED_MAX: name + value + 16 */
+	size_t lines = 0;
+	const char *p;
+	for(p = request; p < end; p ++)
+		lines += *p == '\n';
+
+	uint8_t *out = arena_alloc(c->arena, HPACK_SIZE_UPDATE_MAX + s->request_length + 16 * (lines + 4) + 64);
+	char *name = arena_alloc(c->arena, s->request_length + 1); // lowercased
+	if(!out || !name)
+		return -1;
+
+	/* Request line: "GET /path HTTP/1.1" */
+	const char *method = request;
+	const char *method_end = memchr(method, ' ', end - method);
+	const char *path = method_end ? method_end + 1 : NULL;
+	const char *path_end = path ? memchr(path, ' ', end - path) : NULL;
+	const char *line_end = path_end ? memchr(path_end, '\n', end - path_end) : NULL;
+	if(!line_end)
+		return -1;
+
+	/* :authority is taken from Host (pseudo-headers go first) */
+	const char *host = NULL, *host_end = NULL;
+	for(p = line_end + 1; p < end; )
+	{
+		const char *eol = memchr(p, '\n', end - p);
+		if(!eol)
+			break;
+
+		if(eol - p > 5 && !strncasecmp(p, "host:", 5))
+		{
+			host = p + 5;
+			host += strspn(host, " \t");
+			host_end = eol > host && eol[-1] == '\r' ? eol - 1 : eol;
+		}
+		p = eol + 1;
+	}
+	if(!host)
+		return -1;
+
+	size_t n = hpack_encode_begin(&c->encoder, out);
+	n += encode(c, out + n, ":method", 7, method, method_end - method);
+	n += encode(c, out + n, ":scheme", 7, "http", 4);
+	n += encode(c, out + n, ":authority", 10, host, host_end - host);
+	n += encode(c, out + n, ":path", 5, path, path_end - path);
+
+	for(p = line_end + 1; p < end; )
+	{
+		const char *eol = memchr(p, '\n', end - p);
+		if(!eol)
+			break;
+
+		const char *value_end = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+		const char *colon = memchr(p, ':', value_end - p);
+		if(colon && colon > p && !(colon - p == 4 && !strncasecmp(p, "host", 4)) && !is_connection_header(p, colon - p))
+		{
+			size_t name_length = colon - p, i;
+			for(i = 0; i < name_length; i ++)
+				name[i] = tolower((unsigned char) p[i]);
+
+			const char *value = colon + 1;
+			value += strspn(value, " \t");
+			n += encode(c, out + n, name, name_length, value, value_end - value);
+		}
+		p = eol + 1;
+	}
+
+	*block = out;
+	return n;
+}
+
+/* Sends HEADERS of the waiting stream "s" (removed from the queue already) */
+static void start_stream(struct h2_connection *c, struct h2_stream *s)
+{
+	uint8_t *block;
+	ssize_t length = encode_request(c, s, &block);
+	if(length < 0)
+	{
+		arena_reset(c->arena);
+		c->cb->on_close(s->opaque, "failed to convert the request for HTTP/2", 0);
+		return;
+	}
+
+	s->id = c->next_stream_id;
+	c->next_stream_id += 2;
+	if(c->next_stream_id > MAX_STREAM_ID)
+		c->going_away = 1; // Stream ids are exhausted: a new connection is needed
+
+	/* HEADERS (+ CONTINUATION if the block is larger than a frame), not interrupted by other frames */
+	size_t offset = 0;
+	do {
+		size_t part = (size_t) length - offset;
+		if(part > c->max_frame_size)
+			part = c->max_frame_size;
+
+		uint8_t flags = offset + part == (size_t) length ? FLAG_END_HEADERS : 0;
+		if(offset == 0)
+			queue_frame(c, FRAME_HEADERS, flags | FLAG_END_STREAM, s->id, block, part);
+		else
+			queue_frame(c, FRAME_CONTINUATION, flags, s->id, block + offset, part);
+
+		offset += part;
+	} while(offset < (size_t) length);
+	arena_reset(c->arena);
+
+	s->conn = c;
+	s->response_started = 0;
+	s->unacked = 0;
+	s->window = H2_STREAM_WINDOW;
+	s->next = c->streams[bucket_of(s->id)];
+	c->streams[bucket_of(s->id)] = s;
+	c->open_streams ++;
+
+	h2_stats.streams ++;
+	h2_stats.header_bytes += length + H2_FRAME_HEADER_SIZE;
+	h2_stats.plain_header_bytes += s->request_length;
+	if(c->open_streams > h2_stats.max_concurrent)
+		h2_stats.max_concurrent = c->open_streams;
+
+	s->request = NULL;
+	c->cb->on_sent(s->opaque);
+}
+
+/* Starts the waiting streams while there are free slots */
+static void start_waiting(struct h2_connection *c)
+{
+	struct h2_stream *s;
+	while(c->sock >= 0 && !c->dead && !c->going_away && c->open_streams < c->max_streams && (s = c->waiting))
+	{
+		detach_stream(c, s);
+		start_stream(c, s);
+	}
+}
+
+/* Response headers converted into HTTP/1.1 form (see on_headers) */
+struct head_builder {
+	struct arena *arena;
+	char *lines; // "name: value\r\n" lines
+	size_t length, size;
+	char status[4]; // value of ":status"
+	int malformed;
+};
+
+static int add_head_line(void *opaque, const char *name, size_t name_length, const char *value, size_t value_length)
+{
+	struct head_builder *hb = opaque;
+
+	/* Not a reason to stop decoding: the dynamic table must stay the same as on the server */
+	if(hb->malformed)
+		return 0;
+
+	if(name[0] == ':')
+	{
+		if(name_length == 7 && !memcmp(name, ":status", 7) && value_length == 3 && !hb->status[0] && hb->length == 0)
+			memcpy(hb->status, value, 4);
+		else
+			hb->malformed = 1; // Unknown or misplaced pseudo-header
+		return 0;
+	}
+
+	if(is_connection_header(name, name_length))
+		return 0;
+
+	/* These would break the HTTP/1.1 form (and they are not allowed anyway) */
+	if(strpbrk(name, "\r\n: ") || memchr(value, '\r', value_length) || memchr(value, '\n', value_length) ||
+		memchr(value, '\0', value_length))
+	{
+		hb->malformed = 1;
+		return 0;
+	}
+
+	size_t needed = hb->length + name_length + value_length + 4;
+	if(needed > MAX_HEADER_BLOCK)
+	{
+		hb->malformed = 1;
+		return 0;
+	}
+
+	if(needed > hb->size)
+	{
+		size_t size = hb->size ? hb->size * 2 : 1024;
+		while(size < needed)
+			size *= 2;
+
+		char *lines = arena_realloc(hb->arena, hb->lines, hb->size, size);
+		if(!lines)
+		{
+			hb->malformed = 1;
+			return 0;
+		}
+		hb->lines = lines;
+		hb->size = size;
+	}
+
+	char *p = hb->lines + hb->length;
+	memcpy(p, name, name_length);
+	p += name_length;
+	*p ++ = ':';
+	*p ++ = ' ';
+	memcpy(p, value, value_length);
+	p += value_length;
+	*p ++ = '\r';
+	*p ++ = '\n';
+	hb->length = p - hb->lines;
+	return 0;
+}
+
+/* The header block (HEADERS and CONTINUATION frames) is complete */
+static int finish_header_block(struct h2_connection *c)
+{
+	uint32_t id = c->header_block_stream;
+	int end_stream = c->header_block_end_stream;
+	c->header_block_stream = 0;
+
+	struct head_builder hb;
+	memset(&hb, 0, sizeof(hb));
+	hb.arena = c->arena;
+
+	/* Must be decoded even if the stream is no longer needed (the table is updated by it) */
+	if(hpack_decode(&c->decoder, c->arena, c->header_block, c->header_block_length, add_head_line, &hb) < 0)
+		return connection_error(c, H2_COMPRESSION_ERROR, "failed to decode HTTP/2 headers (HPACK)");
+
+	struct h2_stream *s = find_stream(c, id);
+	if(!s)
+		goto done; // Cancelled by us
+
+	if(s->response_started)
+	{
+		/* Trailers: not needed */
+		if(end_stream)
+			close_stream(c, s, NULL, 0);
+		else
+			reset_stream(c, s, H2_PROTOCOL_ERROR, "trailers without the end of stream");
+		goto done;
+	}
+
+	unsigned code = atoi(hb.status);
+	if(hb.malformed || code < 100 || code > 999)
+	{
+		reset_stream(c, s, H2_PROTOCOL_ERROR, "malformed HTTP/2 response headers");
+		goto done;
+	}
+
+	if(code < 200)
+	{
+		/* Informational (e.g. 103 Early Hints): the final response follows */
+		if(end_stream)
+			reset_stream(c, s, H2_PROTOCOL_ERROR, "stream has ended after an informational response");
+		goto done;
+	}
+	s->response_started = 1;
+
+	char *head = arena_printf(c->arena, "HTTP/2 %s \r\n%.*s\r\n", hb.status, (int) hb.length, hb.lines ? hb.lines : "");
+	if(!head)
+	{
+		reset_stream(c, s, H2_INTERNAL_ERROR, "memory allocation failed");
+		goto done;
+	}
+
+	/* The stream may be cancelled (or even closed) by the callback */
+	if(c->cb->on_headers(s->opaque, head, strlen(head)) < 0)
+	{
+		if((s = find_stream(c, id)))
+			h2_cancel(s);
+	}
+	else if(end_stream && (s = find_stream(c, id)))
+		close_stream(c, s, NULL, 0);
+
+done:
+	arena_reset(c->arena);
+	return 0;
+}
+
+/* Appends a fragment of the header block (from HEADERS or CONTINUATION) */
+static int add_header_fragment(struct h2_connection *c, const uint8_t *data, size_t length)
+{
+	if(c->header_block_length + length > MAX_HEADER_BLOCK)
+		return connection_error(c, H2_PROTOCOL_ERROR, "response headers are too long (> %i bytes)", MAX_HEADER_BLOCK);
+
+	if(c->header_block_length + length > c->header_block_size)
+	{
+		size_t size = c->header_block_size ? c->header_block_size : 4096;
+		while(size < c->header_block_length + length)
+			size *= 2;
+
+		uint8_t *block = realloc(c->header_block, size);
+		if(!block)
+			return connection_error(c, H2_INTERNAL_ERROR, "memory allocation failed");
+
+		c->header_block = block;
+		c->header_block_size = size;
+	}
+
+	memcpy(c->header_block + c->header_block_length, data, length);
+	c->header_block_length += length;
+	return 0;
+}
+
+static int handle_headers(struct h2_connection *c, uint8_t flags, uint32_t id, const uint8_t *payload, size_t length)
+{
+	if(id == 0 || (id & 1) == 0)
+		return connection_error(c, H2_PROTOCOL_ERROR, "HEADERS on stream %u", id);
+
+	size_t pad = 0;
+	if(flags & FLAG_PADDED)
+	{
+		if(length < 1)
+			return connection_error(c, H2_FRAME_SIZE_ERROR, "HEADERS frame is too short");
+		pad = payload[0];
+		payload ++;
+		length --;
+	}
+	if(flags & FLAG_PRIORITY)
+	{
+		if(length < 5)
+			return connection_error(c, H2_FRAME_SIZE_ERROR, "HEADERS frame is too short");
+		payload += 5;
+		length -= 5;
+	}
+	if(pad > length)
+		return connection_error(c, H2_PROTOCOL_ERROR, "padding is longer than the HEADERS frame");
+	length -= pad;
+
+	c->header_block_length = 0;
+	c->header_block_stream = id;
+	c->header_block_end_stream = flags & FLAG_END_STREAM;
+	if(add_header_fragment(c, payload, length) < 0)
+		return -1;
+
+	return (flags & FLAG_END_HEADERS) ? finish_header_block(c) : 0;
+}
+
+static int handle_data(struct h2_connection *c, uint8_t flags, uint32_t id, const uint8_t *payload, size_t length)
+{
+	if(id == 0)
+		return connection_error(c, H2_PROTOCOL_ERROR, "DATA on stream 0");
+
+	/* Flow control counts the whole frame (with padding) */
+	if((long long) length > c->window)
+		return connection_error(c, H2_FLOW_CONTROL_ERROR, "server has exceeded the flow control window");
+	c->window -= length;
+	c->unacked += length;
+
+	if(c->unacked >= H2_CONNECTION_WINDOW / 2)
+	{
+		queue_u32_frame(c, FRAME_WINDOW_UPDATE, 0, c->unacked);
+		c->window += c->unacked;
+		c->unacked = 0;
+	}
+
+	const uint8_t *data = payload;
+	size_t size = length;
+	if(flags & FLAG_PADDED)
+	{
+		if(length < 1 || payload[0] >= length)
+			return connection_error(c, H2_PROTOCOL_ERROR, "malformed padding of DATA frame");
+		data ++;
+		size = length - 1 - payload[0];
+	}
+
+	struct h2_stream *s = find_stream(c, id);
+	if(!s)
+		return 0; // Cancelled by us: the data is not needed
+
+	if(!s->response_started)
+	{
+		reset_stream(c, s, H2_PROTOCOL_ERROR, "DATA before the response headers");
+		return 0;
+	}
+
+	if((long long) length > s->window)
+	{
+		reset_stream(c, s, H2_FLOW_CONTROL_ERROR, "server has exceeded the flow control window of the stream");
+		return 0;
+	}
+	s->window -= length;
+	s->unacked += length;
+
+	if(size > 0 && c->cb->on_data(s->opaque, (const char *) data, size) < 0)
+	{
+		if((s = find_stream(c, id)))
+			h2_cancel(s);
+		return 0;
+	}
+
+	if(!(s = find_stream(c, id)))
+		return 0;
+
+	if(flags & FLAG_END_STREAM)
+	{
+		close_stream(c, s, NULL, 0);
+		return 0;
+	}
+
+	if(s->unacked >= H2_STREAM_WINDOW / 2)
+	{
+		queue_u32_frame(c, FRAME_WINDOW_UPDATE, id, s->unacked);
+		s->window += s->unacked;
+		s->unacked = 0;
+	}
+	return 0;
+}
+
+static int handle_settings(struct h2_connection *c, uint8_t flags, uint32_t id, const uint8_t *payload, size_t length)
+{
+	if(id != 0)
+		return connection_error(c, H2_PROTOCOL_ERROR, "SETTINGS on stream %u", id);
+
+	if(flags & FLAG_ACK)
+		return length ? connection_error(c, H2_FRAME_SIZE_ERROR, "SETTINGS ACK with payload") : 0;
+
+	if(length % 6)
+		return connection_error(c, H2_FRAME_SIZE_ERROR, "malformed SETTINGS frame");
+
+	size_t i;
+	for(i = 0; i < length; i += 6)
+	{
+		unsigned setting = (payload[i] << 8) | payload[i + 1];
+		uint32_t value = get32(payload + i + 2);
+
+		switch(setting)
+		{
+			case SETTINGS_HEADER_TABLE_SIZE:
+				hpack_set_max_size(&c->encoder, value);
+				break;
+			case SETTINGS_MAX_CONCURRENT_STREAMS:
+				c->max_streams = value;
+				break;
+			case SETTINGS_INITIAL_WINDOW_SIZE:
+				if(value > MAX_STREAM_ID)
+					return connection_error(c, H2_FLOW_CONTROL_ERROR, "SETTINGS_INITIAL_WINDOW_SIZE is too large");
+				break; // We don't send DATA
+			case SETTINGS_MAX_FRAME_SIZE:
+				if(value < H2_MAX_FRAME_SIZE || value > 0xffffff)
+					return connection_error(c, H2_PROTOCOL_ERROR, "invalid SETTINGS_MAX_FRAME_SIZE");
+				c->max_frame_size = value;
+				break;
+		}
+	}
+
+	queue_frame(c, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+	start_waiting(c); // More slots may be available now
+	return 0;
+}
+
+static int handle_goaway(struct h2_connection *c, const uint8_t *payload, size_t length)
+{
+	if(length < 8)
+		return connection_error(c, H2_FRAME_SIZE_ERROR, "GOAWAY frame is too short");
+
+	uint32_t last_id = get32(payload) & MAX_STREAM_ID;
+	uint32_t code = get32(payload + 4);
+	c->going_away = 1;
+
+	if(code != H2_NO_ERROR)
+		fprintf(stderr, "[warn] HTTP/2 server has sent GOAWAY with error 0x%x: %.*s\n", code, (int) (length - 8), payload + 8);
+
+	/* Streams after "last_id" haven't been processed by the server: they can be retried via a new connection */
+	struct h2_stream *list = NULL, *s;
+	unsigned i;
+	for(i = 0; i < H2_STREAM_BUCKETS; i ++)
+	{
+		struct h2_stream *next;
+		for(s = c->streams[i]; s; s = next)
+		{
+			next = s->next;
+			if(s->id > last_id)
+			{
+				detach_stream(c, s);
+				s->next = list;
+				list = s;
+			}
+		}
+	}
+
+	while((s = list))
+	{
+		list = s->next;
+		s->next = NULL;
+		c->cb->on_close(s->opaque, "server is shutting down the connection (GOAWAY)", 1);
+	}
+
+	while((s = c->waiting))
+	{
+		detach_stream(c, s);
+		c->cb->on_close(s->opaque, "server is shutting down the connection (GOAWAY)", 1);
+	}
+	return 0;
+}
+
+static int handle_frame(struct h2_connection *c, uint8_t type, uint8_t flags, uint32_t id, const uint8_t *payload, size_t length)
+{
+	/* Header block must not be interrupted by other frames */
+	if(c->header_block_stream && (type != FRAME_CONTINUATION || id != c->header_block_stream))
+		return connection_error(c, H2_PROTOCOL_ERROR, "header block was interrupted by another frame");
+
+	switch(type)
+	{
+		case FRAME_DATA:
+			return handle_data(c, flags, id, payload, length);
+
+		case FRAME_HEADERS:
+			return handle_headers(c, flags, id, payload, length);
+
+		case FRAME_CONTINUATION:
+			if(!c->header_block_stream)
+				return connection_error(c, H2_PROTOCOL_ERROR, "unexpected CONTINUATION frame");
+
+			if(add_header_fragment(c, payload, length) < 0)
+				return -1;
+
+			return (flags & FLAG_END_HEADERS) ? finish_header_block(c) : 0;
+
+		case FRAME_RST_STREAM:
+		{
+			if(length != 4)
+				return connection_error(c, H2_FRAME_SIZE_ERROR, "malformed RST_STREAM frame");
+
+			uint32_t code = get32(payload);
+			struct h2_stream *s = find_stream(c, id);
+			if(s)
+			{
+				char error[64];
+				snprintf(error, sizeof(error), "stream was reset by server (error 0x%x)", code);
+				close_stream(c, s, error, code == H2_REFUSED_STREAM);
+			}
+			return 0;
+		}
+
+		case FRAME_SETTINGS:
+			return handle_settings(c, flags, id, payload, length);
+
+		case FRAME_PUSH_PROMISE:
+			return connection_error(c, H2_PROTOCOL_ERROR, "PUSH_PROMISE, but server push is disabled");
+
+		case FRAME_PING:
+			if(length != 8 || id != 0)
+				return connection_error(c, H2_FRAME_SIZE_ERROR, "malformed PING frame");
+
+			if(!(flags & FLAG_ACK))
+				queue_frame(c, FRAME_PING, FLAG_ACK, 0, payload, 8);
+			return 0;
+
+		case FRAME_GOAWAY:
+			return handle_goaway(c, payload, length);
+
+		case FRAME_WINDOW_UPDATE:
+			if(length != 4)
+				return connection_error(c, H2_FRAME_SIZE_ERROR, "malformed WINDOW_UPDATE frame");
+			return 0; // We don't send DATA
+
+		default:
+			return 0; // PRIORITY and unknown frames are ignored
+	}
+}
+
+/* Handles all complete frames in c->in. Returns 0 on success, -1 on connection error. */
+static int handle_frames(struct h2_connection *c)
+{
+	size_t pos = 0;
+	int ret = 0;
+
+	while(c->in_length - pos >= H2_FRAME_HEADER_SIZE)
+	{
+		const uint8_t *p = c->in + pos;
+		size_t length = (p[0] << 16) | (p[1] << 8) | p[2];
+		if(length > H2_MAX_FRAME_SIZE)
+		{
+			ret = connection_error(c, H2_FRAME_SIZE_ERROR, "frame is larger than SETTINGS_MAX_FRAME_SIZE");
+			break;
+		}
+
+		if(c->in_length - pos < H2_FRAME_HEADER_SIZE + length)
+			break; // Not received completely yet
+
+		h2_stats.frames ++;
+		if(handle_frame(c, p[3], p[4], get32(p + 5) & MAX_STREAM_ID, p + H2_FRAME_HEADER_SIZE, length) < 0 || c->dead)
+		{
+			ret = -1;
+			break;
+		}
+		pos += H2_FRAME_HEADER_SIZE + length;
+	}
+
+	memmove(c->in, c->in + pos, c->in_length - pos);
+	c->in_length -= pos;
+	return ret;
+}
+
+int h2_init(struct h2_connection *c, const struct h2_callbacks *cb)
+{
+	memset(c, 0, sizeof(struct h2_connection));
+	c->sock = -1;
+	c->cb = cb;
+	c->next_stream_id = 1;
+	c->max_streams = H2_DEFAULT_MAX_STREAMS;
+	c->max_frame_size = H2_MAX_FRAME_SIZE;
+	c->window = DEFAULT_WINDOW;
+
+	hpack_table_init(&c->encoder);
+	hpack_table_init(&c->decoder);
+
+	c->in = malloc(H2_READ_BUFFER_SIZE);
+	c->arena = arena_get();
+	if(!c->in || !c->arena)
+	{
+		free(c->in);
+		if(c->arena)
+			arena_put(c->arena);
+		return -1;
+	}
+	return 0;
+}
+
+int h2_start(struct h2_connection *c, int sock)
+{
+	c->sock = sock;
+	h2_stats.connections ++;
+
+	uint8_t *p = out_reserve(c, sizeof(PREFACE) - 1);
+	if(!p)
+		return -1;
+	memcpy(p, PREFACE, sizeof(PREFACE) - 1);
+	c->out_length += sizeof(PREFACE) - 1;
+
+	uint8_t settings[12];
+	settings[0] = 0;
+	settings[1] = SETTINGS_ENABLE_PUSH;
+	put32(settings + 2, 0);
+	settings[6] = 0;
+	settings[7] = SETTINGS_INITIAL_WINDOW_SIZE;
+	put32(settings + 8, H2_STREAM_WINDOW);
+	queue_frame(c, FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+
+	queue_u32_frame(c, FRAME_WINDOW_UPDATE, 0, H2_CONNECTION_WINDOW - DEFAULT_WINDOW);
+	c->window = H2_CONNECTION_WINDOW;
+	return c->dead ? -1 : 0;
+}
+
+int h2_submit(struct h2_connection *c, struct h2_stream *s, const char *request, size_t length, void *opaque)
+{
+	if(!h2_usable(c))
+		return -1;
+
+	s->id = 0;
+	s->conn = c;
+	s->request = request;
+	s->request_length = length;
+	s->opaque = opaque;
+
+	s->next = NULL;
+	s->prev = c->waiting_tail;
+	if(c->waiting_tail)
+		c->waiting_tail->next = s;
+	else
+		c->waiting = s;
+	c->waiting_tail = s;
+	return 0;
+}
+
+void h2_cancel(struct h2_stream *s)
+{
+	struct h2_connection *c = s->conn;
+	if(!c)
+		return;
+
+	uint32_t id = s->id;
+	detach_stream(c, s);
+
+	if(id && !c->dead)
+		queue_u32_frame(c, FRAME_RST_STREAM, id, H2_CANCEL); // the slot is reused by h2_flush()
+}
+
+int h2_usable(const struct h2_connection *c)
+{
+	return !c->dead && !c->going_away;
+}
+
+int h2_flush(struct h2_connection *c)
+{
+	if(c->sock < 0)
+		return 0;
+
+	start_waiting(c);
+
+	while(c->out_offset < c->out_length)
+	{
+		ssize_t bytes = send(c->sock, c->out + c->out_offset, c->out_length - c->out_offset, MSG_NOSIGNAL);
+		if(bytes < 0)
+		{
+			if(errno == EAGAIN)
+				return 0;
+			if(errno == EINTR)
+				continue;
+
+			set_error(c, "send() failed: %s", strerror(errno));
+			return -1;
+		}
+		c->out_offset += bytes;
+	}
+
+	c->out_offset = c->out_length = 0;
+	return 0;
+}
+
+int h2_process(struct h2_connection *c)
+{
+	if(c->dead || h2_flush(c) < 0)
+		goto dead;
+
+	while(1)
+	{
+		ssize_t bytes = read(c->sock, c->in + c->in_length, H2_READ_BUFFER_SIZE - c->in_length);
+		transfer_stats.read_calls ++;
+
+		if(bytes < 0)
+		{
+			if(errno == EAGAIN)
+				break;
+			if(errno == EINTR)
+				continue;
+
+			set_error(c, "read() failed: %s", strerror(errno));
+			goto dead;
+		}
+
+		if(bytes == 0)
+		{
+			set_error(c, c->going_away ? "connection closed by server after GOAWAY" : "connection closed by server");
+			goto dead;
+		}
+
+		c->in_length += bytes;
+		if(handle_frames(c) < 0)
+			goto dead;
+	}
+
+	if(h2_flush(c) < 0)
+		goto dead;
+
+	if(c->going_away && !c->open_streams && !c->waiting)
+	{
+		snprintf(c->error, sizeof(c->error), "server has closed the connection (GOAWAY)");
+		return -1;
+	}
+	return 0;
+
+dead:
+	c->dead = 1;
+	close_all_streams(c, c->error);
+	return -1;
+}
+
+void h2_free(struct h2_connection *c, const char *error)
+{
+	if(c->sock >= 0)
+	{
+		if(!c->dead)
+		{
+			queue_goaway(c, H2_NO_ERROR);
+			h2_flush(c);
+		}
+
+		close(c->sock);
+		c->sock = -1;
+	}
+
+	c->dead = 1;
+	close_all_streams(c, error);
+
+	hpack_table_free(&c->encoder);
+	hpack_table_free(&c->decoder);
+	arena_put(c->arena);
+	free(c->in);
+	free(c->out);
+	free(c->header_block);
+}
@@ -0,0 +1,201 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_H2_H
+#define HTTP_CLIENT_H2_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "arena.h"
+#include "hpack.h"
+
+/*
+	HTTP/2 over plain TCP with prior knowledge ("h2c", RFC 9113 3.3): the client
+	sends the connection preface right away, without Upgrade from HTTP/1.1.
+
+	Many requests are sent at once as streams of one connection, and their
+	responses arrive in interleaved frames: a large or slow response doesn't
+	hold up the others (unlike HTTP/1.1 pipelining, where the responses come in order).
+	Headers are compressed with HPACK (see hpack.h).
+
+	This is the protocol state machine for a non-blocking socket, it doesn't wait
+	for anything itself: the caller (see batch.c) calls h2_process() when the socket
+	becomes readable or writable, and the responses are passed to the callbacks.
+	Only what a client needs is here: requests without bodies, server push
+	is disabled (SETTINGS_ENABLE_PUSH), priorities are ignored.
+*/
+
+#define H2_FRAME_HEADER_SIZE 9
+#define H2_MAX_FRAME_SIZE 16384 // SETTINGS_MAX_FRAME_SIZE (the default, larger frames save little)
+#define H2_READ_BUFFER_SIZE (4 * (H2_FRAME_HEADER_SIZE + H2_MAX_FRAME_SIZE)) // several frames per read()
+
+/*
+	Flow control windows for the bodies of responses. The defaults (64 Kb)
+	would make the server wait for WINDOW_UPDATE after every 64 Kb,
+	i.e. one round trip per 64 Kb. Bodies are written into files right away,
+	so the windows are large, and WINDOW_UPDATE is sent when half of the window is used.
+*/
+#define H2_STREAM_WINDOW (16 * 1024 * 1024) // SETTINGS_INITIAL_WINDOW_SIZE
+#define H2_CONNECTION_WINDOW (64 * 1024 * 1024) // for all streams together
+
+#define H2_DEFAULT_MAX_STREAMS 100 // until the server has sent SETTINGS_MAX_CONCURRENT_STREAMS
+#define H2_STREAM_BUCKETS 256 // hash table of open streams (by id)
+
+/* Error codes (RFC 9113 7) */
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_INTERNAL_ERROR 0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED 0x5
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_CANCEL 0x8
+#define H2_COMPRESSION_ERROR 0x9
+
+struct h2_connection;
+
+/*
+	One request. It's provided by the caller (e.g. it's a part of the batch job)
+	and must stay valid until on_close() is called or h2_cancel() returns.
+*/
+struct h2_stream {
+	uint32_t id; // 0 while waiting for a free slot (see h2_submit)
+	struct h2_connection *conn; // NULL if the stream is not attached to any connection
+	struct h2_stream *next; // in the bucket of open streams, or in the queue of waiting ones
+	struct h2_stream *prev; // in the queue of waiting streams
+
+	const char *request; // HTTP/1.1 request (converted into HEADERS when the stream is started)
+	size_t request_length;
+	void *opaque; // passed to the callbacks
+
+	int response_started; // final (non-1xx) response headers have been received
+	uint32_t unacked; // bytes of DATA received since the last WINDOW_UPDATE
+	int32_t window; // how much more the server can send
+};
+
+struct h2_callbacks {
+	/* HEADERS of the request have been queued for sending (the stream has got its id) */
+	void (*on_sent)(void *opaque);
+
+	/*
+		Final response headers, converted into HTTP/1.1 form
+		("HTTP/2 200 \r\nname: value\r\n...\r\n\r\n", valid only during the call),
+		so that they can be parsed by http_parse_response(). 1xx responses are skipped.
+		Returns 0 to continue, -1 to cancel the stream (RST_STREAM).
+	*/
+	int (*on_headers)(void *opaque, const char *head, size_t length);
+
+	/* Next part of the response body. Returns 0 to continue, -1 to cancel the stream. */
+	int (*on_data)(void *opaque, const char *data, size_t length);
+
+	/*
+		The stream is closed and detached from the connection: "error" is NULL
+		if the response is complete. Otherwise, "retry" is 1 if the server
+		has not processed the request (GOAWAY or REFUSED_STREAM): it can be sent again.
+	*/
+	void (*on_close)(void *opaque, const char *error, int retry);
+};
+
+struct h2_stats {
+	unsigned long connections; // h2_start() calls
+	unsigned long streams; // requests sent
+	unsigned long frames; // frames received
+	unsigned max_concurrent; // largest number of open streams on one connection
+	unsigned long long header_bytes; // HEADERS sent (HPACK-compressed)
+	unsigned long long plain_header_bytes; // the same requests in HTTP/1.1 form
+};
+extern __thread struct h2_stats h2_stats;
+
+struct h2_connection {
+	int sock; // -1 until h2_start()
+	const struct h2_callbacks *cb;
+
+	struct hpack_table encoder, decoder;
+	struct arena *arena; // for decoding of one header block (reset after it)
+
+	struct h2_stream *streams[H2_STREAM_BUCKETS]; // open streams
+	unsigned open_streams;
+	struct h2_stream *waiting, *waiting_tail; // submitted, but not started yet
+	uint32_t next_stream_id;
+
+	/* Settings of the server */
+	unsigned max_streams; // SETTINGS_MAX_CONCURRENT_STREAMS
+	unsigned max_frame_size; // SETTINGS_MAX_FRAME_SIZE (for our HEADERS)
+
+	int32_t window; // connection-level flow control (see H2_CONNECTION_WINDOW)
+	uint32_t unacked;
+
+	/* Received data: frames are handled when they are complete */
+	uint8_t *in;
+	size_t in_length;
+
+	/* Header block which is continued in CONTINUATION frames */
+	uint8_t *header_block;
+	size_t header_block_length, header_block_size;
+	uint32_t header_block_stream; // 0 if there is none
+	int header_block_end_stream;
+
+	/* Data to send (frames are queued here and sent by h2_flush) */
+	uint8_t *out;
+	size_t out_offset, out_length, out_size;
+
+	int going_away; // GOAWAY was received: no new streams
+	int dead; // connection error (see "error")
+	char error[256];
+};
+
+/* Prepares "c". Returns 0 on success, -1 if out of memory. Streams can be submitted before h2_start(). */
+int h2_init(struct h2_connection *c, const struct h2_callbacks *cb);
+
+/* Starts using the connected non-blocking socket "sock": queues the connection preface
+	and SETTINGS (streams are started by h2_flush). Returns 0 on success, -1 if out of memory. */
+int h2_start(struct h2_connection *c, int sock);
+
+/*
+	Adds a stream for "request" (HTTP/1.1 request without body, e.g. from format_request(),
+	which must stay valid until the stream is started, see on_sent). If all slots
+	(SETTINGS_MAX_CONCURRENT_STREAMS) are taken, the stream waits for the next free one.
+	Doesn't send anything and doesn't call the callbacks: streams are started by h2_flush().
+	Returns 0 on success, -1 if the connection is going away or dead.
+*/
+int h2_submit(struct h2_connection *c, struct h2_stream *s, const char *request, size_t length, void *opaque);
+
+/* Forgets the stream (RST_STREAM is queued if it has been started). Doesn't call the callbacks. */
+void h2_cancel(struct h2_stream *s);
+
+/* Returns 1 if new streams can be submitted (the server hasn't sent GOAWAY, etc.), 0 otherwise */
+int h2_usable(const struct h2_connection *c);
+
+/*
+	Receives and handles all frames which are available, then sends what is queued.
+	Callbacks are called from here (they may submit or cancel streams).
+	Returns 0 if the connection is still alive, -1 if it is closed or broken:
+	then all streams have been closed (see on_close) and "c->error" says why.
+*/
+int h2_process(struct h2_connection *c);
+
+/*
+	Starts the waiting streams (if there are free slots) and sends what is queued,
+	as much as the socket accepts. Callbacks on_sent() and on_close() may be called.
+	Returns 0 on success, -1 on error ("c->error" says why, the caller should h2_free() it).
+*/
+int h2_flush(struct h2_connection *c);
+
+/* Sends GOAWAY (if possible), closes the socket and frees everything. Remaining streams are closed with "error" (see on_close). */
+void h2_free(struct h2_connection *c, const char *error);
+
+#endif
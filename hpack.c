@@ -0,0 +1,632 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "hpack.h"
+
+#define HUFFMAN_EOS 256
+#define HUFFMAN_MAX_BITS 30
+
+struct hpack_entry {
+	size_t name_length, value_length;
+	char data[]; // name, '\0', value, '\0'
+};
+
+/* RFC 7541 Appendix A */
+static const struct {
+	const char *name, *value;
+} static_table[HPACK_STATIC_COUNT] = {
+	{ ":authority", "" }, // 1
+	{ ":method", "GET" }, // 2
+	{ ":method", "POST" }, // 3
+	{ ":path", "/" }, // 4
+	{ ":path", "/index.html" }, // 5
+	{ ":scheme", "http" }, // 6
+	{ ":scheme", "https" }, // 7
+	{ ":status", "200" }, // 8
+	{ ":status", "204" }, // 9
+	{ ":status", "206" }, // 10
+	{ ":status", "304" }, // 11
+	{ ":status", "400" }, // 12
+	{ ":status", "404" }, // 13
+	{ ":status", "500" }, // 14
+	{ "accept-charset", "" }, // 15
+	{ "accept-encoding", "gzip, deflate" }, // 16
+	{ "accept-language", "" }, // 17
+	{ "accept-ranges", "" }, // 18
+	{ "accept", "" }, // 19
+	{ "access-control-allow-origin", "" }, // 20
+	{ "age", "" }, // 21
+	{ "allow", "" }, // 22
+	{ "authorization", "" }, // 23
+	{ "cache-control", "" }, // 24
+	{ "content-disposition", "" }, // 25
+	{ "content-encoding", "" }, // 26
+	{ "content-language", "" }, // 27
+	{ "content-length", "" }, // 28
+	{ "content-location", "" }, // 29
+	{ "content-range", "" }, // 30
+	{ "content-type", "" }, // 31
+	{ "cookie", "" }, // 32
+	{ "date", "" }, // 33
+	{ "etag", "" }, // 34
+	{ "expect", "" }, // 35
+	{ "expires", "" }, // 36
+	{ "from", "" }, // 37
+	{ "host", "" }, // 38
+	{ "if-match", "" }, // 39
+	{ "if-modified-since", "" }, // 40
+	{ "if-none-match", "" }, // 41
+	{ "if-range", "" }, // 42
+	{ "if-unmodified-since", "" }, // 43
+	{ "last-modified", "" }, // 44
+	{ "link", "" }, // 45
+	{ "location", "" }, // 46
+	{ "max-forwards", "" }, // 47
+	{ "proxy-authenticate", "" }, // 48
+	{ "proxy-authorization", "" }, // 49
+	{ "range", "" }, // 50
+	{ "referer", "" }, // 51
+	{ "refresh", "" }, // 52
+	{ "retry-after", "" }, // 53
+	{ "server", "" }, // 54
+	{ "set-cookie", "" }, // 55
+	{ "strict-transport-security", "" }, // 56
+	{ "transfer-encoding", "" }, // 57
+	{ "user-agent", "" }, // 58
+	{ "vary", "" }, // 59
+	{ "via", "" }, // 60
+	{ "www-authenticate", "" }, // 61
+};
+
+/*
+	RFC 7541 Appendix B: lengths of the Huffman codes of bytes 0-255 and EOS (256).
+	The code is canonical (shorter codes first, codes of the same length
+	in the order of symbols), so the codes themselves are computed from this.
+*/
+static const unsigned char huffman_length[HUFFMAN_EOS + 1] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30,
+};
+
+static uint32_t huffman_code[HUFFMAN_EOS + 1];
+
+/* For decoding: codes of length L are first_code[L] .. first_code[L] + code_count[L] - 1,
+	their symbols are symbols[first_index[L] ...] */
+static uint32_t first_code[HUFFMAN_MAX_BITS + 1];
+static unsigned first_index[HUFFMAN_MAX_BITS + 1];
+static unsigned code_count[HUFFMAN_MAX_BITS + 1];
+static uint16_t symbols[HUFFMAN_EOS + 1];
+
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void huffman_init(void)
+{
+	unsigned length, sym, n = 0;
+	uint32_t code = 0;
+
+	for(length = 1; length <= HUFFMAN_MAX_BITS; length ++)
+	{
+		first_code[length] = code;
+		first_index[length] = n;
+
+		for(sym = 0; sym <= HUFFMAN_EOS; sym ++)
+		{
+			if(huffman_length[sym] != length)
+				continue;
+
+			huffman_code[sym] = code ++;
+			symbols[n ++] = sym;
+			code_count[length] ++;
+		}
+		code <<= 1;
+	}
+}
+
+/* Returns the length of "s" after Huffman encoding */
+static size_t huffman_encoded_length(const char *s, size_t length)
+{
+	unsigned long long bits = 0;
+	size_t i;
+	for(i = 0; i < length; i ++)
+		bits += huffman_length[(unsigned char) s[i]];
+	return (bits + 7) / 8;
+}
+
+static size_t huffman_encode(uint8_t *out, const char *s, size_t length)
+{
+	uint64_t acc = 0;
+	unsigned bits = 0;
+	size_t i, n = 0;
+
+	for(i = 0; i < length; i ++)
+	{
+		unsigned char c = s[i];
+		acc = (acc << huffman_length[c]) | huffman_code[c];
+		bits += huffman_length[c];
+
+		while(bits >= 8)
+		{
+			bits -= 8;
+			out[n ++] = acc >> bits;
+		}
+		acc &= (1ULL << bits) - 1;
+	}
+
+	if(bits)
+		out[n ++] = (acc << (8 - bits)) | (0xff >> bits); // Padded with the beginning of EOS (all ones)
+	return n;
+}
+
+/* Decodes src[0 .. length) into "out" (large enough: at least length * 8 / 5).
+	Returns the length of the result, -1 if it's malformed. */
+static ssize_t huffman_decode(char *out, const uint8_t *src, size_t length)
+{
+	uint32_t code = 0;
+	unsigned bits = 0;
+	size_t i, n = 0;
+
+	for(i = 0; i < length; i ++)
+	{
+		int bit;
+		for(bit = 7; bit >= 0; bit --)
+		{
+			code = (code << 1) | ((src[i] >> bit) & 1);
+			bits ++;
+
+			if(code - first_code[bits] < code_count[bits])
+			{
+				unsigned sym = symbols[first_index[bits] + code - first_code[bits]];
+				if(sym == HUFFMAN_EOS)
+					return -1; // Must not be in the string
+
+				out[n ++] = sym;
+				code = 0;
+				bits = 0;
+			}
+			else if(bits == HUFFMAN_MAX_BITS)
+				return -1;
+		}
+	}
+
+	/* Padding: less than 8 bits, all ones */
+	if(bits >= 8 || code != (1U << bits) - 1)
+		return -1;
+	return n;
+}
+
+static size_t encode_integer(uint8_t *out, uint8_t flags, unsigned prefix_bits, size_t value)
+{
+	size_t max = (1U << prefix_bits) - 1, n = 1;
+	if(value < max)
+	{
+		out[0] = flags | value;
+		return 1;
+	}
+
+	out[0] = flags | max;
+	value -= max;
+	while(value >= 0x80)
+	{
+		out[n ++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	out[n ++] = value;
+	return n;
+}
+
+/* Returns 0 on success, -1 if the integer is truncated or too large */
+static int decode_integer(const uint8_t **p, const uint8_t *end, unsigned prefix_bits, size_t *value)
+{
+	if(*p >= end)
+		return -1;
+
+	size_t max = (1U << prefix_bits) - 1;
+	size_t v = *(*p) ++ & max;
+
+	if(v == max)
+	{
+		unsigned shift = 0;
+		uint8_t b;
+		do {
+			if(*p >= end || shift > 21)
+				return -1; // More than 2^28: nothing in this protocol is that large
+			b = *(*p) ++;
+			v += (size_t) (b & 0x7f) << shift;
+			shift += 7;
+		} while(b & 0x80);
+	}
+
+	*value = v;
+	return 0;
+}
+
+/* String literal: Huffman-encoded if it's shorter this way */
+static size_t encode_string(uint8_t *out, const char *s, size_t length)
+{
+	size_t huffman = huffman_encoded_length(s, length);
+	if(huffman < length)
+	{
+		size_t n = encode_integer(out, 0x80, 7, huffman);
+		return n + huffman_encode(out + n, s, length);
+	}
+
+	size_t n = encode_integer(out, 0, 7, length);
+	memcpy(out + n, s, length);
+	return n + length;
+}
+
+/* Returns 0 on success (the string is in "arena", zero-terminated), -1 if it's malformed */
+static int decode_string(const uint8_t **p, const uint8_t *end, struct arena *arena, char **s, size_t *length)
+{
+	if(*p >= end)
+		return -1;
+
+	int huffman = **p & 0x80;
+	size_t n;
+	if(decode_integer(p, end, 7, &n) < 0 || n > (size_t) (end - *p))
+		return -1;
+
+	char *out = arena_alloc(arena, huffman ? n * 8 / 5 + 1 : n + 1);
+	if(!out)
+		return -1;
+
+	if(huffman)
+	{
+		ssize_t decoded = huffman_decode(out, *p, n);
+		if(decoded < 0)
+			return -1;
+		*length = decoded;
+	}
+	else
+	{
+		memcpy(out, *p, n);
+		*length = n;
+	}
+
+	out[*length] = '\0';
+	*s = out;
+	*p += n;
+	return 0;
+}
+
+static size_t entry_size(const struct hpack_entry *e)
+{
+	return e->name_length + e->value_length + HPACK_ENTRY_OVERHEAD;
+}
+
+/* i = 0 is the newest entry */
+static struct hpack_entry *get_entry(const struct hpack_table *t, unsigned i)
+{
+	return t->entries[(t->first + i) & (t->capacity - 1)];
+}
+
+static const char *entry_name(const struct hpack_entry *e)
+{
+	return e->data;
+}
+
+static const char *entry_value(const struct hpack_entry *e)
+{
+	return e->data + e->name_length + 1;
+}
+
+/* Evicts the oldest entries until the size of the table is at most "limit" */
+static void evict(struct hpack_table *t, size_t limit)
+{
+	while(t->count > 0 && t->size > limit)
+	{
+		struct hpack_entry *oldest = get_entry(t, t->count - 1);
+		t->size -= entry_size(oldest);
+		t->count --;
+		free(oldest);
+	}
+}
+
+static struct hpack_entry *new_entry(const char *name, size_t name_length, const char *value, size_t value_length)
+{
+	struct hpack_entry *e = malloc(sizeof(struct hpack_entry) + name_length + value_length + 2);
+	if(!e)
+		return NULL;
+
+	e->name_length = name_length;
+	e->value_length = value_length;
+	memcpy(e->data, name, name_length);
+	e->data[name_length] = '\0';
+	memcpy(e->data + name_length + 1, value, value_length);
+	e->data[name_length + 1 + value_length] = '\0';
+	return e;
+}
+
+/* Makes room in entries[] for one more entry. Returns 0 on success, -1 if out of memory. */
+static int reserve_entry(struct hpack_table *t)
+{
+	if(t->count < t->capacity)
+		return 0;
+
+	unsigned capacity = t->capacity ? t->capacity * 2 : 16, i;
+	struct hpack_entry **entries = malloc(capacity * sizeof(struct hpack_entry *));
+	if(!entries)
+		return -1;
+
+	for(i = 0; i < t->count; i ++)
+		entries[i] = get_entry(t, i);
+
+	free(t->entries);
+	t->entries = entries;
+	t->capacity = capacity;
+	t->first = 0;
+	return 0;
+}
+
+/* Adds "e" as the newest entry, evicting the old ones to make room (see reserve_entry) */
+static void insert_entry(struct hpack_table *t, struct hpack_entry *e)
+{
+	size_t size = entry_size(e);
+	if(size > t->max_size)
+	{
+		/* Not an error: the table just becomes empty (RFC 7541 4.4) */
+		evict(t, 0);
+		free(e);
+		return;
+	}
+	evict(t, t->max_size - size);
+
+	t->first = (t->first - 1) & (t->capacity - 1);
+	t->entries[t->first] = e;
+	t->count ++;
+	t->size += size;
+}
+
+void hpack_table_init(struct hpack_table *t)
+{
+	memset(t, 0, sizeof(struct hpack_table));
+	t->max_size = HPACK_TABLE_SIZE;
+	pthread_once(&huffman_once, huffman_init);
+}
+
+void hpack_table_free(struct hpack_table *t)
+{
+	evict(t, 0);
+	free(t->entries);
+	t->entries = NULL;
+	t->capacity = 0;
+}
+
+/* Finds name and value of the header with index "index" (static or dynamic). Returns 0 on success, -1 if there is no such index. */
+static int lookup(const struct hpack_table *t, size_t index, const char **name, size_t *name_length,
+	const char **value, size_t *value_length)
+{
+	if(index == 0)
+		return -1;
+
+	if(index <= HPACK_STATIC_COUNT)
+	{
+		*name = static_table[index - 1].name;
+		*name_length = strlen(*name);
+		*value = static_table[index - 1].value;
+		*value_length = strlen(*value);
+		return 0;
+	}
+
+	index -= HPACK_STATIC_COUNT + 1;
+	if(index >= t->count)
+		return -1;
+
+	const struct hpack_entry *e = get_entry(t, index);
+	*name = entry_name(e);
+	*name_length = e->name_length;
+	*value = entry_value(e);
+	*value_length = e->value_length;
+	return 0;
+}
+
+int hpack_decode(struct hpack_table *t, struct arena *arena, const uint8_t *data, size_t length,
+	hpack_header_cb cb, void *opaque)
+{
+	const uint8_t *p = data, *end = data + length;
+
+	while(p < end)
+	{
+		const char *name, *value;
+		char *literal_name, *literal_value;
+		size_t name_length, value_length, index;
+		enum hpack_indexing indexing;
+
+		if(*p & 0x80)
+		{
+			/* Indexed header field */
+			if(decode_integer(&p, end, 7, &index) < 0 || lookup(t, index, &name, &name_length, &value, &value_length) < 0)
+				goto malformed;
+
+			if(cb(opaque, name, name_length, value, value_length) < 0)
+				return -1;
+			continue;
+		}
+
+		if((*p & 0xe0) == 0x20)
+		{
+			/* Dynamic table size update */
+			size_t max_size;
+			if(decode_integer(&p, end, 5, &max_size) < 0 || max_size > HPACK_TABLE_SIZE)
+				goto malformed;
+
+			t->max_size = max_size;
+			evict(t, max_size);
+			continue;
+		}
+
+		/* Literal header field (the name is either indexed or also a literal) */
+		if(*p & 0x40)
+		{
+			indexing = HPACK_INDEX;
+			if(decode_integer(&p, end, 6, &index) < 0)
+				goto malformed;
+		}
+		else
+		{
+			indexing = (*p & 0x10) ? HPACK_NEVER_INDEX : HPACK_NO_INDEX;
+			if(decode_integer(&p, end, 4, &index) < 0)
+				goto malformed;
+		}
+
+		if(index)
+		{
+			if(lookup(t, index, &name, &name_length, &value, &value_length) < 0)
+				goto malformed;
+		}
+		else
+		{
+			if(decode_string(&p, end, arena, &literal_name, &name_length) < 0)
+				goto malformed;
+			name = literal_name;
+		}
+
+		if(decode_string(&p, end, arena, &literal_value, &value_length) < 0)
+			goto malformed;
+		value = literal_value;
+
+		/* Before the entry is added: it may evict the one which "name" is taken from */
+		if(cb(opaque, name, name_length, value, value_length) < 0)
+			return -1;
+
+		if(indexing == HPACK_INDEX)
+		{
+			struct hpack_entry *e = new_entry(name, name_length, value, value_length);
+			if(!e || reserve_entry(t) < 0)
+			{
+				free(e);
+				fprintf(stderr, "[error] HPACK: memory allocation failed\n");
+				return -1;
+			}
+			insert_entry(t, e);
+		}
+	}
+	return 0;
+
+malformed:
+	fprintf(stderr, "[error] HPACK: malformed header block (at byte %zu of %zu).\n", (size_t) (p - data), length);
+	return -1;
+}
+
+void hpack_set_max_size(struct hpack_table *t, size_t max_size)
+{
+	if(max_size > HPACK_TABLE_SIZE)
+		max_size = HPACK_TABLE_SIZE;
+
+	if(max_size == t->max_size)
+		return;
+
+	if(!t->size_update || max_size < t->size_update_min)
+		t->size_update_min = max_size;
+
+	t->max_size = max_size;
+	t->size_update = 1;
+	evict(t, max_size);
+}
+
+size_t hpack_encode_begin(struct hpack_table *t, uint8_t *out)
+{
+	size_t n = 0;
+	if(t->size_update)
+	{
+		/* If it was lowered and then raised again, the decoder must evict as much as we did (RFC 7541 4.2) */
+		if(t->size_update_min < t->max_size)
+			n += encode_integer(out, 0x20, 5, t->size_update_min);
+		n += encode_integer(out + n, 0x20, 5, t->max_size);
+		t->size_update = 0;
+	}
+	return n;
+}
+
+/* Returns the index of the header with this name and value (0 if none), "*name_index" is set to the index of the same name (0 if none) */
+static size_t find_header(const struct hpack_table *t, const char *name, size_t name_length,
+	const char *value, size_t value_length, size_t *name_index)
+{
+	unsigned i;
+	*name_index = 0;
+
+	for(i = 0; i < HPACK_STATIC_COUNT; i ++)
+	{
+		if(strlen(static_table[i].name) != name_length || memcmp(static_table[i].name, name, name_length))
+			continue;
+
+		if(!*name_index)
+			*name_index = i + 1;
+		if(strlen(static_table[i].value) == value_length && !memcmp(static_table[i].value, value, value_length))
+			return i + 1;
+	}
+
+	for(i = 0; i < t->count; i ++)
+	{
+		const struct hpack_entry *e = get_entry(t, i);
+		if(e->name_length != name_length || memcmp(entry_name(e), name, name_length))
+			continue;
+
+		if(!*name_index)
+			*name_index = HPACK_STATIC_COUNT + 1 + i;
+		if(e->value_length == value_length && !memcmp(entry_value(e), value, value_length))
+			return HPACK_STATIC_COUNT + 1 + i;
+	}
+
+	return 0;
+}
+
+size_t hpack_encode_header(struct hpack_table *t, uint8_t *out, const char *name, size_t name_length,
+	const char *value, size_t value_length, enum hpack_indexing indexing)
+{
+	size_t name_index;
+	size_t index = find_header(t, name, name_length, value, value_length, &name_index);
+	if(index && indexing != HPACK_NEVER_INDEX)
+		return encode_integer(out, 0x80, 7, index);
+
+	/* The decoder will add it to its table, so we must add it too (not indexed if we can't) */
+	struct hpack_entry *e = NULL;
+	if(indexing == HPACK_INDEX && (reserve_entry(t) < 0 || !(e = new_entry(name, name_length, value, value_length))))
+		indexing = HPACK_NO_INDEX;
+
+	size_t n;
+	if(indexing == HPACK_INDEX)
+		n = encode_integer(out, 0x40, 6, name_index);
+	else
+		n = encode_integer(out, indexing == HPACK_NEVER_INDEX ? 0x10 : 0, 4, name_index);
+
+	if(!name_index)
+		n += encode_string(out + n, name, name_length);
+	n += encode_string(out + n, value, value_length);
+
+	if(e)
+		insert_entry(t, e);
+	return n;
+}
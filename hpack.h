@@ -0,0 +1,95 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_HPACK_H
+#define HTTP_CLIENT_HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+/*
+	HPACK (RFC 7541): compression of headers in HTTP/2.
+
+	Each direction of the connection has a dynamic table of recently
+	sent headers, and both sides keep a copy of it. A header which is
+	already in the table (or in the static table of 61 common headers)
+	is sent as its index, usually one byte: e.g. the same Host and User-Agent
+	of the second and all following requests cost 1 byte each.
+	Other strings are sent as literals, compressed with the static Huffman code.
+
+	Decoding errors are connection errors (COMPRESSION_ERROR): after them,
+	the tables of the two sides are no longer the same.
+*/
+
+#define HPACK_TABLE_SIZE 4096 // SETTINGS_HEADER_TABLE_SIZE (the default, we don't ask for more)
+#define HPACK_STATIC_COUNT 61 // entries in the static table, dynamic ones have the next indices
+#define HPACK_ENTRY_OVERHEAD 32 // added to the length of name and value (RFC 7541 4.1)
+
+/* Space to reserve for one encoded header (integers and the length of Huffman output never exceed this) */
+#define HPACK_ENCODED_MAX(name_length, value_length) ((name_length) + (value_length) + 16)
+#define HPACK_SIZE_UPDATE_MAX 6 // encoded "dynamic table size update"
+
+struct hpack_entry;
+
+struct hpack_table {
+	struct hpack_entry **entries; // ring buffer, entries[first] is the newest one
+	unsigned capacity; // of entries[] (power of 2)
+	unsigned first, count;
+	size_t size; // sum of the sizes of all entries
+	size_t max_size; // current limit (entries are evicted from the end to stay within it)
+	int size_update; // encoder: max_size has changed, the next header block must tell the decoder
+	size_t size_update_min; // the smallest max_size since then (the decoder must evict as much)
+};
+
+/* What the encoder may do with a literal header (RFC 7541 6.2) */
+enum hpack_indexing {
+	HPACK_INDEX, // add to the dynamic table (repeated headers: Host, User-Agent, ...)
+	HPACK_NO_INDEX, // not worth it (e.g. :path is different in every request)
+	HPACK_NEVER_INDEX // sensitive (Cookie, Authorization): intermediaries must not index it either
+};
+
+void hpack_table_init(struct hpack_table *t);
+void hpack_table_free(struct hpack_table *t);
+
+/* Called for each decoded header. Name and value are zero-terminated, valid only during the call.
+	Returns 0 to continue, -1 to stop decoding. */
+typedef int (*hpack_header_cb)(void *opaque, const char *name, size_t name_length, const char *value, size_t value_length);
+
+/*
+	Decodes the complete header block data[0 .. length), calls "cb" for each header.
+	Decoded strings are allocated in "arena".
+	Returns 0 on success, -1 if the block is malformed (the error is printed)
+	or if "cb" has returned -1.
+*/
+int hpack_decode(struct hpack_table *t, struct arena *arena, const uint8_t *data, size_t length,
+	hpack_header_cb cb, void *opaque);
+
+/* Encoder: the peer has sent SETTINGS_HEADER_TABLE_SIZE (our table is never larger than HPACK_TABLE_SIZE) */
+void hpack_set_max_size(struct hpack_table *t, size_t max_size);
+
+/* Starts a new header block: writes the dynamic table size update into "out" if it's needed.
+	Returns the number of bytes written (at most HPACK_SIZE_UPDATE_MAX). */
+size_t hpack_encode_begin(struct hpack_table *t, uint8_t *out);
+
+/*
+	Encodes one header into "out" (HPACK_ENCODED_MAX bytes must be available).
+	Name must be lowercase. Returns the number of bytes written.
+*/
+size_t hpack_encode_header(struct hpack_table *t, uint8_t *out, const char *name, size_t name_length,
+	const char *value, size_t value_length, enum hpack_indexing indexing);
+
+#endif
@@ -0,0 +1,859 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <strings.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HTTP_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "http.h"
+#include "content_encoding.h"
+#include "log.h"
+
+const unsigned max_redirects = 7;
+const char *appname = "http_client";
+const char *appversion = "0.1";
+
+int parse_url(char *URL, struct http_url *u)
+{
+	char *p; // temporary pointer used when parsing URLs
+	char *begin = URL;
+
+	u->tls = 0;
+
+	p = strchr(begin, ':');
+	if(!p || (strchr(begin, '/') && strchr(begin, '/') < p))
+	{
+		log_warn("No schema in URL, assuming HTTP.");
+		p = begin;
+	}
+	else
+	{
+		*p = '\0'; p ++;
+		if(strncmp(begin, "http", 4))
+		{
+bad_schema:
+			log_error("Unsupported schema: '%s' in URL.", begin);
+			return EINVAL;
+		}
+		else if(begin[4] != '\0')
+		{
+			if(begin[4] == 's' && begin[5] == '\0')
+				u->tls = 1;
+			else goto bad_schema;
+		}
+
+		if(strncmp(p, "//", 2))
+		{
+			log_error("Malformed URL (no http://).");
+			return EINVAL;
+		}
+		p += 2;
+	}
+
+
+	begin = p; // "begin" points to the beginning of "example.com/some/path"
+	p = strchr(begin, '/'); // separate the host
+	if(p) {
+		*p = '\0';
+	}
+
+	u->host = begin; // points to "example.com" or "example.com:1234"
+	u->path = p ? (p + 1) : ""; // points to "some/path"
+
+	// Separate the port from the host
+	p = strchr(u->host, ':');
+	if(p)
+	{
+		u->port = p + 1;
+		*p = '\0'; // port is separated from the "host" string
+	}
+	else u->port = u->tls ? "443" : "80";
+
+	return 0;
+}
+
+int is_default_port(const struct http_url *u)
+{
+	return !strcmp(u->port, u->tls ? "443" : "80");
+}
+
+const char *url_scheme(const struct http_url *u)
+{
+	return u->tls ? "https" : "http";
+}
+
+char *url_normalize(struct arena *arena, const struct http_url *u)
+{
+	int default_port = is_default_port(u);
+	size_t path_length = strcspn(u->path, "#"); // fragment is not sent to the server
+
+	char *key = arena_printf(arena, "%s://%s%s%s/%.*s", url_scheme(u), u->host,
+		default_port ? "" : ":", default_port ? "" : u->port,
+		(int) path_length, u->path);
+	if(!key)
+		return NULL;
+
+	/* Hostnames are case-insensitive */
+	char *p;
+	for(p = strstr(key, "://") + 3; *p && *p != '/'; p ++)
+		*p = tolower((unsigned char) *p);
+
+	return key;
+}
+
+/*
+	Removes "." and ".." segments (RFC 3986, section 5.2.4) from path[0 .. length),
+	which starts with '/'. Returns the new length (the path only becomes shorter).
+*/
+static size_t remove_dot_segments(char *path, size_t length)
+{
+	const char *in = path, *end = path + length;
+	char *out = path; // path[0 .. out) is the result so far
+
+	while(in < end)
+	{
+		/* "in" points to '/' before the segment */
+		const char *segment = in + 1;
+		const char *next = memchr(segment, '/', end - segment);
+		if(!next)
+			next = end;
+
+		size_t segment_length = next - segment;
+		if(segment_length == 1 && segment[0] == '.')
+		{
+			if(next == end)
+				*out ++ = '/'; // "/a/." means "/a/"
+		}
+		else if(segment_length == 2 && segment[0] == '.' && segment[1] == '.')
+		{
+			while(out > path && *(-- out) != '/'); // Remove the last segment of the result
+
+			if(next == end)
+				*out ++ = '/';
+		}
+		else
+		{
+			memmove(out, in, next - in);
+			out += next - in;
+		}
+		in = next;
+	}
+
+	if(out == path)
+		*out ++ = '/';
+	return out - path;
+}
+
+char *resolve_location(struct arena *arena, const struct http_url *base, const char *location)
+{
+	/* Absolute URL ("scheme:...") is used as is */
+	size_t scheme_length = strspn(location, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789+-.");
+	if(scheme_length > 0 && isalpha((unsigned char) location[0]) && location[scheme_length] == ':')
+		return arena_strdup(arena, location);
+
+	/* Network-path reference ("//example.com/path"): same scheme */
+	if(location[0] == '/' && location[1] == '/')
+		return arena_printf(arena, "%s:%s", url_scheme(base), location);
+
+	/* Otherwise it's a path on the same server. Build the absolute path (with query). */
+	size_t base_length = strcspn(base->path, "?#");
+	char *path;
+
+	if(location[0] == '/')
+		path = arena_strdup(arena, location);
+	else if(location[0] == '?')
+		path = arena_printf(arena, "/%.*s%s", (int) base_length, base->path, location);
+	else if(location[0] == '#' || location[0] == '\0')
+		path = arena_printf(arena, "/%s", base->path);
+	else
+	{
+		/* Relative to the "directory" of the base path */
+		size_t dir_length = base_length;
+		while(dir_length > 0 && base->path[dir_length - 1] != '/')
+			dir_length --;
+
+		path = arena_printf(arena, "/%.*s%s", (int) dir_length, base->path, location);
+	}
+	if(!path)
+		return NULL;
+
+	path[strcspn(path, "#")] = '\0'; // Fragment is not sent to the server
+
+	size_t path_length = strcspn(path, "?");
+	size_t new_length = remove_dot_segments(path, path_length);
+	memmove(path + new_length, path + path_length, strlen(path + path_length) + 1); // Query
+
+	int default_port = is_default_port(base);
+	return arena_printf(arena, "%s://%s%s%s%s", url_scheme(base), base->host,
+		default_port ? "" : ":", default_port ? "" : base->port, path);
+}
+
+int format_request_with(struct arena *arena, char **request, const char *method, const struct http_url *u,
+	const char *accept_encoding, const char *extra_headers)
+{
+	int default_port = is_default_port(u);
+
+	*request = arena_printf(arena,
+		"%s /%s HTTP/1.1\r\n"
+		"Host: %s%s%s\r\n"
+		"User-Agent: %s/%s\r\n"
+		"Accept-Encoding: %s\r\n"
+		"%s"
+		"\r\n", method, u->path, u->host,
+		default_port ? "" : ":", default_port ? "" : u->port,
+		appname, appversion, accept_encoding, extra_headers);
+
+	return *request ? (int) strlen(*request) : -1;
+}
+
+int format_request(struct arena *arena, char **request, const struct http_url *u)
+{
+	return format_request_with(arena, request, "GET", u, ACCEPT_ENCODING, "");
+}
+
+int format_range_request(struct arena *arena, char **request, const struct http_url *u,
+	unsigned long long first, unsigned long long last, const char *if_range)
+{
+	char range[80];
+	if(last == (unsigned long long) -1)
+		snprintf(range, sizeof(range), "Range: bytes=%llu-\r\n", first);
+	else
+		snprintf(range, sizeof(range), "Range: bytes=%llu-%llu\r\n", first, last);
+
+	if(!if_range)
+		return format_request_with(arena, request, "GET", u, "identity", range);
+
+	char *extra_headers = arena_printf(arena, "%sIf-Range: %s\r\n", range, if_range);
+	if(!extra_headers)
+		return -1;
+
+	return format_request_with(arena, request, "GET", u, "identity", extra_headers);
+}
+
+int format_conditional_request(struct arena *arena, char **request, const struct http_url *u,
+	const char *etag, const char *last_modified)
+{
+	char *extra_headers = arena_printf(arena, "%s%s%s%s%s%s",
+		etag ? "If-None-Match: " : "", etag ? etag : "", etag ? "\r\n" : "",
+		last_modified ? "If-Modified-Since: " : "", last_modified ? last_modified : "", last_modified ? "\r\n" : "");
+	if(!extra_headers)
+		return -1;
+
+	return format_request_with(arena, request, "GET", u, ACCEPT_ENCODING, extra_headers);
+}
+
+/*
+	Perfect hash of the names of well-known headers: no two of them
+	have the same hash, so finding out whether the header is well-known
+	needs only one comparison (instead of a search in the list).
+	Names are case-insensitive, so the hash is calculated from lowercased bytes.
+*/
+#define KNOWN_HASH_SIZE 32
+
+struct known_header_name {
+	const char *name;
+	size_t length;
+	enum http_known_header id;
+};
+
+#define KNOWN(hash, name, id) [hash] = { name, sizeof(name) - 1, id }
+static const struct known_header_name known_headers[KNOWN_HASH_SIZE] = {
+	KNOWN(3, "date", HDR_DATE),
+	KNOWN(6, "location", HDR_LOCATION),
+	KNOWN(7, "expires", HDR_EXPIRES),
+	KNOWN(9, "transfer-encoding", HDR_TRANSFER_ENCODING),
+	KNOWN(10, "cache-control", HDR_CACHE_CONTROL),
+	KNOWN(11, "content-type", HDR_CONTENT_TYPE),
+	KNOWN(12, "content-range", HDR_CONTENT_RANGE),
+	KNOWN(13, "content-length", HDR_CONTENT_LENGTH),
+	KNOWN(16, "content-encoding", HDR_CONTENT_ENCODING),
+	KNOWN(21, "connection", HDR_CONNECTION),
+	KNOWN(22, "last-modified", HDR_LAST_MODIFIED),
+	KNOWN(24, "etag", HDR_ETAG),
+	KNOWN(25, "accept-ranges", HDR_ACCEPT_RANGES),
+	KNOWN(27, "age", HDR_AGE)
+};
+#undef KNOWN
+
+static inline unsigned char lowercase(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static inline unsigned known_hash(const char *name, size_t length)
+{
+	return (length + lowercase(name[length - 1]) * 7 + lowercase(name[length / 2]) * 3) % KNOWN_HASH_SIZE;
+}
+
+static int known_header_id(const char *name, size_t length)
+{
+	const struct known_header_name *k = &known_headers[known_hash(name, length)];
+	if(k->length == length && !strncasecmp(k->name, name, length))
+		return k->id;
+
+	return HDR_OTHER;
+}
+
+/*
+	Returns the position of the first ':' or '\n' in buf[from .. to),
+	or "to" if there is none. Looks at 16 bytes at once if possible.
+*/
+static size_t find_colon_or_lf_sse2(const char *buf, size_t from, size_t to)
+{
+	size_t i = from;
+
+#ifdef __SSE2__
+	const __m128i colon = _mm_set1_epi8(':'), lf = _mm_set1_epi8('\n');
+	for(; i + 16 <= to; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+		unsigned mask = _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(v, colon), _mm_cmpeq_epi8(v, lf)));
+		if(mask)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+
+	for(; i < to; i ++)
+	{
+		if(buf[i] == ':' || buf[i] == '\n')
+			return i;
+	}
+	return to;
+}
+
+#ifdef HTTP_X86
+/* Same, but looks at 32 bytes at once (the rest is left to the SSE2 version) */
+__attribute__((target("avx2")))
+static size_t find_colon_or_lf_avx2(const char *buf, size_t from, size_t to)
+{
+	size_t i = from;
+
+	const __m256i colon = _mm256_set1_epi8(':'), lf = _mm256_set1_epi8('\n');
+	for(; i + 32 <= to; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *) (buf + i));
+		unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_cmpeq_epi8(v, colon), _mm256_cmpeq_epi8(v, lf)));
+		if(mask)
+			return i + __builtin_ctz(mask);
+	}
+	return find_colon_or_lf_sse2(buf, i, to);
+}
+#endif
+
+/* Implementation is chosen once (by what the CPU supports) */
+static size_t (*find_colon_or_lf)(const char *buf, size_t from, size_t to);
+static pthread_once_t parser_once = PTHREAD_ONCE_INIT;
+
+static void parser_setup(void)
+{
+	find_colon_or_lf = find_colon_or_lf_sse2;
+
+#ifdef HTTP_X86
+	/* AVX2: CPUID.(EAX=7,ECX=0):EBX bit 5, and the OS must save the YMM registers (OSXSAVE, XCR0 bits 1-2) */
+	unsigned eax, ebx, ecx, edx;
+	if(__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_OSXSAVE))
+	{
+		unsigned xcr0_low, xcr0_high;
+		__asm__("xgetbv" : "=a" (xcr0_low), "=d" (xcr0_high) : "c" (0));
+
+		if((xcr0_low & 6) == 6 && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_AVX2))
+			find_colon_or_lf = find_colon_or_lf_avx2;
+	}
+#endif
+}
+
+void http_response_init(struct http_response *r, struct arena *arena)
+{
+	memset(r, 0, sizeof(struct http_response));
+	r->arena = arena;
+
+	int i;
+	for(i = 0; i < HDR_KNOWN_COUNT; i ++)
+		r->first[i] = r->last[i] = -1;
+}
+
+static int parse_status_line(struct http_response *r, size_t start, size_t end)
+{
+	char *line = r->buf + start;
+	r->buf[end] = '\0';
+
+	if(sscanf(line, "%9s %3hu", r->proto, &r->code) < 2 || strncmp(r->proto, "HTTP/", 5))
+	{
+		log_error("Server has sent a malformed status line: \"%s\"", line);
+		return -1;
+	}
+
+	/* "HTTP/1.1 404 Not Found": skip the protocol and the code */
+	char *p = line;
+	while(*p && !isspace(*p)) p ++;
+	while(isspace(*p)) p ++;
+	while(isdigit(*p)) p ++;
+	while(isspace(*p)) p ++;
+
+	r->status_offset = p - r->buf;
+	return 0;
+}
+
+static int add_header(struct http_response *r, size_t key_start, size_t key_end, size_t val_start, size_t val_end)
+{
+	if(r->count == r->capacity)
+	{
+		int capacity = r->capacity ? r->capacity * 2 : 32;
+		struct http_header *headers = arena_realloc(r->arena, r->headers,
+			r->capacity * sizeof(struct http_header), capacity * sizeof(struct http_header));
+		if(!headers)
+		{
+			log_error("arena_realloc: memory allocation failed");
+			return -1;
+		}
+
+		r->headers = headers;
+		r->capacity = capacity;
+	}
+
+	r->buf[key_end] = '\0';
+	r->buf[val_end] = '\0';
+
+	struct http_header *h = &r->headers[r->count];
+	h->key_offset = key_start;
+	h->key_length = key_end - key_start;
+	h->val_offset = val_start;
+	h->val_length = val_end - val_start;
+	h->id = known_header_id(r->buf + key_start, key_end - key_start);
+	h->next = -1;
+
+	/* Headers with the same id are linked (in the order they were received) */
+	if(h->id != HDR_OTHER)
+	{
+		if(r->last[h->id] >= 0)
+			r->headers[r->last[h->id]].next = r->count;
+		else
+			r->first[h->id] = r->count;
+
+		r->last[h->id] = r->count;
+	}
+
+	r->count ++;
+	return 0;
+}
+
+/* Handles one header line buf[start .. end) (without CRLF) */
+static int parse_header_line(struct http_response *r, size_t start, size_t end)
+{
+	char *buf = r->buf;
+
+	/* Remove the whitespace at the end of line */
+	while(end > start && (buf[end - 1] == ' ' || buf[end - 1] == '\t'))
+		end --;
+
+	// If the string starts with space or tabulation, then
+	// it is a continuation of the previous HTTP header.
+	if(buf[start] == ' ' || buf[start] == '\t')
+	{
+		if(r->count == 0)
+		{
+			log_error("Server has sent a malformed _first_ HTTP header (starts with space or tabulation)");
+			return -1;
+		}
+
+		if(end == start)
+			return 0; // Nothing to append
+
+		/* The value is extended to the end of this line:
+			CRLF and whitespace between the two parts become spaces */
+		struct http_header *h = &r->headers[r->count - 1];
+		size_t i;
+		for(i = h->val_offset + h->val_length; i < start || buf[i] == ' ' || buf[i] == '\t'; i ++)
+			buf[i] = ' ';
+
+		buf[end] = '\0';
+		h->val_length = end - h->val_offset;
+
+		log_debug("Header '%s' continues on the next line: '%s'.", http_header_key(r, r->count - 1), http_header_value(r, r->count - 1));
+		return 0;
+	}
+
+	if(!r->colon)
+	{
+		log_error("Server has sent a malformed HTTP header (no colon).");
+		return -1;
+	}
+
+	size_t key_end = r->colon;
+	while(key_end > start && (buf[key_end - 1] == ' ' || buf[key_end - 1] == '\t'))
+		key_end --;
+
+	if(key_end == start)
+	{
+		log_error("Server has sent a malformed HTTP header (empty name).");
+		return -1;
+	}
+
+	// Remove the spaces after ':'
+	size_t val_start = r->colon + 1;
+	while(val_start < end && (buf[val_start] == ' ' || buf[val_start] == '\t'))
+		val_start ++;
+
+	return add_header(r, start, key_end, val_start, end);
+}
+
+ssize_t http_parse_response(struct http_response *r, char *buf, size_t length)
+{
+	size_t pos = r->scanned;
+	r->buf = buf;
+	pthread_once(&parser_once, parser_setup);
+
+	while(pos < length)
+	{
+		if(r->lineno > 0 && !r->colon)
+		{
+			/* The header name ends with the first colon */
+			pos = find_colon_or_lf(buf, pos, length);
+			if(pos == length)
+				break;
+
+			if(buf[pos] == ':')
+			{
+				r->colon = pos ++;
+				continue;
+			}
+		}
+		else
+		{
+			const char *lf = memchr(buf + pos, '\n', length - pos);
+			if(!lf)
+			{
+				pos = length;
+				break;
+			}
+			pos = lf - buf;
+		}
+
+		/* buf[pos] is '\n': the current line has ended */
+		size_t start = r->line_start, end = pos;
+		if(end > start && buf[end - 1] == '\r')
+			end --;
+
+		if(r->lineno == 0)
+		{
+			if(parse_status_line(r, start, end) < 0)
+				return -1;
+		}
+		else if(end == start)
+		{
+			/* Empty line: the end of headers */
+			r->scanned = pos + 1;
+			return pos + 1;
+		}
+		else if(parse_header_line(r, start, end) < 0)
+			return -1;
+
+		r->lineno ++;
+		r->line_start = pos + 1;
+		r->colon = 0;
+		pos ++;
+	}
+
+	r->scanned = pos;
+
+	if(r->scanned >= HTTP_MAX_HEADERS_SIZE)
+	{
+		log_error("HTTP response headers returned by server are too long (> %i bytes). Aborting (just in case).", HTTP_MAX_HEADERS_SIZE);
+		return -1;
+	}
+	return 0;
+}
+
+const char *find_header(const struct http_response *r, const char *name)
+{
+	int id = known_header_id(name, strlen(name));
+	if(id != HDR_OTHER)
+		return http_known_header(r, id);
+
+	int i;
+	for(i = 0; i < r->count; i ++)
+	{
+		if(!strcasecmp(http_header_key(r, i), name))
+			return http_header_value(r, i);
+	}
+	return NULL;
+}
+
+/* Finds the next element of comma-separated list (e.g. "gzip, chunked").
+	Returns its length (and "*token" points to it), or 0 at the end of list. */
+static size_t next_token(const char **p, const char **token)
+{
+	const char *s = *p;
+	while(isspace(*s) || *s == ',')
+		s ++;
+
+	const char *end = s;
+	while(*end != '\0' && *end != ',')
+		end ++;
+
+	*p = end;
+	*token = s;
+
+	while(end > s && isspace(end[-1]))
+		end --;
+	return end - s;
+}
+
+int header_has_token(const char *value, const char *token)
+{
+	size_t token_len = strlen(token);
+	const char *p = value, *t;
+	size_t len;
+
+	while((len = next_token(&p, &t)) > 0)
+	{
+		if(len == token_len && !strncasecmp(t, token, token_len))
+			return 1;
+	}
+	return 0;
+}
+
+int http_known_header_has_token(const struct http_response *r, enum http_known_header id, const char *token)
+{
+	int i;
+	for(i = r->first[id]; i >= 0; i = r->headers[i].next)
+	{
+		if(header_has_token(http_header_value(r, i), token))
+			return 1;
+	}
+	return 0;
+}
+
+int get_body_framing(const struct http_response *r, struct body_framing *framing)
+{
+	/*
+		We don't need to support all headers.
+		Transfer-Encoding and Content-Length are enough.
+	*/
+	framing->len = 0;
+	framing->is_chunked = 0;
+	framing->no_length = 0;
+
+	/* These responses never have a body (even if they have Content-Length) */
+	if(r->code == 204 || r->code == 304 || r->code < 200)
+		return 0;
+
+	int i;
+	int transfer_encoding = r->first[HDR_TRANSFER_ENCODING];
+	int content_length = r->first[HDR_CONTENT_LENGTH];
+
+	if(transfer_encoding < 0) /* When Transfer-Encoding exists, we must ignore Content-Length */
+	{
+		if(content_length < 0)
+		{
+			log_warn("Server has responded without both Content-Length and Transfer-Encoding headers.");
+
+			framing->no_length = 1;
+			framing->len = (unsigned long) -1; // = very-very long
+			return 0;
+		}
+
+		/* There can be several Content-Length headers, but they must be the same */
+		for(i = content_length; i >= 0; i = r->headers[i].next)
+		{
+			const char *value = http_header_value(r, i);
+			char *end;
+
+			errno = 0;
+			unsigned long len = strtoul(value, &end, 10);
+
+			if(errno || end == value || *end != '\0' || !isdigit(*value))
+			{
+				log_error("Malformed Content-Length response header: not a number.");
+				return -1;
+			}
+
+			if(i != content_length && len != framing->len)
+			{
+				log_error("Server has sent several different Content-Length headers.");
+				return -1;
+			}
+			framing->len = len;
+		}
+		return 0;
+	}
+
+	if(content_length >= 0)
+		log_warn("Received both Transfer-Encoding and Content-Length. Ignoring the latter per RFC2616.");
+
+	/* Per HTTP/1.1, the client must support chunked. We only support chunked. */
+	for(i = transfer_encoding; i >= 0; i = r->headers[i].next)
+	{
+		const char *p = http_header_value(r, i), *token;
+		size_t len;
+
+		while((len = next_token(&p, &token)) > 0)
+		{
+			if(len == 7 && !strncasecmp(token, "chunked", 7))
+				framing->is_chunked = 1;
+			else if(!(len == 8 && !strncasecmp(token, "identity", 8)))
+			{
+				log_error("Server has requested transfer encoding \"%s\", we can't use that. Only 'chunked' transfer encoding is supported.", http_header_value(r, i));
+				return -1;
+			}
+		}
+	}
+
+	if(framing->is_chunked)
+		log_info("Server is using chunked transfer-encoding");
+	else
+	{
+		/* Not chunked: the body ends when the connection is closed */
+		framing->no_length = 1;
+		framing->len = (unsigned long) -1;
+	}
+	return 0;
+}
+
+int is_keep_alive(const struct http_response *r)
+{
+	// HTTP/1.0 connections are not persistent by default
+	int keep_alive = strcmp(r->proto, "HTTP/1.0") != 0;
+
+	if(http_known_header_has_token(r, HDR_CONNECTION, "close"))
+		keep_alive = 0;
+	else if(http_known_header_has_token(r, HDR_CONNECTION, "keep-alive"))
+		keep_alive = 1;
+
+	return keep_alive;
+}
+
+int get_content_range(const struct http_response *r, struct content_range *range)
+{
+	const char *value = http_known_header(r, HDR_CONTENT_RANGE);
+	if(!value)
+		return -1;
+
+	if(strncasecmp(value, "bytes", 5) || !isspace((unsigned char) value[5]))
+		return -1;
+
+	const char *p = value + 6;
+	char *end;
+
+	while(isspace((unsigned char) *p))
+		p ++;
+	if(!isdigit((unsigned char) *p))
+		return -1;
+	range->first = strtoull(p, &end, 10);
+	if(*end != '-' || !isdigit((unsigned char) end[1]))
+		return -1;
+
+	range->last = strtoull(end + 1, &end, 10);
+	if(*end != '/' || range->last < range->first)
+		return -1;
+
+	p = end + 1;
+	if(*p == '*' && p[1] == '\0')
+	{
+		range->total = (unsigned long long) -1;
+		return 0;
+	}
+
+	if(!isdigit((unsigned char) *p))
+		return -1;
+	range->total = strtoull(p, &end, 10);
+	if(*end != '\0' || range->last >= range->total)
+		return -1;
+
+	return 0;
+}
+
+/* Parses the date in HTTP format ("Sun, 06 Nov 1994 08:49:37 GMT"). Returns -1 if malformed. */
+static time_t parse_http_date(const char *value)
+{
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+
+	const char *end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if(!end || *end != '\0')
+		return -1;
+
+	return timegm(&tm);
+}
+
+long long http_freshness_lifetime(const struct http_response *r)
+{
+	long long lifetime = HTTP_LIFETIME_UNKNOWN;
+	int i;
+
+	if(http_known_header_has_token(r, HDR_CACHE_CONTROL, "no-store"))
+		return HTTP_LIFETIME_NO_STORE;
+
+	if(http_known_header_has_token(r, HDR_CACHE_CONTROL, "no-cache"))
+		return 0;
+
+	/* max-age=N (overrides Expires) */
+	for(i = r->first[HDR_CACHE_CONTROL]; i >= 0 && lifetime == HTTP_LIFETIME_UNKNOWN; i = r->headers[i].next)
+	{
+		const char *p = http_header_value(r, i);
+		while(*p)
+		{
+			p += strspn(p, " \t,");
+			if(!strncasecmp(p, "max-age=", 8))
+			{
+				p += 8;
+				if(*p == '"')
+					p ++;
+				if(isdigit((unsigned char) *p))
+					lifetime = strtoll(p, NULL, 10);
+				break;
+			}
+			p += strcspn(p, ",");
+		}
+	}
+
+	if(lifetime == HTTP_LIFETIME_UNKNOWN)
+	{
+		const char *expires = http_known_header(r, HDR_EXPIRES);
+		if(!expires)
+			return HTTP_LIFETIME_UNKNOWN;
+
+		/* Relative to the server's Date (our clock can be different) */
+		const char *date = http_known_header(r, HDR_DATE);
+		time_t now = date ? parse_http_date(date) : -1;
+		if(now < 0)
+			now = time(NULL);
+
+		time_t expires_time = parse_http_date(expires);
+		lifetime = expires_time > now ? expires_time - now : 0; // Malformed Expires means "already expired"
+	}
+
+	/* Age: how long the response has already been in other caches */
+	const char *age = http_known_header(r, HDR_AGE);
+	if(age && isdigit((unsigned char) *age))
+		lifetime -= strtoll(age, NULL, 10);
+
+	return lifetime > 0 ? lifetime : 0;
+}
@@ -0,0 +1,228 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_HTTP_H
+#define HTTP_CLIENT_HTTP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "arena.h"
+
+/* Helpers for parsing URLs and HTTP responses,
+	shared by the single-request mode and the batch mode */
+
+extern const unsigned max_redirects;
+extern const char *appname;
+extern const char *appversion;
+
+#define HTTP_MAX_HEADERS_SIZE (1024 * 1024) // sanity limit for the sum length of all HTTP headers
+#define HTTP_HEADERS_BUFFER_SIZE 16384 // initial size of buffer for headers (it grows when needed)
+#define MAX_DRAIN_LENGTH 65536 // longer bodies of redirects are not read (connection is closed instead)
+
+struct http_url {
+	int tls; // 1 for https://
+	char *host; // "example.com"
+	const char *port; // "80" (or "443" for https://)
+	const char *path; // "some/path" (without the leading slash)
+};
+
+/* Splits "URL" into host, port and path. Modifies "URL" in place.
+	Returns 0 on success, EINVAL if the URL is not supported. */
+int parse_url(char *URL, struct http_url *u);
+
+/* Returns 1 if the port of "u" is the default one for its scheme (then it's not written in Host, etc.) */
+int is_default_port(const struct http_url *u);
+
+/* "http" or "https" */
+const char *url_scheme(const struct http_url *u);
+
+/* Returns the normalized URL (in "arena", NULL if out of memory):
+	lowercase host, no default port, no fragment. */
+char *url_normalize(struct arena *arena, const struct http_url *u);
+
+/*
+	Returns the absolute URL (in "arena", NULL if out of memory)
+	which Location header "location" means in response to "base":
+	absolute URL, "//host/path", "/path", "relative/path" or "?query"
+	(with "." and ".." segments removed).
+*/
+char *resolve_location(struct arena *arena, const struct http_url *base, const char *location);
+
+/* Formats the GET request for "u" into "*request" (allocated in "arena").
+	Returns the length of request or -1 if out of memory. */
+int format_request(struct arena *arena, char **request, const struct http_url *u);
+
+/* Same as format_request(), but with the given method (e.g. "PUT"), value of Accept-Encoding
+	and "extra_headers" ("Name: value\r\n" lines, can be empty). */
+int format_request_with(struct arena *arena, char **request, const char *method, const struct http_url *u,
+	const char *accept_encoding, const char *extra_headers);
+
+/* Same as format_request(), but asks for bytes [first, last] of the resource
+	("last" = -1 means "until the end"), without Content-Encoding
+	(ranges must be the offsets in the file, not in the compressed stream).
+	If "if_range" is not NULL (ETag or Last-Modified), it's sent in If-Range:
+	if the resource has changed, the server will return all of it (200). */
+int format_range_request(struct arena *arena, char **request, const struct http_url *u,
+	unsigned long long first, unsigned long long last, const char *if_range);
+
+/* Same as format_request(), but the response is requested only if it differs
+	from the cached copy with these validators (either can be NULL):
+	otherwise the server answers "304 Not Modified" without a body. */
+int format_conditional_request(struct arena *arena, char **request, const struct http_url *u,
+	const char *etag, const char *last_modified);
+
+/*
+	Headers that we are interested in. They are recognized by the parser
+	(via perfect hash, see http.c), so finding them doesn't require a search.
+*/
+enum http_known_header {
+	HDR_CACHE_CONTROL,
+	HDR_CONNECTION,
+	HDR_CONTENT_ENCODING,
+	HDR_CONTENT_LENGTH,
+	HDR_CONTENT_RANGE,
+	HDR_CONTENT_TYPE,
+	HDR_DATE,
+	HDR_ETAG,
+	HDR_EXPIRES,
+	HDR_LAST_MODIFIED,
+	HDR_LOCATION,
+	HDR_TRANSFER_ENCODING,
+	HDR_ACCEPT_RANGES,
+	HDR_AGE,
+	HDR_KNOWN_COUNT,
+
+	HDR_OTHER = -1
+};
+
+/*
+	One header of the response. Key and value are not copied anywhere:
+	they are offsets in the buffer which was given to http_parse_response()
+	(offsets, not pointers, because this buffer can be reallocated while
+	the headers are being received). Both are zero-terminated in the buffer.
+*/
+struct http_header {
+	uint32_t key_offset, key_length; // as sent by server (not lowercased)
+	uint32_t val_offset, val_length; // without leading/trailing whitespace
+	int id; // HDR_* or HDR_OTHER
+	int next; // index of the next header with the same id (if id != HDR_OTHER), -1 if none
+};
+
+struct http_response {
+	char proto[10]; // "HTTP/1.1"
+	unsigned short code;
+	uint32_t status_offset; // e.g. "Not Found"
+
+	struct http_header *headers; // in "arena"
+	struct arena *arena;
+	int count;
+	int capacity;
+	int first[HDR_KNOWN_COUNT]; // index of the first header with this id, -1 if none
+	int last[HDR_KNOWN_COUNT];
+
+	/* State of the parser (headers can arrive in several parts) */
+	char *buf;
+	size_t scanned; // buf[0 .. scanned) has been parsed
+	size_t line_start;
+	size_t colon; // position of ':' in the current line, 0 if not found yet
+	int lineno;
+};
+
+/* Prepares "r" for parsing a new response. The array of headers is allocated
+	in "arena" (it's not freed separately). */
+void http_response_init(struct http_response *r, struct arena *arena);
+
+/*
+	Parses the status line and headers in buf[0 .. length) in one pass.
+	If the headers are incomplete, call this again when more data arrives:
+	buf[] must contain the same data (it may have been moved by realloc)
+	plus new data. Parsing continues from where it stopped.
+
+	Returns the offset of the first byte of body (after the empty line),
+	0 if more data is needed, -1 if the response is malformed
+	(the error is printed). Modifies the header lines in buf[] in place.
+*/
+ssize_t http_parse_response(struct http_response *r, char *buf, size_t length);
+
+static inline const char *http_header_key(const struct http_response *r, int idx)
+{
+	return r->buf + r->headers[idx].key_offset;
+}
+
+static inline const char *http_header_value(const struct http_response *r, int idx)
+{
+	return r->buf + r->headers[idx].val_offset;
+}
+
+static inline const char *http_status_text(const struct http_response *r)
+{
+	return r->buf + r->status_offset;
+}
+
+/* Returns the value of the (first) header with this id or NULL */
+static inline const char *http_known_header(const struct http_response *r, enum http_known_header id)
+{
+	return r->first[id] >= 0 ? http_header_value(r, r->first[id]) : NULL;
+}
+
+/* Returns the value of the (first) header called "name" (case-insensitive) or NULL */
+const char *find_header(const struct http_response *r, const char *name);
+
+/* Returns 1 if comma-separated list "value" (e.g. "Connection" header)
+	contains "token" (case-insensitive), 0 otherwise. */
+int header_has_token(const char *value, const char *token);
+
+/* Same as header_has_token(), but looks into all headers with this id */
+int http_known_header_has_token(const struct http_response *r, enum http_known_header id, const char *token);
+
+/* How to find where the response body ends */
+struct body_framing {
+	unsigned long len; // Content-Length
+	int is_chunked; // 1 if "Transfer-Encoding: chunked"
+	int no_length; // 1 if there is neither "Transfer-Encoding: chunked" nor "Content-Length"
+};
+
+/* Determines the body framing from headers.
+	Returns 0 on success, -1 if the headers are malformed or unsupported. */
+int get_body_framing(const struct http_response *r, struct body_framing *framing);
+
+/* Returns 1 if the connection can be reused after this response, 0 otherwise */
+int is_keep_alive(const struct http_response *r);
+
+/* Range of bytes in the response with code 206 (Partial Content) */
+struct content_range {
+	unsigned long long first, last; // inclusive
+	unsigned long long total; // length of the whole resource, -1 if unknown ("*")
+};
+
+/* Parses "Content-Range: bytes FIRST-LAST/TOTAL".
+	Returns 0 on success, -1 if the header is missing or malformed. */
+int get_content_range(const struct http_response *r, struct content_range *range);
+
+/* Lifetimes returned by http_freshness_lifetime() */
+#define HTTP_LIFETIME_NO_STORE -1 // Cache-Control: no-store
+#define HTTP_LIFETIME_UNKNOWN -2 // no Cache-Control or Expires
+
+/*
+	Returns how long (in seconds) the response stays fresh after it has been received:
+	0 if it must be revalidated every time, HTTP_LIFETIME_NO_STORE if it must not be cached,
+	HTTP_LIFETIME_UNKNOWN if the server didn't say. Based on Cache-Control (no-store,
+	no-cache, max-age), Expires, Date and Age.
+*/
+long long http_freshness_lifetime(const struct http_response *r);
+
+#endif
@@ -15,891 +15,927 @@
 
 #define _GNU_SOURCE
 
+#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <netdb.h>
-#include <signal.h>
 #include <fcntl.h>
-#include <poll.h>
-#include <ctype.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/time.h>
 #include <unistd.h>
 
-const unsigned request_timeout = 60; // in seconds
-const unsigned max_redirects = 7;
-const char *appname = "http_client";
-const char *appversion = "0.1";
-#define MAX_HTTP_HEADERS_LENGTH 4096 // maximum sum length of all HTTP headers
-#define MAX_HTTP_HEADERS_COUNT 100
-
-struct http_header {
-	char *key;
-	char *val;
-
-	int val_must_be_freed; // 0 if 'val' points to a static buffer, 1 if it was malloc()-ed
-};
-unsigned redirect_nr = 0;
+#include "httpclient.h"
+#include "http.h"
+#include "pool.h"
+#include "dns.h"
+#include "transfer.h"
+#include "batch.h"
+#include "segmented.h"
+#include "resume.h"
+#include "cache.h"
+#include "timing.h"
+#include "deadline.h"
+#include "uring.h"
+#include "tls.h"
+#include "redirect.h"
+#include "digest.h"
+#include "output.h"
+#include "log.h"
+
+const unsigned max_retry_delay_ms = 10000;
+
+unsigned retries_left = 0; // -r: how many times to resume the interrupted download
+unsigned retry_delay_ms = 250; // doubled after each retry (up to max_retry_delay_ms)
+
+/* Timing of the request (including all redirect hops), see report_timing() */
+struct request_timing timing;
+struct transfer_stats transfer_before; // transfer_stats before the request
+char *request_url; // URL from the command line
+int request_succeeded = 0;
+
+/* Request other than GET (-X, -H, -u) */
+const char *request_method = "GET";
+char *request_headers = NULL; // "Name: value\r\n" lines
+size_t request_headers_length = 0;
+int upload_fd = -1; // -u: the request body is sent from this file
+unsigned long long upload_length;
+
+/* -V: algorithm (DIGEST_NONE if the download is not verified) and the expected value
+	(if its size is 0, the value is taken from Repr-Digest or Digest header of the response) */
+struct digest_value verify_digest;
 
-void free_headers(struct http_header *HEADERS, int HEADERS_count)
+void print_usage()
 {
-	int i;
-	for(i = 0; i < HEADERS_count; i ++)
-	{
-		if(HEADERS[i].val_must_be_freed)
-			free(HEADERS[i].val);
-	}
+	fprintf(stderr, "Usage: %s [-C DIR] [-D FILE] [-R FILE] [-T FILE] [-t TIMEOUTS] [-c CAFILE] [-U] [-s CONNECTIONS] [-r RETRIES]\n", appname);
+	fprintf(stderr, "       %*s [-X METHOD] [-H HEADER]... [-u FILE] [-V ALGORITHM[:HEX]] [-o PATH] [-d] URL\n", (int) strlen(appname), "");
+	fprintf(stderr, "       %s [-C DIR] [-D FILE] [-R FILE] [-T FILE] [-t TIMEOUTS] -i FILE [-j CONCURRENCY] [-p DEPTH] [-w THREADS] [-2]\n", appname);
+	fprintf(stderr, "       %*s [-V ALGORITHM] [-o PATH] [-d]\n", (int) strlen(appname), "");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -C DIR   Keep responses in DIR (cache): fresh ones are used without requests,\n");
+	fprintf(stderr, "           stale ones are revalidated (If-None-Match, If-Modified-Since).\n");
+	fprintf(stderr, "  -D FILE  Keep resolved addresses of hostnames in FILE (DNS cache) between runs.\n");
+	fprintf(stderr, "  -R FILE  Keep permanent redirects (301, 308) in FILE between runs: next time\n");
+	fprintf(stderr, "           the request goes straight to the target.\n");
+	fprintf(stderr, "  -T FILE  Append timing of each request (DNS, connect, time to first byte, etc.)\n");
+	fprintf(stderr, "           to FILE as JSON, one record per line (default: print to stderr).\n");
+	fprintf(stderr, "  -t connect=S,first-byte=S,idle=S,total=S\n");
+	fprintf(stderr, "           Timeouts in seconds, 0 - no limit (default: connect=10,first-byte=30,idle=30,total=60).\n");
+	fprintf(stderr, "  -c FILE  Trust the certificates in FILE (PEM) for https:// URLs, in addition to the system ones.\n");
+	fprintf(stderr, "  -U       Receive large bodies via io_uring (if built with \"make IO_URING=1\").\n");
+	fprintf(stderr, "  -s N     Download the file via N connections at once, each receiving its part\n");
+	fprintf(stderr, "           (if the server supports Range requests).\n");
+	fprintf(stderr, "  -r N     If the connection breaks or stalls, resume the download up to N times.\n");
+	fprintf(stderr, "           (Interrupted download is also resumed by the next run, see http.out.resume)\n");
+	fprintf(stderr, "  -X M     Request method, e.g. HEAD, POST, PUT, DELETE (default: GET, or PUT with -u).\n");
+	fprintf(stderr, "  -H H     Additional request header, e.g. -H \"Content-Type: text/plain\" (can be repeated).\n");
+	fprintf(stderr, "  -u FILE  Upload FILE as the request body (via sendfile(), large files are sent\n");
+	fprintf(stderr, "           only after the server has answered \"100 Continue\").\n");
+	fprintf(stderr, "  -o PATH  Save the response into PATH (default: http.out), or into PATH/http.out\n");
+	fprintf(stderr, "           if PATH is a directory. In batch mode, N-th response is saved into PATH.N.\n");
+	fprintf(stderr, "  -d       Write the output files with O_DIRECT (bypassing the page cache),\n");
+	fprintf(stderr, "           in large aligned blocks.\n");
+	fprintf(stderr, "  -V sha256[:HEX], -V crc32c[:HEX]\n");
+	fprintf(stderr, "           Verify the integrity of the downloaded file: it's hashed while it's written\n");
+	fprintf(stderr, "           and compared with HEX, or with Repr-Digest (Digest) header of the response\n");
+	fprintf(stderr, "           if HEX is not given. The download fails if they are different.\n");
+	fprintf(stderr, "  -i FILE  Batch mode: fetch all URLs listed in FILE (one per line, \"-\" for stdin).\n");
+	fprintf(stderr, "           Response to N-th URL is saved into 'http.out.N'.\n");
+	fprintf(stderr, "  -j N     Batch mode: perform up to N requests simultaneously (default: 8).\n");
+	fprintf(stderr, "  -p N     Batch mode: send up to N requests to the same host via one connection\n");
+	fprintf(stderr, "           without waiting for responses (HTTP pipelining, default: 1 - disabled).\n");
+	fprintf(stderr, "  -2       Batch mode: use HTTP/2 without TLS (the server must support h2c): requests\n");
+	fprintf(stderr, "           to the same host are sent as concurrent streams of one connection.\n");
+	fprintf(stderr, "  -w N     Batch mode: perform the requests in N threads, each with its own event loop\n");
+	fprintf(stderr, "           (0 - one per CPU, default: 1).\n");
+	exit(1);
 }
 
-int compare_headers_cb(const void *a, const void *b)
+/* Value of the numeric option (-j, -p, -r, -s, -w). Prints the usage if it's not a number or less than "min". */
+unsigned parse_number(const char *value, unsigned min)
 {
-	return strcmp(
-		((struct http_header *) a)->key,
-		((struct http_header *) b)->key
-	);
-}
+	char *end;
+	errno = 0;
+	unsigned long number = strtoul(value, &end, 10);
 
+	/* strtoul() would accept "-3" (as a huge number) and " 3" */
+	if(!isdigit((unsigned char) *value) || *end != '\0' || errno == ERANGE || number > UINT_MAX || number < min)
+		print_usage();
+	return number;
+}
 
-char *find_header(
-	struct http_header *HEADERS,
-	int HEADERS_count,
+/* State of the download into "filename" (see download_file()) */
+struct download {
+	const char *url; // from the command line
+	const char *filename;
+	int fout; // -1 if the file is not opened
+	int plain_get; // 1 if it's GET without a body: only such responses are resumed and cached
+
+	/* Partially downloaded file (see resume.c) */
+	struct resume_info resume;
+	unsigned long long resume_offset; // 0 if it can't be resumed
+	unsigned long long offset; // where the body starts in the output file
+	int resumable; // 1 if we're keeping the sidecar
+
+	/* On-disk cache (see cache.c) */
+	struct arena *arena; // for the cache key
+	char *cache_key; // NULL if the cache is disabled
+	struct cache_entry cache_entry; // stale entry (we're revalidating it), url is NULL if none
+
+	int restart; // partially downloaded file can't be resumed: download all of it
+	int not_modified; // 304: the body must be taken from the cache
+	int complete; // nothing to receive (e.g. we already have all of it)
+	int failed; // error has already been reported
+	int interrupted; // body has stalled or timed out (-t idle/total): it can be resumed like an incomplete one
+
+	/* -V: the body is hashed as it's written (see httpc_options.digest) */
+	struct digest digest;
+	struct digest_value header_digest; // from Repr-Digest or Digest header (size is 0 if none)
+};
 
-	// "header_name_normalized" must be completely in lowercase
-	char *header_name_normalized)
+/*
+	-V: compares the digest of "filename" with the expected one: from the command line,
+	otherwise "from_headers" (can be NULL). Returns 0 if it matches (or there is nothing
+	to compare with), -1 if it doesn't.
+*/
+int check_digest(struct digest *digest, const struct digest_value *from_headers, const char *filename)
 {
-	struct http_header query;
-	query.key = header_name_normalized;
+	struct digest_value actual;
+	char hex[DIGEST_HEX_SIZE], expected_hex[DIGEST_HEX_SIZE];
 
-	struct http_header *h = (struct http_header *) bsearch(&query, HEADERS, HEADERS_count, sizeof(HEADERS[0]), compare_headers_cb);
-	return h ? h->val : NULL;
-}
-void print_usage()
-{
-	fprintf(stderr, "Usage: %s URL\n", appname);
-	exit(1);
+	digest_final(digest, &actual);
+	fprintf(stderr, "[info] %s of %s is %s\n", digest_name(actual.algorithm), filename, digest_format(&actual, hex));
+
+	const struct digest_value *expected = verify_digest.size ? &verify_digest : from_headers;
+	if(!expected || !expected->size)
+	{
+		fprintf(stderr, "[warn] Server hasn't sent %s in Repr-Digest or Digest header: %s is not verified.\n",
+			digest_name(actual.algorithm), filename);
+		return 0;
+	}
+
+	if(!digest_equal(&actual, expected))
+	{
+		fprintf(stderr, "[error] %s is corrupted: its %s should be %s (%s)\n", filename, digest_name(actual.algorithm),
+			digest_format(expected, expected_hex), expected == &verify_digest ? "-V" : "from the response headers");
+		return -1;
+	}
+
+	fprintf(stderr, "[notice] %s of %s matches the expected one.\n", digest_name(actual.algorithm), filename);
+	return 0;
 }
-void timeout_handler(int unused __attribute__((unused)))
+
+/* -V: verifies the file which wasn't received just now (e.g. taken from the cache). Returns 0 on success, -1 on error. */
+int verify_file(const char *filename)
 {
-	fprintf(stderr, "[error] Timeout\n");
-	exit(1);
+	struct digest digest;
+	digest_init(&digest, verify_digest.algorithm);
+
+	if(digest_file(&digest, filename, ULLONG_MAX) < 0)
+	{
+		fprintf(stderr, "[error] Failed to read %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	return check_digest(&digest, NULL, filename);
 }
 
-/* separate_CRLF
-	- looks at "string" and detects "\n", "\r" or
-		their combination ("\r\n" or "\n\r")
-	- replaces first of those detected symbols with \0
-	- returns the pointer to the first byte after CRLF
-	- returns NULL if neither \r nor \n were found
+/*
+	Finds out whether "filename" is a partially downloaded "URL" (see resume.c).
+	Returns the offset from which the download can be resumed
+	(0 if it can't be resumed). "resume" receives the contents of the sidecar.
 */
-char *separate_CRLF(char *string)
+unsigned long long find_resume_offset(const char *filename, const char *URL, struct resume_info *resume)
 {
-	char *p = strpbrk(string, "\r\n");
-	if(!p)
-		return NULL;
+	if(resume_load(filename, resume) < 0)
+		return 0;
 
-	char c = *p;
-	*p = '\0'; // mark the end of the string
-
-	p ++;
+	struct stat st;
+	if(strcmp(resume->url, URL) || stat(filename, &st) < 0)
+		return 0;
 
-	// if \r is followed by \n (or vice versa), then ignore the second symbol
-	if((c == '\n' && *p == '\r') || (c == '\r' && *p == '\n'))
-		p ++;
+	// Bytes beyond "received" might not have been written completely
+	unsigned long long offset = st.st_size;
+	if(resume->received < offset)
+		offset = resume->received;
 
-	return p;
+	return offset;
 }
 
-/* If "string" starts with CRLF, returns a pointer to whatever is after CRLF.
-	Otherwise returns "string".
-	No more than one CRLF is skipped (because CRLF can be followed
-	by binary data).
-*/
-
-char *strip_first_CRLF(char *string)
+/* Copies the cached response into "filename" (instead of receiving it).
+	Returns 0 on success, -1 on error. */
+int save_cached_response(const char *key, const struct cache_entry *entry, const char *filename)
 {
-	if(*string == '\r')
-	{
-		string ++;
-		if(*string == '\n') string ++;
-	}
-	else if(*string == '\n')
+	if(cache_copy_body(key, filename) < 0)
 	{
-		string ++;
-		if(*string == '\r') string ++;
+		fprintf(stderr, "[error] Failed to copy the cached response into \"%s\": %s\n", filename, strerror(errno));
+		return -1;
 	}
-	return string;
-}
+	resume_remove(filename); // It's complete
 
-/*
-	Helper method to read the response body.
-	Unlike in the usual sendfile(), "in_fd" here can be a socket.
+	timing_mark(&timing, TIMING_BODY);
+	fprintf(stderr, "[notice] File received from the cache (saved to %s)\n", filename);
+	fprintf(stderr, "[info] %s is %llu bytes long\n", filename, entry->length);
+	return 0;
+}
 
-	Returns the number of NOT YET READ bytes (i.e. 0 if "count" bytes
-	have been read completely).
-*/
-size_t sendfile_from_socket(int out_fd, int in_fd, size_t count)
+/* Called with the headers of the final response: decides where its body goes */
+int download_on_headers(void *opaque, const struct httpc_response *r)
 {
-#define READ_BUFFER_SIZE 4096
-	char buffer[READ_BUFFER_SIZE];
+	struct download *d = opaque;
+	const struct http_response *response = httpc_response_parsed(r);
+	int code = httpc_response_code(r);
 
-	while(count)
+	if(d->resume_offset > 0 && code == 416)
 	{
-		size_t todo;
-		ssize_t bytes, written;
-
-		todo = count > READ_BUFFER_SIZE ? READ_BUFFER_SIZE : count;
-		bytes = read(in_fd, buffer, todo);
+		/* There is nothing after "resume_offset": either we already have all of it,
+			or the file has become shorter (then it's downloaded again) */
+		const char *content_range = http_known_header(response, HDR_CONTENT_RANGE);
+		unsigned long long total = d->resume.length;
+		if(content_range)
+			sscanf(content_range, "bytes */%llu", &total);
+
+		if(total != d->resume_offset)
+		{
+			fprintf(stderr, "[notice] File has changed on the server since the previous attempt, downloading all of it.\n");
+			d->restart = 1;
+			return HTTPC_ABORT;
+		}
 
-		if(bytes < 0)
+		if(truncate(d->filename, d->resume_offset) < 0)
 		{
-			fprintf(stderr, "read() failed: %s\n", strerror(errno));
-			exit(1);
+			fprintf(stderr, "[error] truncate(\"%s\") failed: %s\n", d->filename, strerror(errno));
+			d->failed = 1;
+			return HTTPC_ABORT;
 		}
+		resume_remove(d->filename);
 
-		written = write(out_fd, buffer, bytes);
-		if(written < bytes)
+		fprintf(stderr, "[notice] File has already been received completely (saved to %s)\n", d->filename);
+		d->complete = 1;
+		return HTTPC_SKIP_BODY;
+	}
+	if(code >= 400)
+	{
+		fprintf(stderr, "[error] Server returned HTTP error %i: %s\n", code, httpc_response_status(r));
+		d->failed = 1;
+		return HTTPC_ABORT;
+	}
+	if(code == 204)
+	{
+		fprintf(stderr, "[notice] Server has returned 204 No Content. There is nothing to save.\n");
+		d->complete = 1;
+		return HTTPC_SKIP_BODY;
+	}
+	if(code == 304)
+	{
+		if(!d->cache_entry.url)
 		{
-			fprintf(stderr, "write() failed: %s\n", strerror(errno));
-			exit(1);
+			fprintf(stderr, "[error] Server returned 304 Not Modified, but our request was not conditional.\n");
+			d->failed = 1;
+			return HTTPC_ABORT;
 		}
 
-		if(bytes == 0)
-			break;
+		fprintf(stderr, "[notice] Not modified since it was cached.\n");
+		if(cache_refresh(&d->cache_entry, response) < 0)
+			fprintf(stderr, "[warn] Failed to update the cache: %s\n", strerror(errno));
 
-		count -= bytes;
+		d->not_modified = 1;
+		return HTTPC_SKIP_BODY;
 	}
-	return count;
-}
+	if(d->cache_entry.url)
+		cache_stats.misses ++; // Stale entry has changed on the server
 
-void perform_http_request(char *URL)
-{
-	struct http_header HEADERS[MAX_HTTP_HEADERS_COUNT];
-	int HEADERS_count = 0;
+	if(code >= 300) /* Redirects with Location have been followed by httpc_get() */
+	{
+		fprintf(stderr, "[error] Server returned redirect (%i) without Location\n", code);
+		d->failed = 1;
+		return HTTPC_ABORT;
+	}
 
-	memset(&HEADERS, 0, sizeof(HEADERS));
+	/* Did we get the remaining part of the partially downloaded file? */
+	unsigned long long total_length = RESUME_UNKNOWN;
+	if(httpc_response_content_length(r) >= 0)
+		total_length = httpc_response_content_length(r);
 
-	int i, j; // temporary variables for loops
-	char *p; // temporary pointer used when parsing URLs
-	char *begin = URL;
+	if(d->resume_offset > 0)
+	{
+		struct content_range range;
+		if(code != 206)
+			fprintf(stderr, "[notice] File has changed on the server since the previous attempt, downloading all of it.\n");
+		else if(get_content_range(response, &range) < 0 || range.first != d->resume_offset || httpc_response_decompressed(r))
+		{
+			fprintf(stderr, "[warn] Server has returned a wrong part of the file, downloading all of it.\n");
+			d->restart = 1;
+			return HTTPC_ABORT;
+		}
+		else
+		{
+			fprintf(stderr, "[notice] Resuming the download from byte %llu.\n", d->resume_offset);
+			d->offset = d->resume_offset;
+			total_length = range.total;
+		}
+	}
+	resume_free(&d->resume);
+
+	/* Open the output file (httpc_get() will write the body into it) after the part
+		we already have. Space for the rest is allocated if its length is known. */
+	long long length = -1;
+	if(total_length != RESUME_UNKNOWN && total_length >= d->offset && !httpc_response_decompressed(r))
+		length = total_length - d->offset;
 
-	p = strchr(begin, ':');
-	if(!p)
+	unsigned long long preallocated = output_stats.preallocated;
+	d->fout = output_open(d->filename, d->offset, length);
+	if(d->fout < 0)
 	{
-		fprintf(stderr, "[warn] No schema in URL, assuming HTTP.\n");
-		p = begin;
+		fprintf(stderr, "[error] open(\"%s\") failed: %s\n", d->filename, strerror(errno));
+		d->failed = 1;
+		return HTTPC_ABORT;
 	}
+
+	if(output_stats.preallocated > preallocated)
+		fprintf(stderr, "[info] Opened \"%s\" for writing (%llu bytes allocated).\n", d->filename, output_stats.preallocated - preallocated);
 	else
+		fprintf(stderr, "[info] Opened \"%s\" for writing.\n", d->filename);
+
+	if(verify_digest.algorithm != DIGEST_NONE)
 	{
-		*p = '\0'; p ++;
-		if(strncmp(begin, "http", 4))
+		/* Resumed download: the part we already have is hashed first */
+		digest_init(&d->digest, verify_digest.algorithm);
+		if(d->offset > 0 && digest_file(&d->digest, d->filename, d->offset) < 0)
 		{
-bad_schema:
-			fprintf(stderr, "[error] Unsupported schema: '%s' in URL.\n", begin);
-			exit(EINVAL);
+			fprintf(stderr, "[error] Failed to read %s: %s\n", d->filename, strerror(errno));
+			d->failed = 1;
+			return HTTPC_ABORT;
 		}
-		else if(begin[4] != '\0')
+
+		/* Digest in the headers is of the representation (of the whole file, even in 206 response),
+			i.e. of the compressed data if there is Content-Encoding: then it can't be checked */
+		if(!httpc_response_decompressed(r))
 		{
-			if(begin[4] == 's' && begin[5] == '\0')
+			const char *header = find_header(response, "Repr-Digest");
+			if(!header || digest_parse_header(header, verify_digest.algorithm, &d->header_digest) < 0)
 			{
-				fprintf(stderr, "[error] HTTPS is not yet implemented.\n");
-				exit(ENOSYS);
+				header = find_header(response, "Digest");
+				if(header)
+					digest_parse_header(header, verify_digest.algorithm, &d->header_digest);
 			}
-			else goto bad_schema;
 		}
-
-		if(!strcmp(p, "//"))
-		{
-			fprintf(stderr, "[error] Malformed URL (no http://).\n");
-			exit(EINVAL);
-		}
-		p += 2;
 	}
 
-
-	begin = p; // "begin" points to the beginning of "example.com/some/path"
-	p = strchr(begin, '/'); // separate the host
-	if(p) {
-		*p = '\0';
-	}
-
-	char *host = begin; // points to "example.com" or "example.com:1234"
-	const char *path = p ? (p + 1) : ""; // points to "some/path"
-
-	// Convert the port from string to integer
-	p = strchr(host, ':');
-	const char *port;
-	if(p)
+	/* Remember where the file comes from (before receiving the body: if we're interrupted,
+		the next attempt will resume it). Decompressed body can't be resumed:
+		offsets in the file are not the offsets in the compressed response. */
+	if(d->plain_get && (code == 200 || d->offset > 0) && !httpc_response_decompressed(r) &&
+		resume_from_response(&d->resume, d->url, response, total_length) == 0)
 	{
-		port = p + 1;
-		*p = '\0'; // port is separated from the "host" string
+		if(resume_validator(&d->resume))
+		{
+			if(resume_save(d->filename, &d->resume) < 0)
+				fprintf(stderr, "[warn] Failed to save %s%s: %s\n", d->filename, RESUME_SUFFIX, strerror(errno));
+			else
+				d->resumable = 1;
+		}
 	}
-	else port = "80";
-
-	/* Convert "host" into IP address (unless it is already an address) */
+	if(!d->resumable)
+		resume_remove(d->filename); // Stale sidecar of another file
 
-	struct addrinfo hints;
-	struct addrinfo *ai;
-
-	memset(&hints, 0, sizeof(struct addrinfo));
-	hints.ai_family = AF_UNSPEC; /* Both IPv4 and IPv6 are acceptable */
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = 0;
-	hints.ai_protocol = 0;
+	return d->fout;
+}
 
-	int ret = getaddrinfo(host, port, &hints, &ai);
-	if(ret != 0)
+/* Called after the body has been received (completely or not) */
+void download_on_complete(void *opaque, const struct httpc_response *r, int result)
+{
+	struct download *d = opaque;
+	if(d->fout < 0)
+		return; // No body was needed
+
+	/* Corrupted file is not cached (and its sidecar is removed below, as after any complete download) */
+	int corrupted = 0;
+	if(result == HTTPC_OK && verify_digest.algorithm != DIGEST_NONE &&
+		check_digest(&d->digest, &d->header_digest, d->filename) < 0)
 	{
-		fprintf(stderr, "[error] Bad hostname or address: \"%s\": %s\n", host, gai_strerror(ret));
-		exit(1);
+		corrupted = 1;
+		d->failed = 1;
 	}
 
-	// "ai" is a linked list, but we don't need all results,
-	// we can just use the first
-	int sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-	if(sock < 0)
+	/* The end of the body may still be buffered (O_DIRECT, see output.h) */
+	if(output_close(d->fout) < 0)
 	{
-		fprintf(stderr, "[error] socket() failed: %s\n", strerror(errno));
-		exit(1);
+		fprintf(stderr, "[error] Failed to save the response body into %s: %s\n", d->filename, strerror(errno));
+		d->failed = 1;
+		result = HTTPC_ERR_IO;
 	}
+	d->fout = -1;
 
-	/* Timeout control */
-	signal(SIGALRM, timeout_handler);
-	alarm(request_timeout);
-
-	/* Debug code: how much time does each step take? */
-	struct timeval start;
-	gettimeofday(&start, NULL);
-
-#define SPENT() ({ \
-	struct timeval now; \
-	gettimeofday(&now, NULL); \
-	fprintf(stderr, "[info] Started %.4f seconds ago...\n", \
-		now.tv_sec - start.tv_sec + 0.000001 * (now.tv_usec - start.tv_usec) ); \
-})
+	/* The headers have been received, then the body has stalled */
+	d->interrupted = result == HTTPC_ERR_IDLE_TIMEOUT || result == HTTPC_ERR_TIMEOUT;
 
-	fprintf(stderr, "[info] Connecting to %s:%s...\n", host, port);
-	if(connect(sock, ai->ai_addr, ai->ai_addrlen) < 0)
+	if(result == HTTPC_OK && !corrupted && d->cache_key && d->offset == 0 && httpc_response_redirects(r) == 0 &&
+		cache_store(d->cache_key, httpc_response_parsed(r), d->filename) < 0)
 	{
-		fprintf(stderr, "[error] connect(%s:%s) failed: %s\n", host, port, strerror(errno));
- 		exit(1);
+		fprintf(stderr, "[warn] Failed to save the response into the cache: %s\n", strerror(errno));
 	}
-	SPENT();
-	freeaddrinfo(ai);
 
-	fprintf(stderr, "[info] Connected to %s:%s OK\n", host, port);
+	struct stat st;
+	st.st_size = 0;
+	if(stat(d->filename, &st) < 0)
+		fprintf(stderr, "[error] stat(\"%s\") failed: %s\n", d->filename, strerror(errno));
+
+	if(result != HTTPC_OK && result != HTTPC_INCOMPLETE && !d->interrupted)
+		return;
 
-	char *request;
-	int request_length = asprintf(&request,
-		"GET /%s HTTP/1.1\r\n"
-		"Host: %s\r\n"
-		"Connection: close\r\n"
-		"User-Agent: %s/%s\r\n"
-		"\r\n", path, host, appname, appversion);
-	if(request_length < 0)
+	if(d->interrupted)
+		fprintf(stderr, "[warn] Body transfer has timed out (%s), %li bytes received.\n", httpc_strerror(result), st.st_size);
+	else
 	{
-		fprintf(stderr, "[error] asprintf: memory allocation failed\n");
-		exit(1);
+		fprintf(stderr, "[notice] File received (saved to %s)\n", d->filename);
+		fprintf(stderr, "[info] %s is %li bytes long\n", d->filename, st.st_size);
 	}
 
-	fprintf(stderr, "[info] Sending request to server...\n");
-	fprintf(stderr, "[debug] Contents of HTTP request: [%s]\n", request);
-
-	write(sock, request, request_length);
-	free(request);
+	if(result != HTTPC_OK && verify_digest.algorithm != DIGEST_NONE)
+		fprintf(stderr, "[warn] %s is incomplete: its %s is not verified.\n", d->filename, digest_name(verify_digest.algorithm));
 
-	fprintf(stderr, "[info] Request sent OK.\n");
-	SPENT();
+	if(!d->resumable)
+		return;
 
-	/* Read the reply. Here we must put the socket into non-blocking mode,
-		because when we're reading headers, we can try to read more
-		than exists in the response, if the response is small enough
-		(less than MAX_HTTP_HEADERS_LENGTH). Which would cause timeout.
-	*/
-	if(fcntl(sock, F_SETFL, O_NONBLOCK) < 0)
+	if(result == HTTPC_OK)
 	{
-		fprintf(stderr, "[error] fcntl() failed: %s\n", strerror(errno));
-		exit(1);
+		resume_remove(d->filename);
+		return;
 	}
 
-	// We'll read into buffer[] until the first newline,
-	// then parse with simple strchr()-s
-	char buffer[MAX_HTTP_HEADERS_LENGTH + 1];
-	int lineno = 0;
-
-	// index of HTTP header we're currently reading in the HEADERS[] array
-	int header_idx = 0;
-
-	struct pollfd fds;
-	fds.fd = sock;
-	fds.events = POLLIN;
-
-	char *line = buffer; // Start of the current string (inside "buffer").
-
-	// Pointer to the byte in "buffer", into which we're going to read with
-	// the next read() call. Changes with each read().
-	char *buffer_offset = buffer;
+	d->resume.received = st.st_size;
+	if(resume_save(d->filename, &d->resume) < 0)
+		fprintf(stderr, "[warn] Failed to save %s%s: %s\n", d->filename, RESUME_SUFFIX, strerror(errno));
+	else
+		fprintf(stderr, "[notice] Download is incomplete (%li bytes received), it can be resumed.\n", st.st_size);
+}
 
-	unsigned short code; // HTTP response code
+void download_free(struct download *d)
+{
+	if(d->fout >= 0)
+		output_close(d->fout);
 
-	// Number of bytes of HTTP response body which we read prematurely
-	// (while reading HTTP headers). "line" pointer will point
-	// to the first byte of this data.
-	unsigned int prefetched_body_length;
-	char *p1;
+	resume_free(&d->resume);
+	cache_entry_free(&d->cache_entry);
+	if(d->arena)
+		arena_put(d->arena);
+}
 
-	while(1)
+/*
+	Downloads "URL" into "filename" (see struct download): resumes the partially
+	downloaded file, uses the cache, retries if the connection breaks (-r).
+	Returns 0 on success (including the incomplete body), -1 on error.
+*/
+int download_file(struct httpc_client *client, const char *URL, const char *filename)
+{
+	static const struct httpc_callbacks callbacks = { download_on_headers, NULL, download_on_complete };
+	struct download d;
+	int ret;
+
+again:
+	memset(&d, 0, sizeof(d));
+	d.url = URL;
+	d.filename = filename;
+	d.fout = -1;
+	d.plain_get = !strcmp(request_method, "GET") && upload_fd < 0;
+
+	/* Is this URL partially downloaded already? Then only the remaining part is requested,
+		unless the file has changed on the server (If-Range) */
+	if(d.plain_get)
+		d.resume_offset = find_resume_offset(filename, URL, &d.resume);
+
+	/* On-disk cache (see cache.c): fresh entry is used without requests, stale one is revalidated */
+	if(cache_enabled() && d.plain_get && d.resume_offset == 0)
 	{
-		if(poll(&fds, 1, -1) < 0) // no timeout needed, we did alarm()
-		{
-			fprintf(stderr, "[error] poll() failed: %s\n", strerror(errno));
-			exit(1);
-		}
+		struct http_url u;
+		char *url_copy; // parse_url() modifies it
 
-		int space_left_in_buffer = MAX_HTTP_HEADERS_LENGTH - (buffer_offset - buffer);
-		ssize_t bytes_received = read(sock, buffer_offset, space_left_in_buffer);
-		if(bytes_received < 0)
+		if(!(d.arena = arena_get()) || !(url_copy = arena_strdup(d.arena, URL)))
 		{
-			fprintf(stderr, "[error] read(sock) failed: %s\n", strerror(errno));
-			exit(1);
+			fprintf(stderr, "[error] arena: memory allocation failed\n");
+			goto failed;
 		}
-		if(bytes_received == 0) continue;
-
-
-#if 0 /* Debugging code. Here you can replace HTTP response with any text
-	and check how it is parsed */
 
-#warning "Debug code: real response substituted"
-		bytes_received = snprintf(buffer, MAX_HTTP_HEADERS_LENGTH, "HTTP/1.1 200 OK\nContent-Type: text/html; charset=UTF-8\nSome-Header: text123\n appendix to text123\nContent-Length: 112\nTransfer-Encoding: chunked\nTransfer-Encoding: something-else\nTransfer-Encoding: yet-another-line\nX-another: first line\nX-another: and yet another line\n\nINTERESTING CONTENT");
-
-		/* WARNING: debug */
-#endif
-
-		char *new_offset = buffer_offset + bytes_received;
-		*new_offset = '\0';
-
-		// 1) There're no newlines in whatever was in buffer[] before
-		// read() call, so we search from buffer_offset.
-		// 2) Line break can be \r, \n or their combination, so we
-		// check everything with separate_CRLF().
-
-check_buffer_for_newlines:
-		p1 = separate_CRLF(buffer_offset); /* points to the next line */
-		if(!p1) // no line breaks found
+		if(parse_url(url_copy, &u) == 0)
 		{
-			if(bytes_received == space_left_in_buffer)
+			d.cache_key = cache_key(d.arena, &u);
+			if(!d.cache_key)
 			{
-				// Server is doing something wrong:
-				// it sent a lot of stuff already,
-				// but HTTP headers still haven't ended yet
-
-				fprintf(stderr, "[error] HTTP response headers returned by server are too long (> %i bytes). Aborting (just in case).\n", MAX_HTTP_HEADERS_LENGTH);
-				exit(1);
+				fprintf(stderr, "[error] cache_key: memory allocation failed\n");
+				goto failed;
 			}
-
-			// return to poll(), server should sent the remainder of this string
-			buffer_offset = new_offset;
-			continue;
 		}
+	}
 
-		/* Handle the line */
-		fprintf(stderr, "[debug] Received line: \"%s\"\n", line);
-		if(lineno == 0)
-		{
-			char proto[10];
-			char status[256];
-
-			sscanf(line, "%9s %3hu %255[^\n]", proto, &code, status);
-
-			/* Catch the "wrong" status codes */
-			if(code >= 400)
-			{
-				fprintf(stderr, "[error] Server returned HTTP error %i: %s\n", code, status);
-				exit(1);
-			}
-			if(code < 100)
-			{
-				fprintf(stderr, "[error] Server has returned code %i. What?\n", code);
-				exit(1);
-			}
-			if(code < 200)
-			{
-				fprintf(stderr, "[error] Server has returned code %i, which is quite strange (we didn't send the Upgrade header and our HTTP request had no body). Anyway, responses with 1xx codes can't have content. There is nothing to save. Exiting.\n", code);
-				exit(1);
-			}
-
-			if(code == 204)
-			{
-				fprintf(stderr, "[notice] Server has returned 204 No Content. There is nothing to save. Exiting.\n");
-				exit(0);
-			}
-
-		}
-		else
+	if(d.cache_key)
+	{
+		if(cache_lookup(d.cache_key, &d.cache_entry) == 0)
 		{
-			if(line[0] == '\0')
-			{
-				// Start of the response body.
-				// NOTE: part of the body has already been read
-				// and is saved at (line+1).
-				fprintf(stderr, "[info] All HTTP response headers have been received\n");
-				line ++;
-
-				/* Strip one newline (no more than one, as response body can have binary data) */
-				line = strip_first_CRLF(line);
-
-				prefetched_body_length = new_offset - line;
-				goto read_response_body;
-			}
-
-			// If the string starts with space or tabulation, then
-			// it is a continuation of the previous HTTP header.
-			if(line[0] == ' ' || line[0] == '\t')
+			if(cache_is_fresh(&d.cache_entry))
 			{
-				do
-				{
-					line ++; // Skip all spaces/tabs
-				}
-				while(*line == ' ' || *line == '\t');
-				line --; // Leave one space
-
-				if(!HEADERS[header_idx].val)
-				{
-					fprintf(stderr, "[error] Server has sent a malformed _first_ HTTP header (starts with space or tabulation)\n");
-					exit(1);
-				}
+				fprintf(stderr, "[notice] Using the fresh copy from the cache.\n");
+				cache_stats.hits ++;
 
-				fprintf(stderr, "[debug] Appending \"%s\" to \"%s\" in \"%s\" header.\n", line, HEADERS[header_idx].val, HEADERS[header_idx].key);
+				ret = save_cached_response(d.cache_key, &d.cache_entry, filename);
+				if(ret == 0 && verify_digest.algorithm != DIGEST_NONE)
+					ret = verify_file(filename);
 
-				int oldlen = strlen(HEADERS[header_idx].val);
-				int applen = strlen(line);
-
-				//fprintf(stderr, "[debug] Appending \"%p\" to \"%p\" (diff %i) (len %i) header.\n", line, HEADERS[header_idx].val, line - HEADERS[header_idx].val, len);
-
-				// We do have enough space for memmove(): we're copying
-				// to the area which contained the very same text (plus newlines).
-				memmove(HEADERS[header_idx].val + oldlen, line, applen);
-				HEADERS[header_idx].val[oldlen + applen] = '\0';
+				download_free(&d);
+				return ret;
 			}
-			else // New HTTP header found
-			{
-				char *val = strchr(line, ':');
-				if(!val)
-				{
-					fprintf(stderr, "[error] Server has sent a malformed HTTP header (no colon).\n");
-					exit(1);
-				}
-
-				*val = '\0';
-				val ++;
-
-				// Remove the spaces after ':'
-				while(isspace(*val))
-					val ++;
-
-				if(HEADERS[header_idx].val)
-					header_idx ++;
 
-				fprintf(stderr, "[debug] Found header '%s': '%s' -> goes into HEADERS[%i]\n", line, val, header_idx);
-				HEADERS[header_idx].key = line;
-				HEADERS[header_idx].val = val;
-
-				// Normalize header names (they are case-insensitive)
-				char *ptr;
-				for(ptr = HEADERS[header_idx].key; *ptr != '\0'; ptr ++)
-					*ptr = tolower(*ptr);
-			}
+			if(!cache_can_revalidate(&d.cache_entry))
+				cache_entry_free(&d.cache_entry);
 		}
 
-		line = p1;
-		buffer_offset = p1;
-		lineno ++;
-
-		// We need to check if the last read() got more than one line.
-		goto check_buffer_for_newlines;
+		if(!d.cache_entry.url)
+			cache_stats.misses ++;
 	}
 
-read_response_body:
-	/* Let's study the HTTP response headers */
-	HEADERS_count = header_idx;
-	if(HEADERS[header_idx].val)
-		HEADERS_count ++;
-
-	SPENT();
-
-	/* Sort the HEADERS[] array for faster search */
-	qsort(HEADERS, HEADERS_count, sizeof(HEADERS[0]), compare_headers_cb);
-
-	/* Merge duplicate headers (their values are joined using commas) */
-	for(i = 0; i < HEADERS_count - 1; i ++)
+	struct httpc_options options;
+	httpc_options_init(&options);
+	options.timing = &timing;
+	options.log_callback = httpc_log_stderr;
+	options.headers = request_headers;
+	options.body_fd = upload_fd;
+	options.body_length = upload_length;
+	if(verify_digest.algorithm != DIGEST_NONE)
+		options.digest = &d.digest;
+
+	if(d.resume_offset > 0)
 	{
-test_another_dup:
-		if(!strcmp(HEADERS[i].key, HEADERS[i + 1].key))
-		{
-			int oldlen = strlen(HEADERS[i].val);
-
-			char *newval;
-			if(HEADERS[i].val_must_be_freed)
-			{
-				newval = realloc(HEADERS[i].val, oldlen + strlen(HEADERS[i + 1].val) + 3 /* 3 bytes = comma + space + zero byte */);
-				if(!newval)
-				{
-					fprintf(stderr, "[error] realloc: memory allocation failed\n");
-					exit(1);
-				}
+		fprintf(stderr, "[notice] %s is a partially downloaded %s, asking only for the bytes after %llu\n",
+			filename, URL, d.resume_offset);
+		options.range_from = d.resume_offset;
+		options.if_range = resume_validator(&d.resume);
+	}
+	else if(d.cache_entry.url)
+	{
+		fprintf(stderr, "[info] Cached copy is stale, asking the server whether it has changed...\n");
+		options.if_none_match = d.cache_entry.etag;
+		options.if_modified_since = d.cache_entry.last_modified;
+	}
 
-				newval[oldlen] = ',';
-				newval[oldlen + 1] = ' ';
+	ret = httpc_request(client, request_method, URL, &options, &callbacks, &d);
 
-				strcpy(newval + oldlen + 2, HEADERS[i + 1].val);
-			}
-			else
-			{
-				if(asprintf(&newval, "%s, %s", HEADERS[i].val, HEADERS[i + 1].val) < 0)
-				{
-					fprintf(stderr, "[error] asprintf: memory allocation failed\n");
-					exit(1);
-				}
-				HEADERS[i].val_must_be_freed = 1;
-			}
-			HEADERS[i].val = newval;
+	if(d.restart)
+	{
+		/* The partially downloaded file can't be resumed: download all of it */
+		resume_remove(filename);
+		download_free(&d);
+		goto again;
+	}
+	if(d.failed || (ret < 0 && ret != HTTPC_ERR_ABORTED && !d.interrupted))
+		goto failed;
 
-			/* Move the remaining elements of HEADERS[] to the beginning of the array */
-			HEADERS_count --;
-			for(j = i + 1; j < HEADERS_count; j ++)
-				HEADERS[j] = HEADERS[j + 1];
+	if(d.not_modified)
+	{
+		ret = save_cached_response(d.cache_key, &d.cache_entry, filename);
+		if(ret == 0 && verify_digest.algorithm != DIGEST_NONE)
+			ret = verify_file(filename);
 
-			if(i != HEADERS_count - 1)
-				goto test_another_dup;
-		}
+		download_free(&d);
+		return ret;
 	}
 
-	fprintf(stderr, "[debug] Total %i headers found:\n", HEADERS_count);
-	for(i = 0; i < HEADERS_count; i ++)
+	if((ret == HTTPC_INCOMPLETE || d.interrupted) && retries_left > 0 && d.plain_get)
 	{
-		fprintf(stderr, "[debug] Header[%i] '%s' is '%s'.\n", i, HEADERS[i].key, HEADERS[i].val);
+		retries_left --;
+		fprintf(stderr, "[notice] Retrying in %u ms (%u retries left)...\n", retry_delay_ms, retries_left);
+
+		usleep(retry_delay_ms * 1000);
+		retry_delay_ms *= 2;
+		if(retry_delay_ms > max_retry_delay_ms)
+			retry_delay_ms = max_retry_delay_ms;
+
+		download_free(&d);
+		goto again;
 	}
+	if(d.interrupted)
+		goto failed; // Still resumable by the next run
 
-	/* OK, we've parsed the headers. Is it a redirect? */
-	if(code >= 300) /* codes >= 400 have already been filtered before */
+	if(verify_digest.algorithm != DIGEST_NONE)
 	{
-		char *location = find_header(HEADERS, HEADERS_count, "location");
-
-		fprintf(stderr, "[notice] Server returned redirect: %s\n", location);
+		if(d.complete && d.resume_offset > 0 && verify_file(filename) < 0)
+			goto failed; // Already received by the previous run
 
-		if(++ redirect_nr > max_redirects)
+		if(ret == HTTPC_INCOMPLETE)
 		{
-			fprintf(stderr, "[error] Redirects depth limit reached: maximum %u are allowed\n", max_redirects);
-			exit(1);
+			fprintf(stderr, "[error] Download is incomplete, so its integrity can't be verified (-V).\n");
+			goto failed;
 		}
+	}
 
-		location = strdup(location);
-		if(!location)
-		{
-			fprintf(stderr, "[error] strdup: memory allocation failed\n");
-			exit(1);
-		}
-		free_headers(HEADERS, HEADERS_count);
+	download_free(&d);
+	return 0;
 
-		perform_http_request(location);
-		free(location);
+failed:
+	download_free(&d);
+	return -1;
+}
 
-		return; /* Done. */
-	}
+/* Called on exit (the request can fail anywhere, and then we exit() right away) */
+void report_timing(void)
+{
+	timing_add_transfer(&timing, &transfer_before);
+	timing_report(&timing, request_url, request_succeeded ? NULL : "request failed");
+}
 
-	/*
-		We don't need to support all headers.
-		Transfer-Encoding and Content-Length are enough.
+/* Saves the DNS cache for the next run (if -D was used) */
+void save_dns_cache(const char *filename)
+{
+	if(filename && dns_save(filename) < 0)
+		fprintf(stderr, "[warn] Failed to save DNS cache into %s: %s\n", filename, strerror(errno));
+}
+
+void save_redirect_cache(const char *filename)
+{
+	if(filename && redirect_save(filename) < 0)
+		fprintf(stderr, "[warn] Failed to save permanent redirects into %s: %s\n", filename, strerror(errno));
+}
 
-		Content-Encoding header can't be here because
-		we never sent Accept-Encoding. But we'll check
-		in case the server is misbehaving.
-	*/
-	if(find_header(HEADERS, HEADERS_count, "content-encoding"))
+/* -H: appends "header" ("Name: value") to request_headers */
+void add_request_header(const char *header)
+{
+	const char *colon = strchr(header, ':');
+	if(!colon || colon == header || header[strcspn(header, "\r\n")] != '\0')
 	{
-		fprintf(stderr, "[error] Server has returned Content-Encoding header, but we support none of them. Exiting.\n");
+		fprintf(stderr, "[error] Malformed request header (must be \"Name: value\"): %s\n", header);
 		exit(1);
 	}
 
-	unsigned long len = 0;
-	int is_chunked = 0;
-	int no_length = 0; // 1 if there is neither "Transfer-Encoding: chunked" nor "Content-Length"
-
-	char *transfer_encoding = find_header(HEADERS, HEADERS_count, "transfer-encoding");
-	char *content_length = find_header(HEADERS, HEADERS_count, "content-length");
-	if(!transfer_encoding) /* When Transfer-Encoding exists, we must ignore Content-Length */
+	size_t length = strlen(header);
+	char *headers = realloc(request_headers, request_headers_length + length + 3);
+	if(!headers)
 	{
-		if(content_length)
-		{
-			errno = 0;
-			len = strtol(content_length, NULL, 10);
+		fprintf(stderr, "[error] realloc: memory allocation failed\n");
+		exit(1);
+	}
 
-			if(errno)
-			{
-				fprintf(stderr, "[error] Malformed Content-Length response header: not a number.\n");
-				exit(1);
-			}
-		}
-		else
-		{
-			fprintf(stderr, "[warn] Server has responded without both Content-Length and Transfer-Encoding headers.\n");
+	memcpy(headers + request_headers_length, header, length);
+	memcpy(headers + request_headers_length + length, "\r\n", 3);
+	request_headers = headers;
+	request_headers_length += length + 2;
+}
 
-			no_length = 1;
-			len = (unsigned long) -1; // = very-very long
-		}
+/* -u: opens "filename" to be sent as the request body */
+void open_upload(const char *filename)
+{
+	struct stat st;
+	upload_fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if(upload_fd < 0 || fstat(upload_fd, &st) < 0)
+	{
+		fprintf(stderr, "[error] open(\"%s\") failed: %s\n", filename, strerror(errno));
+		exit(1);
 	}
-	else
+	if(!S_ISREG(st.st_mode))
 	{
-		/* Per HTTP/1.1, the client must support chunked */
-		const char chunked[] = "chunked";
+		fprintf(stderr, "[error] %s is not a regular file.\n", filename);
+		exit(1);
+	}
 
-		if(content_length)
-			fprintf(stderr, "[warn] Received both Transfer-Encoding and Content-Length. Ignoring the latter per RFC2616.\n");
+	upload_length = st.st_size;
+	posix_fadvise(upload_fd, 0, 0, POSIX_FADV_SEQUENTIAL); // Larger readahead for sendfile()
+}
 
-		char *p = strstr(transfer_encoding, chunked);
-		if(p)
+int main( int argc, char **argv )
+{
+	const char *batch_file = NULL; // -i: file with URLs (one per line)
+	const char *cache_dir = NULL; // -C: on-disk cache of responses
+	const char *dns_cache_file = NULL; // -D: on-disk DNS cache
+	const char *redirect_cache_file = NULL; // -R: on-disk cache of permanent redirects
+	const char *timing_file = NULL; // -T: where to write the timing records
+	unsigned concurrency = 8; // -j: number of simultaneous requests in batch mode
+	unsigned pipeline_depth = 1; // -p: number of pipelined requests per connection in batch mode
+	unsigned threads = 1; // -w: number of threads (event loops) in batch mode
+	unsigned segments = 1; // -s: number of connections for the segmented download
+	const char *method = NULL; // -X
+	int http2 = 0; // -2: HTTP/2 in batch mode
+	int opt;
+
+	/* Messages of the library (its default is to print nothing) */
+	log_set(httpc_log_stderr, NULL, HTTPC_LOG_DEBUG);
+
+	while((opt = getopt(argc, argv, "2c:C:dD:H:i:j:o:p:r:R:s:t:T:u:UV:w:X:")) != -1)
+	{
+		switch(opt)
 		{
-			fprintf(stderr, "[info] Server is using chunked transfer-encoding\n");
-			is_chunked = 1;
-
-			/* Is there something else in the Transfer-Encoding?
-				We only support chunked. */
-			memset(p, ' ', sizeof(chunked) - 1);
-
-			char *q;
-			for(q = transfer_encoding; *q != '\0'; q ++)
-				if(!isspace(*q) && *q != ',')
+			case '2':
+				http2 = 1;
+				break;
+			case 'd':
+				output_direct = 1;
+				break;
+			case 'o':
+				if(!*optarg)
+					print_usage();
+				if(output_set_name(optarg) < 0)
 				{
-					// Restore 'transfer_encoding' for the error message below.
-					memcpy(p, chunked, sizeof(chunked) - 1);
-
-					fprintf(stderr, "[error] Server has requested transfer encoding \"%s\", we can't use that. Only 'chunked' transfer encoding is supported.\n", transfer_encoding);
+					fprintf(stderr, "[error] asprintf: memory allocation failed\n");
+					exit(1);
+				}
+				break;
+			case 'H':
+				add_request_header(optarg);
+				break;
+			case 'u':
+				open_upload(optarg);
+				break;
+			case 'X':
+				method = optarg;
+				if(!*method || method[strcspn(method, " \t\r\n")] != '\0')
+					print_usage();
+				break;
+			case 'c':
+				if(tls_set_ca_file(optarg) < 0)
+					exit(1);
+				break;
+			case 'C':
+				cache_dir = optarg;
+				break;
+			case 'D':
+				dns_cache_file = optarg;
+				break;
+			case 'i':
+				batch_file = optarg;
+				break;
+			case 'j':
+				concurrency = parse_number(optarg, 1);
+				break;
+			case 'r':
+				retries_left = parse_number(optarg, 0);
+				break;
+			case 'R':
+				redirect_cache_file = optarg;
+				break;
+			case 's':
+				segments = parse_number(optarg, 1);
+				break;
+			case 't':
+				if(deadline_parse_limits(optarg, &deadline_limits) < 0)
+					print_usage();
+				break;
+			case 'T':
+				timing_file = optarg;
+				break;
+			case 'U':
+#ifdef USE_IO_URING
+				uring_enabled = 1;
+#else
+				fprintf(stderr, "[warn] Built without io_uring support (see \"make IO_URING=1\"), -U is ignored.\n");
+#endif
+				break;
+			case 'p':
+				pipeline_depth = parse_number(optarg, 1);
+				break;
+			case 'V':
+				if(digest_parse_option(optarg, &verify_digest) < 0)
+				{
+					fprintf(stderr, "[error] -V: expected sha256 or crc32c, optionally followed by :HEX (e.g. sha256:e3b0c442...).\n");
 					exit(1);
 				}
+				break;
+			case 'w':
+				threads = parse_number(optarg, 0);
+				break;
+			default:
+				print_usage();
 		}
 	}
-	free_headers(HEADERS, HEADERS_count);
 
-	SPENT();
+	if(method)
+		request_method = method;
+	else if(upload_fd >= 0)
+		request_method = "PUT";
 
-	/* Read the response body. Note: part of it has already been read into "line" */
-	const char *filename = "http.out"; // write response into this file
-	int fout = open(filename, O_WRONLY | O_CREAT, 0600);
-	if(fout < 0)
+	if(timing_file && timing_set_output(timing_file) < 0)
 	{
-		fprintf(stderr, "[error] open(\"%s\") failed: %s\n", filename, strerror(errno));
+		fprintf(stderr, "[error] fopen(\"%s\") failed: %s\n", timing_file, strerror(errno));
 		exit(1);
 	}
-	if(ftruncate(fout, 0) < 0)
+
+	if(cache_dir && cache_open(cache_dir) < 0)
 	{
-		fprintf(stderr, "[error] ftruncate() failed: %s\n", strerror(errno));
+		fprintf(stderr, "[error] mkdir(\"%s\") failed: %s\n", cache_dir, strerror(errno));
 		exit(1);
 	}
-	fprintf(stderr, "[info] Opened \"%s\" for writing.\n", filename);
 
-	fprintf(stderr, "[info] Reading response body...\n");
+	if(dns_cache_file && dns_load(dns_cache_file) < 0 && errno != ENOENT)
+		fprintf(stderr, "[warn] Failed to load DNS cache from %s: %s\n", dns_cache_file, strerror(errno));
 
-	/* Put the socket back into the blocking mode */
-	if(fcntl(sock, F_SETFL, 0) < 0)
-	{
-		fprintf(stderr, "[error] fcntl() failed: %s\n", strerror(errno));
-		exit(1);
-	}
+	if(redirect_cache_file && redirect_load(redirect_cache_file) < 0 && errno != ENOENT)
+		fprintf(stderr, "[warn] Failed to load permanent redirects from %s: %s\n", redirect_cache_file, strerror(errno));
 
-	ssize_t bytes; int prefetched_bytes_needed;
-	if(!is_chunked)
+	if(batch_file)
 	{
-		prefetched_bytes_needed = prefetched_body_length;
-		if(len && len < prefetched_body_length)
-		{
-			prefetched_bytes_needed = len;
+		if(optind != argc)
+			print_usage();
 
-			fprintf(stderr, "[warn] Detecting (and ignoring) extra data in HTTP response (beyond the length specified by server).\n");
-		}
-
-		bytes = write(fout, line, prefetched_bytes_needed);
-		if(bytes != prefetched_bytes_needed)
+		if(strcmp(request_method, "GET") || request_headers || upload_fd >= 0)
 		{
-			fprintf(stderr, "write() failed: %s\n", strerror(errno));
+			fprintf(stderr, "[error] -X, -H and -u are not supported in batch mode.\n");
 			exit(1);
 		}
 
-		len -= prefetched_bytes_needed;
-		if(len == 0) // Everything read OK.
-			goto close_file;
-
-		size_t left = sendfile_from_socket(fout, sock, len);
-
-		if(!no_length && left > 0)
-			fprintf(stderr, "[warn] Response has ended prematurely (either the server has transmitted wrong length or the response body we received is incomplete)\n");
-	}
-	else
-	{
-		/* chunked method.
-			For convenience we're moving the text which exists in
-			"line" into the beginning of "buffer" (otherwise we'd
-			have two different versions of code - for "line"
-			and for "buffer").
-		*/
-		memmove(buffer, line, prefetched_body_length);
-		buffer[prefetched_body_length] = '\0';
-
-		buffer_offset = buffer + prefetched_body_length; // points to the end of what we have read
-
-		char *start;
-get_next_chunk:
-		/* If buffer[] has only 1-2 symbols and they are CRLF,
-			separate_CRLF() would return a correct pointer (to the
-			string ""). We use strip_first_CRLF() to avoid that */
-		start = strip_first_CRLF(buffer);
-		p1 = separate_CRLF(start); /* points to the beginning of the next chunk */
-
-		if(!p1)
+		FILE *urls = strcmp(batch_file, "-") ? fopen(batch_file, "r") : stdin;
+		if(!urls)
 		{
-			// We've got an incomplete string (it must have length
-			// and newline symbol in the end). Continue reading it.
-
-			ssize_t ret = read(sock, buffer_offset, sizeof(buffer) - 1 - (buffer_offset - buffer));
-			if(ret < 0)
-			{
-				fprintf(stderr, "[warn] read(sock) failed: %s\n", strerror(errno));
-				exit(1);
-			}
-
-			if(ret == 0)
-			{
-				// We just read the entire buffer[], but haven't found any newlines.
-				// This is an incorrect chunked from the server.
-
-response_ended_prematurely:
-				fprintf(stderr, "[warn] Response has ended prematurely (while waiting for another chunk). It might be incomplete\n");
-				goto close_file;
-			}
-
-			buffer_offset += ret;
-			*buffer_offset = '\0';
-
-			goto get_next_chunk;
-		}
-
-		errno = 0;
-		ssize_t chunk_len = strtol(start, 0, 16);
-		if(errno)
-		{
-			fprintf(stderr, "[error] Malformed chunk length: not a number.\n");
+			fprintf(stderr, "[error] fopen(\"%s\") failed: %s\n", batch_file, strerror(errno));
 			exit(1);
 		}
-		if(chunk_len == 0)
-		{
-			fprintf(stderr, "[debug] Last chunk received.\n");
-			goto close_file;
-		}
 
-		fprintf(stderr, "[debug] Chunk length: %zu\n", chunk_len);
-
-		/*
-			Either the chunk is completely within buffer
-			(already read), or the chunk is longer
-		*/
-		if(buffer_offset - p1 > chunk_len)
+		if(verify_digest.size)
 		{
-			/* FIXME: this part of code wasn't really tested */
-
-			/* The chunk is completely within the buffer.
-				Just write it into the file. */
-			if(write(fout, p1, chunk_len) < chunk_len)
-			{
-				fprintf(stderr, "write() failed: %s\n", strerror(errno));
-				exit(1);
-			}
-
-			/* Move the rest into the beginning of buffer[] */
-			int newlen = buffer_offset - p1 - chunk_len;
-			memmove(buffer, p1 + chunk_len, newlen);
-			buffer[newlen] = '\0';
-			buffer_offset = buffer + newlen;
-
-			goto get_next_chunk;
+			fprintf(stderr, "[error] -V with a value is not supported in batch mode: each body is compared with its Repr-Digest header.\n");
+			exit(1);
 		}
-		else
-		{
-			/* Write what we already have */
 
-			ssize_t todo = buffer_offset - p1;
-			if(write(fout, p1, todo) < todo)
-			{
-				fprintf(stderr, "write() failed: %s\n", strerror(errno));
-				exit(1);
-			}
-			chunk_len -= todo;
+		if(http2 && pipeline_depth > 1)
+			fprintf(stderr, "[notice] Pipelining is not used with HTTP/2: requests are sent as concurrent streams.\n");
 
-			//fprintf(stderr, "p1[%i]:\n-------------\n%s\n-------------\n\n", todo, p1);
-
-			/* Read into the beginning of buffer[] */
-
-			while(chunk_len)
-			{
-				todo = chunk_len > MAX_HTTP_HEADERS_LENGTH ? MAX_HTTP_HEADERS_LENGTH : chunk_len;
-				ssize_t bytes = read(sock, buffer, todo);
-
-				if(bytes < 0)
-				{
-					fprintf(stderr, "[error] read() failed: %s\n", strerror(errno));
-					exit(1);
-				}
-
-				//fprintf(stderr, "buffer[%i]:\n-------------\n%s\n-------------\n\n", bytes, buffer);
-
-				if(write(fout, buffer, bytes) < bytes)
-				{
-					fprintf(stderr, "[error] write() failed: %s\n", strerror(errno));
-					exit(1);
-				}
-
-				if(bytes == 0)
-					break;
+		int failures = batch_run(urls, concurrency, pipeline_depth, threads, http2, verify_digest.algorithm);
+		pool_close_all();
+		save_dns_cache(dns_cache_file);
+		save_redirect_cache(redirect_cache_file);
+		return failures ? 1 : 0;
+	}
 
-				chunk_len -= bytes;
-			}
+	if(optind != argc - 1)
+		print_usage();
 
-			if(chunk_len > 0) goto response_ended_prematurely;
+	if(http2)
+		fprintf(stderr, "[notice] HTTP/2 (-2) is only supported in batch mode (-i), using HTTP/1.1.\n");
 
-			/* Go to the next chunk. Here buffer[] is completely
-				blank (we didn't read more than we needed) */
-			buffer[0] = '\0';
-			buffer_offset = buffer;
-			goto get_next_chunk;
-		}
+	request_url = strdup(argv[optind]);
+	if(!request_url)
+	{
+		fprintf(stderr, "[error] strdup: memory allocation failed\n");
+		exit(1);
 	}
 
-close_file:
-	alarm(0); /* Disable the timeout */
-	SPENT();
-	fprintf(stderr, "[notice] File received (saved to %s)\n", filename);
+	timing_start(&timing);
+	transfer_before = transfer_stats;
+	atexit(report_timing);
 
-	struct stat st;
-	if(fstat(fout, &st) < 0)
+	int ret = SEGMENTED_UNSUPPORTED;
+	if(segments > 1 && (strcmp(request_method, "GET") || request_headers || upload_fd >= 0))
+		fprintf(stderr, "[notice] Segmented download is only supported for GET without -H, downloading as usual.\n");
+	else if(segments > 1)
 	{
-		fprintf(stderr, "[error] fstat() failed: %s\n", strerror(errno));
-		exit(1);
-	}
+		/* Parts of the file are received in any order: it can't be resumed later */
+		resume_remove(output_name);
 
-	fprintf(stderr, "[info] %s is %li bytes long\n", filename, st.st_size);
+		ret = segmented_download(request_url, segments, output_name, &timing);
+		if(ret < 0)
+			exit(1);
+	}
 
-	if(close(fout) < 0)
+	if(ret == SEGMENTED_UNSUPPORTED)
 	{
-		fprintf(stderr, "[error] close() failed: %s\n", strerror(errno));
-		exit(1);
+		struct httpc_client *client = httpc_client_new();
+		if(!client)
+		{
+			fprintf(stderr, "[error] httpc_client_new: memory allocation failed\n");
+			exit(1);
+		}
+
+		ret = download_file(client, request_url, output_name);
+		httpc_client_free(client);
+		if(ret < 0)
+			exit(1);
 	}
-}
+	else
+	{
+		fprintf(stderr, "[notice] File received (saved to %s)\n", output_name);
 
-int main( int argc, char **argv )
-{
-	if(argc != 2)
-		print_usage();
+		/* Parts were written in any order: the file is hashed after the download */
+		if(verify_digest.algorithm != DIGEST_NONE && verify_file(output_name) < 0)
+			exit(1);
+	}
 
-	perform_http_request(argv[1]);
+	request_succeeded = 1;
+
+	fprintf(stderr, "[info] Connections: %lu opened, %lu reused.\n", pool_stats.created, pool_stats.reused);
+	fprintf(stderr, "[info] DNS: %lu lookups, %lu answered from cache.\n", dns_stats.lookups, dns_stats.hits);
+	fprintf(stderr, "[info] Body transfer: %llu bytes via %lu splice(), %lu read() and %lu write() calls.\n",
+		transfer_stats.bytes, transfer_stats.splice_calls, transfer_stats.read_calls, transfer_stats.write_calls);
+	if(transfer_stats.sent_bytes)
+		fprintf(stderr, "[info] Request body: %llu bytes sent via %lu sendfile() calls.\n",
+			transfer_stats.sent_bytes, transfer_stats.sendfile_calls);
+	if(tls_stats.handshakes)
+		fprintf(stderr, "[info] TLS: %lu handshakes, %lu of them resumed sessions, %lu with kernel TLS offload.\n",
+			tls_stats.handshakes, tls_stats.resumed, tls_stats.ktls);
+	if(transfer_stats.uring_calls)
+		fprintf(stderr, "[info] io_uring: %lu io_uring_enter() calls.\n", transfer_stats.uring_calls);
+	if(transfer_stats.compressed_bytes)
+		fprintf(stderr, "[info] Content-Encoding: %llu compressed bytes received, %llu bytes after decompression.\n",
+			transfer_stats.compressed_bytes, transfer_stats.decoded_bytes);
+	if(cache_enabled())
+		fprintf(stderr, "[info] Cache: %lu hits, %lu revalidated (304), %lu misses, %lu responses stored.\n",
+			cache_stats.hits, cache_stats.revalidated, cache_stats.misses, cache_stats.stored);
+	pool_close_all();
+	save_dns_cache(dns_cache_file);
+	save_redirect_cache(redirect_cache_file);
 	return 0;
 }
@@ -0,0 +1,1312 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "httpclient.h"
+#include "http.h"
+#include "content_encoding.h"
+#include "pool.h"
+#include "connect.h"
+#include "dns.h"
+#include "chunked.h"
+#include "transfer.h"
+#include "timing.h"
+#include "deadline.h"
+#include "uring.h"
+#include "tls.h"
+#include "redirect.h"
+#include "log.h"
+
+#define SEND_BODY_MAX (1 << 30) // bytes of the request body per tls_sendfile() call
+
+struct httpc_client {
+	char *buffer; // response headers are read here (grows if they are long)
+	size_t buffer_size;
+
+	char *chunk_buffer; // chunked body is parsed here (CHUNKED_BUFFER_SIZE)
+	char *body_buffer; // body for on_body() is read here (TRANSFER_BUFFER_SIZE)
+};
+
+struct httpc_response {
+	struct http_response http;
+	const char *url;
+	unsigned redirects;
+	int decompressed;
+	long long content_length;
+};
+
+/* State of one httpc_get() */
+struct request {
+	struct httpc_client *client;
+	const struct httpc_options *options;
+	const struct httpc_callbacks *callbacks;
+	void *opaque;
+
+	struct request_timing *timing;
+	unsigned redirect_nr;
+
+	const char *method; // of the current hop (redirects can change it to GET, see follow_redirect_method)
+	int send_body; // 1 if options->body_fd is sent with the current hop
+	int no_expect; // server doesn't support "Expect: 100-continue" (has answered 417)
+
+	struct arena *arena; // URLs of the hops, requests, response headers (see arena.h)
+
+	struct deadline_limits limits; // from the options
+	struct deadlines deadlines;
+	int sock_timeout_ms; // SO_RCVTIMEO of the current socket, -1 if not set
+};
+
+/* Where the response body goes */
+struct body_sink {
+	struct request *req;
+	struct content_decoder *decoder; // NULL if there is no Content-Encoding
+	int fd; // -1 if the body is passed to on_body()
+	int discard; // 1 if the body is not needed (e.g. body of redirect)
+};
+
+static const struct httpc_callbacks no_callbacks;
+
+/* Returned by httpc_get() when the deadline of this kind expires */
+static const int timeout_errors[DEADLINE_KINDS] = {
+	[DEADLINE_CONNECT] = HTTPC_ERR_CONNECT_TIMEOUT,
+	[DEADLINE_FIRST_BYTE] = HTTPC_ERR_FIRST_BYTE_TIMEOUT,
+	[DEADLINE_IDLE] = HTTPC_ERR_IDLE_TIMEOUT,
+	[DEADLINE_TOTAL] = HTTPC_ERR_TIMEOUT
+};
+
+/* Returns milliseconds left until the earliest deadline (0 if it has expired, -1 if there are no deadlines) */
+static int time_left_ms(const struct request *req)
+{
+	return deadline_wait_ms(&req->deadlines, NULL);
+}
+
+/*
+	Blocking send()/read() on "sock" will fail with EAGAIN after the earliest deadline.
+	SO_RCVTIMEO limits each call (not all of them), so it's set again when the deadline
+	becomes much closer than the limit we've set before (e.g. the total deadline is near).
+	This way it's changed only a few times per request, not before every read().
+*/
+static void update_socket_timeout(struct request *req, int sock, int force)
+{
+	int left = time_left_ms(req);
+	if(!force && (left < 0 || (req->sock_timeout_ms >= 0 && left >= req->sock_timeout_ms / 2)))
+		return;
+
+	struct timeval tv;
+	tv.tv_sec = 0;
+	tv.tv_usec = 0; // no timeout
+	if(left >= 0)
+	{
+		tv.tv_sec = left / 1000;
+		tv.tv_usec = (left % 1000) * 1000 + 1;
+	}
+
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	req->sock_timeout_ms = left;
+}
+
+/* The earliest deadline has expired: which one was it? */
+static int report_timeout(const struct request *req)
+{
+	enum deadline_kind kind = DEADLINE_TOTAL;
+	deadline_next(&req->deadlines, &kind);
+
+	log_error("Timeout: %s deadline (%u ms) has expired", deadline_name(kind), req->limits.ms[kind]);
+	return timeout_errors[kind];
+}
+
+static int report_nomem(const char *function)
+{
+	log_error("%s: memory allocation failed", function);
+	return HTTPC_ERR_NOMEM;
+}
+
+/*
+	Returns 1 if "err" (errno) means that the connection has broken
+	(e.g. reset by server or lost because of the network), 0 otherwise.
+	Such errors only end the response body prematurely: what has been
+	received can be used (e.g. the download can be resumed).
+*/
+static int is_connection_error(int err)
+{
+	switch(err)
+	{
+		case ECONNRESET:
+		case ECONNABORTED:
+		case ETIMEDOUT:
+		case EHOSTUNREACH:
+		case ENETUNREACH:
+		case ENETDOWN:
+		case EPIPE:
+			return 1;
+	}
+	return 0;
+}
+
+static int sink_callback(void *opaque, const char *data, size_t length)
+{
+	struct body_sink *sink = opaque;
+	const struct request *req = sink->req;
+
+	if(sink->discard || !req->callbacks->on_body)
+		return 0;
+
+	if(req->callbacks->on_body(req->opaque, data, length) < 0)
+	{
+		errno = ECANCELED;
+		return -1;
+	}
+	return 0;
+}
+
+/* Writes a part of the body (which is already in userspace) */
+static int sink_write(struct body_sink *sink, const char *data, size_t length)
+{
+	if(sink->fd >= 0)
+		return decode_body(sink->decoder, sink->fd, data, length);
+
+	return decode_body_to(sink->decoder, data, length, sink_callback, sink);
+}
+
+/* Same as sink_write(), but for several parts (e.g. from chunked_decode_iov()) */
+static int sink_write_iov(struct body_sink *sink, struct iovec *iov, int iovcnt)
+{
+	if(sink->fd >= 0)
+		return decode_body_iov(sink->decoder, sink->fd, iov, iovcnt);
+
+	int i;
+	for(i = 0; i < iovcnt; i ++)
+	{
+		if(sink_write(sink, iov[i].iov_base, iov[i].iov_len) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+	Reads up to "count" bytes of the body from "sock".
+	When the body goes into a file, the data is moved via splice() when possible
+	(without copying it into userspace), unless it must be decompressed.
+	Returns the number of bytes read, 0 on EOF, -1 on error.
+*/
+static ssize_t sink_from_socket(struct body_sink *sink, int sock, size_t count)
+{
+	/* Encrypted data must be decrypted by OpenSSL, unless the kernel does it (kTLS) */
+	if(sink->fd >= 0 && !tls_in_userspace(sock))
+	{
+		ssize_t bytes = -1;
+		errno = ENOSYS;
+
+		/* Large uncompressed body: via io_uring (if enabled with -U), see uring.h */
+		if(uring_enabled && count >= URING_MIN_TRANSFER &&
+			(!sink->decoder || (sink->decoder->coding == CODING_IDENTITY && !sink->decoder->digest)))
+		{
+			bytes = uring_transfer_from_socket(sink->fd, sock, count, time_left_ms(sink->req));
+		}
+
+		if(bytes < 0 && errno == ENOSYS)
+			bytes = decode_from_socket(sink->decoder, sink->fd, sock, count);
+
+		/* With kTLS, a record which is not data (e.g. alert) can only be read by OpenSSL */
+		if(bytes >= 0 || errno != EIO || !tls_is_active(sock))
+			return bytes;
+	}
+
+	if(count > TRANSFER_BUFFER_SIZE)
+		count = TRANSFER_BUFFER_SIZE;
+
+	ssize_t bytes = tls_read(sock, sink->req->client->body_buffer, count);
+	transfer_stats.read_calls ++;
+
+	if(bytes <= 0)
+		return bytes;
+
+	if(sink_write(sink, sink->req->client->body_buffer, bytes) < 0)
+		return -1;
+
+	return bytes;
+}
+
+/* Converts the error of sink_*() functions (errno) into HTTPC_ERR_* code */
+static int sink_error(struct body_sink *sink)
+{
+	if(errno == ECANCELED)
+		return HTTPC_ERR_ABORTED;
+
+	if(errno == EAGAIN || errno == EWOULDBLOCK)
+		return report_timeout(sink->req);
+
+	log_error("Failed to save the response body: %s", decode_strerror(sink->decoder));
+	return errno == EBADMSG ? HTTPC_ERR_ENCODING : HTTPC_ERR_IO;
+}
+
+/*
+	Reads "count" bytes of the body from socket "sock".
+	Returns the number of NOT YET READ bytes via "*left" (i.e. 0 if "count"
+	bytes have been read completely). Returns HTTPC_OK, HTTPC_INCOMPLETE
+	(if the connection has broken) or an error.
+*/
+static int read_from_socket(struct body_sink *sink, int sock, size_t count, size_t *left)
+{
+	struct request *req = sink->req;
+	int ret = HTTPC_OK;
+
+	while(count)
+	{
+		update_socket_timeout(req, sock, 0);
+
+		ssize_t bytes = sink_from_socket(sink, sock, count);
+		if(bytes < 0)
+		{
+			if(is_connection_error(errno))
+			{
+				log_warn("Connection lost: %s", strerror(errno));
+				ret = HTTPC_INCOMPLETE;
+				break;
+			}
+			*left = count;
+			return sink_error(sink);
+		}
+
+		if(bytes == 0)
+			break;
+
+		count -= bytes;
+		deadline_arm(&req->deadlines, DEADLINE_IDLE);
+
+		if(count && time_left_ms(req) == 0)
+		{
+			*left = count;
+			return report_timeout(req);
+		}
+	}
+
+	*left = count;
+	return ret;
+}
+
+/*
+	Resolves the host of "u" and connects to it (and performs TLS handshake for https://).
+	Returns the connected socket or HTTPC_ERR_* code.
+*/
+static int open_connection(struct request *req, const struct http_url *u)
+{
+	const char *host = u->host;
+	const char *port = u->port;
+
+	/* Convert "host" into IP address (unless it is already an address).
+		Redirect hops to the same host are answered from the cache (see dns.c). */
+
+	deadline_arm(&req->deadlines, DEADLINE_CONNECT);
+
+	struct addrinfo *ai;
+	int ret = dns_resolve(host, port, &ai);
+	if(ret != 0)
+	{
+		log_error("Bad hostname or address: \"%s\": %s", host, gai_strerror(ret));
+		return HTTPC_ERR_DNS;
+	}
+	timing_mark(req->timing, TIMING_DNS);
+
+	// "ai" is a linked list: all addresses are tried (see connect.c),
+	// the first one to accept the connection wins
+	struct happy_eyeballs he;
+
+	log_info("Connecting to %s:%s...", host, port);
+	int sock = connect_happy_eyeballs(ai, &he, time_left_ms(req));
+	dns_freeaddrinfo(ai);
+
+	if(sock < 0)
+	{
+		if(errno == ETIMEDOUT && time_left_ms(req) == 0)
+			return report_timeout(req);
+
+		log_error("connect(%s:%s) failed: %s", host, port, strerror(errno));
+		return HTTPC_ERR_CONNECT;
+	}
+	timing_mark(req->timing, TIMING_CONNECT);
+
+	log_info("Connected to %s:%s OK (address %s, %.1f ms)", host, port, he.winner_address, he.elapsed_ms);
+	pool_stats.created ++;
+
+	/* TLS handshake is a part of connecting (the same deadline) */
+	if(u->tls)
+	{
+		update_socket_timeout(req, sock, 1);
+		if(tls_connect(sock, host, port) < 0)
+		{
+			int err = errno;
+			close(sock);
+
+			if(err == EAGAIN)
+				return report_timeout(req);
+			return err == ENOMEM ? HTTPC_ERR_NOMEM : HTTPC_ERR_TLS;
+		}
+		timing_mark(req->timing, TIMING_TLS);
+	}
+	deadline_disarm(&req->deadlines, DEADLINE_CONNECT);
+
+	return sock;
+}
+
+/*
+	Reads the response body and passes it into "sink".
+	The body is either "len" bytes long, or chunked, or lasts until
+	the server closes the connection (see "framing").
+
+	First "prefetched_length" bytes of the body have already been read
+	(together with HTTP headers) into "prefetched".
+
+	Returns HTTPC_OK, HTTPC_INCOMPLETE (body is known to be incomplete) or an error.
+	"*reusable" is set to 1 if the body has been read exactly up to its end
+	(so the connection can be reused for another request), to 0 otherwise.
+*/
+static int read_response_body(struct body_sink *sink, int sock,
+	const char *prefetched, size_t prefetched_length,
+	const struct body_framing *framing, int *reusable)
+{
+	unsigned long len = framing->len;
+	size_t prefetched_bytes_needed;
+	int ret;
+
+	*reusable = 1;
+
+	if(!framing->is_chunked)
+	{
+		prefetched_bytes_needed = prefetched_length;
+		if(len < prefetched_length)
+		{
+			prefetched_bytes_needed = len;
+
+			log_warn("Detecting (and ignoring) extra data in HTTP response (beyond the length specified by server).");
+			*reusable = 0;
+		}
+
+		if(sink_write(sink, prefetched, prefetched_bytes_needed) < 0)
+		{
+			*reusable = 0;
+			return sink_error(sink);
+		}
+
+		len -= prefetched_bytes_needed;
+		if(len == 0) // Everything read OK.
+			return HTTPC_OK;
+
+		size_t left;
+		ret = read_from_socket(sink, sock, len, &left);
+
+		if(ret == HTTPC_OK && !framing->no_length && left > 0)
+		{
+			log_warn("Response has ended prematurely (either the server has transmitted wrong length or the response body we received is incomplete)");
+			ret = HTTPC_INCOMPLETE;
+		}
+
+		if(ret != HTTPC_OK || framing->no_length)
+			*reusable = 0;
+		return ret;
+	}
+
+	/* chunked method. Chunk headers are parsed in a large buffer (many small
+		chunks are received with one read() and written with one writev()),
+		and long chunks are moved from socket into the file via splice(). */
+	char *chunk_buffer = sink->req->client->chunk_buffer;
+	struct chunked_decoder chunked;
+	struct iovec iov[CHUNKED_MAX_IOV];
+	chunked_init(&chunked);
+
+	const char *data = prefetched; // not yet decoded part of the body
+	size_t data_length = prefetched_length;
+
+	*reusable = 0;
+
+	while(1)
+	{
+		while(data_length > 0 && !chunked_is_done(&chunked))
+		{
+			int iovcnt;
+			ssize_t used = chunked_decode_iov(&chunked, data, data_length, iov, CHUNKED_MAX_IOV, &iovcnt);
+			if(used < 0)
+			{
+				log_error("Malformed chunked response body: %s.", chunked.error);
+				return HTTPC_ERR_PROTOCOL;
+			}
+
+			if(sink_write_iov(sink, iov, iovcnt) < 0)
+				return sink_error(sink);
+
+			data += used;
+			data_length -= used;
+		}
+
+		if(chunked_is_done(&chunked))
+		{
+			log_debug("Last chunk received (%lu chunks, %u trailer fields).", chunked.chunks, chunked.trailers);
+
+			if(data_length > 0)
+				log_warn("Detecting (and ignoring) extra data in HTTP response (after the last chunk).");
+			else
+				*reusable = 1;
+			return HTTPC_OK;
+		}
+
+		if(time_left_ms(sink->req) == 0)
+			return report_timeout(sink->req);
+
+		/* Read the remainder of a long chunk directly into the file */
+		unsigned long long raw_length = chunked_data_remaining(&chunked);
+		if(raw_length >= CHUNKED_SPLICE_MIN)
+		{
+			size_t left;
+			ret = read_from_socket(sink, sock, raw_length, &left);
+			chunked_data_consumed(&chunked, raw_length - left);
+
+			if(ret < 0)
+				return ret;
+			if(ret == HTTPC_INCOMPLETE || left > 0)
+				break;
+			continue;
+		}
+
+		update_socket_timeout(sink->req, sock, 0);
+
+		ssize_t bytes = tls_read(sock, chunk_buffer, CHUNKED_BUFFER_SIZE);
+		if(bytes < 0)
+		{
+			if(is_connection_error(errno))
+			{
+				log_warn("Connection lost: %s", strerror(errno));
+				break;
+			}
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return report_timeout(sink->req);
+
+			log_error("read(sock) failed: %s", strerror(errno));
+			return HTTPC_ERR_IO;
+		}
+		transfer_stats.read_calls ++;
+
+		if(bytes == 0)
+			break;
+		deadline_arm(&sink->req->deadlines, DEADLINE_IDLE);
+
+		data = chunk_buffer;
+		data_length = bytes;
+	}
+
+	log_warn("Response has ended prematurely (while waiting for another chunk). It might be incomplete");
+	return HTTPC_INCOMPLETE;
+}
+
+/* Returns 1 if the request body must wait for "100 Continue" */
+static int expects_continue(const struct request *req)
+{
+	const struct httpc_options *options = req->options;
+	return req->send_body && !req->no_expect && options->expect_continue_min > 0 &&
+		options->body_length >= options->expect_continue_min;
+}
+
+/* Formats the request line and headers for this hop (see the options), without options->headers */
+static int format_hop_request(struct request *req, char **request, const struct http_url *u)
+{
+	const struct httpc_options *options = req->options;
+	int is_get = !strcmp(req->method, "GET");
+
+	if(is_get && options->range_from > 0)
+		return format_range_request(req->arena, request, u, options->range_from, -1, options->if_range);
+
+	const char *etag = is_get ? options->if_none_match : NULL;
+	const char *last_modified = is_get ? options->if_modified_since : NULL;
+
+	/* Methods which usually have a body send "Content-Length: 0" without it */
+	int has_length = req->send_body || !strcmp(req->method, "POST") || !strcmp(req->method, "PUT") || !strcmp(req->method, "PATCH");
+	char content_length[80] = "";
+	if(has_length)
+		snprintf(content_length, sizeof(content_length), "Content-Length: %llu\r\n%s",
+			req->send_body ? options->body_length : 0, expects_continue(req) ? "Expect: 100-continue\r\n" : "");
+
+	char *extra_headers = arena_printf(req->arena, "%s%s%s%s%s%s%s",
+		etag ? "If-None-Match: " : "", etag ? etag : "", etag ? "\r\n" : "",
+		last_modified ? "If-Modified-Since: " : "", last_modified ? last_modified : "", last_modified ? "\r\n" : "",
+		content_length);
+	if(!extra_headers)
+		return -1;
+
+	return format_request_with(req->arena, request, req->method, u, options->decompress ? ACCEPT_ENCODING : "identity", extra_headers);
+}
+
+/* Sends the request: its headers, options->headers and the empty line in one sendmsg() */
+static int send_request_head(struct request *req, int sock, const char *request, int request_length)
+{
+	const char *headers = req->options->headers ? req->options->headers : "";
+
+	struct iovec iov[3];
+	iov[0].iov_base = (char *) request;
+	iov[0].iov_len = request_length - 2; // without the empty line
+	iov[1].iov_base = (char *) headers;
+	iov[1].iov_len = strlen(headers);
+	iov[2].iov_base = "\r\n";
+	iov[2].iov_len = 2;
+
+	/* The body follows right away: it can start in the same packet */
+	int more = req->send_body && !expects_continue(req);
+	return tls_sendv(sock, iov, 3, more);
+}
+
+/*
+	Sends the request body (options->body_fd) via tls_sendfile().
+	Returns HTTPC_OK or HTTPC_ERR_* code. If the connection has been closed (e.g. the server
+	has answered before reading the whole body), HTTPC_OK is returned and errno is stored
+	into "*send_errno": the response can still be read.
+*/
+static int send_request_body(struct request *req, int sock, int *send_errno)
+{
+	const struct httpc_options *options = req->options;
+	off_t offset = options->body_offset;
+	unsigned long long left = options->body_length;
+
+	/* Blocking send (SO_SNDTIMEO limits how long it takes) */
+	int flags = fcntl(sock, F_GETFL);
+	if(flags >= 0 && (flags & O_NONBLOCK))
+		fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
+
+	log_info("Sending the request body (%llu bytes)...", left);
+	deadline_disarm(&req->deadlines, DEADLINE_FIRST_BYTE); // the response can't be expected yet
+	deadline_arm(&req->deadlines, DEADLINE_IDLE);
+
+	int ret = HTTPC_OK;
+	while(left > 0)
+	{
+		if(time_left_ms(req) == 0)
+		{
+			ret = report_timeout(req);
+			break;
+		}
+		update_socket_timeout(req, sock, 0);
+
+		size_t count = left < SEND_BODY_MAX ? left : SEND_BODY_MAX;
+		ssize_t sent = tls_sendfile(sock, options->body_fd, &offset, count);
+		if(sent < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(is_connection_error(errno))
+			{
+				log_warn("Connection was closed while sending the request body: %s", strerror(errno));
+				*send_errno = errno;
+				break;
+			}
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				ret = report_timeout(req);
+			else
+			{
+				log_error("sendfile() failed: %s", strerror(errno));
+				ret = HTTPC_ERR_IO;
+			}
+			break;
+		}
+		if(sent == 0)
+		{
+			log_error("Request body has ended prematurely (file is shorter than %llu bytes).", options->body_length);
+			ret = HTTPC_ERR_IO;
+			break;
+		}
+
+		left -= sent;
+		deadline_arm(&req->deadlines, DEADLINE_IDLE); // Nothing is received while we're sending
+	}
+
+	if(ret == HTTPC_OK && left == 0)
+		log_info("Request body sent OK.");
+	deadline_disarm(&req->deadlines, DEADLINE_IDLE); // until the response starts
+	deadline_arm(&req->deadlines, DEADLINE_FIRST_BYTE);
+
+	if(flags >= 0 && (flags & O_NONBLOCK))
+		fcntl(sock, F_SETFL, flags);
+	return ret;
+}
+
+/*
+	Redirect "code": what method should be used for the next hop?
+	303 See Other is always followed with GET (except HEAD), and so are 301 and 302
+	in response to POST (like browsers do). 307 and 308 repeat the request with its body.
+*/
+static void follow_redirect_method(struct request *req, unsigned short code)
+{
+	int is_post = !strcmp(req->method, "POST");
+	if((code == 303 && strcmp(req->method, "HEAD")) || ((code == 301 || code == 302) && is_post))
+	{
+		if(strcmp(req->method, "GET"))
+			log_notice("Redirect %i: the next request is GET (without the body).", code);
+		req->method = "GET";
+		req->send_body = 0;
+	}
+}
+
+/* Only these can use the cache of permanent redirects (see redirect.h) */
+static int is_safe_request(const struct request *req)
+{
+	return !req->send_body && (!strcmp(req->method, "GET") || !strcmp(req->method, "HEAD"));
+}
+
+/* Is it a redirect which we should follow? */
+static int is_redirect(const struct request *req, const struct http_response *response)
+{
+	unsigned short code = response->code;
+
+	/* 304 Not Modified is not a redirect, and neither is 3xx without Location (e.g. 300 Multiple Choices) */
+	return code >= 300 && code < 400 && code != 304 &&
+		req->options->max_redirects > 0 && http_known_header(response, HDR_LOCATION);
+}
+
+/*
+	Performs one request (hop) to "URL".
+	If the response is a redirect, "*location" receives its target (absolute URL
+	in req->arena), and the request to it must be performed next.
+	Returns HTTPC_OK, HTTPC_INCOMPLETE or HTTPC_ERR_* code.
+*/
+static int perform_hop(struct request *req, const char *URL, char **location)
+{
+	struct httpc_client *client = req->client;
+	struct http_url u;
+	int ret;
+
+	timing_hop(req->timing);
+
+	char *url_copy = arena_strdup(req->arena, URL); // parse_url() modifies it
+	if(!url_copy)
+		return report_nomem("arena_strdup");
+
+	if(parse_url(url_copy, &u) != 0)
+		return HTTPC_ERR_URL;
+
+	char *request = NULL;
+	int request_length;
+	int sock = -1;
+
+	int body_pending = 0; // 1 if the body waits for "100 Continue"
+	long long body_wait_until = 0; // ... until this time (see HTTPC_EXPECT_TIMEOUT_MS), then it's sent anyway
+	int send_errno = 0; // connection was closed while the body was being sent
+
+	struct httpc_response response;
+	http_response_init(&response.http, req->arena);
+
+	/* Reuse the keep-alive connection to the same host:port (if we have one) */
+	int reused = 0;
+	sock = pool_acquire(&u);
+	if(sock >= 0)
+	{
+		log_info("Reusing the connection to %s:%s", u.host, u.port);
+		reused = 1;
+	}
+	else
+	{
+		sock = open_connection(req, &u);
+		if(sock < 0)
+		{
+			ret = sock;
+			sock = -1;
+			goto done;
+		}
+	}
+	timing_set_reused(req->timing, reused);
+
+	goto send_request;
+
+reconnect:
+	/* Reused connection might have been closed by server
+		right before we've sent the request. Not an error:
+		just try again with a new connection. */
+	log_info("Keep-alive connection was closed by server, reconnecting...");
+retry:
+	tls_close(sock);
+
+	timing_retry(req->timing);
+	sock = open_connection(req, &u);
+	if(sock < 0)
+	{
+		ret = sock;
+		sock = -1;
+		goto done;
+	}
+	reused = 0;
+
+send_request:
+	request_length = format_hop_request(req, &request, &u);
+	if(request_length < 0)
+	{
+		ret = report_nomem("arena_printf");
+		goto done;
+	}
+
+	log_info("Sending request to server...");
+	log_debug("Contents of HTTP request: [%s]", request);
+
+	update_socket_timeout(req, sock, 1);
+	if(send_request_head(req, sock, request, request_length) < 0)
+	{
+		if(reused)
+			goto reconnect;
+
+		if(errno == EAGAIN || errno == EWOULDBLOCK)
+			ret = report_timeout(req);
+		else
+		{
+			log_error("send() failed: %s", strerror(errno));
+			ret = HTTPC_ERR_IO;
+		}
+		goto done;
+	}
+
+	/* Request body: either right away or after "100 Continue" (see below) */
+	body_pending = 0;
+	send_errno = 0;
+	if(expects_continue(req))
+	{
+		log_info("Waiting for \"100 Continue\" before sending the body...");
+		body_pending = 1;
+		body_wait_until = deadline_now_ms() + HTTPC_EXPECT_TIMEOUT_MS;
+	}
+	else if(req->send_body && (ret = send_request_body(req, sock, &send_errno)) != HTTPC_OK)
+		goto done;
+
+	log_info("Request sent OK.");
+	timing_mark(req->timing, TIMING_REQUEST);
+	deadline_arm(&req->deadlines, DEADLINE_FIRST_BYTE);
+	deadline_disarm(&req->deadlines, DEADLINE_IDLE); // until the response starts
+
+	/* Read the reply. Here we must put the socket into non-blocking mode,
+		because when we're reading headers, we can try to read more
+		than exists in the response, if the response is small enough
+		(less than the size of buffer). Which would cause timeout.
+	*/
+	if(fcntl(sock, F_SETFL, O_NONBLOCK) < 0)
+	{
+		log_error("fcntl() failed: %s", strerror(errno));
+		ret = HTTPC_ERR_IO;
+		goto done;
+	}
+
+	// We'll read the headers into client->buffer (it grows if the headers are long)
+	// and parse them with http_parse_response() as they arrive
+	size_t buffer_length = 0;
+	ssize_t body_offset;
+
+	struct pollfd fds;
+	fds.fd = sock;
+	fds.events = POLLIN;
+
+	while(1)
+	{
+		/* The body which waits for "100 Continue" is not waiting forever */
+		int wait_ms = time_left_ms(req);
+		if(body_pending)
+		{
+			long long body_wait_ms = body_wait_until - deadline_now_ms();
+			if(body_wait_ms < 0)
+				body_wait_ms = 0;
+			if(wait_ms < 0 || body_wait_ms < wait_ms)
+				wait_ms = body_wait_ms;
+		}
+
+		// Data which OpenSSL has already received is not reported by poll()
+		int ready = tls_pending(sock) ? 1 : poll(&fds, 1, wait_ms);
+		if(ready < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			log_error("poll() failed: %s", strerror(errno));
+			ret = HTTPC_ERR_IO;
+			goto done;
+		}
+		if(ready == 0 && body_pending && time_left_ms(req) != 0)
+		{
+			log_info("No \"100 Continue\" from the server in %u ms, sending the body anyway.", HTTPC_EXPECT_TIMEOUT_MS);
+			body_pending = 0;
+			if((ret = send_request_body(req, sock, &send_errno)) != HTTPC_OK)
+				goto done;
+			continue;
+		}
+		if(ready == 0)
+		{
+			ret = report_timeout(req);
+			goto done;
+		}
+
+		if(buffer_length == client->buffer_size)
+		{
+			// Long headers (e.g. a lot of cookies): make the buffer larger.
+			// http_parse_response() has a sanity limit for their length.
+			char *buffer = realloc(client->buffer, client->buffer_size * 2);
+			if(!buffer)
+			{
+				ret = report_nomem("realloc");
+				goto done;
+			}
+			client->buffer = buffer;
+			client->buffer_size *= 2;
+		}
+
+		ssize_t bytes_received = tls_read(sock, client->buffer + buffer_length, client->buffer_size - buffer_length);
+		if(bytes_received <= 0)
+		{
+			if(bytes_received < 0 && errno == EAGAIN)
+				continue;
+
+			if(reused && buffer_length == 0 &&
+				(bytes_received == 0 || errno == ECONNRESET))
+			{
+				http_response_init(&response.http, req->arena);
+				goto reconnect;
+			}
+
+			if(send_errno && buffer_length == 0)
+				log_error("send() failed: %s", strerror(send_errno));
+			else if(bytes_received == 0)
+				log_error("Connection closed by server before all HTTP response headers were received.");
+			else
+				log_error("read(sock) failed: %s", strerror(errno));
+
+			ret = HTTPC_ERR_IO;
+			goto done;
+		}
+
+		if(buffer_length == 0)
+		{
+			timing_mark(req->timing, TIMING_FIRST_BYTE);
+			deadline_disarm(&req->deadlines, DEADLINE_FIRST_BYTE);
+		}
+		deadline_arm(&req->deadlines, DEADLINE_IDLE);
+
+		buffer_length += bytes_received;
+
+parse:
+		// Only the new data is parsed (the parser remembers where it has stopped)
+		body_offset = http_parse_response(&response.http, client->buffer, buffer_length);
+		if(body_offset < 0)
+		{
+			ret = HTTPC_ERR_PROTOCOL;
+			goto done;
+		}
+
+		if(body_offset == 0)
+			continue;
+
+		/* Interim response (e.g. "100 Continue"): the final one follows it */
+		if(response.http.code >= 100 && response.http.code < 200 && response.http.code != 101)
+		{
+			if(response.http.code == 100 && body_pending)
+			{
+				log_info("Server has answered \"100 Continue\".");
+				body_pending = 0;
+				if((ret = send_request_body(req, sock, &send_errno)) != HTTPC_OK)
+					goto done;
+			}
+
+			buffer_length -= body_offset;
+			memmove(client->buffer, client->buffer + body_offset, buffer_length);
+			http_response_init(&response.http, req->arena);
+
+			if(buffer_length > 0)
+				goto parse;
+			continue;
+		}
+
+		break; // Start of the response body
+	}
+
+	log_info("All HTTP response headers have been received");
+	timing_mark(req->timing, TIMING_HEADERS);
+	timing_set_code(req->timing, response.http.code);
+
+	/* Server has answered without waiting for the body */
+	if(body_pending && response.http.code == 417 && !req->no_expect)
+	{
+		log_notice("Server doesn't support \"Expect: 100-continue\", sending the request again without it.");
+		req->no_expect = 1;
+		http_response_init(&response.http, req->arena);
+		timing_retry(req->timing);
+		goto retry;
+	}
+	if(body_pending)
+		log_notice("Server has answered %i without waiting for the request body: it was not sent.", response.http.code);
+
+	/* Catch the "wrong" status codes */
+	unsigned short code = response.http.code;
+	if(code < 100)
+	{
+		log_error("Server has returned code %i. What?", code);
+		ret = HTTPC_ERR_PROTOCOL;
+		goto done;
+	}
+	if(code < 200)
+	{
+		log_error("Server has returned code %i, which is quite strange (we didn't send the Upgrade header). Anyway, responses with 1xx codes can't have content.", code);
+		ret = HTTPC_ERR_PROTOCOL;
+		goto done;
+	}
+
+	// Part of the response body could have been read together with headers
+	char *line = client->buffer + body_offset;
+	size_t prefetched_body_length = buffer_length - body_offset;
+
+	struct body_framing framing;
+	if(get_body_framing(&response.http, &framing) < 0)
+	{
+		ret = HTTPC_ERR_PROTOCOL;
+		goto done;
+	}
+
+	/* Response to HEAD has no body (Content-Length is the one GET would have) */
+	if(!strcmp(req->method, "HEAD"))
+		memset(&framing, 0, sizeof(framing));
+
+	/* If the body wasn't sent completely, the server might still be waiting for its end */
+	int keep_alive = is_keep_alive(&response.http) && !body_pending && !send_errno;
+	int reusable;
+
+	/* Put the socket back into the blocking mode */
+	if(fcntl(sock, F_SETFL, 0) < 0)
+	{
+		log_error("fcntl() failed: %s", strerror(errno));
+		ret = HTTPC_ERR_IO;
+		goto done;
+	}
+	update_socket_timeout(req, sock, 1);
+
+	struct body_sink sink;
+	memset(&sink, 0, sizeof(sink));
+	sink.req = req;
+	sink.fd = -1;
+
+	/* OK, we've parsed the headers. Is it a redirect? */
+	if(is_redirect(req, &response.http))
+	{
+		const char *location_header = http_known_header(&response.http, HDR_LOCATION);
+		log_notice("Server returned redirect: %s", location_header);
+
+		if(++ req->redirect_nr > req->options->max_redirects)
+		{
+			log_error("Redirects depth limit reached: maximum %u are allowed", req->options->max_redirects);
+			ret = HTTPC_ERR_REDIRECTS;
+			goto done;
+		}
+
+		*location = resolve_location(req->arena, &u, location_header);
+		if(!*location)
+		{
+			ret = report_nomem("resolve_location");
+			goto done;
+		}
+		if(is_safe_request(req))
+			redirect_store(req->arena, &u, *location, &response.http);
+		follow_redirect_method(req, code);
+
+		/* Body of the redirect is not needed, but it must be read
+			(if it's not too long), otherwise we can't send the next
+			request via the same connection */
+		if(keep_alive && !framing.no_length && (framing.is_chunked || framing.len <= MAX_DRAIN_LENGTH))
+		{
+			sink.discard = 1;
+			if(read_response_body(&sink, sock, line, prefetched_body_length, &framing, &reusable) != HTTPC_OK || !reusable)
+				keep_alive = 0;
+		}
+		else keep_alive = 0;
+
+		if(keep_alive)
+			pool_release(&u, sock);
+		else
+			tls_close(sock);
+		sock = -1;
+
+		timing_mark(req->timing, TIMING_BODY);
+		ret = HTTPC_OK;
+		goto done;
+	}
+
+	/* Compressed response (we have sent Accept-Encoding) */
+	struct content_decoder decoder;
+	const char *content_encoding = NULL;
+	if(req->options->decompress && code != 204 && code != 304) // these never have a body
+		content_encoding = http_known_header(&response.http, HDR_CONTENT_ENCODING);
+
+	if(content_decoder_init(&decoder, content_encoding ? content_encoding : "") < 0)
+	{
+		log_error("Server has returned Content-Encoding: %s, but %s.", content_encoding, decoder.error);
+		ret = HTTPC_ERR_ENCODING;
+		goto done;
+	}
+	sink.decoder = &decoder;
+	decoder.digest = req->options->digest;
+
+	response.url = URL;
+	response.redirects = req->redirect_nr;
+	response.decompressed = decoder.coding != CODING_IDENTITY;
+	response.content_length = (framing.is_chunked || framing.no_length) ? -1 : (long long) framing.len;
+
+	/* Where should the body go? */
+	int destination = HTTPC_BODY_CALLBACK;
+	if(req->callbacks->on_headers)
+		destination = req->callbacks->on_headers(req->opaque, &response);
+
+	if(destination == HTTPC_ABORT)
+	{
+		ret = HTTPC_ERR_ABORTED;
+		keep_alive = 0;
+	}
+	else
+	{
+		if(destination >= 0)
+			sink.fd = destination;
+		else if(destination == HTTPC_SKIP_BODY)
+			sink.discard = 1;
+
+		log_info("Reading response body...");
+		ret = read_response_body(&sink, sock, line, prefetched_body_length, &framing, &reusable);
+		if(ret != HTTPC_OK || !reusable)
+			keep_alive = 0;
+
+		if(ret == HTTPC_OK && !content_decoder_is_done(&decoder))
+		{
+			log_warn("Compressed response body has ended prematurely. It might be incomplete");
+			ret = HTTPC_INCOMPLETE;
+		}
+		else if(ret == HTTPC_OK && response.decompressed)
+			log_info("Response body was decompressed (Content-Encoding: %s).", content_encoding);
+	}
+	timing_mark(req->timing, TIMING_BODY);
+
+	if(req->callbacks->on_complete)
+		req->callbacks->on_complete(req->opaque, &response, ret);
+
+	content_decoder_free(&decoder);
+
+	if(keep_alive)
+		pool_release(&u, sock);
+	else
+		tls_close(sock);
+	sock = -1;
+
+done:
+	if(sock >= 0)
+		tls_close(sock);
+
+	return ret;
+}
+
+struct httpc_client *httpc_client_new(void)
+{
+	struct httpc_client *client = calloc(1, sizeof(struct httpc_client));
+	if(!client)
+		return NULL;
+
+	client->buffer_size = HTTP_HEADERS_BUFFER_SIZE;
+	client->buffer = malloc(client->buffer_size);
+	client->chunk_buffer = malloc(CHUNKED_BUFFER_SIZE);
+	client->body_buffer = malloc(TRANSFER_BUFFER_SIZE);
+
+	if(!client->buffer || !client->chunk_buffer || !client->body_buffer)
+	{
+		httpc_client_free(client);
+		return NULL;
+	}
+	return client;
+}
+
+void httpc_client_free(struct httpc_client *client)
+{
+	if(!client)
+		return;
+
+	pool_close_all();
+	arena_free_unused();
+
+	free(client->buffer);
+	free(client->chunk_buffer);
+	free(client->body_buffer);
+	free(client);
+}
+
+void httpc_options_init(struct httpc_options *options)
+{
+	memset(options, 0, sizeof(struct httpc_options));
+	options->timeout_ms = deadline_limits.ms[DEADLINE_TOTAL];
+	options->connect_timeout_ms = deadline_limits.ms[DEADLINE_CONNECT];
+	options->first_byte_timeout_ms = deadline_limits.ms[DEADLINE_FIRST_BYTE];
+	options->idle_timeout_ms = deadline_limits.ms[DEADLINE_IDLE];
+	options->max_redirects = max_redirects;
+	options->decompress = 1;
+	options->body_fd = -1;
+	options->expect_continue_min = HTTPC_EXPECT_CONTINUE_MIN;
+	options->log_level = HTTPC_LOG_DEBUG;
+}
+
+int httpc_get(struct httpc_client *client, const char *url, const struct httpc_options *options,
+	const struct httpc_callbacks *callbacks, void *opaque)
+{
+	return httpc_request(client, "GET", url, options, callbacks, opaque);
+}
+
+int httpc_request(struct httpc_client *client, const char *method, const char *url, const struct httpc_options *options,
+	const struct httpc_callbacks *callbacks, void *opaque)
+{
+	struct httpc_options default_options;
+	if(!options)
+	{
+		httpc_options_init(&default_options);
+		options = &default_options;
+	}
+
+	struct request_timing timing;
+	if(!options->timing)
+		timing_start(&timing);
+
+	struct request req;
+	req.client = client;
+	req.options = options;
+	req.callbacks = callbacks ? callbacks : &no_callbacks;
+	req.opaque = opaque;
+	req.timing = options->timing ? options->timing : &timing;
+	req.redirect_nr = 0;
+	req.sock_timeout_ms = -1;
+	req.method = method;
+	req.send_body = options->body_fd >= 0;
+	req.no_expect = 0;
+
+	req.limits.ms[DEADLINE_CONNECT] = options->connect_timeout_ms;
+	req.limits.ms[DEADLINE_FIRST_BYTE] = options->first_byte_timeout_ms;
+	req.limits.ms[DEADLINE_IDLE] = options->idle_timeout_ms;
+	req.limits.ms[DEADLINE_TOTAL] = options->timeout_ms;
+	deadlines_start(&req.deadlines, &req.limits);
+
+	struct log_target previous_log = log_set(options->log_callback, options->log_opaque, options->log_level);
+
+	req.arena = arena_get();
+	if(!req.arena)
+	{
+		report_nomem("arena_get");
+		log_target = previous_log;
+		return HTTPC_ERR_NOMEM;
+	}
+
+	/* Permanent redirects which we already know about: go straight to the target */
+	const char *hop_url = options->max_redirects > 0 && is_safe_request(&req) ? redirect_lookup(req.arena, url, &req.redirect_nr) : NULL;
+	if(hop_url)
+	{
+		log_notice("Known permanent redirect: %s", hop_url);
+		redirect_stats.used ++;
+	}
+	else
+		hop_url = url;
+
+	int ret;
+	while(1)
+	{
+		char *location = NULL;
+		ret = perform_hop(&req, hop_url, &location);
+
+		if(ret != HTTPC_OK || !location)
+			break;
+
+		hop_url = location; // Follow the redirect
+	}
+
+	arena_put(req.arena);
+	log_target = previous_log;
+	return ret;
+}
+
+const char *httpc_strerror(int error)
+{
+	switch(error)
+	{
+		case HTTPC_OK: return "Success";
+		case HTTPC_INCOMPLETE: return "Response body has ended prematurely";
+		case HTTPC_ERR_URL: return "Malformed or unsupported URL";
+		case HTTPC_ERR_DNS: return "Hostname can't be resolved";
+		case HTTPC_ERR_CONNECT: return "Can't connect to the server";
+		case HTTPC_ERR_IO: return "Input/output error";
+		case HTTPC_ERR_PROTOCOL: return "Malformed response";
+		case HTTPC_ERR_REDIRECTS: return "Too many redirects";
+		case HTTPC_ERR_TIMEOUT: return "Timeout";
+		case HTTPC_ERR_CONNECT_TIMEOUT: return "Timeout while connecting";
+		case HTTPC_ERR_FIRST_BYTE_TIMEOUT: return "Timeout while waiting for the response";
+		case HTTPC_ERR_IDLE_TIMEOUT: return "Timeout: nothing received for too long";
+		case HTTPC_ERR_NOMEM: return "Out of memory";
+		case HTTPC_ERR_ENCODING: return "Unsupported or malformed Content-Encoding";
+		case HTTPC_ERR_ABORTED: return "Aborted";
+		case HTTPC_ERR_TLS: return "TLS handshake has failed";
+	}
+	return "Unknown error";
+}
+
+int httpc_set_ca_file(const char *filename)
+{
+	return tls_set_ca_file(filename) == 0 ? HTTPC_OK : HTTPC_ERR_TLS;
+}
+
+int httpc_response_code(const struct httpc_response *response)
+{
+	return response->http.code;
+}
+
+const char *httpc_response_status(const struct httpc_response *response)
+{
+	return http_status_text(&response->http);
+}
+
+const char *httpc_response_url(const struct httpc_response *response)
+{
+	return response->url;
+}
+
+unsigned httpc_response_redirects(const struct httpc_response *response)
+{
+	return response->redirects;
+}
+
+int httpc_response_decompressed(const struct httpc_response *response)
+{
+	return response->decompressed;
+}
+
+const char *httpc_response_header(const struct httpc_response *response, const char *name)
+{
+	return find_header(&response->http, name);
+}
+
+long long httpc_response_content_length(const struct httpc_response *response)
+{
+	return response->content_length;
+}
+
+const struct http_response *httpc_response_parsed(const struct httpc_response *response)
+{
+	return &response->http;
+}
@@ -0,0 +1,222 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_HTTPCLIENT_H
+#define HTTP_CLIENT_HTTPCLIENT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+	libhttpclient: HTTP/1.1 client which can be embedded into other programs
+	(libhttpclient.a or libhttpclient.so). Requests are performed in the calling
+	thread; headers and body of the response are passed to the callbacks.
+	Errors are returned (never exit()).
+
+	Example:
+		struct httpc_client *client = httpc_client_new();
+		struct httpc_options options;
+		struct httpc_callbacks callbacks = { NULL, on_body, NULL };
+
+		httpc_options_init(&options);
+		int ret = httpc_get(client, "http://example.com/", &options, &callbacks, opaque);
+		if(ret < 0)
+			fprintf(stderr, "Failed: %s\n", httpc_strerror(ret));
+
+		httpc_client_free(client);
+
+	Uploads: httpc_request() with another method (e.g. "PUT") and the body
+	from a file (options.body_fd), which is sent via sendfile().
+
+	Both http:// and https:// URLs are supported (TLS via OpenSSL, the certificate
+	of the server is verified). Keep-alive connections, the DNS cache and the statistics
+	belong to the thread (they are shared by the clients of that thread only). TLS sessions
+	and the known permanent redirects are shared by the whole process. The library is
+	not thread-safe: TLS connections must only be made by one thread.
+
+	The library prints nothing by default. Its messages ("[info] Connecting to ...")
+	are passed to options.log_callback, e.g. httpc_log_stderr (as http_client does).
+*/
+
+/* Returned by httpc_get() */
+enum httpc_error {
+	HTTPC_OK = 0,
+	HTTPC_INCOMPLETE = 1, // response body has ended prematurely (what was received has been delivered)
+
+	HTTPC_ERR_URL = -1, // malformed or unsupported URL
+	HTTPC_ERR_DNS = -2, // hostname can't be resolved
+	HTTPC_ERR_CONNECT = -3, // can't connect to the server
+	HTTPC_ERR_IO = -4, // send(), read() or write() has failed (see errno)
+	HTTPC_ERR_PROTOCOL = -5, // malformed response
+	HTTPC_ERR_REDIRECTS = -6, // too many redirects (or redirect without Location)
+	HTTPC_ERR_TIMEOUT = -7, // total timeout of the request has expired
+	HTTPC_ERR_NOMEM = -8,
+	HTTPC_ERR_ENCODING = -9, // unsupported or malformed Content-Encoding
+	HTTPC_ERR_ABORTED = -10, // a callback has asked to stop
+	HTTPC_ERR_CONNECT_TIMEOUT = -11, // DNS lookup and connect() took too long
+	HTTPC_ERR_FIRST_BYTE_TIMEOUT = -12, // server hasn't started to respond in time
+	HTTPC_ERR_IDLE_TIMEOUT = -13, // nothing received (or sent, while uploading the body) for too long
+	HTTPC_ERR_TLS = -14 // TLS handshake has failed or the certificate can't be trusted
+};
+
+/* Returned by on_headers() */
+#define HTTPC_BODY_CALLBACK -1 // pass the body to on_body()
+#define HTTPC_SKIP_BODY -2 // the body is not needed
+#define HTTPC_ABORT -3 // stop the request (httpc_get() returns HTTPC_ERR_ABORTED)
+
+/* Request bodies of at least this size are sent with "Expect: 100-continue" (see httpc_options) */
+#define HTTPC_EXPECT_CONTINUE_MIN (1024 * 1024)
+#define HTTPC_EXPECT_TIMEOUT_MS 1000 // if the server doesn't answer "100 Continue" in time, the body is sent anyway
+
+/* Verbosity of the messages passed to httpc_options.log_callback */
+enum httpc_log_level {
+	HTTPC_LOG_ERROR,
+	HTTPC_LOG_WARN,
+	HTTPC_LOG_NOTICE,
+	HTTPC_LOG_INFO,
+	HTTPC_LOG_DEBUG
+};
+
+/* Receives one message (without the trailing newline) */
+typedef void (*httpc_log_callback)(void *opaque, enum httpc_log_level level, const char *message);
+
+struct httpc_client; // opaque
+struct httpc_response; // opaque, see the accessors below
+
+struct http_response; // see http.h
+struct request_timing; // see timing.h
+struct digest; // see digest.h
+
+struct httpc_options {
+	/* Timeouts in milliseconds (0: no limit), see deadline.h */
+	unsigned timeout_ms; // for the whole request (including redirects)
+	unsigned connect_timeout_ms; // DNS lookup and connect() of each hop
+	unsigned first_byte_timeout_ms; // from sending the request till the first byte of the response
+	unsigned idle_timeout_ms; // nothing received for this long
+
+	unsigned max_redirects; // 0: redirect is returned as the response
+	int decompress; // 1: send Accept-Encoding and decompress gzip/deflate responses
+
+	/* Additional request headers ("Name: value\r\n" lines) or NULL. They are sent
+		as they are (with writev(), not copied), after the headers of the request itself. */
+	const char *headers;
+
+	/*
+		Request body (e.g. for PUT or POST): "body_length" bytes of the file "body_fd" (-1: no body),
+		starting at "body_offset". It's sent via sendfile(): from the page cache into the socket.
+		It's sent again after 307 and 308 redirects (301, 302 and 303 are followed with GET).
+		If the body is at least "expect_continue_min" bytes long (0: never), the request has
+		"Expect: 100-continue": the body is only sent if the server agrees (e.g. not if it answers
+		413 Payload Too Large or 401 Unauthorized right away).
+	*/
+	int body_fd;
+	off_t body_offset;
+	unsigned long long body_length;
+	unsigned long long expect_continue_min;
+
+	/* Range request (GET only): only the bytes from "range_from" (if not 0) till the end are requested,
+		if the resource still has the validator "if_range" (if not NULL) */
+	unsigned long long range_from;
+	const char *if_range;
+
+	/* Conditional request (GET only): "304 Not Modified" is returned if the resource still has these validators */
+	const char *if_none_match; // ETag
+	const char *if_modified_since; // Last-Modified
+
+	struct request_timing *timing; // if not NULL, receives the phases of each hop (see timing.h)
+
+	/* If not NULL, the body of the final response (after decompression) is added to this digest
+		as it's written: on_headers() should digest_init() it. The body is then read()
+		and written, not moved via splice(). */
+	struct digest *digest;
+
+	/* Messages of the request up to "log_level" (default: HTTPC_LOG_DEBUG) are passed
+		to "log_callback" (default: NULL, nothing is logged) */
+	httpc_log_callback log_callback;
+	void *log_opaque;
+	enum httpc_log_level log_level;
+};
+
+struct httpc_callbacks {
+	/*
+		Called when the headers of the final response (not of a redirect) have been received
+		(including error responses, e.g. 404). Returns a file descriptor where the body must be
+		written (then it's moved there via splice() when possible, without copying it into userspace),
+		or one of HTTPC_BODY_CALLBACK, HTTPC_SKIP_BODY or HTTPC_ABORT.
+		If NULL, the body is passed to on_body().
+	*/
+	int (*on_headers)(void *opaque, const struct httpc_response *response);
+
+	/* Called for each part of the body (decompressed if needed). Returns 0 to continue, -1 to abort. */
+	int (*on_body)(void *opaque, const char *data, size_t length);
+
+	/* Called after the body (if the headers have been received), "result" is the same as returned by httpc_get() */
+	void (*on_complete)(void *opaque, const struct httpc_response *response, int result);
+};
+
+struct httpc_client *httpc_client_new(void);
+
+/* Also closes idle keep-alive connections (and frees the unused arenas of this thread, see arena.h) */
+void httpc_client_free(struct httpc_client *client);
+
+/* Fills "options" with the defaults: timeouts from deadline_limits (10 seconds for connect, 30 seconds
+	for the first byte and for idle, 60 seconds total), up to 7 redirects, decompression enabled,
+	no request body, "Expect: 100-continue" for bodies of HTTPC_EXPECT_CONTINUE_MIN bytes and more */
+void httpc_options_init(struct httpc_options *options);
+
+/*
+	Performs GET request to "url" (following redirects).
+	Permanent redirects are remembered, and the next request to the same URL
+	goes straight to the target (see redirect.h).
+	Returns HTTPC_OK, HTTPC_INCOMPLETE or one of HTTPC_ERR_* codes.
+	Note: HTTP errors (e.g. 404) are not errors here, see on_headers().
+*/
+int httpc_get(struct httpc_client *client, const char *url, const struct httpc_options *options,
+	const struct httpc_callbacks *callbacks, void *opaque);
+
+/*
+	Same as httpc_get(), but with another "method" (e.g. "HEAD", "PUT", "POST", "DELETE"),
+	and the body from options->body_fd (if any). Only GET and HEAD use the known
+	permanent redirects. Returns the same codes as httpc_get().
+*/
+int httpc_request(struct httpc_client *client, const char *method, const char *url, const struct httpc_options *options,
+	const struct httpc_callbacks *callbacks, void *opaque);
+
+const char *httpc_strerror(int error);
+
+/* Logger which prints "[level] message" lines to stderr (log_opaque is not used) */
+void httpc_log_stderr(void *opaque, enum httpc_log_level level, const char *message);
+
+/* Trust the certificates from "filename" (PEM), in addition to the system ones (for the whole process).
+	Returns HTTPC_OK or HTTPC_ERR_TLS. */
+int httpc_set_ca_file(const char *filename);
+
+/* Accessors of the response (valid only inside the callbacks) */
+int httpc_response_code(const struct httpc_response *response);
+const char *httpc_response_status(const struct httpc_response *response); // e.g. "Not Found"
+const char *httpc_response_url(const struct httpc_response *response); // URL of the last redirect hop
+unsigned httpc_response_redirects(const struct httpc_response *response);
+int httpc_response_decompressed(const struct httpc_response *response); // 1 if Content-Encoding is being decoded
+
+/* Returns the value of the (first) header called "name" (case-insensitive), or NULL */
+const char *httpc_response_header(const struct httpc_response *response, const char *name);
+
+/* Returns the length of the body (as sent by the server, before decompression), -1 if unknown */
+long long httpc_response_content_length(const struct httpc_response *response);
+
+/* Low-level access to the parsed headers (see http.h) */
+const struct http_response *httpc_response_parsed(const struct httpc_response *response);
+
+#endif
@@ -0,0 +1,77 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "log.h"
+
+__thread struct log_target log_target = { NULL, NULL, HTTPC_LOG_DEBUG };
+
+struct log_target log_set(httpc_log_callback callback, void *opaque, enum httpc_log_level level)
+{
+	struct log_target previous = log_target;
+	log_target.callback = callback;
+	log_target.opaque = opaque;
+	log_target.level = level;
+	return previous;
+}
+
+void log_message(enum httpc_log_level level, const char *format, ...)
+{
+	char buffer[1024];
+	va_list ap;
+
+	va_start(ap, format);
+	int length = vsnprintf(buffer, sizeof(buffer), format, ap);
+	va_end(ap);
+
+	if(length < 0)
+		return;
+
+	if((size_t) length < sizeof(buffer))
+	{
+		log_target.callback(log_target.opaque, level, buffer);
+		return;
+	}
+
+	/* Long message (e.g. the whole request): formatted again into the heap */
+	char *message;
+	va_start(ap, format);
+	length = vasprintf(&message, format, ap);
+	va_end(ap);
+
+	if(length < 0)
+		return;
+
+	log_target.callback(log_target.opaque, level, message);
+	free(message);
+}
+
+void httpc_log_stderr(void *opaque __attribute__((unused)), enum httpc_log_level level, const char *message)
+{
+	static const char *names[] = {
+		[HTTPC_LOG_ERROR] = "error",
+		[HTTPC_LOG_WARN] = "warn",
+		[HTTPC_LOG_NOTICE] = "notice",
+		[HTTPC_LOG_INFO] = "info",
+		[HTTPC_LOG_DEBUG] = "debug"
+	};
+
+	fprintf(stderr, "[%s] %s\n", names[level], message);
+}
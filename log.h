@@ -0,0 +1,52 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_LOG_H
+#define HTTP_CLIENT_LOG_H
+
+#include "httpclient.h"
+
+/*
+	Messages of the library ("[info] Connecting to ...", "[error] ...").
+	They are passed to the logger of the current thread: httpc_request() uses
+	httpc_options.log_callback for the time of the request, http_client sets
+	httpc_log_stderr for all its threads. Without a logger (the default for
+	programs which embed the library) messages are not even formatted.
+*/
+
+struct log_target {
+	httpc_log_callback callback; // NULL: messages are discarded
+	void *opaque;
+	enum httpc_log_level level; // more verbose messages are discarded
+};
+extern __thread struct log_target log_target;
+
+/* Sets the logger of this thread, returns the previous one (to be restored by the caller) */
+struct log_target log_set(httpc_log_callback callback, void *opaque, enum httpc_log_level level);
+
+void log_message(enum httpc_log_level level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#define log_at(message_level, ...) do { \
+	if(log_target.callback && (message_level) <= log_target.level) \
+		log_message((message_level), __VA_ARGS__); \
+} while(0)
+
+#define log_error(...) log_at(HTTPC_LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(HTTPC_LOG_WARN, __VA_ARGS__)
+#define log_notice(...) log_at(HTTPC_LOG_NOTICE, __VA_ARGS__)
+#define log_info(...) log_at(HTTPC_LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(HTTPC_LOG_DEBUG, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,311 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#define _GNU_SOURCE // O_DIRECT, fallocate(), sync_file_range(), asprintf()
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "output.h"
+#include "transfer.h"
+#include "log.h"
+
+const char *output_name = OUTPUT_DEFAULT_NAME;
+int output_direct = 0;
+
+__thread struct output_stats output_stats;
+
+struct output_file {
+	int fd;
+	struct output_file *next; // in the list of open files of this thread
+
+	unsigned long long start; // where the body starts in the file
+	unsigned long long position; // where its next byte goes
+	unsigned long long allocated_end; // fallocate() has allocated the space till here (0 if it hasn't)
+	unsigned long long synced; // writeback has been started for the body till here
+
+	/* O_DIRECT: the buffer is written at "block_start" (aligned) when it's full */
+	int direct;
+	char *buffer;
+	size_t buffered;
+	unsigned long long block_start;
+};
+
+/* Files opened by this thread (there are few: one per request in progress) */
+static __thread struct output_file *files = NULL;
+
+int output_set_name(const char *path)
+{
+	size_t length = strlen(path);
+	struct stat st;
+
+	if(length > 0 && (path[length - 1] == '/' || (stat(path, &st) == 0 && S_ISDIR(st.st_mode))))
+	{
+		char *name;
+		if(asprintf(&name, "%s%s%s", path, path[length - 1] == '/' ? "" : "/", OUTPUT_DEFAULT_NAME) < 0)
+			return -1;
+
+		output_name = name;
+		return 0;
+	}
+
+	output_name = path;
+	return 0;
+}
+
+struct output_file *output_find(int fd)
+{
+	struct output_file *f;
+	for(f = files; f; f = f->next)
+	{
+		if(f->fd == fd)
+			return f;
+	}
+	return NULL;
+}
+
+int output_is_buffered(const struct output_file *f)
+{
+	return f->direct;
+}
+
+static void output_free(struct output_file *f)
+{
+	free(f->buffer);
+	free(f);
+}
+
+int output_open(const char *filename, unsigned long long offset, long long length)
+{
+	int direct = output_direct;
+
+	/* O_RDWR: the beginning of the first block may have to be read back (see below) */
+	int fd = open(filename, (direct ? O_RDWR | O_DIRECT : O_WRONLY) | O_CREAT | O_CLOEXEC, 0600);
+	if(fd < 0 && direct && errno == EINVAL)
+	{
+		log_notice("O_DIRECT is not supported for \"%s\", writing it through the page cache.", filename);
+		direct = 0;
+		fd = open(filename, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+	}
+	if(fd < 0)
+		return -1;
+
+	struct output_file *f = calloc(1, sizeof(struct output_file));
+	if(!f)
+		goto failed;
+
+	f->fd = fd;
+	f->start = f->position = f->synced = offset;
+
+	if(ftruncate(fd, offset) < 0 || lseek(fd, offset, SEEK_SET) < 0)
+		goto failed;
+
+	/* Not an error if the filesystem doesn't support it (EOPNOTSUPP), unless the disk is full */
+	if(length > 0)
+	{
+		if(fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+		{
+			f->allocated_end = offset + length;
+			output_stats.preallocated += length;
+		}
+		else if(errno == ENOSPC)
+			goto failed;
+	}
+
+	if(direct)
+	{
+		if(posix_memalign((void **) &f->buffer, OUTPUT_ALIGNMENT, OUTPUT_BLOCK_SIZE) != 0)
+		{
+			f->buffer = NULL;
+			errno = ENOMEM;
+			goto failed;
+		}
+		f->direct = 1;
+
+		/* Resumed download: the first block starts at the aligned offset before "offset",
+			so the part of it which we already have is read back */
+		f->block_start = offset & ~(unsigned long long) (OUTPUT_ALIGNMENT - 1);
+		f->buffered = offset - f->block_start;
+
+		if(f->buffered > 0)
+		{
+			ssize_t bytes = pread(fd, f->buffer, OUTPUT_ALIGNMENT, f->block_start);
+			if(bytes < (ssize_t) f->buffered)
+			{
+				if(bytes >= 0)
+					errno = EIO;
+				goto failed;
+			}
+		}
+	}
+
+	f->next = files;
+	files = f;
+	return fd;
+
+failed:
+	{
+		int saved_errno = errno;
+		if(f)
+			output_free(f);
+		close(fd);
+		errno = saved_errno;
+	}
+	return -1;
+}
+
+/* O_DIRECT: writes the first "length" bytes of the buffer (a multiple of OUTPUT_ALIGNMENT) at "block_start" */
+static int output_flush(struct output_file *f, size_t length)
+{
+	size_t done = 0;
+	while(done < length)
+	{
+		ssize_t written = pwrite(f->fd, f->buffer + done, length - done, f->block_start + done);
+		transfer_stats.write_calls ++;
+
+		if(written < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += written;
+	}
+
+	output_stats.direct_writes ++;
+	return 0;
+}
+
+/* The buffer is full: writes it and starts the next block */
+static int output_next_block(struct output_file *f)
+{
+	if(output_flush(f, OUTPUT_BLOCK_SIZE) < 0)
+		return -1;
+
+	f->block_start += OUTPUT_BLOCK_SIZE;
+	f->buffered = 0;
+	return 0;
+}
+
+int output_write(struct output_file *f, const char *data, size_t length)
+{
+	while(length > 0)
+	{
+		size_t part = OUTPUT_BLOCK_SIZE - f->buffered;
+		if(part > length)
+			part = length;
+
+		memcpy(f->buffer + f->buffered, data, part);
+		f->buffered += part;
+		f->position += part;
+		data += part;
+		length -= part;
+
+		if(f->buffered == OUTPUT_BLOCK_SIZE && output_next_block(f) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+ssize_t output_read(struct output_file *f, int in_fd, size_t count)
+{
+	size_t space = OUTPUT_BLOCK_SIZE - f->buffered;
+	if(count > space)
+		count = space;
+
+	ssize_t bytes = read(in_fd, f->buffer + f->buffered, count);
+	if(bytes <= 0)
+		return bytes;
+
+	f->buffered += bytes;
+	f->position += bytes;
+
+	if(f->buffered == OUTPUT_BLOCK_SIZE && output_next_block(f) < 0)
+		return -1;
+	return bytes;
+}
+
+void output_written(struct output_file *f, size_t length)
+{
+	f->position += length;
+
+	/* Write-behind (errors are ignored: it's only advice to the kernel) */
+	while(f->position - f->synced >= OUTPUT_WRITEBEHIND)
+	{
+		/* The previous window has been written back since its writeback was started:
+			wait for the rest of it, then its pages are not needed in memory */
+		if(f->synced - f->start >= OUTPUT_WRITEBEHIND)
+		{
+			off_t previous = f->synced - OUTPUT_WRITEBEHIND;
+			sync_file_range(f->fd, previous, OUTPUT_WRITEBEHIND,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+			posix_fadvise(f->fd, previous, OUTPUT_WRITEBEHIND, POSIX_FADV_DONTNEED);
+			output_stats.writebehind ++;
+		}
+
+		sync_file_range(f->fd, f->synced, OUTPUT_WRITEBEHIND, SYNC_FILE_RANGE_WRITE);
+		f->synced += OUTPUT_WRITEBEHIND;
+	}
+}
+
+int output_close(int fd)
+{
+	struct output_file **p = &files, *f;
+	while((f = *p) && f->fd != fd)
+		p = &f->next;
+
+	if(!f)
+		return close(fd);
+	*p = f->next;
+
+	int ret = 0, saved_errno = 0;
+	if(f->direct && f->buffered > 0)
+	{
+		/* The last block is padded to the alignment, then the file is cut to its real length */
+		size_t length = (f->buffered + OUTPUT_ALIGNMENT - 1) & ~(size_t) (OUTPUT_ALIGNMENT - 1);
+		memset(f->buffer + f->buffered, 0, length - f->buffered);
+
+		if(output_flush(f, length) < 0 || ftruncate(fd, f->position) < 0)
+		{
+			saved_errno = errno;
+			ret = -1;
+		}
+	}
+
+	/* Body was shorter than expected (e.g. the download was interrupted): the rest of the space
+		is released (truncation to the same size frees the blocks allocated after the end of the file) */
+	struct stat st;
+	if(ret == 0 && f->allocated_end && fstat(fd, &st) == 0 && (unsigned long long) st.st_size < f->allocated_end &&
+		ftruncate(fd, st.st_size) < 0)
+	{
+		saved_errno = errno;
+		ret = -1;
+	}
+
+	output_free(f);
+	if(close(fd) < 0 && ret == 0)
+	{
+		saved_errno = errno;
+		ret = -1;
+	}
+
+	errno = saved_errno;
+	return ret;
+}
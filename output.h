@@ -0,0 +1,100 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_OUTPUT_H
+#define HTTP_CLIENT_OUTPUT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+	Output files of the downloads (http.out, http.out.N).
+
+	When the length of the body is known, its space is allocated in advance
+	(fallocate() with KEEP_SIZE: the size of the file still grows as the data
+	is written, so an interrupted download can be resumed as usual). The file
+	is not fragmented, and a full disk is noticed before the download.
+
+	Large bodies don't flood the page cache with dirty pages (which would
+	then be flushed all at once): after every OUTPUT_WRITEBEHIND bytes,
+	their writeback is started with sync_file_range(), and the window before
+	them (which is on disk by then) is dropped from the page cache.
+
+	With output_direct (-d), the file is opened with O_DIRECT, bypassing the page
+	cache entirely: the body is gathered in an aligned buffer (it's read from
+	the socket right into it) and written in blocks of OUTPUT_BLOCK_SIZE.
+
+	Files opened by output_open() are known by their descriptors (per thread):
+	write_body(), transfer_from_socket() and the rest of transfer.h go through
+	the output file when they write into it. Other descriptors (e.g. passed
+	to the library by its user) are written as they are.
+*/
+
+#define OUTPUT_DEFAULT_NAME "http.out"
+#define OUTPUT_ALIGNMENT 4096 // of O_DIRECT buffers, file offsets and lengths
+#define OUTPUT_BLOCK_SIZE (1024 * 1024) // O_DIRECT: the body is written in blocks of this size
+#define OUTPUT_WRITEBEHIND (8 * 1024 * 1024) // writeback is started after every 8 Mb
+
+extern const char *output_name; // -o: "http.out", the batch mode adds ".N" to it
+extern int output_direct; // -d: write the files with O_DIRECT
+
+struct output_stats {
+	unsigned long long preallocated; // bytes allocated with fallocate()
+	unsigned long direct_writes; // O_DIRECT writes (of up to OUTPUT_BLOCK_SIZE)
+	unsigned long writebehind; // windows of OUTPUT_WRITEBEHIND written back and dropped from the page cache
+};
+extern __thread struct output_stats output_stats; // per thread (see batch.c)
+
+/*
+	-o PATH: where to save the body. If PATH is a directory (or ends with '/'),
+	the file is PATH/http.out. Returns 0 on success, -1 if out of memory.
+*/
+int output_set_name(const char *path);
+
+/*
+	Opens (creates) "filename" for the body: it's truncated at "offset" (0 for a new file,
+	otherwise the body is appended to the partially downloaded file). "length" is
+	the expected length of the body after "offset" (-1 if unknown): this much is allocated.
+	Returns the file descriptor, or -1 on error (see errno: ENOSPC if there is not enough disk space).
+*/
+int output_open(const char *filename, unsigned long long offset, long long length);
+
+/*
+	Writes what is still buffered, releases the allocated space which hasn't been
+	used (if the body was shorter) and closes "fd". Returns 0 on success, -1 on error (see errno).
+*/
+int output_close(int fd);
+
+/* For transfer.c and uring.c (see above) */
+
+struct output_file;
+
+/* Returns the output file of "fd", or NULL if "fd" was not opened by output_open() in this thread */
+struct output_file *output_find(int fd);
+
+/* Returns 1 if the data must be passed to output_write() (O_DIRECT), 0 if it's written into the file as usual */
+int output_is_buffered(const struct output_file *f);
+
+/* Adds "length" bytes to the buffer (written when a block is full). Returns 0 on success, -1 on error. */
+int output_write(struct output_file *f, const char *data, size_t length);
+
+/* Reads up to "count" bytes from "in_fd" right into the buffer.
+	Returns the number of bytes read, 0 on EOF, -1 on error. */
+ssize_t output_read(struct output_file *f, int in_fd, size_t count);
+
+/* "length" bytes have been written into the file as usual (for the write-behind) */
+void output_written(struct output_file *f, size_t length);
+
+#endif
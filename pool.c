@@ -0,0 +1,190 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "http.h"
+#include "tls.h"
+#include "log.h"
+
+__thread struct pool_stats pool_stats;
+
+struct idle_connection {
+	char key[POOL_KEY_SIZE]; // "scheme://host:port", empty if this slot is free (not allocated: releases don't call malloc)
+	int sock;
+	unsigned long released_at; // value of "release_counter", used to find the oldest connection
+};
+
+static __thread struct idle_connection *POOL = NULL;
+static __thread int pool_capacity = POOL_MAX_IDLE;
+static __thread unsigned long release_counter = 0;
+
+/* Allocates POOL[] on first use */
+static int pool_init(void)
+{
+	if(POOL)
+		return 0;
+
+	POOL = calloc(pool_capacity, sizeof(POOL[0]));
+	return POOL ? 0 : -1;
+}
+
+void pool_set_capacity(int capacity)
+{
+	if(capacity <= pool_capacity)
+		return;
+
+	struct idle_connection *new_pool = realloc(POOL, capacity * sizeof(POOL[0]));
+	if(!new_pool)
+		return; // Not fatal: the pool will just remain smaller
+
+	if(POOL)
+		memset(new_pool + pool_capacity, 0, (capacity - pool_capacity) * sizeof(POOL[0]));
+	else
+		memset(new_pool, 0, capacity * sizeof(POOL[0]));
+
+	POOL = new_pool;
+	pool_capacity = capacity;
+}
+
+static int is_same_key(const char *key, const struct http_url *u)
+{
+	const char *scheme = url_scheme(u);
+	size_t scheme_len = strlen(scheme);
+	if(strncmp(key, scheme, scheme_len) || strncmp(key + scheme_len, "://", 3))
+		return 0;
+
+	key += scheme_len + 3;
+	size_t host_len = strlen(u->host);
+	return !strncmp(key, u->host, host_len) && key[host_len] == ':' && !strcmp(key + host_len + 1, u->port);
+}
+
+static void free_slot(struct idle_connection *c)
+{
+	c->key[0] = '\0';
+}
+
+/*
+	Idle connection is usable only if there is nothing to read from it:
+	if the server has closed it (or sent something unexpected),
+	then poll() will report it as readable.
+*/
+static int is_alive(int sock)
+{
+	struct pollfd fds;
+	fds.fd = sock;
+	fds.events = POLLIN;
+
+	return poll(&fds, 1, 0) == 0;
+}
+
+int pool_acquire(const struct http_url *u)
+{
+	if(!POOL)
+		return -1;
+
+	while(1)
+	{
+		// Most recently used connection is the least likely to be closed by server
+		struct idle_connection *best = NULL;
+		int i;
+		for(i = 0; i < pool_capacity; i ++)
+		{
+			if(POOL[i].key[0] && is_same_key(POOL[i].key, u))
+				if(!best || POOL[i].released_at > best->released_at)
+					best = &POOL[i];
+		}
+
+		if(!best)
+			return -1;
+
+		int sock = best->sock;
+		free_slot(best);
+
+		if(is_alive(sock))
+		{
+			pool_stats.reused ++;
+			return sock;
+		}
+
+		log_debug("Idle connection to %s:%s was closed by server.", u->host, u->port);
+		tls_close(sock);
+	}
+}
+
+void pool_release(const struct http_url *u, int sock)
+{
+	if(pool_init() < 0)
+	{
+		tls_close(sock);
+		return;
+	}
+
+	struct idle_connection *slot = NULL;
+	int i;
+	for(i = 0; i < pool_capacity; i ++)
+	{
+		if(!POOL[i].key[0])
+		{
+			slot = &POOL[i];
+			break;
+		}
+
+		if(!slot || POOL[i].released_at < slot->released_at)
+			slot = &POOL[i];
+	}
+
+	if(slot->key[0])
+	{
+		// Pool is full: evict the connection which has been idle for the longest time
+		tls_close(slot->sock);
+		free_slot(slot);
+	}
+
+	if((size_t) snprintf(slot->key, sizeof(slot->key), "%s://%s:%s", url_scheme(u), u->host, u->port) >= sizeof(slot->key))
+	{
+		slot->key[0] = '\0'; // Hostname is too long (not a valid one anyway)
+		tls_close(sock);
+		return;
+	}
+	slot->sock = sock;
+	slot->released_at = ++ release_counter;
+}
+
+void pool_close_all(void)
+{
+	if(!POOL)
+		return;
+
+	int i;
+	for(i = 0; i < pool_capacity; i ++)
+	{
+		if(POOL[i].key[0])
+		{
+			tls_close(POOL[i].sock);
+			free_slot(&POOL[i]);
+		}
+	}
+
+	free(POOL);
+	POOL = NULL; // Will be allocated again (with the same capacity) if needed
+}
@@ -0,0 +1,48 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_POOL_H
+#define HTTP_CLIENT_POOL_H
+
+/* Pool of idle keep-alive connections, keyed by "scheme://host:port".
+	Each thread has its own pool (see batch.c), so connections are never shared. */
+
+struct http_url;
+
+#define POOL_MAX_IDLE 16 // default maximum number of idle connections kept open
+#define POOL_KEY_SIZE 288 // "https://" + hostname (up to 253 characters) + ":port"
+
+struct pool_stats {
+	unsigned long created; // connections opened with connect()
+	unsigned long reused; // requests sent over an already open connection
+};
+extern __thread struct pool_stats pool_stats;
+
+/* Returns an idle connection to the host:port of "u" (removing it from the pool),
+	or -1 if there is none. HTTPS connections are only returned for https:// URLs. */
+int pool_acquire(const struct http_url *u);
+
+/* Puts the connection back into the pool. The response to the previous
+	request must have been read completely. */
+void pool_release(const struct http_url *u, int sock);
+
+/* Allows the pool to keep up to "capacity" idle connections (e.g. one per
+	simultaneous request in batch mode). The pool never shrinks. */
+void pool_set_capacity(int capacity);
+
+/* Closes all idle connections (and frees the memory of the pool) */
+void pool_close_all(void);
+
+#endif
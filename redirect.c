@@ -0,0 +1,247 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "redirect.h"
+
+__thread struct redirect_stats redirect_stats;
+
+struct redirect_entry {
+	struct redirect_entry *next; // in the same bucket
+	char *from; // normalized URL
+	char *to; // absolute URL
+	time_t expires;
+};
+
+static struct redirect_entry *TABLE[REDIRECT_HASH_SIZE];
+static unsigned entry_count = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // protects TABLE[] and entry_count
+
+/* FNV-1a, same as in cache.c */
+static unsigned hash_key(const char *key)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	for(; *key; key ++)
+	{
+		hash ^= (unsigned char) *key;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash % REDIRECT_HASH_SIZE;
+}
+
+static void free_entry(struct redirect_entry *e)
+{
+	free(e->from);
+	free(e->to);
+	free(e);
+}
+
+/* Finds the entry for "key" (must be called with the lock held). Expired entries are removed along the way. */
+static struct redirect_entry *find_entry(const char *key)
+{
+	time_t now = time(NULL);
+	struct redirect_entry **pe = &TABLE[hash_key(key)], *e;
+
+	while((e = *pe))
+	{
+		if(e->expires <= now)
+		{
+			*pe = e->next;
+			free_entry(e);
+			entry_count --;
+			continue;
+		}
+
+		if(!strcmp(e->from, key))
+			return e;
+
+		pe = &e->next;
+	}
+
+	return NULL;
+}
+
+/* Adds (or replaces) the entry (must be called with the lock held). Returns 0 on success, -1 if out of memory. */
+static int add_entry(const char *from, const char *to, time_t expires)
+{
+	char *to_copy = strdup(to);
+	if(!to_copy)
+		return -1;
+
+	struct redirect_entry *e = find_entry(from);
+	if(!e)
+	{
+		e = calloc(1, sizeof(struct redirect_entry));
+		if(!e || !(e->from = strdup(from)))
+		{
+			free(e);
+			free(to_copy);
+			return -1;
+		}
+
+		unsigned bucket = hash_key(from);
+		e->next = TABLE[bucket];
+		TABLE[bucket] = e;
+		entry_count ++;
+	}
+
+	free(e->to);
+	e->to = to_copy;
+	e->expires = expires;
+	return 0;
+}
+
+/* Returns the normalized "url" (in "arena") or NULL if it's malformed */
+static char *normalize(struct arena *arena, const char *url)
+{
+	char *copy = arena_strdup(arena, url);
+	struct http_url u;
+
+	return copy && parse_url(copy, &u) == 0 ? url_normalize(arena, &u) : NULL;
+}
+
+void redirect_store(struct arena *arena, const struct http_url *from, const char *to, const struct http_response *r)
+{
+	if(r->code != 301 && r->code != 308)
+		return;
+
+	long long lifetime = http_freshness_lifetime(r);
+	if(lifetime == HTTP_LIFETIME_UNKNOWN)
+		lifetime = REDIRECT_TTL;
+	if(lifetime <= 0)
+		return; // "no-store", "no-cache" or already expired
+
+	/* Saved on one line (see redirect_save) */
+	if(to[strcspn(to, " \t\r\n")] != '\0')
+		return;
+
+	char *key = url_normalize(arena, from);
+	if(!key || !strcmp(key, to)) // Redirect to itself would be a loop
+		return;
+
+	pthread_mutex_lock(&lock);
+	if(add_entry(key, to, time(NULL) + lifetime) == 0)
+		redirect_stats.stored ++;
+	pthread_mutex_unlock(&lock);
+}
+
+char *redirect_lookup(struct arena *arena, const char *url, unsigned *hops)
+{
+	char *target = NULL;
+	unsigned i;
+
+	pthread_mutex_lock(&lock);
+	for(i = 0; i < max_redirects && entry_count > 0; i ++)
+	{
+		char *key = normalize(arena, target ? target : url);
+		struct redirect_entry *e = key ? find_entry(key) : NULL;
+		if(!e)
+			break;
+
+		char *next = arena_strdup(arena, e->to);
+		if(!next)
+			break;
+
+		target = next;
+		(*hops) ++;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return target;
+}
+
+int redirect_save(const char *filename)
+{
+	char *tmpname;
+	if(asprintf(&tmpname, "%s.tmp", filename) < 0)
+		return -1;
+
+	FILE *f = fopen(tmpname, "w");
+	if(!f)
+	{
+		free(tmpname);
+		return -1;
+	}
+
+	fprintf(f, "# expires from to\n");
+
+	time_t now = time(NULL);
+	unsigned i;
+
+	pthread_mutex_lock(&lock);
+	for(i = 0; i < REDIRECT_HASH_SIZE; i ++)
+	{
+		struct redirect_entry *e;
+		for(e = TABLE[i]; e; e = e->next)
+		{
+			if(e->expires > now)
+				fprintf(f, "%lld %s %s\n", (long long) e->expires, e->from, e->to);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	if(fclose(f) != 0 || rename(tmpname, filename) < 0)
+	{
+		int saved_errno = errno;
+		unlink(tmpname);
+		free(tmpname);
+		errno = saved_errno;
+		return -1;
+	}
+
+	free(tmpname);
+	return 0;
+}
+
+int redirect_load(const char *filename)
+{
+	FILE *f = fopen(filename, "r");
+	if(!f)
+		return -1;
+
+	time_t now = time(NULL);
+	char *line = NULL;
+	size_t size = 0;
+
+	pthread_mutex_lock(&lock);
+	while(getline(&line, &size, f) > 0)
+	{
+		if(line[0] == '#')
+			continue;
+
+		long long expires;
+		char *from = NULL, *to = NULL;
+
+		if(sscanf(line, "%lld %ms %ms", &expires, &from, &to) == 3 && expires > now)
+			add_entry(from, to, expires);
+
+		free(from);
+		free(to);
+	}
+	pthread_mutex_unlock(&lock);
+
+	free(line);
+	fclose(f);
+	return 0;
+}
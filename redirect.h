@@ -0,0 +1,60 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_REDIRECT_H
+#define HTTP_CLIENT_REDIRECT_H
+
+#include "http.h"
+
+/*
+	Cache of permanent redirects (301 Moved Permanently, 308 Permanent Redirect),
+	keyed by the normalized URL (see url_normalize()). When the URL is in the cache,
+	the request goes straight to the target, without DNS lookup, connection
+	and round trip for each hop. Temporary redirects (302, 303, 307) are not cached.
+
+	Redirect stays in the cache for as long as Cache-Control/Expires allow
+	(REDIRECT_TTL seconds if the server didn't say), "no-store" and "no-cache"
+	are respected. The cache is shared by all threads (see batch.c).
+*/
+
+#define REDIRECT_TTL 86400
+#define REDIRECT_HASH_SIZE 1024
+
+struct redirect_stats {
+	unsigned long used; // requests which went straight to the cached target
+	unsigned long stored; // permanent redirects added to the cache
+};
+extern __thread struct redirect_stats redirect_stats;
+
+/* Remembers redirect response "r" from "from" to "to" (absolute URL, see resolve_location())
+	if it's a permanent one and it can be cached. "arena" is for temporary strings. */
+void redirect_store(struct arena *arena, const struct http_url *from, const char *to, const struct http_response *r);
+
+/*
+	Returns the final target of "url" (in "arena") after all cached redirects
+	(at most max_redirects of them), or NULL if "url" is not in the cache.
+	The number of redirects is added to "*hops".
+*/
+char *redirect_lookup(struct arena *arena, const char *url, unsigned *hops);
+
+/*
+	On-disk cache (for short-lived invocations): redirects which are not
+	yet expired are loaded/saved from/to "filename".
+	Returns 0 on success, -1 on error (errno is set).
+*/
+int redirect_load(const char *filename);
+int redirect_save(const char *filename);
+
+#endif
@@ -0,0 +1,202 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "resume.h"
+
+/*
+	Format of the sidecar (one field per line):
+		url http://example.com/file
+		etag "abc"
+		last-modified Mon, 01 Jan 2018 00:00:00 GMT
+		length 123456
+		received 4096
+	Only "url" and at least one of the validators are required.
+*/
+
+static char *sidecar_name(const char *filename)
+{
+	char *name;
+	if(asprintf(&name, "%s%s", filename, RESUME_SUFFIX) < 0)
+		return NULL;
+	return name;
+}
+
+void resume_free(struct resume_info *info)
+{
+	free(info->url);
+	free(info->etag);
+	free(info->last_modified);
+	memset(info, 0, sizeof(struct resume_info));
+}
+
+int resume_load(const char *filename, struct resume_info *info)
+{
+	memset(info, 0, sizeof(struct resume_info));
+	info->length = info->received = RESUME_UNKNOWN;
+
+	char *name = sidecar_name(filename);
+	if(!name)
+		return -1;
+
+	FILE *f = fopen(name, "r");
+	free(name);
+	if(!f)
+		return -1;
+
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t length;
+
+	while((length = getline(&line, &line_size, f)) > 0)
+	{
+		if(line[length - 1] == '\n')
+			line[-- length] = '\0';
+
+		char *value = strchr(line, ' ');
+		if(!value)
+			continue;
+		*value ++ = '\0';
+
+		if(!strcmp(line, "url"))
+		{
+			free(info->url);
+			info->url = strdup(value);
+		}
+		else if(!strcmp(line, "etag"))
+		{
+			free(info->etag);
+			info->etag = strdup(value);
+		}
+		else if(!strcmp(line, "last-modified"))
+		{
+			free(info->last_modified);
+			info->last_modified = strdup(value);
+		}
+		else if(!strcmp(line, "length"))
+			info->length = strtoull(value, NULL, 10);
+		else if(!strcmp(line, "received"))
+			info->received = strtoull(value, NULL, 10);
+	}
+
+	free(line);
+	fclose(f);
+
+	if(!info->url || !resume_validator(info))
+	{
+		resume_free(info);
+		return -1;
+	}
+	return 0;
+}
+
+int resume_save(const char *filename, const struct resume_info *info)
+{
+	char *name = sidecar_name(filename);
+	if(!name)
+		return -1;
+
+	/* Written into a temporary file and renamed: the sidecar is either old or new, never half-written */
+	char *tmpname;
+	if(asprintf(&tmpname, "%s.tmp", name) < 0)
+	{
+		free(name);
+		return -1;
+	}
+
+	int ret = -1;
+	FILE *f = fopen(tmpname, "w");
+	if(!f)
+		goto done;
+
+	fprintf(f, "url %s\n", info->url);
+	if(info->etag)
+		fprintf(f, "etag %s\n", info->etag);
+	if(info->last_modified)
+		fprintf(f, "last-modified %s\n", info->last_modified);
+	if(info->length != RESUME_UNKNOWN)
+		fprintf(f, "length %llu\n", info->length);
+	if(info->received != RESUME_UNKNOWN)
+		fprintf(f, "received %llu\n", info->received);
+
+	if(fclose(f) != 0 || rename(tmpname, name) < 0)
+	{
+		unlink(tmpname);
+		goto done;
+	}
+	ret = 0;
+
+done:
+	free(tmpname);
+	free(name);
+	return ret;
+}
+
+void resume_remove(const char *filename)
+{
+	char *name = sidecar_name(filename);
+	if(name)
+	{
+		unlink(name);
+		free(name);
+	}
+}
+
+const char *resume_validator(const struct resume_info *info)
+{
+	/* Weak ETag (W/"...") can't be used in If-Range */
+	if(info->etag && strncmp(info->etag, "W/", 2))
+		return info->etag;
+
+	return info->last_modified;
+}
+
+/* Values are written one per line, so they must not contain line breaks */
+static char *copy_value(const char *value)
+{
+	if(!value || strpbrk(value, "\r\n"))
+		return NULL;
+
+	return strdup(value);
+}
+
+int resume_from_response(struct resume_info *info, const char *url, const struct http_response *r,
+	unsigned long long length)
+{
+	memset(info, 0, sizeof(struct resume_info));
+	info->length = length;
+	info->received = RESUME_UNKNOWN;
+
+	const char *etag = http_known_header(r, HDR_ETAG);
+	const char *last_modified = http_known_header(r, HDR_LAST_MODIFIED);
+
+	info->url = strdup(url);
+	info->etag = copy_value(etag);
+	info->last_modified = copy_value(last_modified);
+
+	if(!info->url || (etag && !info->etag) || (last_modified && !info->last_modified))
+	{
+		resume_free(info);
+		return -1;
+	}
+	return 0;
+}
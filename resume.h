@@ -0,0 +1,63 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_RESUME_H
+#define HTTP_CLIENT_RESUME_H
+
+#include "http.h"
+
+/*
+	Resuming of interrupted downloads.
+
+	While the body is being received into the output file, a small sidecar
+	file (e.g. "http.out.resume") remembers where it came from: URL,
+	validators of the response (ETag and/or Last-Modified), length of the file
+	and how many bytes were received. The next attempt asks only for the
+	missing tail ("Range: bytes=N-") with "If-Range: <validator>":
+	if the file has changed on the server, the server sends it whole.
+*/
+
+#define RESUME_SUFFIX ".resume" // sidecar of "http.out" is "http.out.resume"
+
+#define RESUME_UNKNOWN ((unsigned long long) -1)
+
+struct resume_info {
+	char *url;
+	char *etag; // NULL if none
+	char *last_modified; // NULL if none
+	unsigned long long length; // of the whole file (RESUME_UNKNOWN if not known)
+	unsigned long long received; // RESUME_UNKNOWN if the download was interrupted abruptly (then the size of the file is used)
+};
+
+/* Reads the sidecar of "filename". Returns 0 on success, -1 if there is none (or it's malformed). */
+int resume_load(const char *filename, struct resume_info *info);
+
+/* Writes the sidecar of "filename". Returns 0 on success, -1 on error (errno is set). */
+int resume_save(const char *filename, const struct resume_info *info);
+
+/* Deletes the sidecar of "filename" (if any) */
+void resume_remove(const char *filename);
+
+void resume_free(struct resume_info *info);
+
+/* Returns the value for If-Range header: strong ETag (preferred) or Last-Modified.
+	Returns NULL if there is none (then the download can't be resumed safely). */
+const char *resume_validator(const struct resume_info *info);
+
+/* Fills "info" from the response headers. Returns 0 on success, -1 if out of memory. */
+int resume_from_response(struct resume_info *info, const char *url, const struct http_response *r,
+	unsigned long long length);
+
+#endif
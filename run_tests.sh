@@ -2,6 +2,43 @@
 
 HOST=${HTTPBIN_HOST:-'httpbin.org'}
 FAILURES=0
+LOCAL=0
+
+# With --local, tests are run against ./test_server (started here) instead of httpbin.org
+if [ "$1" = "--local" ]; then
+	PORT=${TEST_SERVER_PORT:-18080}
+	HOST="127.0.0.1:$PORT"
+	LOCAL=1
+
+	./test_server -p $PORT &
+	SERVER_PID=$!
+	trap 'kill $SERVER_PID' EXIT
+
+	# HTTPS: "openssl s_server -WWW" with a self-signed certificate serves files from TLS_DIR
+	if command -v openssl >/dev/null; then
+		TLS_PORT=${TLS_SERVER_PORT:-18443}
+		TLS_DIR=$(mktemp -d)
+		openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+			-keyout $TLS_DIR/key.pem -out $TLS_DIR/cert.pem 2>/dev/null
+		head -c 1000000 /dev/urandom > $TLS_DIR/file
+
+		( cd $TLS_DIR && exec openssl s_server -quiet -WWW -accept $TLS_PORT -cert cert.pem -key key.pem >/dev/null 2>&1 ) &
+		TLS_SERVER_PID=$!
+		trap 'kill $SERVER_PID $TLS_SERVER_PID; rm -rf $TLS_DIR' EXIT
+	fi
+
+	# HTTP/2 without TLS: "nghttpd --no-tls" (from nghttp2) serves files from H2_DIR
+	if command -v nghttpd >/dev/null; then
+		H2_PORT=${H2_SERVER_PORT:-18082}
+		H2_DIR=$(mktemp -d)
+		for i in 1 2 3 4 5 6 7 8; do head -c $((i * 300000)) /dev/urandom > $H2_DIR/file$i; done
+
+		nghttpd --no-tls -d $H2_DIR $H2_PORT >/dev/null 2>&1 &
+		H2_SERVER_PID=$!
+		trap 'kill $SERVER_PID $TLS_SERVER_PID $H2_SERVER_PID; rm -rf $TLS_DIR $H2_DIR' EXIT
+	fi
+	sleep 0.5
+fi
 
 function main {
 	runtest "" assert_rootpage
@@ -9,6 +46,8 @@ function main {
 	runtest /redirect-to?url=http://$HOST/robots.txt assert_robots
 	runtest /absolute-redirect/7 assert_redirect_target
 	runtest /absolute-redirect/8 assert_failed_request # more than 7 redirects
+	runtest /relative-redirect/1 assert_redirect_target
+	runtest /relative-redirect/7 assert_redirect_target
 	runtest /image/png assert_png
 	runtest /user-agent assert_user_agent
 	runtest /status/404 assert_failed_request
@@ -16,8 +55,274 @@ function main {
 	runtest /status/101 assert_failed_request # Unexpected
 	runtest /status/204 assert_no_content
 
-	# Not implemented:
-	#runtest /relative-redirect/1 assert_redirect_target
+	if [ $LOCAL -eq 1 ]; then
+		# Only the local test_server has these pages
+		runtest /bytes/1000000 "assert_size 1000000"
+		runtest /chunked/1000000/777 "assert_size 1000000"
+		runtest /headers/300/100 assert_ok # More than 100 headers
+		runtest /headers/10/20000 assert_ok # Longer than 16Kb
+		runtest /disconnect/100000 "assert_size 100000" # Incomplete body is saved (with a warning)
+		runtest /gzip/1000000 "assert_size 1000000"
+		runtest /deflate/1000000 "assert_size 1000000"
+		runtest /deflate-raw/1000000 "assert_size 1000000"
+		runtest /gzip-chunked/1000000/1000 "assert_size 1000000"
+		CLIENT_OPTIONS="-s 4" runtest /bytes/10000000 "assert_size 10000000"
+		CLIENT_OPTIONS="-s 4" runtest /slow-start/10000000/1000 "assert_size 10000000"
+		CLIENT_OPTIONS="-s 4" runtest /chunked/1000000/1000 "assert_size 1000000" # No Range support
+		runtest /flaky/100000/60000 "assert_resumed 100000" # Interrupted download is resumed by the next run
+		CLIENT_OPTIONS="-r 5" runtest /flaky/1000000/300000 "assert_size 1000000"
+		CLIENT_OPTIONS="-C http.cache" runtest /cache/100000/3600 "assert_cached hits 100000" # Fresh: no request
+		CLIENT_OPTIONS="-C http.cache" runtest /cache/100000/0 "assert_cached revalidated 100000" # Stale: 304
+		CLIENT_OPTIONS="-R http.redirects" runtest "/redirect-to?url=/robots.txt&status_code=301" "assert_redirect_cached 1"
+		CLIENT_OPTIONS="-R http.redirects" runtest "/redirect-to?url=/robots.txt&status_code=308" "assert_redirect_cached 1"
+		CLIENT_OPTIONS="-R http.redirects" runtest "/redirect-to?url=/robots.txt&status_code=302" "assert_redirect_cached 0" # Temporary
+		CLIENT_OPTIONS="-t idle=1" runtest /stall/1000 assert_failed_request # Body has stalled
+		CLIENT_OPTIONS="-t idle=1" runtest /drip/15/100 "assert_size 15" # Slow, but never idle for 1 second
+		CLIENT_OPTIONS="-t total=1" runtest /drip/15/100 assert_failed_request
+		CLIENT_OPTIONS="-t idle=0.0004" runtest /drip/15/100 assert_failed_request # 1 ms, not 0 (no limit)
+		CLIENT_OPTIONS="-t idle=1e10" runtest /bytes/1000 assert_failed_request # Too large: rejected
+		CLIENT_OPTIONS="-t idle=1 -r 3" runtest /flaky-stall/1000000/400000 "assert_size 1000000" # Stalled body is resumed
+		CLIENT_OPTIONS="-t idle=1" runtest /flaky-stall/1000000/600000 "assert_resumed 1000000" # ... by the next run without -r
+		CLIENT_OPTIONS="-U" runtest /bytes/10000000 "assert_size 10000000" # io_uring (if built with IO_URING=1)
+		CLIENT_OPTIONS="-U -t idle=1" runtest /stall/1000000 assert_failed_request
+
+		# Integrity (-V): the body is hashed while it's written
+		./http_client http://$HOST/bytes/1000000 2>/dev/null && SHA256=$(sha256sum http.out | cut -d' ' -f1)
+		CLIENT_OPTIONS="-V sha256:$SHA256" runtest /bytes/1000000 "assert_size 1000000"
+		CLIENT_OPTIONS="-V sha256:$SHA256" runtest /chunked/1000000/777 "assert_size 1000000"
+		CLIENT_OPTIONS="-V sha256:$SHA256" runtest /gzip/1000000 "assert_size 1000000" # Digest of the decompressed body
+		CLIENT_OPTIONS="-V sha256:$SHA256 -r 5" runtest /flaky/1000000/300000 "assert_size 1000000" # Resumed: the first part is hashed from the file
+		CLIENT_OPTIONS="-V sha256:$SHA256 -s 4" runtest /bytes/1000000 "assert_size 1000000"
+		CLIENT_OPTIONS="-V sha256:$(echo -n | sha256sum | cut -d' ' -f1)" runtest /bytes/1000000 assert_failed_request
+		CLIENT_OPTIONS="-V sha256" runtest /digest/1000000 "assert_size 1000000" # Repr-Digest
+		CLIENT_OPTIONS="-V crc32c" runtest /digest-legacy/1000000 "assert_size 1000000" # Digest
+		CLIENT_OPTIONS="-V sha256" runtest /digest-wrong/1000000 assert_failed_request
+		CLIENT_OPTIONS="-V sha256" runtest /flaky/1000000/300000 assert_failed_request # Incomplete: can't be verified
+		test_batch_integrity
+		test_batch_threads
+		test_batch_pipeline
+
+		# Output writer: O_DIRECT (-d) and the path of the file (-o)
+		CLIENT_OPTIONS="-d" runtest /bytes/10000000 "assert_size 10000000"
+		CLIENT_OPTIONS="-d -V sha256:$SHA256" runtest /chunked/1000000/777 "assert_size 1000000"
+		CLIENT_OPTIONS="-d -V sha256:$SHA256" runtest /gzip/1000000 "assert_size 1000000"
+		CLIENT_OPTIONS="-d -V sha256:$SHA256 -r 5" runtest /flaky/1000000/300000 "assert_size 1000000" # Resumed at an unaligned offset
+		CLIENT_OPTIONS="-d" runtest /disconnect/100000 "assert_size 100000"
+		test_output_path
+
+		# Request bodies (the pattern of /bytes is checked by /anything)
+		./http_client http://$HOST/bytes/3000000 2>/dev/null && mv http.out http.upload
+		CLIENT_OPTIONS="-u http.upload -H X-Test:upload" runtest /anything "assert_anything PUT 3000000 upload" # Expect: 100-continue
+		CLIENT_OPTIONS="-X POST -u http.upload" runtest "/redirect-to?url=/anything&status_code=307" "assert_anything POST 3000000"
+		CLIENT_OPTIONS="-X POST -u http.upload" runtest "/redirect-to?url=/anything&status_code=302" "assert_anything GET 0"
+		CLIENT_OPTIONS="-X DELETE" runtest /anything "assert_anything DELETE 0"
+		CLIENT_OPTIONS="-X HEAD" runtest /bytes/1000 "assert_size 0"
+		CLIENT_OPTIONS="-u http.upload" runtest /status/413 assert_failed_request # Body is not sent
+		rm -f http.upload
+
+		if [ -n "$TLS_SERVER_PID" ]; then
+			SCHEME=https HOST=localhost:$TLS_PORT CLIENT_OPTIONS="-c $TLS_DIR/cert.pem" runtest /file "assert_size 1000000"
+			SCHEME=https HOST=localhost:$TLS_PORT runtest /file assert_failed_request # Self-signed certificate is not trusted
+		fi
+
+		if [ -n "$H2_SERVER_PID" ]; then
+			test_http2
+		fi
+		test_http2_error
+	fi
+}
+
+# Batch mode via HTTP/2: all files are received as streams of one connection
+function test_http2 {
+	local i result=0
+	rm -f http.out.*
+
+	for i in 1 2 3 4 5 6 7 8; do echo http://127.0.0.1:$H2_PORT/file$i; done |
+		./http_client -2 -i - -j 8 2>&1 | grep -aq "HTTP/2: 1 connections, 8 streams" || result=1
+	for i in 1 2 3 4 5 6 7 8; do cmp -s http.out.$i $H2_DIR/file$i || result=1; done
+
+	echo http://127.0.0.1:$H2_PORT/missing | ./http_client -2 -i - 2>/dev/null && result=1 # 404
+	rm -f http.out.*
+
+	if [ $result -ne 0 ]; then
+		echo "run_tests: ERROR: HTTP/2 batch produced unexpected result" >&2
+		(( FAILURES ++ ))
+	else
+		echo "run_tests: test passed: HTTP/2 batch" >&2
+	fi
+}
+
+# HTTP/2 connection error (test_server sends a malformed frame for the first stream):
+# 100 streams have been sent (the limit until SETTINGS arrives) and fail, the 20 waiting ones are retried
+function test_http2_error {
+	local i result=0
+	rm -f http.out http.out.*
+
+	./http_client http://$HOST/bytes/1000 2>/dev/null && mv http.out http.expected
+	(echo http://$HOST/h2-bad-frame; for i in $(seq 119); do echo http://$HOST/bytes/1000; done) |
+		./http_client -2 -i - -j 120 2>&1 | grep -aq "120 requests (20 succeeded, 100 failed)" || result=1
+	for i in $(seq 101 120); do cmp -s http.out.$i http.expected || result=1; done
+	rm -f http.out.* http.expected
+
+	if [ $result -ne 0 ]; then
+		echo "run_tests: ERROR: HTTP/2 connection error produced unexpected result" >&2
+		(( FAILURES ++ ))
+	else
+		echo "run_tests: test passed: HTTP/2 connection error" >&2
+	fi
+}
+
+# Batch mode with -w: the threads decompress their bodies at the same time
+function test_batch_threads {
+	local i result=0
+	rm -f http.out http.out.*
+
+	./http_client http://$HOST/bytes/1000000 2>/dev/null && mv http.out http.expected
+	for i in $(seq 64); do echo http://$HOST/gzip/1000000; done |
+		./http_client -i - -j 16 -w 4 2>/dev/null || result=1
+	for i in $(seq 64); do cmp -s http.out.$i http.expected || result=1; done
+	rm -f http.out.*
+
+	# Same entry of the cache is stored (and read) by several threads at once
+	for i in $(seq 64); do echo http://$HOST/cache/1000000/3600; done |
+		./http_client -C http.cache -i - -j 16 -w 4 2>/dev/null || result=1
+	for i in $(seq 64); do cmp -s http.out.$i http.expected || result=1; done
+	ls http.cache | grep -q '\.body\.\|\.meta\.' && result=1 # Leftover temporary files
+	rm -rf http.out.* http.expected http.cache
+
+	# Malformed numbers are rejected (not taken as 0, i.e. one thread per CPU)
+	./http_client -w abc -i - </dev/null 2>/dev/null && result=1
+	./http_client -w -3 -i - </dev/null 2>/dev/null && result=1
+
+	if [ $result -ne 0 ]; then
+		echo "run_tests: ERROR: batch with -w produced unexpected result" >&2
+		(( FAILURES ++ ))
+	else
+		echo "run_tests: test passed: batch with -w" >&2
+	fi
+}
+
+# Batch mode with -p: responses are split between the pipelined requests (small ones arrive
+# in one read), and the requests after a broken response are retried via other connections
+function test_batch_pipeline {
+	local i result=0
+	rm -f http.out http.out.*
+
+	./http_client http://$HOST/bytes/1000 2>/dev/null && mv http.out http.small
+	./http_client http://$HOST/bytes/100000 2>/dev/null && mv http.out http.expected
+	for i in $(seq 8); do
+		echo http://$HOST/bytes/1000; echo http://$HOST/chunked/1000/100
+		echo http://$HOST/bytes/100000; echo http://$HOST/chunked/100000/777
+	done | ./http_client -i - -j 2 -p 8 2>&1 | grep -aq "Pipelining: [1-9][0-9]* requests" || result=1
+	for i in $(seq 32); do
+		if (( i % 4 == 1 || i % 4 == 2 )); then cmp -s http.out.$i http.small || result=1
+		else cmp -s http.out.$i http.expected || result=1; fi
+	done
+	rm -f http.out.*
+
+	# /disconnect/1000 is the 4th of the 8 requests pipelined via the first connection: the next 4 are retried
+	for i in $(seq 16); do
+		if [ $i -eq 4 ]; then echo http://$HOST/disconnect/1000; else echo http://$HOST/bytes/100000; fi
+	done | ./http_client -i - -j 8 -p 8 2>&1 > /dev/null | grep -a "Batch finished\|Pipelining" > http.log
+	grep -q "16 requests (15 succeeded, 1 failed)" http.log || result=1
+	grep -q "4 of them had to be retried" http.log || result=1
+	for i in $(seq 16); do
+		[ $i -eq 4 ] || cmp -s http.out.$i http.expected || result=1
+	done
+	rm -f http.out.* http.small http.expected http.log
+
+	if [ $result -ne 0 ]; then
+		echo "run_tests: ERROR: batch with -p produced unexpected result" >&2
+		(( FAILURES ++ ))
+	else
+		echo "run_tests: test passed: batch with -p" >&2
+	fi
+}
+
+# Batch mode with -V: each body is compared with its Repr-Digest
+function test_batch_integrity {
+	local result=0
+	rm -f http.out.*
+
+	printf "http://$HOST/digest/100000\nhttp://$HOST/digest-wrong/100000\nhttp://$HOST/bytes/100000\n" |
+		./http_client -V crc32c -i - 2>&1 | grep -aq "Integrity (CRC32C): 1 bodies matched Repr-Digest/Digest, 1 didn't match, 1 had" || result=1
+	rm -f http.out.*
+
+	if [ $result -ne 0 ]; then
+		echo "run_tests: ERROR: batch with -V produced unexpected result" >&2
+		(( FAILURES ++ ))
+	else
+		echo "run_tests: test passed: batch with -V" >&2
+	fi
+}
+
+# -o: a file name or a directory (for http.out or http.out.N in batch mode)
+function test_output_path {
+	local result=0
+	rm -rf http.out http.dir
+	mkdir http.dir
+
+	./http_client -o http.dir/page http://$HOST/bytes/100000 2>/dev/null || result=1
+	[[ $(stat -c %s http.dir/page) -eq 100000 ]] || result=1
+	./http_client -d -o http.dir http://$HOST/bytes/100000 2>/dev/null || result=1
+	cmp -s http.dir/page http.dir/http.out || result=1
+
+	printf "http://$HOST/bytes/100000\nhttp://$HOST/chunked/100000/777\n" | ./http_client -d -o http.dir/ -i - 2>/dev/null || result=1
+	cmp -s http.dir/page http.dir/http.out.1 || result=1
+	cmp -s http.dir/page http.dir/http.out.2 || result=1
+	[[ -f http.out || -f http.out.1 ]] && result=1
+	rm -rf http.dir
+
+	if [ $result -ne 0 ]; then
+		echo "run_tests: ERROR: output path (-o) produced unexpected result" >&2
+		(( FAILURES ++ ))
+	else
+		echo "run_tests: test passed: output path (-o)" >&2
+	fi
+}
+
+function assert_size {
+	[[ $2 -eq 0 ]] || return 1
+	[[ $(stat -c %s http.out) -eq $1 ]] || return 1
+}
+
+function assert_resumed {
+	[[ -f http.out.resume ]] || return 1
+	./http_client http://${HOST}${relativeUrl} || return 1
+	[[ -f http.out.resume ]] && return 1 # Not needed after the file is complete
+	assert_size $1 0
+}
+
+function assert_cached {
+	[[ $3 -eq 0 ]] || return 1
+	rm -f http.out
+	./http_client $CLIENT_OPTIONS http://${HOST}${relativeUrl} 2>&1 | grep -aq "Cache:.* 1 $1" || return 1
+	assert_size $2 0
+}
+
+function assert_redirect_cached {
+	[[ $2 -eq 0 ]] || return 1
+	assert_robots || return 1
+
+	# Second run: permanent redirect (and only it) goes straight to the target
+	rm -f http.out
+	local cached=0
+	./http_client $CLIENT_OPTIONS http://${HOST}${relativeUrl} 2>&1 | grep -a "Known permanent redirect" >/dev/null && cached=1
+	[[ $cached -eq $1 ]] || return 1
+	assert_robots
+}
+
+function assert_anything {
+	# Arguments: METHOD LENGTH [X-TEST] retval
+	[[ ${!#} -eq 0 ]] || return 1
+	grep -q "\"method\": \"$1\"" http.out || return 1
+	grep -q "\"length\": $2," http.out || return 1
+	[[ $# -eq 3 ]] || grep -q "\"x-test\": \"$3\"" http.out || return 1
+	grep -q '"pattern": "ok"' http.out || return 1
+}
+
+function assert_ok {
+	[[ $1 -eq 0 ]] || return 1
 }
 
 function assert_rootpage {
@@ -56,8 +361,8 @@ function runtest {
 	relativeUrl=$1
 	testFunction=$2
 
-	rm -f http.out
-	./http_client http://${HOST}${relativeUrl}
+	rm -rf http.out http.out.resume http.cache http.redirects
+	./http_client $CLIENT_OPTIONS ${SCHEME:-http}://${HOST}${relativeUrl}
 	retval=$?
 
 	$testFunction $retval
@@ -72,6 +377,7 @@ function runtest {
 }
 
 main
+rm -rf http.cache http.redirects
 
 if [ $FAILURES -ne 0 ]; then
 	echo "run_tests: Number of failed tests: $FAILURES." >&2
@@ -0,0 +1,743 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "pool.h"
+#include "connect.h"
+#include "dns.h"
+#include "transfer.h"
+#include "segmented.h"
+#include "deadline.h"
+#include "redirect.h"
+
+#define UNKNOWN_LENGTH ((unsigned long long) -1)
+#define SEGMENTED_MAX_EVENTS 64
+
+enum worker_state {
+	WORKER_IDLE, // has nothing to do (waits for a part to take over)
+	WORKER_SEND, // sending the request
+	WORKER_HEADERS, // receiving response headers
+	WORKER_BODY // receiving the part of the file
+};
+
+/* One connection */
+struct worker {
+	unsigned nr;
+	enum worker_state state;
+	int sock; // -1 if not connected
+	int reused; // 1 if the request was sent via the already open connection
+	unsigned retries;
+
+	unsigned long long offset; // next byte of the file to be received
+	unsigned long long end; // end of the part (exclusive). Can be lowered when another worker takes over the rest.
+	unsigned long long response_end; // end of the range in the response (exclusive)
+
+	struct arena *arena; // request and response headers of the current part (reset by worker_start)
+	char *request;
+	size_t request_length, request_sent;
+
+	char *buffer; // response headers are read here
+	size_t buffer_size, buffer_length;
+	struct http_response response;
+	int keep_alive;
+
+	unsigned long long received; // total for all parts (for statistics)
+	unsigned parts;
+};
+
+static struct worker *workers = NULL;
+static unsigned worker_count = 0;
+
+static int epfd = -1;
+static int fout = -1;
+static const char *output_filename;
+
+static struct arena *arena = NULL; // current_url and what it was resolved from
+static char *current_url = NULL; // URL after redirects (parsed into "u")
+static struct http_url u;
+static unsigned redirect_nr = 0;
+static unsigned long long total_length = UNKNOWN_LENGTH; // known after the first response
+
+static struct request_timing *first_timing; // timing of the first request (until the length is known)
+static unsigned steals = 0; // parts taken over by the workers which have finished their own part
+
+static int worker_advance(struct worker *w);
+
+static void worker_close(struct worker *w)
+{
+	if(w->sock < 0)
+		return;
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, w->sock, NULL);
+	close(w->sock);
+	w->sock = -1;
+}
+
+/* Returns 1 if "w" is receiving the first response (which tells the length of the file) */
+static int is_first_request(const struct worker *w)
+{
+	return total_length == UNKNOWN_LENGTH && w->nr == 0;
+}
+
+/* Opens the connection (or takes it from the pool). Returns 0 on success, -1 on error. */
+static int worker_connect(struct worker *w)
+{
+	w->sock = pool_acquire(&u);
+	w->reused = w->sock >= 0;
+
+	if(w->sock < 0)
+	{
+		struct addrinfo *ai;
+		int ret = dns_resolve(u.host, u.port, &ai);
+		if(ret != 0)
+		{
+			fprintf(stderr, "[error] Bad hostname or address: \"%s\": %s\n", u.host, gai_strerror(ret));
+			return -1;
+		}
+		if(is_first_request(w))
+			timing_mark(first_timing, TIMING_DNS);
+
+		/* Blocking connect: connections are opened rarely (once per worker,
+			unless the part is taken over by another worker, or the connection fails) */
+		struct happy_eyeballs he;
+		unsigned connect_ms = deadline_limits.ms[DEADLINE_CONNECT];
+		w->sock = connect_happy_eyeballs(ai, &he, connect_ms ? (int) connect_ms : -1);
+		dns_freeaddrinfo(ai);
+
+		if(w->sock < 0)
+		{
+			fprintf(stderr, "[error] connect(%s:%s) failed: %s\n", u.host, u.port, strerror(errno));
+			return -1;
+		}
+		pool_stats.created ++;
+
+		if(is_first_request(w))
+			timing_mark(first_timing, TIMING_CONNECT);
+	}
+	else
+		pool_stats.reused ++;
+
+	if(is_first_request(w))
+		timing_set_reused(first_timing, w->reused);
+
+	if(fcntl(w->sock, F_SETFL, O_NONBLOCK) < 0)
+	{
+		fprintf(stderr, "[error] fcntl() failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.ptr = w;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, w->sock, &ev) < 0)
+	{
+		fprintf(stderr, "[error] epoll_ctl() failed: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+	Requests bytes [first, end) of the file ("end" = UNKNOWN_LENGTH means "until the end").
+	Returns 0 on success, -1 on error.
+*/
+static int worker_start(struct worker *w, unsigned long long first, unsigned long long end)
+{
+	w->offset = first;
+	w->end = end;
+	w->response_end = end;
+	w->parts ++;
+
+	arena_reset(w->arena);
+	int length = format_range_request(w->arena, &w->request, &u, first, end == UNKNOWN_LENGTH ? UNKNOWN_LENGTH : end - 1, NULL);
+	if(length < 0)
+	{
+		fprintf(stderr, "[error] format_range_request: memory allocation failed\n");
+		return -1;
+	}
+	w->request_length = length;
+	w->request_sent = 0;
+
+	w->buffer_length = 0;
+	http_response_init(&w->response, w->arena);
+
+	if(w->sock >= 0)
+		w->reused = 1; // Connection of the previous part
+	else if(worker_connect(w) < 0)
+		return -1;
+
+	w->state = WORKER_SEND;
+	return worker_advance(w);
+}
+
+/* The connection has failed: request the rest of the part via a new connection.
+	Returns 0 on success, -1 on error. */
+static int worker_retry(struct worker *w, const char *reason)
+{
+	worker_close(w);
+
+	/* Reused connection might have been closed by server before it has
+		received our request. Not an error: just try again. */
+	if(w->reused && w->state != WORKER_BODY && w->buffer_length == 0)
+		fprintf(stderr, "[info] Keep-alive connection was closed by server, reconnecting...\n");
+	else if(++ w->retries > SEGMENT_MAX_RETRIES)
+	{
+		fprintf(stderr, "[error] Connection #%u: %s (gave up after %u attempts).\n", w->nr, reason, SEGMENT_MAX_RETRIES + 1);
+		return -1;
+	}
+	else
+		fprintf(stderr, "[warn] Connection #%u: %s, reconnecting to continue from byte %llu.\n", w->nr, reason, w->offset);
+
+	if(is_first_request(w))
+		timing_retry(first_timing);
+
+	w->parts --; // Not a new part
+	return worker_start(w, w->offset, w->end);
+}
+
+/* Response to the first request has told us the length of the file */
+static int open_output(void)
+{
+	fout = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if(fout < 0)
+	{
+		fprintf(stderr, "[error] open(\"%s\") failed: %s\n", output_filename, strerror(errno));
+		return -1;
+	}
+
+	/* Each part is written at its offset, so the whole file is allocated now
+		(this also ensures that there is enough disk space) */
+	if(total_length > 0)
+	{
+		int ret = posix_fallocate(fout, 0, total_length);
+		if(ret == ENOSPC)
+		{
+			fprintf(stderr, "[error] Not enough disk space for \"%s\" (%llu bytes).\n", output_filename, total_length);
+			return -1;
+		}
+
+		if(ret != 0 && ftruncate(fout, total_length) < 0)
+		{
+			fprintf(stderr, "[error] ftruncate() failed: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	fprintf(stderr, "[info] Opened \"%s\" for writing (%llu bytes).\n", output_filename, total_length);
+	return 0;
+}
+
+/* Redirect in response to the first request: starts again with the new URL */
+static int worker_redirect(struct worker *w)
+{
+	const char *location = http_known_header(&w->response, HDR_LOCATION);
+	if(!location)
+	{
+		fprintf(stderr, "[error] Server returned redirect (%i) without Location.\n", w->response.code);
+		return -1;
+	}
+
+	if(++ redirect_nr > max_redirects)
+	{
+		fprintf(stderr, "[error] Redirects depth limit reached: maximum %u are allowed.\n", max_redirects);
+		return -1;
+	}
+
+	char *url = resolve_location(arena, &u, location);
+	if(!url)
+	{
+		fprintf(stderr, "[error] resolve_location: memory allocation failed\n");
+		return -1;
+	}
+	redirect_store(w->arena, &u, url, &w->response);
+
+	fprintf(stderr, "[notice] Redirect to %s\n", url);
+
+	current_url = url;
+	if(parse_url(current_url, &u) != 0)
+		return -1;
+	if(u.tls)
+	{
+		fprintf(stderr, "[notice] Redirect to HTTPS: segmented download is not supported, downloading as usual.\n");
+		return SEGMENTED_UNSUPPORTED;
+	}
+
+	timing_mark(first_timing, TIMING_BODY);
+	timing_hop(first_timing);
+
+	/* The body of redirect is not needed */
+	worker_close(w);
+	return worker_start(w, 0, UNKNOWN_LENGTH);
+}
+
+/*
+	Handles the response headers. Returns 0 on success, -1 on error,
+	SEGMENTED_UNSUPPORTED if the server has ignored the Range header.
+*/
+static int worker_handle_headers(struct worker *w, size_t body_offset)
+{
+	struct http_response *r = &w->response;
+	struct content_range range;
+	struct body_framing framing;
+
+	if(is_first_request(w))
+	{
+		timing_mark(first_timing, TIMING_HEADERS);
+		timing_set_code(first_timing, r->code);
+
+		if(r->code >= 300 && r->code < 400)
+			return worker_redirect(w);
+
+		if(r->code == 200 || r->code == 416) // 416: e.g. the file is empty
+		{
+			fprintf(stderr, "[info] Server doesn't support Range requests, the file will be downloaded via one connection.\n");
+			return SEGMENTED_UNSUPPORTED;
+		}
+	}
+
+	if(r->code != 206)
+	{
+		fprintf(stderr, "[error] Server returned HTTP code %i to the Range request: %s\n", r->code, http_status_text(r));
+		return -1;
+	}
+
+	if(get_content_range(r, &range) < 0 || range.first != w->offset)
+	{
+		const char *value = http_known_header(r, HDR_CONTENT_RANGE);
+		fprintf(stderr, "[error] Server returned wrong Content-Range: %s\n", value ? value : "(none)");
+		return -1;
+	}
+
+	if(get_body_framing(r, &framing) < 0 || framing.is_chunked || framing.no_length ||
+		framing.len != range.last - range.first + 1)
+	{
+		fprintf(stderr, "[error] Unsupported response to the Range request (Content-Length doesn't match Content-Range).\n");
+		return -1;
+	}
+
+	const char *content_encoding = http_known_header(r, HDR_CONTENT_ENCODING);
+	if(content_encoding && strcasecmp(content_encoding, "identity"))
+	{
+		fprintf(stderr, "[error] Server has returned Content-Encoding: %s to the Range request.\n", content_encoding);
+		return -1;
+	}
+
+	if(total_length == UNKNOWN_LENGTH)
+	{
+		if(range.total == UNKNOWN_LENGTH)
+		{
+			fprintf(stderr, "[info] Server doesn't tell the length of the file, it will be downloaded via one connection.\n");
+			return SEGMENTED_UNSUPPORTED;
+		}
+
+		total_length = range.total;
+		w->end = total_length;
+		fprintf(stderr, "[info] Server supports Range requests, the file is %llu bytes long.\n", total_length);
+
+		if(open_output() < 0)
+			return -1;
+	}
+	else if(range.total != total_length)
+	{
+		fprintf(stderr, "[error] The file has been changed on the server during the download.\n");
+		return -1;
+	}
+
+	/* The server may return less than requested (then the rest is requested again) */
+	w->response_end = range.last + 1;
+	w->keep_alive = is_keep_alive(r);
+	w->state = WORKER_BODY;
+
+	/* Part of the body has already been read together with headers */
+	size_t prefetched = w->buffer_length - body_offset;
+	unsigned long long wanted = (w->end < w->response_end ? w->end : w->response_end) - w->offset;
+	if(prefetched > wanted)
+	{
+		prefetched = wanted;
+		if(w->end >= w->response_end)
+			w->keep_alive = 0; // Extra data after the response
+	}
+
+	if(write_body_at(fout, w->buffer + body_offset, prefetched, w->offset) < 0)
+	{
+		fprintf(stderr, "[error] write(\"%s\") failed: %s\n", output_filename, strerror(errno));
+		return -1;
+	}
+	w->offset += prefetched;
+	w->received += prefetched;
+	return 0;
+}
+
+/* The response has ended (or the rest of our part was taken by another worker) */
+static int worker_part_done(struct worker *w)
+{
+	/* Unless the whole response has been read, the connection can't be reused */
+	if(w->offset != w->response_end || !w->keep_alive)
+		worker_close(w);
+
+	if(w->offset < w->end)
+		return worker_start(w, w->offset, w->end); // Server has sent less than requested
+
+	w->state = WORKER_IDLE;
+	return 0;
+}
+
+/* Advances the worker as far as possible without blocking. Returns 0 on success, -1 on error,
+	SEGMENTED_UNSUPPORTED if the server doesn't support ranges. */
+static int worker_advance(struct worker *w)
+{
+	ssize_t bytes;
+
+	while(1)
+	{
+		switch(w->state)
+		{
+			case WORKER_IDLE:
+				return 0;
+
+			case WORKER_SEND:
+				bytes = send(w->sock, w->request + w->request_sent, w->request_length - w->request_sent, MSG_NOSIGNAL);
+				if(bytes < 0)
+				{
+					if(errno == EAGAIN)
+						return 0;
+					return worker_retry(w, strerror(errno));
+				}
+
+				w->request_sent += bytes;
+				if(w->request_sent == w->request_length)
+				{
+					w->state = WORKER_HEADERS;
+					if(is_first_request(w))
+						timing_mark(first_timing, TIMING_REQUEST);
+				}
+				break;
+
+			case WORKER_HEADERS:
+			{
+				if(w->buffer_length == w->buffer_size)
+				{
+					size_t size = w->buffer_size ? w->buffer_size * 2 : HTTP_HEADERS_BUFFER_SIZE;
+					char *buffer = realloc(w->buffer, size);
+					if(!buffer)
+					{
+						fprintf(stderr, "[error] realloc: memory allocation failed\n");
+						return -1;
+					}
+
+					w->buffer = buffer;
+					w->buffer_size = size;
+				}
+
+				bytes = read(w->sock, w->buffer + w->buffer_length, w->buffer_size - w->buffer_length);
+				transfer_stats.read_calls ++;
+
+				if(bytes <= 0)
+				{
+					if(bytes < 0 && errno == EAGAIN)
+						return 0;
+					return worker_retry(w, bytes == 0 ? "connection closed before the response headers" : strerror(errno));
+				}
+
+				if(w->buffer_length == 0 && is_first_request(w))
+					timing_mark(first_timing, TIMING_FIRST_BYTE);
+				w->buffer_length += bytes;
+
+				ssize_t body_offset = http_parse_response(&w->response, w->buffer, w->buffer_length);
+				if(body_offset < 0)
+					return -1;
+
+				if(body_offset == 0)
+					break; // Not all headers have been received yet
+
+				int ret = worker_handle_headers(w, body_offset);
+				if(ret != 0)
+					return ret;
+				break;
+			}
+
+			case WORKER_BODY:
+			{
+				unsigned long long end = w->end < w->response_end ? w->end : w->response_end;
+				if(w->offset >= end)
+				{
+					if(worker_part_done(w) < 0)
+						return -1;
+					break;
+				}
+
+				off_t offset = w->offset;
+				bytes = transfer_from_socket_at(fout, w->sock, end - w->offset, &offset);
+				if(bytes < 0)
+				{
+					if(errno == EAGAIN)
+						return 0;
+					return worker_retry(w, strerror(errno));
+				}
+
+				if(bytes == 0)
+					return worker_retry(w, "response has ended prematurely");
+
+				w->offset += bytes;
+				w->received += bytes;
+				break;
+			}
+		}
+	}
+}
+
+/*
+	Idle worker takes over the end of the largest part which is still
+	being received (if it's long enough). If there are "idle" idle workers
+	(including this one), each of them gets 1/(idle+1) of that part,
+	e.g. the second half if there is only one.
+	Returns 0 on success, -1 on error.
+*/
+static int worker_steal(struct worker *w, unsigned idle)
+{
+	struct worker *victim = NULL;
+	unsigned long long max_left = 0;
+	unsigned i;
+
+	for(i = 0; i < worker_count; i ++)
+	{
+		struct worker *other = &workers[i];
+		if(other->state == WORKER_IDLE)
+			continue;
+
+		unsigned long long left = other->end - other->offset;
+		if(left > max_left)
+		{
+			max_left = left;
+			victim = other;
+		}
+	}
+
+	unsigned long long share = max_left / (idle + 1);
+	if(!victim || share < SEGMENT_MIN_SIZE)
+		return 0;
+
+	unsigned long long end = victim->end;
+	unsigned long long middle = end - share;
+	victim->end = middle;
+
+	if(w->parts > 0)
+		steals ++;
+
+	fprintf(stderr, "[debug] Connection #%u takes bytes %llu-%llu from connection #%u.\n", w->nr, middle, end - 1, victim->nr);
+	return worker_start(w, middle, end);
+}
+
+static void segmented_cleanup(void)
+{
+	unsigned i;
+	for(i = 0; i < worker_count; i ++)
+	{
+		struct worker *w = &workers[i];
+		worker_close(w);
+		free(w->buffer);
+		if(w->arena)
+			arena_put(w->arena);
+	}
+	free(workers);
+	workers = NULL;
+	worker_count = 0;
+
+	if(fout >= 0)
+	{
+		close(fout);
+		fout = -1;
+	}
+
+	close(epfd);
+	epfd = -1;
+
+	if(arena)
+	{
+		arena_put(arena);
+		arena = NULL;
+	}
+	current_url = NULL;
+}
+
+int segmented_download(const char *url, unsigned connections, const char *filename, struct request_timing *timing)
+{
+	int ret = -1;
+	unsigned i;
+
+	if(connections > SEGMENT_MAX_CONNECTIONS)
+		connections = SEGMENT_MAX_CONNECTIONS;
+
+	output_filename = filename;
+	first_timing = timing;
+	total_length = UNKNOWN_LENGTH;
+	redirect_nr = 0;
+	steals = 0;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	workers = calloc(connections, sizeof(struct worker));
+	arena = arena_get();
+	if(epfd < 0 || !workers || !arena)
+	{
+		fprintf(stderr, "[error] Failed to start the segmented download: %s\n", strerror(errno));
+		goto done;
+	}
+
+	worker_count = connections;
+	for(i = 0; i < worker_count; i ++)
+	{
+		workers[i].nr = i;
+		workers[i].sock = -1;
+		if(!(workers[i].arena = arena_get()))
+		{
+			fprintf(stderr, "[error] Failed to start the segmented download: %s\n", strerror(errno));
+			goto done;
+		}
+		http_response_init(&workers[i].response, workers[i].arena);
+	}
+
+	/* Known permanent redirects (see redirect.h): go straight to the target */
+	current_url = redirect_lookup(arena, url, &redirect_nr);
+	if(current_url)
+	{
+		fprintf(stderr, "[notice] Known permanent redirect: %s\n", current_url);
+		redirect_stats.used ++;
+	}
+	else if(!(current_url = arena_strdup(arena, url)))
+	{
+		fprintf(stderr, "[error] Failed to start the segmented download: %s\n", strerror(errno));
+		goto done;
+	}
+
+	if(parse_url(current_url, &u) != 0)
+		goto done;
+	if(u.tls)
+	{
+		fprintf(stderr, "[notice] Segmented download via HTTPS is not supported, downloading as usual.\n");
+		ret = SEGMENTED_UNSUPPORTED;
+		goto done;
+	}
+
+	timing_hop(first_timing);
+	fprintf(stderr, "[info] Segmented download via up to %u connections.\n", connections);
+
+	/* The first connection asks for the whole file, the others will join
+		when the length is known (see worker_steal) */
+	ret = worker_start(&workers[0], 0, UNKNOWN_LENGTH);
+	if(ret != 0)
+		goto done;
+
+	/* Whole download must fit into the total deadline, and something must arrive
+		via any of the connections before the idle deadline */
+	struct deadlines deadlines;
+	deadlines_start(&deadlines, &deadline_limits);
+	deadline_arm(&deadlines, DEADLINE_IDLE);
+
+	while(1)
+	{
+		/* Idle workers take over the parts of others */
+		unsigned idle = 0;
+		for(i = 0; i < worker_count; i ++)
+		{
+			if(workers[i].state == WORKER_IDLE)
+				idle ++;
+		}
+
+		if(total_length != UNKNOWN_LENGTH)
+		{
+			for(i = 0; i < worker_count; i ++)
+			{
+				if(workers[i].state != WORKER_IDLE)
+					continue;
+
+				if((ret = worker_steal(&workers[i], idle)) != 0)
+					goto done;
+
+				if(workers[i].state != WORKER_IDLE)
+					idle --;
+			}
+		}
+
+		if(idle == worker_count)
+			break; // Done
+
+		struct epoll_event events[SEGMENTED_MAX_EVENTS];
+		enum deadline_kind kind;
+		int count = epoll_wait(epfd, events, SEGMENTED_MAX_EVENTS, deadline_wait_ms(&deadlines, &kind));
+		if(count < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			fprintf(stderr, "[error] epoll_wait() failed: %s\n", strerror(errno));
+			ret = -1;
+			goto done;
+		}
+
+		if(count > 0)
+			deadline_arm(&deadlines, DEADLINE_IDLE);
+
+		if(deadline_wait_ms(&deadlines, &kind) == 0)
+		{
+			fprintf(stderr, "[error] Timeout: %s deadline (%u ms) has expired.\n", deadline_name(kind), deadline_limits.ms[kind]);
+			ret = -1;
+			goto done;
+		}
+
+		int j;
+		for(j = 0; j < count; j ++)
+		{
+			ret = worker_advance(events[j].data.ptr);
+			if(ret != 0)
+				goto done;
+		}
+	}
+
+	timing_mark(first_timing, TIMING_BODY);
+
+	for(i = 0; i < worker_count; i ++)
+	{
+		if(workers[i].parts)
+			fprintf(stderr, "[info] Connection #%u: %llu bytes in %u parts.\n", i, workers[i].received, workers[i].parts);
+	}
+	fprintf(stderr, "[info] Segmented download: %llu bytes via %u connections, %u parts taken over from slower connections.\n",
+		total_length, connections, steals);
+
+	if(close(fout) < 0)
+	{
+		fprintf(stderr, "[error] close() failed: %s\n", strerror(errno));
+		fout = -1;
+		ret = -1;
+		goto done;
+	}
+	fout = -1;
+	ret = 0;
+
+done:
+	segmented_cleanup();
+	return ret;
+}
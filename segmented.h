@@ -0,0 +1,51 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_SEGMENTED_H
+#define HTTP_CLIENT_SEGMENTED_H
+
+#include "timing.h"
+
+/*
+	Segmented download: one large file is fetched via several connections
+	at once, each of them receiving its own part (Range request),
+	which is written at its offset into the preallocated output file.
+
+	The first connection asks for the whole file ("Range: bytes=0-"):
+	its response tells whether the server supports ranges and what
+	is the length of the file. Then the other connections take
+	parts of its range. Whenever a connection finishes its part,
+	it takes over the second half of the largest part which is still
+	being received by another connection (work stealing), so that
+	slow connections don't delay the whole download.
+*/
+
+#define SEGMENT_MIN_SIZE (512 * 1024) // parts shorter than this are not split further
+#define SEGMENT_MAX_CONNECTIONS 64
+#define SEGMENT_MAX_RETRIES 3 // how many times the connection can fail (and be reopened)
+
+#define SEGMENTED_UNSUPPORTED 1 // returned by segmented_download()
+
+/*
+	Downloads "url" into "filename" via up to "connections" connections.
+	"timing" receives the phases of the first request.
+
+	Returns 0 on success, -1 on error (already reported), or
+	SEGMENTED_UNSUPPORTED if the server doesn't support Range requests
+	(nothing has been written then: the file must be downloaded as usual).
+*/
+int segmented_download(const char *url, unsigned connections, const char *filename, struct request_timing *timing);
+
+#endif
@@ -0,0 +1,1236 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+/*
+	Local HTTP server for tests and benchmarks (so that we don't depend on httpbin.org).
+	One thread per connection, keep-alive is supported.
+
+	Pages which are used by run_tests.sh (same as on httpbin.org):
+		/                         - HTML page
+		/robots.txt
+		/redirect-to?url=URL[&status_code=CODE] - 302 (or CODE) to URL
+		/absolute-redirect/N      - N redirects (with absolute Location), then /get
+		/relative-redirect/N      - N redirects (with relative Location), then /get
+		/get, /user-agent         - JSON with User-Agent of the client
+		/image/png                - 1x1 PNG image
+		/status/CODE              - empty response with this HTTP code (the request body is not read)
+		/anything                 - JSON with the method, X-Test header and length of the request body
+		                            (any method; "100 Continue" for "Expect: 100-continue")
+
+	Pages for testing the corner cases and for benchmarks:
+		/bytes/N                  - N bytes, Content-Length (supports Range requests, ETag and If-Range)
+		/slow-start/N/RATE        - same as /bytes, but the response which starts from byte 0
+		                            is sent at RATE Kb/s (for tests of the segmented download)
+		/chunked/N/SIZE           - N bytes, Transfer-Encoding: chunked, chunks of SIZE bytes
+		/drip/N/DELAY             - N bytes, one byte every DELAY milliseconds
+		/stall/N                  - promises N+1 bytes, sends N, then waits until the client goes away
+		/headers/COUNT/LENGTH     - COUNT extra headers with LENGTH-byte values (huge headers)
+		/disconnect/N             - promises 2*N bytes, sends N, then closes the connection
+		/flaky/N/CUT              - same as /bytes, but each response is cut off after CUT bytes of body
+		                            (for tests of resuming the interrupted downloads)
+		/flaky-stall/N/CUT        - same as /flaky, but after CUT bytes the server stops sending and
+		                            keeps the connection open (for tests of -r with idle timeout)
+		/cache/N/MAXAGE           - N bytes, fresh for MAXAGE seconds (Cache-Control), ETag and Last-Modified,
+		                            304 Not Modified for If-None-Match or If-Modified-Since (for tests of the cache)
+		/gzip/N, /deflate/N       - N bytes, compressed (Content-Encoding), Content-Length
+		/deflate-raw/N            - same as /deflate, but without zlib header (like some servers do)
+		/gzip-chunked/N/SIZE      - N bytes, gzip, Transfer-Encoding: chunked, chunks of SIZE bytes
+		/digest/N                 - N bytes with Repr-Digest (SHA-256 and CRC32C of the body, RFC 9530)
+		/digest-legacy/N          - same, but in the older Digest header (RFC 3230)
+		/digest-wrong/N           - Repr-Digest which doesn't match the body (for tests of -V)
+
+	HTTP/2 without TLS (h2c with prior knowledge, for tests of -2 which nghttpd can't do):
+		/bytes/N                  - N bytes (up to 1 Mb)
+		/h2-bad-frame             - DATA frame on stream 0 (connection error), nothing else is answered
+
+	Bodies of /bytes, /chunked, etc. are the same: byte number i is (i % 251).
+	/anything also checks that the request body (if any) is the same pattern.
+	HEAD requests get the headers only.
+*/
+
+#define _GNU_SOURCE // asprintf()
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
+
+#include "arena.h"
+#include "digest.h"
+#include "hpack.h"
+
+#define REQUEST_BUFFER_SIZE 65536 // limit for length of request headers
+#define BODY_PATTERN_LENGTH 251 // body is a repeated pattern of this length (prime, so that offsets are easy to check)
+#define SEND_BUFFER_SIZE (BODY_PATTERN_LENGTH * 256)
+#define LAST_MODIFIED "Mon, 01 Jan 2018 00:00:00 GMT" // of all pages (they never change)
+
+static char pattern[SEND_BUFFER_SIZE]; // pattern repeated 256 times
+static int verbose = 0;
+
+static const unsigned char png_image[] = {
+	0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52,
+	0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x08, 0x00, 0x00, 0x00, 0x00, 0x3a, 0x7e, 0x9b,
+	0x55, 0x00, 0x00, 0x00, 0x0a, 0x49, 0x44, 0x41, 0x54, 0x78, 0x9c, 0x63, 0x60, 0x00, 0x00, 0x00,
+	0x02, 0x00, 0x01, 0x48, 0xaf, 0xa4, 0x71, 0x00, 0x00, 0x00, 0x00, 0x49, 0x45, 0x4e, 0x44, 0xae,
+	0x42, 0x60, 0x82
+};
+
+static const char *root_page =
+	"<!DOCTYPE html>\n<html><head><title>http_client test server</title></head>\n"
+	"<body><p>This is the local test server of http_client.</p></body></html>\n";
+
+static const char *robots_txt = "User-agent: *\nDisallow: /deny\n";
+
+struct connection {
+	int sock;
+	char buffer[REQUEST_BUFFER_SIZE + 1];
+	size_t buffer_length;
+
+	/* Current request */
+	char *method;
+	char *path;
+	const char *host; // value of Host header
+	const char *user_agent;
+	const char *range; // value of Range header (NULL if none)
+	const char *if_range; // value of If-Range header (NULL if none)
+	const char *if_none_match;
+	const char *if_modified_since;
+	const char *x_test; // value of X-Test header (NULL if none)
+	int keep_alive;
+	int head; // HEAD request: no body in the response
+
+	/* Body of the current request (only Content-Length is supported) */
+	size_t request_length; // headers of the current request are conn->buffer[0 .. request_length)
+	unsigned long long body_left; // not read yet
+	int expect_continue; // "Expect: 100-continue" and we haven't answered it yet
+};
+
+static void print_usage()
+{
+	fprintf(stderr, "Usage: test_server [-p PORT] [-v]\n\n"
+		"  -p PORT  Listen on 127.0.0.1:PORT (default: 8080).\n"
+		"  -v       Print every request.\n");
+	exit(1);
+}
+
+/* Returns 0 on success, -1 if the client has closed the connection */
+static int send_all(int sock, const void *data, size_t length)
+{
+	const char *p = data;
+	while(length > 0)
+	{
+		ssize_t bytes = send(sock, p, length, MSG_NOSIGNAL);
+		if(bytes < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		p += bytes;
+		length -= bytes;
+	}
+	return 0;
+}
+
+/* Sends "length" bytes of the body, starting from offset "offset" of the pattern */
+static int send_pattern(int sock, unsigned long long offset, unsigned long long length)
+{
+	while(length > 0)
+	{
+		size_t start = offset % BODY_PATTERN_LENGTH;
+		size_t chunk = SEND_BUFFER_SIZE - start;
+		if(chunk > length)
+			chunk = length;
+
+		if(send_all(sock, pattern + start, chunk) < 0)
+			return -1;
+
+		offset += chunk;
+		length -= chunk;
+	}
+	return 0;
+}
+
+/* Encodes "length" bytes into "out" (4 * ((length + 2) / 3) + 1 bytes) */
+static void base64_encode(const unsigned char *data, size_t length, char *out)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t i;
+
+	for(i = 0; i < length; i += 3)
+	{
+		unsigned bits = data[i] << 16;
+		if(i + 1 < length)
+			bits |= data[i + 1] << 8;
+		if(i + 2 < length)
+			bits |= data[i + 2];
+
+		*out ++ = alphabet[bits >> 18];
+		*out ++ = alphabet[(bits >> 12) & 63];
+		*out ++ = i + 1 < length ? alphabet[(bits >> 6) & 63] : '=';
+		*out ++ = i + 2 < length ? alphabet[bits & 63] : '=';
+	}
+	*out = '\0';
+}
+
+/* Base64 of the digest of the first "n" bytes of the pattern (with one byte changed if "wrong") */
+static void pattern_digest(enum digest_algorithm algorithm, unsigned long long n, int wrong, char *out)
+{
+	struct digest d;
+	struct digest_value v;
+	unsigned long long offset;
+
+	digest_init(&d, algorithm);
+	for(offset = 0; offset < n; )
+	{
+		size_t start = offset % BODY_PATTERN_LENGTH;
+		size_t chunk = SEND_BUFFER_SIZE - start;
+		if(chunk > n - offset)
+			chunk = n - offset;
+
+		digest_update(&d, pattern + start, chunk);
+		offset += chunk;
+	}
+	digest_final(&d, &v);
+
+	if(wrong)
+		v.value[0] ^= 1;
+	base64_encode(v.value, v.size, out);
+}
+
+static const char *status_text(unsigned code)
+{
+	switch(code)
+	{
+		case 100: return "Continue";
+		case 101: return "Switching Protocols";
+		case 200: return "OK";
+		case 206: return "Partial Content";
+		case 204: return "No Content";
+		case 301: return "Moved Permanently";
+		case 302: return "Found";
+		case 304: return "Not Modified";
+		case 307: return "Temporary Redirect";
+		case 308: return "Permanent Redirect";
+		case 400: return "Bad Request";
+		case 404: return "Not Found";
+		case 413: return "Content Too Large";
+		case 416: return "Range Not Satisfiable";
+		case 417: return "Expectation Failed";
+		case 500: return "Internal Server Error";
+	}
+	return "Unknown";
+}
+
+/*
+	Sends the status line and headers (Content-Length is added if "content_length" is not negative).
+	"extra_headers" are either NULL or "Name: value\r\n" lines.
+*/
+static int send_headers(struct connection *conn, unsigned code, long long content_length, const char *extra_headers)
+{
+	char headers[1024];
+	int length = snprintf(headers, sizeof(headers), "HTTP/1.1 %u %s\r\nServer: http_client-test_server\r\n", code, status_text(code));
+
+	if(content_length >= 0)
+		length += snprintf(headers + length, sizeof(headers) - length, "Content-Length: %lld\r\n", content_length);
+
+	if(!conn->keep_alive)
+		length += snprintf(headers + length, sizeof(headers) - length, "Connection: close\r\n");
+
+	if(send_all(conn->sock, headers, length) < 0)
+		return -1;
+
+	if(extra_headers && send_all(conn->sock, extra_headers, strlen(extra_headers)) < 0)
+		return -1;
+
+	return send_all(conn->sock, "\r\n", 2);
+}
+
+/* Sends the whole response with the body from memory */
+static int send_response(struct connection *conn, unsigned code, const char *content_type, const void *body, size_t length)
+{
+	char content_type_header[256];
+	snprintf(content_type_header, sizeof(content_type_header), "Content-Type: %s\r\n", content_type);
+
+	if(send_headers(conn, code, length, content_type_header) < 0)
+		return -1;
+
+	return conn->head ? 0 : send_all(conn->sock, body, length);
+}
+
+static int send_not_found(struct connection *conn)
+{
+	const char *body = "Not found\n";
+	return send_response(conn, 404, "text/plain", body, strlen(body));
+}
+
+static int send_redirect(struct connection *conn, unsigned code, const char *location)
+{
+	char *header;
+	if(asprintf(&header, "Location: %s\r\n", location) < 0)
+		return -1;
+
+	int ret = send_headers(conn, code, 0, header);
+	free(header);
+	return ret;
+}
+
+static void sleep_ms(unsigned ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+	while(nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+/* Waits until the client closes the connection (or for 60 seconds) */
+static void wait_for_client(int sock)
+{
+	struct pollfd pfd = { sock, POLLIN, 0 };
+	char discard[4096];
+	time_t until = time(NULL) + 60;
+
+	while(time(NULL) < until)
+	{
+		if(poll(&pfd, 1, 1000) <= 0)
+			continue;
+
+		if(recv(sock, discard, sizeof(discard), 0) <= 0)
+			return;
+	}
+}
+
+/*
+	Compresses N bytes of the pattern. "window_bits" are the same as in deflateInit2():
+	15 for zlib format ("deflate"), -15 for raw deflate, 31 for gzip.
+	Returns malloc()ed buffer (its length is put into "*length"), NULL on error.
+*/
+static unsigned char *compress_pattern(unsigned long long n, int window_bits, size_t *length)
+{
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return NULL;
+
+	size_t size = deflateBound(&zs, n);
+	unsigned char *out = malloc(size);
+	if(!out)
+	{
+		deflateEnd(&zs);
+		return NULL;
+	}
+
+	zs.next_out = out;
+	zs.avail_out = size;
+
+	unsigned long long offset = 0;
+	int ret;
+	do {
+		size_t start = offset % BODY_PATTERN_LENGTH;
+		size_t chunk = SEND_BUFFER_SIZE - start;
+		if(chunk > n - offset)
+			chunk = n - offset;
+
+		zs.next_in = (unsigned char *) pattern + start;
+		zs.avail_in = chunk;
+		offset += chunk;
+
+		ret = deflate(&zs, offset == n ? Z_FINISH : Z_NO_FLUSH);
+	} while(ret == Z_OK && offset < n);
+
+	while(ret == Z_OK)
+		ret = deflate(&zs, Z_FINISH);
+
+	*length = zs.total_out;
+	deflateEnd(&zs);
+
+	if(ret != Z_STREAM_END)
+	{
+		free(out);
+		return NULL;
+	}
+	return out;
+}
+
+/*
+	Parses "Range: bytes=FIRST-LAST" (also "FIRST-" and "-SUFFIX_LENGTH") for the resource of "n" bytes.
+	Returns 0 on success, -1 if the range can't be satisfied.
+*/
+static int parse_range(const char *range, unsigned long long n, unsigned long long *first, unsigned long long *last)
+{
+	unsigned long long a, b;
+	int consumed = 0;
+
+	if(sscanf(range, "bytes=%llu-%llu%n", &a, &b, &consumed) == 2 && consumed == (int) strlen(range))
+	{
+		if(b >= n)
+			b = n - 1;
+	}
+	else if(sscanf(range, "bytes=%llu-%n", &a, &consumed) == 1 && consumed == (int) strlen(range))
+		b = n - 1;
+	else if(sscanf(range, "bytes=-%llu%n", &b, &consumed) == 1 && consumed == (int) strlen(range) && b > 0)
+	{
+		a = b >= n ? 0 : n - b;
+		b = n - 1;
+	}
+	else
+		return -1;
+
+	if(a >= n || a > b)
+		return -1;
+
+	*first = a;
+	*last = b;
+	return 0;
+}
+
+/*
+	Sends /bytes/N (or the part of it requested in Range header). If "rate" is not 0,
+	the response which starts from byte 0 is throttled to "rate" Kb/s. If "cut" is not NO_CUT,
+	the connection is closed after "cut" bytes of body (with "stall", nothing more is sent,
+	but the connection stays open until the client goes away).
+*/
+#define NO_CUT ((unsigned long long) -1)
+static int send_bytes(struct connection *conn, unsigned long long n, unsigned rate, unsigned long long cut, int stall)
+{
+	unsigned long long first = 0, last = n - 1;
+	unsigned code = 200;
+	char etag[64], headers[256];
+
+	/* ETag depends only on N: the body is the same for the same N */
+	snprintf(etag, sizeof(etag), "\"bytes-%llu\"", n);
+	snprintf(headers, sizeof(headers), "Accept-Ranges: bytes\r\nETag: %s\r\n", etag);
+
+	/* If-Range: send the part only if the client has the same version of the resource */
+	if(conn->range && (!conn->if_range || !strcmp(conn->if_range, etag)))
+	{
+		if(parse_range(conn->range, n, &first, &last) < 0)
+		{
+			snprintf(headers, sizeof(headers), "Content-Range: bytes */%llu\r\n", n);
+			return send_headers(conn, 416, 0, headers);
+		}
+
+		code = 206;
+		snprintf(headers, sizeof(headers), "Accept-Ranges: bytes\r\nETag: %s\r\nContent-Range: bytes %llu-%llu/%llu\r\n",
+			etag, first, last, n);
+	}
+
+	unsigned long long length = n ? last - first + 1 : 0;
+	if(send_headers(conn, code, length, headers) < 0)
+		return -1;
+
+	if(conn->head)
+		return 0;
+
+	if(cut < length)
+	{
+		if(send_pattern(conn->sock, first, cut) == 0 && stall)
+			wait_for_client(conn->sock);
+		return -1; // Close the connection
+	}
+
+	if(!rate || first != 0)
+		return send_pattern(conn->sock, first, length);
+
+	/* Throttled: a part of data every 10 ms */
+	unsigned long long offset = first, step = rate * 1024 / 100 + 1;
+	while(length > 0)
+	{
+		unsigned long long chunk = length < step ? length : step;
+		if(send_pattern(conn->sock, offset, chunk) < 0)
+			return -1;
+
+		offset += chunk;
+		length -= chunk;
+		sleep_ms(10);
+	}
+	return 0;
+}
+
+/* Decodes %XX in place */
+static void url_decode(char *s)
+{
+	char *out = s;
+	for(; *s; s ++)
+	{
+		unsigned c;
+		if(*s == '%' && sscanf(s + 1, "%2x", &c) == 1)
+		{
+			*out ++ = c;
+			s += 2;
+		}
+		else
+			*out ++ = *s;
+	}
+	*out = '\0';
+}
+
+/* Returns 0 if the connection can be reused, -1 if it must be closed */
+/*
+	Reads the next part of the request body (at most "size" bytes) into "buf":
+	first what is already in conn->buffer after the headers, then from the socket.
+	Returns the number of bytes, 0 at the end of the body, -1 if the client has gone away.
+*/
+static ssize_t read_body(struct connection *conn, char *buf, size_t size)
+{
+	if(conn->body_left < size)
+		size = conn->body_left;
+	if(!size)
+		return 0;
+
+	if(conn->expect_continue)
+	{
+		/* The client is waiting for our permission to send the body */
+		conn->expect_continue = 0;
+		if(send_headers(conn, 100, -1, NULL) < 0)
+			return -1;
+	}
+
+	size_t buffered = conn->buffer_length - conn->request_length;
+	ssize_t bytes;
+	if(buffered > 0)
+	{
+		/* Remove it from the buffer (anything after it is the next pipelined request) */
+		bytes = buffered < size ? buffered : size;
+		char *body = conn->buffer + conn->request_length;
+		memcpy(buf, body, bytes);
+		memmove(body, body + bytes, buffered - bytes);
+		conn->buffer_length -= bytes;
+		conn->buffer[conn->buffer_length] = '\0';
+	}
+	else
+	{
+		while((bytes = recv(conn->sock, buf, size, 0)) < 0 && errno == EINTR);
+		if(bytes <= 0)
+			return -1;
+	}
+
+	conn->body_left -= bytes;
+	return bytes;
+}
+
+/* Reads (and checks) the request body, then responds with what we have received */
+static int send_anything(struct connection *conn)
+{
+	char buf[65536];
+	unsigned long long length = 0;
+	int pattern_ok = 1;
+	ssize_t bytes;
+
+	while((bytes = read_body(conn, buf, sizeof(buf))) > 0)
+	{
+		ssize_t i;
+		for(i = 0; i < bytes && pattern_ok; i ++)
+		{
+			if((unsigned char) buf[i] != (length + i) % BODY_PATTERN_LENGTH)
+				pattern_ok = 0;
+		}
+		length += bytes;
+	}
+	if(bytes < 0)
+		return -1;
+
+	char body[2048];
+	int body_length = snprintf(body, sizeof(body),
+		"{\n  \"method\": \"%s\",\n  \"x-test\": \"%s\",\n  \"length\": %llu,\n  \"pattern\": \"%s\"\n}\n",
+		conn->method, conn->x_test ? conn->x_test : "", length, pattern_ok ? "ok" : "mismatch");
+	if(body_length >= (int) sizeof(body))
+		body_length = sizeof(body) - 1;
+	return send_response(conn, 200, "application/json", body, body_length);
+}
+
+static int handle_request(struct connection *conn)
+{
+	const char *path = conn->path;
+	unsigned long long n, m;
+	unsigned code;
+
+	if(!strcmp(path, "/"))
+		return send_response(conn, 200, "text/html", root_page, strlen(root_page));
+
+	if(!strcmp(path, "/robots.txt"))
+		return send_response(conn, 200, "text/plain", robots_txt, strlen(robots_txt));
+
+	if(!strcmp(path, "/image/png"))
+		return send_response(conn, 200, "image/png", png_image, sizeof(png_image));
+
+	if(!strcmp(path, "/anything"))
+		return send_anything(conn);
+
+	if(!strcmp(path, "/get") || !strcmp(path, "/user-agent"))
+	{
+		char body[2048];
+		int length = snprintf(body, sizeof(body), "{\n  \"user-agent\": \"%s\"\n}\n", conn->user_agent ? conn->user_agent : "");
+		if(length >= (int) sizeof(body))
+			length = sizeof(body) - 1;
+		return send_response(conn, 200, "application/json", body, length);
+	}
+
+	if(!strncmp(path, "/redirect-to?url=", 17))
+	{
+		char *location = strdup(path + 17);
+		unsigned redirect_code = 302;
+
+		char *status_code = strstr(location, "&status_code=");
+		if(status_code)
+		{
+			*status_code = '\0';
+			if(sscanf(status_code + 13, "%u", &redirect_code) != 1 || redirect_code < 300 || redirect_code > 399)
+				redirect_code = 302;
+		}
+
+		url_decode(location);
+		int ret = send_redirect(conn, redirect_code, location);
+		free(location);
+		return ret;
+	}
+
+	if(sscanf(path, "/absolute-redirect/%llu", &n) == 1 || sscanf(path, "/relative-redirect/%llu", &n) == 1)
+	{
+		int absolute = path[1] == 'a';
+		char location[1024];
+		char next[64];
+
+		if(n > 1)
+			snprintf(next, sizeof(next), "/%s-redirect/%llu", absolute ? "absolute" : "relative", n - 1);
+		else
+			strcpy(next, "/get");
+
+		if(absolute)
+			snprintf(location, sizeof(location), "http://%s%s", conn->host ? conn->host : "127.0.0.1", next);
+		else
+			strcpy(location, next);
+
+		return send_redirect(conn, 302, location);
+	}
+
+	if(sscanf(path, "/status/%u", &code) == 1)
+	{
+		if(code == 204 || code == 304 || code < 200)
+		{
+			/* These responses have no body (and no Content-Length) */
+			if(code < 200)
+				conn->keep_alive = 0;
+			return send_headers(conn, code, -1, NULL);
+		}
+		return send_headers(conn, code, 0, NULL);
+	}
+
+	if(sscanf(path, "/bytes/%llu", &n) == 1)
+		return send_bytes(conn, n, 0, NO_CUT, 0);
+
+	if(sscanf(path, "/slow-start/%llu/%llu", &n, &m) == 2)
+		return send_bytes(conn, n, m, NO_CUT, 0);
+
+	if(sscanf(path, "/flaky/%llu/%llu", &n, &m) == 2 && m > 0)
+		return send_bytes(conn, n, 0, m, 0);
+
+	if(sscanf(path, "/flaky-stall/%llu/%llu", &n, &m) == 2 && m > 0)
+		return send_bytes(conn, n, 0, m, 1);
+
+	if(sscanf(path, "/cache/%llu/%llu", &n, &m) == 2)
+	{
+		char etag[64], headers[256];
+		snprintf(etag, sizeof(etag), "\"cache-%llu\"", n);
+		snprintf(headers, sizeof(headers), "ETag: %s\r\nLast-Modified: %s\r\nCache-Control: max-age=%llu\r\n", etag, LAST_MODIFIED, m);
+
+		/* If-None-Match has priority over If-Modified-Since */
+		if(conn->if_none_match ? !strcmp(conn->if_none_match, etag) :
+			(conn->if_modified_since && !strcmp(conn->if_modified_since, LAST_MODIFIED)))
+		{
+			return send_headers(conn, 304, -1, headers);
+		}
+
+		if(send_headers(conn, 200, n, headers) < 0)
+			return -1;
+		return send_pattern(conn->sock, 0, n);
+	}
+
+	if(sscanf(path, "/chunked/%llu/%llu", &n, &m) == 2)
+	{
+		if(m == 0)
+			return send_not_found(conn);
+
+		if(send_headers(conn, 200, -1, "Transfer-Encoding: chunked\r\n") < 0)
+			return -1;
+
+		unsigned long long offset;
+		for(offset = 0; offset < n; offset += m)
+		{
+			unsigned long long chunk = n - offset < m ? n - offset : m;
+			char size_line[32];
+
+			snprintf(size_line, sizeof(size_line), "%llx\r\n", chunk);
+			if(send_all(conn->sock, size_line, strlen(size_line)) < 0 ||
+				send_pattern(conn->sock, offset, chunk) < 0 ||
+				send_all(conn->sock, "\r\n", 2) < 0)
+			{
+				return -1;
+			}
+		}
+		return send_all(conn->sock, "0\r\n\r\n", 5);
+	}
+
+	if(sscanf(path, "/drip/%llu/%llu", &n, &m) == 2)
+	{
+		if(send_headers(conn, 200, n, NULL) < 0)
+			return -1;
+
+		unsigned long long offset;
+		for(offset = 0; offset < n; offset ++)
+		{
+			sleep_ms(m);
+			if(send_pattern(conn->sock, offset, 1) < 0)
+				return -1;
+		}
+		return 0;
+	}
+
+	if(sscanf(path, "/stall/%llu", &n) == 1)
+	{
+		if(send_headers(conn, 200, n + 1, NULL) == 0 && send_pattern(conn->sock, 0, n) == 0)
+			wait_for_client(conn->sock);
+		return -1;
+	}
+
+	if(sscanf(path, "/disconnect/%llu", &n) == 1)
+	{
+		if(send_headers(conn, 200, 2 * n, NULL) == 0)
+			send_pattern(conn->sock, 0, n);
+		return -1;
+	}
+
+	int is_legacy = sscanf(path, "/digest-legacy/%llu", &n) == 1;
+	int is_wrong = !is_legacy && sscanf(path, "/digest-wrong/%llu", &n) == 1;
+	if(is_legacy || is_wrong || sscanf(path, "/digest/%llu", &n) == 1)
+	{
+		char sha256[64], crc32c[16], headers[256];
+		pattern_digest(DIGEST_SHA256, n, is_wrong, sha256);
+		pattern_digest(DIGEST_CRC32C, n, is_wrong, crc32c);
+
+		if(is_legacy)
+			snprintf(headers, sizeof(headers), "Digest: SHA-256=%s,CRC32C=%s\r\n", sha256, crc32c);
+		else
+			snprintf(headers, sizeof(headers), "Repr-Digest: sha-256=:%s:, crc32c=:%s:\r\n", sha256, crc32c);
+
+		if(send_headers(conn, 200, n, headers) < 0)
+			return -1;
+		return conn->head ? 0 : send_pattern(conn->sock, 0, n);
+	}
+
+	int is_gzip = sscanf(path, "/gzip/%llu", &n) == 1;
+	int is_deflate = !is_gzip && sscanf(path, "/deflate/%llu", &n) == 1;
+	int is_raw_deflate = !is_gzip && !is_deflate && sscanf(path, "/deflate-raw/%llu", &n) == 1;
+	if(is_gzip || is_deflate || is_raw_deflate)
+	{
+		size_t length;
+		unsigned char *body = compress_pattern(n, is_gzip ? 31 : is_deflate ? 15 : -15, &length);
+		if(!body)
+			return -1;
+
+		int ret = send_headers(conn, 200, length, is_gzip ? "Content-Encoding: gzip\r\n" : "Content-Encoding: deflate\r\n");
+		if(ret == 0)
+			ret = send_all(conn->sock, body, length);
+		free(body);
+		return ret;
+	}
+
+	if(sscanf(path, "/gzip-chunked/%llu/%llu", &n, &m) == 2 && m > 0)
+	{
+		size_t length;
+		unsigned char *body = compress_pattern(n, 31, &length);
+		if(!body)
+			return -1;
+
+		int ret = send_headers(conn, 200, -1, "Content-Encoding: gzip\r\nTransfer-Encoding: chunked\r\n");
+
+		size_t offset;
+		for(offset = 0; ret == 0 && offset < length; offset += m)
+		{
+			size_t chunk = length - offset < m ? length - offset : m;
+			char size_line[32];
+
+			snprintf(size_line, sizeof(size_line), "%zx\r\n", chunk);
+			if(send_all(conn->sock, size_line, strlen(size_line)) < 0 ||
+				send_all(conn->sock, body + offset, chunk) < 0 ||
+				send_all(conn->sock, "\r\n", 2) < 0)
+			{
+				ret = -1;
+			}
+		}
+		free(body);
+
+		if(ret < 0)
+			return -1;
+		return send_all(conn->sock, "0\r\n\r\n", 5);
+	}
+
+	if(sscanf(path, "/headers/%llu/%llu", &n, &m) == 2)
+	{
+		/* Sent as one block (together with the usual headers), like a real server would */
+		char *headers = malloc(n * (m + 32) + 1);
+		if(!headers)
+			return -1;
+
+		char *p = headers;
+		unsigned long long i;
+		for(i = 0; i < n; i ++)
+		{
+			p += sprintf(p, "X-Header-%llu: ", i);
+			memset(p, 'a' + i % 26, m);
+			p += m;
+			*p ++ = '\r';
+			*p ++ = '\n';
+		}
+		*p = '\0';
+
+		int ret = send_headers(conn, 200, 3, headers);
+		free(headers);
+		if(ret < 0)
+			return -1;
+
+		return send_all(conn->sock, "ok\n", 3);
+	}
+
+	return send_not_found(conn);
+}
+
+/*
+	Reads the next request into conn->buffer and parses it.
+	Returns the length of the request, -1 if the connection must be closed.
+*/
+static int read_request(struct connection *conn)
+{
+	char *end_of_headers;
+	while(!(end_of_headers = strstr(conn->buffer, "\r\n\r\n")))
+	{
+		if(conn->buffer_length == REQUEST_BUFFER_SIZE)
+		{
+			fprintf(stderr, "[warn] Request headers are too long (> %i bytes).\n", REQUEST_BUFFER_SIZE);
+			return -1;
+		}
+
+		ssize_t bytes = recv(conn->sock, conn->buffer + conn->buffer_length, REQUEST_BUFFER_SIZE - conn->buffer_length, 0);
+		if(bytes <= 0)
+		{
+			if(bytes < 0 && errno == EINTR)
+				continue;
+			return -1; // Client has closed the connection
+		}
+
+		conn->buffer_length += bytes;
+		conn->buffer[conn->buffer_length] = '\0';
+	}
+	end_of_headers[2] = '\0';
+
+	/* Request line */
+	char *line = conn->buffer;
+	char *next_line = strstr(line, "\r\n");
+	*next_line = '\0';
+
+	char *saveptr;
+	conn->method = strtok_r(line, " ", &saveptr);
+	conn->path = strtok_r(NULL, " ", &saveptr);
+	char *proto = strtok_r(NULL, " ", &saveptr);
+	if(!conn->method || !conn->path || !proto)
+	{
+		fprintf(stderr, "[warn] Malformed request line.\n");
+		return -1;
+	}
+
+	conn->keep_alive = strcmp(proto, "HTTP/1.0") != 0;
+	conn->head = !strcmp(conn->method, "HEAD");
+	conn->body_left = 0;
+	conn->expect_continue = 0;
+	conn->x_test = NULL;
+	conn->host = NULL;
+	conn->user_agent = NULL;
+	conn->range = NULL;
+	conn->if_range = NULL;
+	conn->if_none_match = NULL;
+	conn->if_modified_since = NULL;
+
+	/* Headers (only the ones we need) */
+	for(line = next_line + 2; *line; line = next_line + 2)
+	{
+		next_line = strstr(line, "\r\n");
+		*next_line = '\0';
+
+		char *value = strchr(line, ':');
+		if(!value)
+			continue;
+		*value ++ = '\0';
+		value += strspn(value, " \t");
+
+		if(!strcasecmp(line, "host"))
+			conn->host = value;
+		else if(!strcasecmp(line, "user-agent"))
+			conn->user_agent = value;
+		else if(!strcasecmp(line, "range"))
+			conn->range = value;
+		else if(!strcasecmp(line, "if-range"))
+			conn->if_range = value;
+		else if(!strcasecmp(line, "if-none-match"))
+			conn->if_none_match = value;
+		else if(!strcasecmp(line, "if-modified-since"))
+			conn->if_modified_since = value;
+		else if(!strcasecmp(line, "x-test"))
+			conn->x_test = value;
+		else if(!strcasecmp(line, "content-length"))
+			conn->body_left = strtoull(value, NULL, 10);
+		else if(!strcasecmp(line, "expect"))
+			conn->expect_continue = !strcasecmp(value, "100-continue");
+		else if(!strcasecmp(line, "connection"))
+		{
+			if(!strcasecmp(value, "close"))
+				conn->keep_alive = 0;
+			else if(!strcasecmp(value, "keep-alive"))
+				conn->keep_alive = 1;
+		}
+	}
+
+	if(verbose)
+		fprintf(stderr, "[debug] %s %s\n", conn->method, conn->path);
+
+	return end_of_headers + 4 - conn->buffer;
+}
+
+/* HTTP/2 frames (only what serve_h2() needs) */
+#define H2_FRAME_DATA 0x0
+#define H2_FRAME_HEADERS 0x1
+#define H2_FRAME_SETTINGS 0x4
+#define H2_FRAME_GOAWAY 0x7
+#define H2_FLAG_END_STREAM 0x1 // DATA, HEADERS
+#define H2_FLAG_ACK 0x1 // SETTINGS
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+#define H2_MAX_FRAME_SIZE 16384
+#define H2_MAX_BODY (1024 * 1024) // below the windows of the client, so flow control can be ignored
+
+static int h2_send_frame(int sock, unsigned type, unsigned flags, uint32_t stream_id, const void *payload, size_t length)
+{
+	uint8_t header[9];
+	header[0] = length >> 16;
+	header[1] = length >> 8;
+	header[2] = length;
+	header[3] = type;
+	header[4] = flags;
+	header[5] = stream_id >> 24;
+	header[6] = stream_id >> 16;
+	header[7] = stream_id >> 8;
+	header[8] = stream_id;
+
+	if(send_all(sock, header, sizeof(header)) < 0)
+		return -1;
+	return length ? send_all(sock, payload, length) : 0;
+}
+
+/* Reads exactly "length" bytes (the first ones may already be in conn->buffer) */
+static int h2_read(struct connection *conn, void *out, size_t length)
+{
+	size_t taken = conn->buffer_length < length ? conn->buffer_length : length;
+	memcpy(out, conn->buffer, taken);
+	memmove(conn->buffer, conn->buffer + taken, conn->buffer_length - taken);
+	conn->buffer_length -= taken;
+
+	while(taken < length)
+	{
+		ssize_t bytes = recv(conn->sock, (char *) out + taken, length - taken, 0);
+		if(bytes <= 0)
+		{
+			if(bytes < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		taken += bytes;
+	}
+	return 0;
+}
+
+static int h2_find_path(void *opaque, const char *name, size_t name_length, const char *value, size_t value_length)
+{
+	(void) name_length;
+	if(!strcmp(name, ":path"))
+		snprintf(opaque, 256, "%.*s", (int) value_length, value);
+	return 0;
+}
+
+/* Sends HEADERS with ":status" and "content-length" */
+static int h2_send_headers(int sock, struct hpack_table *encoder, uint32_t id, const char *status, unsigned long long length)
+{
+	uint8_t block[HPACK_SIZE_UPDATE_MAX + HPACK_ENCODED_MAX(7, 3) + HPACK_ENCODED_MAX(14, 20)];
+	char value[21];
+	int value_length = snprintf(value, sizeof(value), "%llu", length);
+
+	size_t block_length = hpack_encode_begin(encoder, block);
+	block_length += hpack_encode_header(encoder, block + block_length, ":status", 7, status, 3, HPACK_INDEX);
+	block_length += hpack_encode_header(encoder, block + block_length, "content-length", 14, value, value_length, HPACK_NO_INDEX);
+
+	return h2_send_frame(sock, H2_FRAME_HEADERS, H2_FLAG_END_HEADERS | (length ? 0 : H2_FLAG_END_STREAM), id, block, block_length);
+}
+
+/* Answers the request of one stream. Returns 0 on success, -1 if the connection must be closed. */
+static int h2_answer(int sock, struct hpack_table *encoder, uint32_t id, const char *path)
+{
+	unsigned long long n;
+
+	if(!strcmp(path, "/h2-bad-frame"))
+	{
+		static const uint8_t data[4] = { 0 };
+		h2_send_frame(sock, H2_FRAME_DATA, 0, 0, data, sizeof(data)); // DATA must be on a stream
+		wait_for_client(sock);
+		return -1;
+	}
+
+	if(sscanf(path, "/bytes/%llu", &n) != 1 || n > H2_MAX_BODY)
+		return h2_send_headers(sock, encoder, id, "404", 0);
+
+	if(h2_send_headers(sock, encoder, id, "200", n) < 0)
+		return -1;
+
+	unsigned long long offset;
+	for(offset = 0; offset < n; offset += H2_MAX_FRAME_SIZE)
+	{
+		size_t length = n - offset < H2_MAX_FRAME_SIZE ? n - offset : H2_MAX_FRAME_SIZE;
+		if(h2_send_frame(sock, H2_FRAME_DATA, offset + length == n ? H2_FLAG_END_STREAM : 0, id,
+			pattern + offset % BODY_PATTERN_LENGTH, length) < 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+	HTTP/2 connection (the client has sent "PRI * HTTP/2.0", the rest of the preface may be in conn->buffer).
+	Streams are answered one by one, in the order of their HEADERS.
+*/
+static void serve_h2(struct connection *conn)
+{
+	uint8_t preface[6], header[9], payload[H2_MAX_FRAME_SIZE];
+	struct hpack_table decoder, encoder;
+	struct arena *arena = arena_get();
+
+	hpack_table_init(&decoder);
+	hpack_table_init(&encoder);
+	if(!arena || h2_send_frame(conn->sock, H2_FRAME_SETTINGS, 0, 0, NULL, 0) < 0 ||
+		h2_read(conn, preface, sizeof(preface)) < 0 || memcmp(preface, "SM\r\n\r\n", sizeof(preface)))
+	{
+		goto done;
+	}
+
+	while(h2_read(conn, header, sizeof(header)) == 0)
+	{
+		size_t length = (header[0] << 16) | (header[1] << 8) | header[2];
+		unsigned type = header[3], flags = header[4];
+		uint32_t id = ((header[5] << 24) | (header[6] << 16) | (header[7] << 8) | header[8]) & 0x7fffffff;
+
+		if(length > sizeof(payload) || h2_read(conn, payload, length) < 0)
+			break;
+
+		if(type == H2_FRAME_SETTINGS && !(flags & H2_FLAG_ACK))
+		{
+			if(h2_send_frame(conn->sock, H2_FRAME_SETTINGS, H2_FLAG_ACK, 0, NULL, 0) < 0)
+				break;
+		}
+		else if(type == H2_FRAME_GOAWAY)
+			break;
+		else if(type == H2_FRAME_HEADERS)
+		{
+			/* Requests are small: the header block is never split into CONTINUATION frames */
+			const uint8_t *block = payload;
+			size_t block_length = length, padding = 0;
+
+			if((flags & H2_FLAG_PADDED) && block_length > 0)
+			{
+				padding = block[0];
+				block ++;
+				block_length --;
+			}
+			if(flags & H2_FLAG_PRIORITY)
+			{
+				block += 5;
+				block_length = block_length >= 5 ? block_length - 5 : 0;
+			}
+			block_length = block_length >= padding ? block_length - padding : 0;
+
+			char path[256] = "";
+			arena_reset(arena);
+			if(!(flags & H2_FLAG_END_HEADERS) || hpack_decode(&decoder, arena, block, block_length, h2_find_path, path) < 0)
+				break;
+
+			if(verbose)
+				fprintf(stderr, "[debug] HTTP/2 stream %u: GET %s\n", id, path);
+
+			if(h2_answer(conn->sock, &encoder, id, path) < 0)
+				break;
+		}
+		/* The rest (WINDOW_UPDATE, PRIORITY, etc.) is ignored */
+	}
+
+done:
+	hpack_table_free(&decoder);
+	hpack_table_free(&encoder);
+	if(arena)
+		arena_put(arena);
+}
+
+static void *serve_connection(void *arg)
+{
+	struct connection *conn = arg;
+
+	int one = 1;
+	setsockopt(conn->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	while(1)
+	{
+		int request_length = read_request(conn);
+		if(request_length < 0)
+			break;
+		conn->request_length = request_length;
+
+		/* HTTP/2 (h2c with prior knowledge) */
+		if(!strcmp(conn->method, "PRI") && !strcmp(conn->path, "*"))
+		{
+			conn->buffer_length -= request_length;
+			memmove(conn->buffer, conn->buffer + request_length, conn->buffer_length);
+			serve_h2(conn);
+			break;
+		}
+
+		if(handle_request(conn) < 0 || !conn->keep_alive)
+			break;
+
+		/* Body which the page hasn't read */
+		if(conn->body_left > 0)
+		{
+			/* The client is waiting for "100 Continue" and won't send it: the connection is useless */
+			if(conn->expect_continue)
+				break;
+
+			char discard[65536];
+			ssize_t bytes;
+			while((bytes = read_body(conn, discard, sizeof(discard))) > 0);
+			if(bytes < 0)
+				break;
+		}
+
+		/* Pipelined requests: the next request may already be in the buffer */
+		conn->buffer_length -= request_length;
+		memmove(conn->buffer, conn->buffer + request_length, conn->buffer_length);
+		conn->buffer[conn->buffer_length] = '\0';
+	}
+
+	close(conn->sock);
+	free(conn);
+	return NULL;
+}
+
+int main( int argc, char **argv )
+{
+	unsigned port = 8080;
+	int opt;
+
+	while((opt = getopt(argc, argv, "p:v")) != -1)
+	{
+		switch(opt)
+		{
+			case 'p':
+				port = atoi(optarg);
+				if(port < 1 || port > 65535)
+					print_usage();
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				print_usage();
+		}
+	}
+	if(optind != argc)
+		print_usage();
+
+	size_t i;
+	for(i = 0; i < SEND_BUFFER_SIZE; i ++)
+		pattern[i] = i % BODY_PATTERN_LENGTH;
+
+	int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+	if(listen_sock < 0)
+	{
+		fprintf(stderr, "[error] socket() failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	int one = 1;
+	setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if(bind(listen_sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listen_sock, 1024) < 0)
+	{
+		fprintf(stderr, "[error] Can't listen on 127.0.0.1:%u: %s\n", port, strerror(errno));
+		exit(1);
+	}
+	fprintf(stderr, "[info] Listening on 127.0.0.1:%u\n", port);
+
+	while(1)
+	{
+		int sock = accept(listen_sock, NULL, NULL);
+		if(sock < 0)
+		{
+			if(errno != EINTR && errno != ECONNABORTED)
+				fprintf(stderr, "[warn] accept() failed: %s\n", strerror(errno));
+			continue;
+		}
+
+		struct connection *conn = calloc(1, sizeof(struct connection));
+		if(!conn)
+		{
+			close(sock);
+			continue;
+		}
+		conn->sock = sock;
+
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+		if(pthread_create(&thread, &attr, serve_connection, conn) != 0)
+		{
+			fprintf(stderr, "[warn] pthread_create() failed\n");
+			close(sock);
+			free(conn);
+		}
+		pthread_attr_destroy(&attr);
+	}
+
+	return 0;
+}
@@ -0,0 +1,202 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "timing.h"
+
+static FILE *output = NULL; // NULL means stderr
+
+/* Names of the JSON fields with duration of each phase */
+static const char *phase_names[TIMING_PHASES] = {
+	"dns_ms",
+	"connect_ms",
+	"tls_ms",
+	"send_ms",
+	"wait_ms", // from the end of request till the first byte of response
+	"headers_ms",
+	"body_ms"
+};
+
+static double elapsed_ms(const struct request_timing *t)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - t->start.tv_sec) * 1000.0 + (now.tv_nsec - t->start.tv_nsec) / 1000000.0;
+}
+
+static struct timing_hop *current_hop(struct request_timing *t)
+{
+	if(t->hop_count == 0 || t->hop_count > TIMING_MAX_HOPS)
+		return NULL;
+
+	return &t->hops[t->hop_count - 1];
+}
+
+void timing_start(struct request_timing *t)
+{
+	memset(t, 0, sizeof(struct request_timing));
+	clock_gettime(CLOCK_MONOTONIC, &t->start);
+}
+
+void timing_hop(struct request_timing *t)
+{
+	t->hop_count ++;
+
+	struct timing_hop *hop = current_hop(t);
+	if(!hop)
+		return;
+
+	hop->start_ms = elapsed_ms(t);
+	timing_retry(t);
+}
+
+void timing_retry(struct request_timing *t)
+{
+	struct timing_hop *hop = current_hop(t);
+	if(!hop)
+		return;
+
+	int i;
+	for(i = 0; i < TIMING_PHASES; i ++)
+		hop->mark_ms[i] = -1;
+
+	hop->code = 0;
+	hop->reused = 0;
+}
+
+void timing_mark(struct request_timing *t, enum timing_phase phase)
+{
+	struct timing_hop *hop = current_hop(t);
+	if(hop)
+		hop->mark_ms[phase] = elapsed_ms(t);
+}
+
+void timing_set_code(struct request_timing *t, unsigned short code)
+{
+	struct timing_hop *hop = current_hop(t);
+	if(hop)
+		hop->code = code;
+}
+
+void timing_set_reused(struct request_timing *t, int reused)
+{
+	struct timing_hop *hop = current_hop(t);
+	if(hop)
+		hop->reused = reused;
+}
+
+void timing_add_transfer(struct request_timing *t, const struct transfer_stats *before)
+{
+	t->transfer.bytes += transfer_stats.bytes - before->bytes;
+	t->transfer.compressed_bytes += transfer_stats.compressed_bytes - before->compressed_bytes;
+	t->transfer.decoded_bytes += transfer_stats.decoded_bytes - before->decoded_bytes;
+	t->transfer.splice_calls += transfer_stats.splice_calls - before->splice_calls;
+	t->transfer.read_calls += transfer_stats.read_calls - before->read_calls;
+	t->transfer.write_calls += transfer_stats.write_calls - before->write_calls;
+}
+
+int timing_set_output(const char *filename)
+{
+	FILE *f = fopen(filename, "a");
+	if(!f)
+		return -1;
+
+	setvbuf(f, NULL, _IOLBF, 0); // One record per line, don't lose them on exit()
+	output = f;
+	return 0;
+}
+
+static void write_json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for(; *s; s ++)
+	{
+		unsigned char c = *s;
+		if(c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if(c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+static void write_hop(FILE *f, const struct timing_hop *hop)
+{
+	fprintf(f, "{\"code\":%u,\"reused\":%s,\"start_ms\":%.3f", hop->code, hop->reused ? "true" : "false", hop->start_ms);
+
+	/* Duration of each phase: since the end of the previous phase which has happened */
+	double prev = hop->start_ms;
+	int i;
+	for(i = 0; i < TIMING_PHASES; i ++)
+	{
+		if(hop->mark_ms[i] < 0)
+		{
+			fprintf(f, ",\"%s\":null", phase_names[i]);
+			continue;
+		}
+
+		fprintf(f, ",\"%s\":%.3f", phase_names[i], hop->mark_ms[i] - prev);
+		prev = hop->mark_ms[i];
+	}
+
+	fprintf(f, ",\"end_ms\":%.3f}", prev);
+}
+
+void timing_report(struct request_timing *t, const char *url, const char *error)
+{
+	FILE *f = output ? output : stderr;
+
+	t->total_ms = elapsed_ms(t);
+
+	flockfile(f); // the record is written by several calls: keep records of other threads out of it
+
+	if(!output)
+		fprintf(f, "[info] Timing: ");
+
+	fprintf(f, "{\"url\":");
+	write_json_string(f, url);
+
+	fprintf(f, ",\"ok\":%s", error ? "false" : "true");
+	if(error)
+	{
+		fprintf(f, ",\"error\":");
+		write_json_string(f, error);
+	}
+
+	fprintf(f, ",\"total_ms\":%.3f,\"bytes\":%llu,\"bytes_per_sec\":%.0f",
+		t->total_ms, t->transfer.bytes, t->total_ms > 0 ? t->transfer.bytes * 1000.0 / t->total_ms : 0);
+	if(t->transfer.compressed_bytes)
+		fprintf(f, ",\"compressed_bytes\":%llu,\"decoded_bytes\":%llu", t->transfer.compressed_bytes, t->transfer.decoded_bytes);
+	fprintf(f, ",\"syscalls\":{\"read\":%lu,\"write\":%lu,\"splice\":%lu}",
+		t->transfer.read_calls, t->transfer.write_calls, t->transfer.splice_calls);
+
+	fprintf(f, ",\"redirects\":%u,\"hops\":[", t->hop_count ? t->hop_count - 1 : 0);
+
+	unsigned i;
+	for(i = 0; i < t->hop_count && i < TIMING_MAX_HOPS; i ++)
+	{
+		if(i > 0)
+			fputc(',', f);
+		write_hop(f, &t->hops[i]);
+	}
+	fprintf(f, "]}\n");
+
+	funlockfile(f);
+}
@@ -0,0 +1,88 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_TIMING_H
+#define HTTP_CLIENT_TIMING_H
+
+#include <time.h>
+
+#include "transfer.h"
+
+/*
+	How much time does each step of the request take?
+	All times are measured with CLOCK_MONOTONIC and reported
+	as one JSON record per request (see timing_report).
+*/
+
+#define TIMING_MAX_HOPS 16 // redirect hops after this are not recorded (but still counted)
+
+/* Phases of one request (hop), in the order they happen */
+enum timing_phase {
+	TIMING_DNS, // hostname resolved
+	TIMING_CONNECT, // connection established
+	TIMING_TLS, // TLS handshake completed (https:// only)
+	TIMING_REQUEST, // request has been written into the socket
+	TIMING_FIRST_BYTE, // first byte of the response received
+	TIMING_HEADERS, // all response headers received
+	TIMING_BODY, // response body received
+	TIMING_PHASES
+};
+
+struct timing_hop {
+	unsigned short code; // HTTP response code (0 if not received)
+	int reused; // 1 if the connection was already open (then there is no DNS/connect phase)
+	double start_ms; // when the hop was started (since the start of the request)
+	double mark_ms[TIMING_PHASES]; // when each phase has ended, -1 if it hasn't happened
+};
+
+struct request_timing {
+	struct timespec start;
+	double total_ms;
+
+	struct timing_hop hops[TIMING_MAX_HOPS];
+	unsigned hop_count; // may be more than TIMING_MAX_HOPS
+
+	struct transfer_stats transfer; // bytes and syscalls spent on this request
+};
+
+void timing_start(struct request_timing *t);
+
+/* Starts the next hop (the first request or the request to Location of redirect) */
+void timing_hop(struct request_timing *t);
+
+/* The current hop is started again (e.g. keep-alive connection was closed
+	by server before it has responded): forgets the phases that have happened */
+void timing_retry(struct request_timing *t);
+
+/* Remembers that "phase" of the current hop has ended just now */
+void timing_mark(struct request_timing *t, enum timing_phase phase);
+
+void timing_set_code(struct request_timing *t, unsigned short code);
+void timing_set_reused(struct request_timing *t, int reused);
+
+/* Adds the difference between the current transfer_stats and "before" */
+void timing_add_transfer(struct request_timing *t, const struct transfer_stats *before);
+
+/*
+	Writes the JSON record about the finished request: to the file
+	chosen by timing_set_output(), or to stderr (after "[info] Timing: ").
+	"error" is NULL if the request has succeeded.
+*/
+void timing_report(struct request_timing *t, const char *url, const char *error);
+
+/* Records will be appended to "filename" (one per line). Returns 0 on success, -1 on error. */
+int timing_set_output(const char *filename);
+
+#endif
@@ -0,0 +1,557 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "tls.h"
+#include "transfer.h"
+#include "log.h"
+
+#define TLS_RECORD_SIZE 16384 // maximum of plaintext in one record
+
+__thread struct tls_stats tls_stats;
+
+static SSL_CTX *ctx = NULL; // created on first use
+
+/* TLS session of each socket (indexed by file descriptor), NULL for plain sockets */
+static SSL **connections = NULL;
+static int connections_size = 0;
+
+/* Sessions for resumption, keyed by "host:port" */
+struct cached_session {
+	char *key; // NULL if this slot is free
+	SSL_SESSION *session;
+	unsigned long stored_at; // value of "store_counter", used to find the oldest session
+};
+static struct cached_session CACHE[TLS_SESSION_CACHE_SIZE];
+static unsigned long store_counter = 0;
+
+/* Prints the error from OpenSSL error queue (or errno if there is none) and clears the queue */
+static void print_ssl_error(const char *what)
+{
+	unsigned long e = ERR_get_error();
+	log_error("%s: %s", what, e ? ERR_reason_error_string(e) : strerror(errno));
+	ERR_clear_error();
+}
+
+static struct cached_session *find_session(const char *key)
+{
+	int i;
+	for(i = 0; i < TLS_SESSION_CACHE_SIZE; i ++)
+	{
+		if(CACHE[i].key && !strcmp(CACHE[i].key, key))
+			return &CACHE[i];
+	}
+	return NULL;
+}
+
+static void free_session(struct cached_session *c)
+{
+	SSL_SESSION_free(c->session);
+	free(c->key);
+	c->key = NULL;
+	c->session = NULL;
+}
+
+/*
+	Called by OpenSSL when the server has given us a session (after the handshake
+	in TLS 1.2, or in a NewSessionTicket message at any time in TLS 1.3).
+	Returns 1 if we keep the reference to "session", 0 otherwise.
+*/
+static int new_session(SSL *ssl, SSL_SESSION *session)
+{
+	const char *key = SSL_get_app_data(ssl);
+	if(!key)
+		return 0;
+
+	struct cached_session *slot = find_session(key);
+	if(!slot)
+	{
+		int i;
+		for(i = 0; i < TLS_SESSION_CACHE_SIZE; i ++)
+		{
+			if(!CACHE[i].key)
+			{
+				slot = &CACHE[i];
+				break;
+			}
+
+			if(!slot || CACHE[i].stored_at < slot->stored_at)
+				slot = &CACHE[i];
+		}
+	}
+
+	if(slot->key && strcmp(slot->key, key))
+		free_session(slot); // Cache is full: forget the oldest session
+
+	if(!slot->key)
+	{
+		slot->key = strdup(key);
+		if(!slot->key)
+			return 0;
+	}
+
+	SSL_SESSION_free(slot->session);
+	slot->session = session;
+	slot->stored_at = ++ store_counter;
+	return 1;
+}
+
+static int tls_init(void)
+{
+	if(ctx)
+		return 0;
+
+	ctx = SSL_CTX_new(TLS_client_method());
+	if(!ctx)
+	{
+		print_ssl_error("SSL_CTX_new() failed");
+		return -1;
+	}
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	if(SSL_CTX_set_default_verify_paths(ctx) != 1)
+		print_ssl_error("Failed to load the system certificates");
+
+	/* Connection closed without close_notify is EOF (like in plain HTTP):
+		truncated bodies are detected by Content-Length or chunked encoding anyway */
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+	/* Sessions are kept by us (see new_session), not by OpenSSL */
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, new_session);
+
+	return 0;
+}
+
+int tls_set_ca_file(const char *filename)
+{
+	if(tls_init() < 0)
+		return -1;
+
+	if(SSL_CTX_load_verify_locations(ctx, filename, NULL) != 1)
+	{
+		char what[1024];
+		snprintf(what, sizeof(what), "Failed to load certificates from \"%s\"", filename);
+		print_ssl_error(what);
+		return -1;
+	}
+	return 0;
+}
+
+static SSL *get_connection(int sock)
+{
+	return (sock >= 0 && sock < connections_size) ? connections[sock] : NULL;
+}
+
+static int set_connection(int sock, SSL *ssl)
+{
+	if(sock >= connections_size)
+	{
+		int size = connections_size ? connections_size : 64;
+		while(size <= sock)
+			size *= 2;
+
+		SSL **new_connections = realloc(connections, size * sizeof(SSL *));
+		if(!new_connections)
+			return -1;
+
+		memset(new_connections + connections_size, 0, (size - connections_size) * sizeof(SSL *));
+		connections = new_connections;
+		connections_size = size;
+	}
+
+	connections[sock] = ssl;
+	return 0;
+}
+
+/*
+	OpenSSL writes into the socket with write(), so a connection closed
+	by the server would kill us with SIGPIPE. It's blocked while we write,
+	and SIGPIPE raised by our write is discarded (unless it was already pending).
+*/
+struct sigpipe_guard {
+	sigset_t old_mask;
+	int was_pending;
+};
+
+static void sigpipe_block(struct sigpipe_guard *g)
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGPIPE);
+
+	sigset_t pending;
+	sigpending(&pending);
+	g->was_pending = sigismember(&pending, SIGPIPE);
+
+	sigprocmask(SIG_BLOCK, &mask, &g->old_mask);
+}
+
+static void sigpipe_restore(struct sigpipe_guard *g)
+{
+	if(!g->was_pending)
+	{
+		sigset_t pending;
+		sigpending(&pending);
+		if(sigismember(&pending, SIGPIPE))
+		{
+			sigset_t mask;
+			sigemptyset(&mask);
+			sigaddset(&mask, SIGPIPE);
+
+			struct timespec no_wait = { 0, 0 };
+			sigtimedwait(&mask, NULL, &no_wait);
+		}
+	}
+
+	sigprocmask(SIG_SETMASK, &g->old_mask, NULL);
+}
+
+/* Converts the failure of SSL_read()/SSL_write() into errno. Returns 0 on EOF, -1 otherwise. */
+static int ssl_failure(SSL *ssl, int ret)
+{
+	switch(SSL_get_error(ssl, ret))
+	{
+		case SSL_ERROR_ZERO_RETURN:
+			return 0; // close_notify
+
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			break;
+
+		case SSL_ERROR_SYSCALL:
+			ERR_clear_error();
+			if(errno == 0)
+				return 0; // Closed without close_notify
+			break;
+
+		default:
+			print_ssl_error("TLS error");
+			errno = EPROTO;
+	}
+	return -1;
+}
+
+int tls_connect(int sock, const char *host, const char *port)
+{
+	if(tls_init() < 0)
+	{
+		errno = EPROTO;
+		return -1;
+	}
+
+	SSL *ssl = SSL_new(ctx);
+	char *key;
+	if(asprintf(&key, "%s:%s", host, port) < 0)
+		key = NULL;
+
+	if(!ssl || !key || set_connection(sock, NULL) < 0)
+	{
+		log_error("TLS: memory allocation failed");
+		SSL_free(ssl);
+		free(key);
+		errno = ENOMEM;
+		return -1;
+	}
+	SSL_set_app_data(ssl, key);
+	SSL_set_fd(ssl, sock);
+
+	/* Certificate must be issued for "host" (hostname or IP address) */
+	unsigned char address[sizeof(struct in6_addr)];
+	int is_address = inet_pton(AF_INET, host, address) == 1 || inet_pton(AF_INET6, host, address) == 1;
+	if(!is_address)
+		SSL_set_tlsext_host_name(ssl, host); // SNI (not used for addresses)
+	SSL_set1_host(ssl, host);
+
+	struct cached_session *cached = find_session(key);
+	if(cached)
+	{
+		SSL_set_session(ssl, cached->session);
+
+		/* TLS 1.3 tickets are for one use only: the server will send new ones */
+		if(SSL_SESSION_get_protocol_version(cached->session) == TLS1_3_VERSION)
+			free_session(cached);
+	}
+
+	struct sigpipe_guard guard;
+	sigpipe_block(&guard);
+	errno = 0;
+	int ret = SSL_connect(ssl);
+	sigpipe_restore(&guard);
+
+	if(ret != 1)
+	{
+		int err = SSL_get_error(ssl, ret);
+		if(err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+		{
+			ERR_clear_error();
+			errno = EAGAIN;
+		}
+		else
+		{
+			long verify = SSL_get_verify_result(ssl);
+			if(verify != X509_V_OK)
+			{
+				log_error("Certificate of %s can't be trusted: %s", host, X509_verify_cert_error_string(verify));
+				ERR_clear_error();
+			}
+			else if(err == SSL_ERROR_SYSCALL && ERR_peek_error() == 0)
+				log_error("TLS handshake with %s:%s failed: %s", host, port,
+					errno ? strerror(errno) : "connection closed by server");
+			else
+			{
+				char what[1024];
+				snprintf(what, sizeof(what), "TLS handshake with %s:%s failed", host, port);
+				print_ssl_error(what);
+			}
+			errno = EPROTO;
+		}
+
+		SSL_free(ssl);
+		free(key);
+		return -1;
+	}
+
+	connections[sock] = ssl;
+	tls_stats.handshakes ++;
+
+	int resumed = SSL_session_reused(ssl);
+	if(resumed)
+		tls_stats.resumed ++;
+
+	int ktls = 0;
+#ifdef BIO_get_ktls_recv
+	ktls = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#endif
+	if(ktls)
+		tls_stats.ktls ++;
+
+	log_info("TLS handshake OK (%s, %s%s%s)", SSL_get_version(ssl), SSL_get_cipher_name(ssl),
+		resumed ? ", session resumed" : "", ktls ? ", kernel TLS offload" : "");
+	return 0;
+}
+
+int tls_is_active(int sock)
+{
+	return get_connection(sock) != NULL;
+}
+
+int tls_in_userspace(int sock)
+{
+	SSL *ssl = get_connection(sock);
+	if(!ssl)
+		return 0;
+
+	/* Even with kTLS, a part of the data may have been read by OpenSSL already */
+#ifdef BIO_get_ktls_recv
+	if(BIO_get_ktls_recv(SSL_get_rbio(ssl)) && !SSL_has_pending(ssl))
+		return 0;
+#endif
+	return 1;
+}
+
+int tls_pending(int sock)
+{
+	SSL *ssl = get_connection(sock);
+	return ssl && SSL_has_pending(ssl);
+}
+
+ssize_t tls_read(int sock, void *buf, size_t count)
+{
+	SSL *ssl = get_connection(sock);
+	if(!ssl)
+		return read(sock, buf, count);
+
+	if(count > INT_MAX)
+		count = INT_MAX;
+
+	errno = 0;
+	int ret = SSL_read(ssl, buf, count);
+	if(ret > 0)
+		return ret;
+
+	return ssl_failure(ssl, ret);
+}
+
+ssize_t tls_send(int sock, const void *buf, size_t count)
+{
+	SSL *ssl = get_connection(sock);
+	if(!ssl)
+		return send(sock, buf, count, MSG_NOSIGNAL);
+
+	if(count > INT_MAX)
+		count = INT_MAX;
+
+	struct sigpipe_guard guard;
+	sigpipe_block(&guard);
+	errno = 0;
+	int ret = SSL_write(ssl, buf, count);
+	sigpipe_restore(&guard);
+
+	if(ret > 0)
+		return ret;
+
+	if(ssl_failure(ssl, ret) == 0)
+		errno = EPIPE;
+	return -1;
+}
+
+int tls_sendv(int sock, const struct iovec *iov, int iovcnt, int more)
+{
+	SSL *ssl = get_connection(sock);
+	int i;
+
+	if(ssl)
+	{
+		for(i = 0; i < iovcnt; i ++)
+		{
+			if(iov[i].iov_len && tls_send(sock, iov[i].iov_base, iov[i].iov_len) != (ssize_t) iov[i].iov_len)
+				return -1;
+		}
+		return 0;
+	}
+
+	struct iovec parts[iovcnt];
+	memcpy(parts, iov, iovcnt * sizeof(struct iovec));
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = parts;
+	msg.msg_iovlen = iovcnt;
+
+	while(msg.msg_iovlen > 0)
+	{
+		ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+		if(sent < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		/* Skip what was sent */
+		while(msg.msg_iovlen > 0 && (size_t) sent >= msg.msg_iov->iov_len)
+		{
+			sent -= msg.msg_iov->iov_len;
+			msg.msg_iov ++;
+			msg.msg_iovlen --;
+		}
+
+		if(msg.msg_iovlen > 0)
+		{
+			msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + sent;
+			msg.msg_iov->iov_len -= sent;
+		}
+	}
+	return 0;
+}
+
+ssize_t tls_sendfile(int sock, int in_fd, off_t *offset, size_t count)
+{
+	SSL *ssl = get_connection(sock);
+	struct sigpipe_guard guard;
+	ssize_t ret;
+
+	if(!ssl)
+	{
+		sigpipe_block(&guard);
+		ret = transfer_to_socket(sock, in_fd, offset, count);
+		sigpipe_restore(&guard);
+		return ret;
+	}
+
+#if defined(BIO_get_ktls_send) && OPENSSL_VERSION_NUMBER >= 0x30000000L
+	if(BIO_get_ktls_send(SSL_get_wbio(ssl)))
+	{
+		sigpipe_block(&guard);
+		errno = 0;
+		ret = SSL_sendfile(ssl, in_fd, *offset, count, 0);
+		sigpipe_restore(&guard);
+		transfer_stats.sendfile_calls ++;
+
+		if(ret > 0)
+		{
+			*offset += ret;
+			transfer_stats.sent_bytes += ret;
+			return ret;
+		}
+
+		if(ssl_failure(ssl, ret) == 0)
+			errno = EPIPE;
+		return -1;
+	}
+#endif
+
+	/* Encrypted by OpenSSL: one record at a time */
+	char buffer[TLS_RECORD_SIZE];
+	if(count > sizeof(buffer))
+		count = sizeof(buffer);
+
+	ssize_t bytes = pread(in_fd, buffer, count, *offset);
+	transfer_stats.read_calls ++;
+	if(bytes <= 0)
+		return bytes;
+
+	ret = tls_send(sock, buffer, bytes);
+	if(ret < 0)
+		return -1;
+
+	*offset += ret;
+	transfer_stats.sent_bytes += ret;
+	return ret;
+}
+
+void tls_close(int sock)
+{
+	SSL *ssl = get_connection(sock);
+	if(ssl)
+	{
+		/* Send close_notify (without waiting for the reply) */
+		struct sigpipe_guard guard;
+		sigpipe_block(&guard);
+		SSL_shutdown(ssl);
+		sigpipe_restore(&guard);
+		ERR_clear_error();
+
+		free(SSL_get_app_data(ssl));
+		SSL_free(ssl);
+		connections[sock] = NULL;
+	}
+
+	close(sock);
+}
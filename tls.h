@@ -0,0 +1,94 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_TLS_H
+#define HTTP_CLIENT_TLS_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+	TLS (for https:// URLs), via OpenSSL.
+
+	TLS session of a connection is found by its socket, so connections
+	are still passed around (and kept in the pool) as file descriptors:
+	tls_read() and tls_send() work with both kinds of sockets,
+	and tls_close() must be used instead of close().
+
+	Sessions are remembered per "host:port" (TLS_SESSION_CACHE_SIZE of them),
+	so the next connection to the same server skips the full handshake
+	(session ID or ticket resumption).
+
+	If the kernel supports TLS offload (kTLS) and OpenSSL has been built
+	with it, the kernel decrypts the received records itself: then the body
+	can still be moved with splice() (see tls_in_userspace()). The same goes
+	for sending: request body is moved from the file by the kernel (see tls_sendfile()).
+*/
+
+#define TLS_SESSION_CACHE_SIZE 16
+
+struct tls_stats {
+	unsigned long handshakes; // full and abbreviated ones
+	unsigned long resumed; // abbreviated handshakes (session from the cache)
+	unsigned long ktls; // connections where the kernel decrypts the received data
+};
+extern __thread struct tls_stats tls_stats;
+
+/* Trust certificates from "filename" (PEM, e.g. self-signed certificate of the test server),
+	in addition to the system ones. Returns 0 on success, -1 on error (it's printed). */
+int tls_set_ca_file(const char *filename);
+
+/*
+	Performs the handshake on connected blocking socket "sock"
+	(SO_RCVTIMEO/SO_SNDTIMEO limit how long it takes) and verifies
+	the certificate of "host". Returns 0 on success, -1 on error
+	(errno is EAGAIN if the timeout has expired, otherwise the error is printed).
+*/
+int tls_connect(int sock, const char *host, const char *port);
+
+/* Returns 1 if "sock" has a TLS session, 0 otherwise */
+int tls_is_active(int sock);
+
+/* Returns 1 if the data received from "sock" must be read via tls_read()
+	(not by read() or splice()), 0 if it's a plain socket or the kernel decrypts it (kTLS) */
+int tls_in_userspace(int sock);
+
+/* Returns 1 if some decrypted data of "sock" has been received already
+	(then poll() on the socket may not report it), 0 otherwise */
+int tls_pending(int sock);
+
+/* Same as read() and send(.., MSG_NOSIGNAL), but via TLS if "sock" has a TLS session.
+	Return -1 with errno EAGAIN if the socket is not ready (or the timeout has expired). */
+ssize_t tls_read(int sock, void *buf, size_t count);
+ssize_t tls_send(int sock, const void *buf, size_t count);
+
+/* Sends all "iovcnt" parts (with one sendmsg() if it's a plain socket, retrying after short writes).
+	If "more" is 1, more data follows right away (MSG_MORE: the kernel waits for it before sending
+	a partial packet). Returns 0 on success, -1 on error (same errno as tls_send()). */
+int tls_sendv(int sock, const struct iovec *iov, int iovcnt, int more);
+
+/*
+	Sends up to "count" bytes of file "in_fd" from "*offset" (and advances it).
+	Plain socket: via sendfile() (see transfer_to_socket). TLS: via SSL_sendfile()
+	if the kernel encrypts the data (kTLS), otherwise the file is read
+	one TLS record at a time and encrypted by OpenSSL.
+	Returns the number of bytes sent, 0 if the file has ended, -1 on error.
+*/
+ssize_t tls_sendfile(int sock, int in_fd, off_t *offset, size_t count);
+
+/* Closes the socket (and its TLS session, if any) */
+void tls_close(int sock);
+
+#endif
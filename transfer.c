@@ -0,0 +1,355 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include "transfer.h"
+#include "output.h"
+#include "log.h"
+
+__thread struct transfer_stats transfer_stats;
+
+/* Pipe between the socket and the file (one per thread). Always empty between the calls. */
+static __thread int splice_pipe[2] = { -1, -1 };
+static __thread size_t splice_pipe_size = 0;
+static __thread int splice_unsupported = 0;
+static __thread int sendfile_unsupported = 0;
+
+static int splice_pipe_init(void)
+{
+	if(splice_pipe_size)
+		return 0;
+
+	if(pipe2(splice_pipe, O_CLOEXEC) < 0)
+		return -1;
+
+	/* Larger pipe means fewer splice() calls.
+		Not fatal if we can't resize it (e.g. due to pipe-max-size). */
+	int size = fcntl(splice_pipe[1], F_SETPIPE_SZ, TRANSFER_PIPE_SIZE);
+	if(size < 0)
+		size = fcntl(splice_pipe[1], F_GETPIPE_SZ);
+
+	splice_pipe_size = size > 0 ? (size_t) size : 65536;
+	return 0;
+}
+
+void transfer_thread_exit(void)
+{
+	if(!splice_pipe_size)
+		return;
+
+	close(splice_pipe[0]);
+	close(splice_pipe[1]);
+	splice_pipe[0] = splice_pipe[1] = -1;
+	splice_pipe_size = 0;
+}
+
+int write_all(int out_fd, const char *buffer, size_t count)
+{
+	/* Output file (see output.h): either buffered for O_DIRECT or written as usual */
+	struct output_file *f = output_find(out_fd);
+	if(f && output_is_buffered(f))
+		return output_write(f, buffer, count);
+
+	size_t length = count;
+	while(count > 0)
+	{
+		ssize_t written = write(out_fd, buffer, count);
+		transfer_stats.write_calls ++;
+
+		if(written < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		buffer += written;
+		count -= written;
+	}
+
+	if(f)
+		output_written(f, length);
+	return 0;
+}
+
+/* Same as write_all(), but writes at "offset" ("offset" = NULL means "current position") */
+static int pwrite_all(int out_fd, const char *buffer, size_t count, off_t *offset)
+{
+	if(!offset)
+		return write_all(out_fd, buffer, count);
+
+	while(count > 0)
+	{
+		ssize_t written = pwrite(out_fd, buffer, count, *offset);
+		transfer_stats.write_calls ++;
+
+		if(written < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		buffer += written;
+		count -= written;
+		*offset += written;
+	}
+	return 0;
+}
+
+int write_body(int out_fd, const char *buffer, size_t count)
+{
+	if(write_all(out_fd, buffer, count) < 0)
+		return -1;
+
+	transfer_stats.bytes += count;
+	return 0;
+}
+
+int write_body_iov(int out_fd, struct iovec *iov, int iovcnt)
+{
+	struct output_file *f = output_find(out_fd);
+	if(f && output_is_buffered(f))
+	{
+		for(; iovcnt > 0; iov ++, iovcnt --)
+		{
+			if(write_body(out_fd, iov->iov_base, iov->iov_len) < 0)
+				return -1;
+		}
+		return 0;
+	}
+
+	while(iovcnt > 0)
+	{
+		ssize_t written = writev(out_fd, iov, iovcnt);
+		transfer_stats.write_calls ++;
+
+		if(written < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		transfer_stats.bytes += written;
+		if(f)
+			output_written(f, written);
+
+		/* Skip what was written (writev() can write less than requested) */
+		while(iovcnt > 0 && (size_t) written >= iov->iov_len)
+		{
+			written -= iov->iov_len;
+			iov ++;
+			iovcnt --;
+		}
+
+		if(iovcnt > 0)
+		{
+			iov->iov_base = (char *) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return 0;
+}
+
+int write_body_at(int out_fd, const char *buffer, size_t count, off_t offset)
+{
+	if(pwrite_all(out_fd, buffer, count, &offset) < 0)
+		return -1;
+
+	transfer_stats.bytes += count;
+	return 0;
+}
+
+static ssize_t copy_from_socket(int out_fd, int in_fd, size_t count, off_t *offset)
+{
+	static __thread char buffer[TRANSFER_BUFFER_SIZE];
+
+	if(count > sizeof(buffer))
+		count = sizeof(buffer);
+
+	ssize_t bytes = read(in_fd, buffer, count);
+	transfer_stats.read_calls ++;
+
+	if(bytes <= 0)
+		return bytes;
+
+	if(pwrite_all(out_fd, buffer, bytes, offset) < 0)
+		return -1;
+
+	transfer_stats.bytes += bytes;
+	return bytes;
+}
+
+/* Moves "count" bytes from the pipe into "out_fd" via read()/write().
+	Used if "out_fd" doesn't support splice() after the data was already put into the pipe. */
+static int drain_pipe(int out_fd, size_t count, off_t *offset)
+{
+	while(count > 0)
+	{
+		ssize_t bytes = copy_from_socket(out_fd, splice_pipe[0], count, offset);
+		if(bytes <= 0)
+			return -1;
+
+		count -= bytes;
+	}
+	return 0;
+}
+
+/* Empties the pipe after the error, so that it could be used again */
+static void discard_pipe(size_t count)
+{
+	char buffer[4096];
+	while(count > 0)
+	{
+		ssize_t bytes = read(splice_pipe[0], buffer, count > sizeof(buffer) ? sizeof(buffer) : count);
+		if(bytes <= 0)
+			break;
+		count -= bytes;
+	}
+}
+
+ssize_t transfer_from_socket(int out_fd, int in_fd, size_t count)
+{
+	return transfer_from_socket_at(out_fd, in_fd, count, NULL);
+}
+
+ssize_t transfer_from_socket_at(int out_fd, int in_fd, size_t count, off_t *offset)
+{
+	/* O_DIRECT output file: the data is read right into its buffer */
+	struct output_file *f = offset ? NULL : output_find(out_fd);
+	if(f && output_is_buffered(f))
+	{
+		ssize_t bytes = output_read(f, in_fd, count);
+		transfer_stats.read_calls ++;
+
+		if(bytes > 0)
+			transfer_stats.bytes += bytes;
+		return bytes;
+	}
+
+	if(splice_unsupported || splice_pipe_init() < 0)
+		return copy_from_socket(out_fd, in_fd, count, offset);
+
+	if(count > splice_pipe_size)
+		count = splice_pipe_size;
+
+	ssize_t received = splice(in_fd, NULL, splice_pipe[1], NULL, count, SPLICE_F_MOVE | SPLICE_F_MORE);
+	transfer_stats.splice_calls ++;
+
+	if(received < 0)
+	{
+		if(errno == EINVAL || errno == ENOSYS)
+		{
+			log_info("splice() is not supported here, falling back to read()/write().");
+			splice_unsupported = 1;
+			return copy_from_socket(out_fd, in_fd, count, offset);
+		}
+		return -1;
+	}
+
+	size_t left = received;
+	while(left > 0)
+	{
+		ssize_t written = splice(splice_pipe[0], NULL, out_fd, offset, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+		transfer_stats.splice_calls ++;
+
+		if(written <= 0)
+		{
+			if(written < 0 && errno == EINTR)
+				continue;
+
+			if(written < 0 && (errno == EINVAL || errno == ENOSYS))
+			{
+				log_info("splice() into the output file is not supported, falling back to read()/write().");
+				splice_unsupported = 1;
+
+				transfer_stats.bytes += received - left;
+				if(f)
+					output_written(f, received - left);
+				if(drain_pipe(out_fd, left, offset) < 0)
+					return -1;
+				return received;
+			}
+			discard_pipe(left);
+			return -1;
+		}
+
+		left -= written;
+	}
+
+	transfer_stats.bytes += received;
+	if(f)
+		output_written(f, received);
+	return received;
+}
+
+/* Fallback of transfer_to_socket() */
+static ssize_t copy_to_socket(int out_sock, int in_fd, off_t *offset, size_t count)
+{
+	static __thread char buffer[TRANSFER_BUFFER_SIZE];
+
+	if(count > sizeof(buffer))
+		count = sizeof(buffer);
+
+	ssize_t bytes = pread(in_fd, buffer, count, *offset);
+	transfer_stats.read_calls ++;
+
+	if(bytes <= 0)
+		return bytes;
+
+	/* If not all of it was sent, the rest is read again by the next call */
+	ssize_t sent = send(out_sock, buffer, bytes, MSG_NOSIGNAL);
+	if(sent < 0)
+		return -1;
+
+	*offset += sent;
+	transfer_stats.sent_bytes += sent;
+	return sent;
+}
+
+ssize_t transfer_to_socket(int out_sock, int in_fd, off_t *offset, size_t count)
+{
+	if(sendfile_unsupported)
+		return copy_to_socket(out_sock, in_fd, offset, count);
+
+	if(count > 0x7ffff000) // Maximum of one sendfile()
+		count = 0x7ffff000;
+
+	ssize_t sent = sendfile(out_sock, in_fd, offset, count);
+	transfer_stats.sendfile_calls ++;
+
+	if(sent < 0)
+	{
+		if(errno == EINVAL || errno == ENOSYS)
+		{
+			log_info("sendfile() is not supported here, falling back to pread()/send().");
+			sendfile_unsupported = 1;
+			return copy_to_socket(out_sock, in_fd, offset, count);
+		}
+		return -1;
+	}
+
+	transfer_stats.sent_bytes += sent;
+	return sent;
+}
@@ -0,0 +1,87 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_TRANSFER_H
+#define HTTP_CLIENT_TRANSFER_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Moving the response body from socket into the output file (and the request body from a file into socket) */
+
+#define TRANSFER_PIPE_SIZE (1024 * 1024) // requested capacity of the pipe used by splice()
+#define TRANSFER_BUFFER_SIZE 65536 // buffer for read()/write() when splice() is not supported
+
+struct transfer_stats {
+	unsigned long long bytes; // body bytes moved from socket to the output file
+	unsigned long long compressed_bytes; // part of "bytes" which had Content-Encoding (see content_encoding.h)
+	unsigned long long decoded_bytes; // what "compressed_bytes" have been decompressed into
+	unsigned long splice_calls;
+	unsigned long read_calls;
+	unsigned long write_calls;
+	unsigned long uring_calls; // io_uring_enter() calls (see uring.h)
+
+	unsigned long long sent_bytes; // request bodies sent from files into sockets (see transfer_to_socket)
+	unsigned long sendfile_calls;
+};
+extern __thread struct transfer_stats transfer_stats; // per thread (see batch.c)
+
+/*
+	Moves up to "count" bytes from socket "in_fd" into "out_fd".
+	Uses splice() (socket -> pipe -> file, without copying the data
+	into userspace), or read()/write() if splice() is not supported.
+
+	If "out_fd" is an output file with O_DIRECT (see output.h),
+	the data is read right into its buffer instead.
+
+	Returns the number of bytes moved, 0 on EOF, -1 on error
+	(errno is EAGAIN if "in_fd" is non-blocking and has no data yet).
+*/
+ssize_t transfer_from_socket(int out_fd, int in_fd, size_t count);
+
+/* Same as transfer_from_socket(), but writes at "*offset" in "out_fd"
+	(instead of the current file position) and advances "*offset".
+	Several sockets can write into different parts of one file. */
+ssize_t transfer_from_socket_at(int out_fd, int in_fd, size_t count, off_t *offset);
+
+/*
+	Sends up to "count" bytes of file "in_fd", starting at "*offset", into socket "out_sock"
+	via sendfile() (without copying them into userspace), or via pread()/send()
+	if sendfile() is not supported. Advances "*offset".
+	The caller must block SIGPIPE (see tls_sendfile).
+
+	Returns the number of bytes sent, 0 if the file has ended, -1 on error.
+*/
+ssize_t transfer_to_socket(int out_sock, int in_fd, off_t *offset, size_t count);
+
+/* Writes "count" bytes from "buffer" into "out_fd" (retrying after short writes).
+	Returns 0 on success, -1 on error. */
+int write_all(int out_fd, const char *buffer, size_t count);
+
+/* Same as write_all(), but for the part of the body which was already
+	read into userspace (e.g. together with headers). Counted in transfer_stats. */
+int write_body(int out_fd, const char *buffer, size_t count);
+
+/* Same as write_body(), but writes several parts of the body with one writev().
+	Modifies iov[]. Returns 0 on success, -1 on error. */
+int write_body_iov(int out_fd, struct iovec *iov, int iovcnt);
+
+/* Same as write_body(), but writes at "offset" (see transfer_from_socket_at) */
+int write_body_at(int out_fd, const char *buffer, size_t count, off_t offset);
+
+/* Closes the pipe of this thread (see transfer_from_socket). Called by the threads of batch mode before they exit. */
+void transfer_thread_exit(void);
+
+#endif
@@ -0,0 +1,490 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uring.h"
+#include "transfer.h"
+#include "output.h"
+#include "log.h"
+
+int uring_enabled = 0;
+
+#ifndef USE_IO_URING
+
+ssize_t uring_transfer_from_socket(int out_fd __attribute__((unused)), int in_fd __attribute__((unused)),
+	size_t count __attribute__((unused)), int timeout_ms __attribute__((unused)))
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#else
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 16 // enough for URING_BUFFERS pairs (+ their timeouts)
+
+/* user_data of our requests: what it is and which buffer */
+#define TAG_RECV (1ULL << 32)
+#define TAG_WRITE (2ULL << 32)
+#define TAG_TIMEOUT (3ULL << 32)
+#define TAG_MASK (0xFFULL << 32)
+
+/* The ring (with its buffers) is created on the first use and kept until exit */
+static struct {
+	int fd;
+	unsigned entries;
+
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_local_tail; // not yet submitted entries are before this
+	struct io_uring_sqe *sqes;
+
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	char *buffers; // URING_BUFFERS * URING_BUFFER_SIZE
+	int registered; // 1 if buffers are registered (then writes use IORING_OP_WRITE_FIXED)
+} ring = { .fd = -1 };
+
+static int ring_state = 0; // 0 - not created yet, 1 - ready, -1 - not supported
+
+/* Transfer which failed after some bytes had been moved: its error is returned by the next call */
+static int deferred_fd = -1, deferred_errno = 0;
+
+static int ring_setup(void)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if(ring.fd < 0)
+		return -1;
+
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	int single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+	if(single_mmap && cq_size > sq_size)
+		sq_size = cq_size;
+
+	char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if(sq == MAP_FAILED)
+		return -1;
+
+	char *cq = sq;
+	if(!single_mmap)
+	{
+		cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+		if(cq == MAP_FAILED)
+			return -1;
+	}
+
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if(ring.sqes == MAP_FAILED)
+		return -1;
+
+	ring.entries = p.sq_entries;
+	ring.sq_head = (unsigned *) (sq + p.sq_off.head);
+	ring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *) (sq + p.sq_off.array);
+	ring.sq_local_tail = *ring.sq_tail;
+
+	ring.cq_head = (unsigned *) (cq + p.cq_off.head);
+	ring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	ring.buffers = mmap(NULL, URING_BUFFERS * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(ring.buffers == MAP_FAILED)
+		return -1;
+
+	/* Registered buffers are pinned once (instead of on every write).
+		Not fatal if it fails (e.g. RLIMIT_MEMLOCK): then the usual IORING_OP_WRITE is used. */
+	struct iovec iov[URING_BUFFERS];
+	int i;
+	for(i = 0; i < URING_BUFFERS; i ++)
+	{
+		iov[i].iov_base = ring.buffers + i * URING_BUFFER_SIZE;
+		iov[i].iov_len = URING_BUFFER_SIZE;
+	}
+	ring.registered = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) == 0;
+
+	return 0;
+}
+
+/* Creates the ring on the first call. Returns 0 on success, -1 if io_uring is not supported. */
+static int ring_init(void)
+{
+	if(ring_state == 0)
+	{
+		ring_state = ring_setup() == 0 ? 1 : -1;
+		if(ring_state < 0)
+			log_warn("io_uring is not available (%s), using the usual read/write path.", strerror(errno));
+	}
+	return ring_state > 0 ? 0 : -1;
+}
+
+/* Returns the next free submission entry (the ring is large enough for all our requests) */
+static struct io_uring_sqe *ring_get_sqe(void)
+{
+	unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+	if(ring.sq_local_tail - head >= ring.entries)
+		return NULL;
+
+	unsigned index = ring.sq_local_tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+
+	ring.sq_array[index] = index;
+	ring.sq_local_tail ++;
+	return sqe;
+}
+
+/* Submits the new entries (if any) and waits until at least "wait" completions are available */
+static int ring_enter(unsigned wait)
+{
+	unsigned submit = ring.sq_local_tail - *ring.sq_tail;
+	__atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+
+	while(1)
+	{
+		int ret = syscall(__NR_io_uring_enter, ring.fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		transfer_stats.uring_calls ++;
+
+		if(ret >= 0)
+		{
+			submit -= ret;
+			if(submit == 0)
+				return 0;
+			continue;
+		}
+
+		if(errno != EINTR)
+			return -1;
+	}
+}
+
+/* Takes the next completion. Returns 1 if there was one, 0 otherwise. */
+static int ring_peek_cqe(struct io_uring_cqe *cqe)
+{
+	unsigned head = *ring.cq_head;
+	if(head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	*cqe = ring.cqes[head & *ring.cq_mask];
+	__atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Waits for the next completion. Returns 0 on success, -1 on error. */
+static int ring_wait_cqe(struct io_uring_cqe *cqe)
+{
+	while(!ring_peek_cqe(cqe))
+	{
+		if(ring_enter(1) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* State of one uring_transfer_from_socket() */
+struct uring_transfer {
+	int out_fd;
+	off_t offset; // where the data of the first buffer goes
+	size_t write_length[URING_BUFFERS]; // 0 if the buffer is free (its write has completed)
+	off_t write_offset[URING_BUFFERS];
+
+	int recv_done; // completion of the current recv() has arrived
+	ssize_t recv_result;
+	int timed_out;
+	int error; // errno of the failed write
+};
+
+static char *buffer_of(unsigned index)
+{
+	return ring.buffers + index * URING_BUFFER_SIZE;
+}
+
+/* Writes (the rest of) the buffer synchronously (e.g. its linked write was cancelled) */
+static void write_buffer_sync(struct uring_transfer *t, unsigned index, size_t from, size_t length)
+{
+	const char *data = buffer_of(index) + from;
+	off_t offset = t->write_offset[index] + from;
+
+	while(length > 0)
+	{
+		ssize_t written = pwrite(t->out_fd, data, length, offset);
+		transfer_stats.write_calls ++;
+
+		if(written < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			t->error = errno;
+			return;
+		}
+
+		data += written;
+		offset += written;
+		length -= written;
+	}
+}
+
+static void handle_cqe(struct uring_transfer *t, const struct io_uring_cqe *cqe)
+{
+	unsigned index = cqe->user_data & ~TAG_MASK;
+
+	switch(cqe->user_data & TAG_MASK)
+	{
+		case TAG_RECV:
+			t->recv_done = 1;
+			t->recv_result = cqe->res;
+			break;
+
+		case TAG_TIMEOUT:
+			if(cqe->res == -ETIME)
+				t->timed_out = 1;
+			break;
+
+		case TAG_WRITE:
+			if(cqe->res == -ECANCELED)
+			{
+				/* recv() was short (the link was broken): the data is written by uring_transfer_from_socket() */
+				t->write_length[index] = 0;
+			}
+			else if(cqe->res < 0)
+			{
+				if(!t->error)
+					t->error = -cqe->res;
+				t->write_length[index] = 0;
+			}
+			else
+			{
+				if((size_t) cqe->res < t->write_length[index])
+					write_buffer_sync(t, index, cqe->res, t->write_length[index] - cqe->res);
+
+				t->write_length[index] = 0;
+			}
+			break;
+	}
+}
+
+/* Waits until the write of buffer "index" completes (then it can be reused) */
+static int wait_for_buffer(struct uring_transfer *t, unsigned index)
+{
+	struct io_uring_cqe cqe;
+	while(t->write_length[index])
+	{
+		if(ring_wait_cqe(&cqe) < 0)
+			return -1;
+		handle_cqe(t, &cqe);
+	}
+	return 0;
+}
+
+ssize_t uring_transfer_from_socket(int out_fd, int in_fd, size_t count, int timeout_ms)
+{
+	if(deferred_errno && deferred_fd == in_fd)
+	{
+		errno = deferred_errno;
+		deferred_errno = 0;
+		deferred_fd = -1;
+		return -1;
+	}
+	deferred_errno = 0;
+	deferred_fd = -1;
+
+	/* O_DIRECT output file is written from its own aligned buffer (see output.h) */
+	struct output_file *f = output_find(out_fd);
+	if(f && output_is_buffered(f))
+	{
+		errno = ENOSYS;
+		return -1;
+	}
+
+	if(ring_init() < 0)
+	{
+		errno = ENOSYS;
+		return -1;
+	}
+
+	struct uring_transfer t;
+	memset(&t, 0, sizeof(t));
+	t.out_fd = out_fd;
+
+	t.offset = lseek(out_fd, 0, SEEK_CUR);
+	if(t.offset < 0)
+	{
+		errno = ENOSYS; // e.g. a pipe: then the usual path is used
+		return -1;
+	}
+
+	struct __kernel_timespec ts;
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+
+	size_t moved = 0;
+	unsigned index = 0;
+	int err = 0;
+
+	while(moved < count)
+	{
+		if(wait_for_buffer(&t, index) < 0)
+		{
+			err = errno;
+			break;
+		}
+		if(t.error)
+			break;
+
+		size_t length = count - moved;
+		if(length > URING_BUFFER_SIZE)
+			length = URING_BUFFER_SIZE;
+
+		/* recv() of the whole buffer -> [timeout of this recv()] -> write of the whole buffer */
+		struct io_uring_sqe *sqe = ring_get_sqe();
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = in_fd;
+		sqe->addr = (unsigned long) buffer_of(index);
+		sqe->len = length;
+		sqe->msg_flags = MSG_WAITALL;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = TAG_RECV | index;
+
+		if(timeout_ms >= 0)
+		{
+			sqe = ring_get_sqe();
+			sqe->opcode = IORING_OP_LINK_TIMEOUT;
+			sqe->fd = -1;
+			sqe->addr = (unsigned long) &ts;
+			sqe->len = 1;
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = TAG_TIMEOUT | index;
+		}
+
+		sqe = ring_get_sqe();
+		sqe->opcode = ring.registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+		sqe->fd = out_fd;
+		sqe->addr = (unsigned long) buffer_of(index);
+		sqe->len = length;
+		sqe->off = t.offset + moved;
+		sqe->buf_index = ring.registered ? index : 0;
+		sqe->user_data = TAG_WRITE | index;
+
+		t.write_length[index] = length;
+		t.write_offset[index] = t.offset + moved;
+		t.recv_done = 0;
+		t.timed_out = 0;
+
+		/* Submit, then wait for this recv() (writes of the previous buffers may still be in progress) */
+		if(ring_enter(1) < 0)
+		{
+			err = errno;
+			break;
+		}
+
+		struct io_uring_cqe cqe;
+		while(!t.recv_done)
+		{
+			if(ring_wait_cqe(&cqe) < 0)
+			{
+				err = errno;
+				break;
+			}
+			handle_cqe(&t, &cqe);
+		}
+		if(!t.recv_done)
+			break;
+
+		if(t.recv_result == (ssize_t) length)
+		{
+			moved += length;
+			index = (index + 1) % URING_BUFFERS;
+			continue;
+		}
+
+		/* Short recv() (EOF, timeout or error): the linked write has been cancelled */
+		if(wait_for_buffer(&t, index) < 0)
+		{
+			err = errno;
+			break;
+		}
+
+		if(t.recv_result > 0)
+		{
+			t.write_length[index] = t.recv_result;
+			write_buffer_sync(&t, index, 0, t.recv_result);
+			t.write_length[index] = 0;
+			moved += t.recv_result;
+		}
+
+		/* Timeout after a part of the buffer is not an error: data is still arriving
+			(the caller returns here if its deadlines allow) */
+		if(t.recv_result < 0)
+			err = (t.recv_result == -ECANCELED || t.timed_out) ? EAGAIN : -t.recv_result;
+		break;
+	}
+
+	/* Wait for the remaining writes */
+	unsigned i;
+	for(i = 0; i < URING_BUFFERS; i ++)
+	{
+		if(wait_for_buffer(&t, i) < 0 && !err)
+			err = errno;
+	}
+
+	/* Timeouts which were not needed (their completions may arrive a bit later) */
+	struct io_uring_cqe cqe;
+	while(ring_peek_cqe(&cqe))
+		handle_cqe(&t, &cqe);
+
+	if(!err && t.error)
+		err = t.error;
+
+	lseek(out_fd, t.offset + moved, SEEK_SET);
+	transfer_stats.bytes += moved;
+	if(f)
+		output_written(f, moved);
+
+	if(err)
+	{
+		if(moved == 0)
+		{
+			errno = err;
+			return -1;
+		}
+
+		/* What was moved is returned now, the error - by the next call */
+		deferred_fd = in_fd;
+		deferred_errno = err;
+	}
+	return moved;
+}
+
+#endif
@@ -0,0 +1,54 @@
+/*
+	Basic http client.
+	Copyright (C) 2013-2018 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CLIENT_URING_H
+#define HTTP_CLIENT_URING_H
+
+#include <sys/types.h>
+
+/*
+	io_uring backend for the response body (built with "make IO_URING=1").
+
+	The body is received into a few registered buffers in turn. Each buffer
+	is a linked pair of requests: recv() with MSG_WAITALL (optionally limited
+	by a linked timeout), then write of the full buffer into the file.
+	While the kernel writes one buffer, the next one is being received,
+	and one io_uring_enter() call both submits the next pair and waits
+	for the previous recv() (instead of separate read() and write() calls).
+
+	Without IO_URING=1 (or if the kernel doesn't support io_uring),
+	uring_transfer_from_socket() fails with ENOSYS and the usual
+	splice()/read()/write() path is used (see transfer.c).
+*/
+
+#define URING_BUFFERS 4 // buffers in turn (one is being received, others are being written)
+#define URING_BUFFER_SIZE (256 * 1024)
+#define URING_MIN_TRANSFER (64 * 1024) // shorter parts of the body are not worth it
+
+/* Set by -U: use uring_transfer_from_socket() for the body of single requests */
+extern int uring_enabled;
+
+/*
+	Moves up to "count" bytes from blocking socket "in_fd" into "out_fd"
+	(at its current position, which is advanced).
+	Each recv() fails if nothing arrives within "timeout_ms" (-1: no timeout).
+
+	Returns the number of bytes moved (less than "count" if the connection
+	has been closed), 0 on EOF, -1 on error (errno is EAGAIN if the timeout
+	has expired, ENOSYS if io_uring is not available).
+*/
+ssize_t uring_transfer_from_socket(int out_fd, int in_fd, size_t count, int timeout_ms);
+
+#endif